@@ -0,0 +1,443 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "data.h"
+#include "alloc.h"
+#include "journal.h"
+
+// Block allocator over a packed bitmap, one bit per block, set = used.
+// Searches go a 64-bit word at a time and skip full (or empty) words.
+// One mutex covers the bitmap and its counters, it is only ever held
+// for a single search or update so writers to different files barely meet.
+//
+// A block mapped by more than one file (see dedup.c) counts its owners
+// past the first in the image's reference table; freeing it drops one
+// of those until only the last owner is left to free it for real.
+//
+// free_run_later frees its blocks in the running transaction, so the
+// commit that stops a file using them frees them on disk too. Until that
+// commit is on disk they are held: searches read them as used and they
+// do not count as available.
+
+static pthread_mutex_t alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t* refs;
+static uint64_t* held;
+static size_t held_words;
+static size_t n_held;
+
+void alloc_lock(void) {
+	pthread_mutex_lock(&alloc_mutex);
+}
+
+void alloc_unlock(void) {
+	pthread_mutex_unlock(&alloc_mutex);
+}
+
+static uint64_t bit(size_t i) {
+	return 1ULL << (i % 64);
+}
+
+bool blk_in_use(const data_blks* blks, size_t blk_idx) {
+	return (blks->bitmap[blk_idx / 64] & bit(blk_idx)) != 0;
+}
+
+// Word w of the bitmap as the searches see it, held blocks set
+static uint64_t used_bits(const data_blks* blks, size_t w) {
+	return blks->bitmap[w] | (w < held_words ? held[w] : 0);
+}
+
+// Mask of the bits of word w inside [start, end)
+static uint64_t word_mask(size_t w, size_t start, size_t end) {
+	size_t lo = start > w * 64 ? start - w * 64 : 0;
+	size_t hi = end - w * 64 < 64 ? end - w * 64 : 64;
+	return (hi == 64 ? ~0ULL : (1ULL << hi) - 1) & ~((1ULL << lo) - 1);
+}
+
+// The counters and bitmap words changed go into the journal
+static void log_change(data_blks* blks, size_t start, size_t len) {
+	journal_dirty(blks, sizeof(data_blks));
+	if (len > 0) {
+		size_t w = start / 64;
+		journal_dirty(&blks->bitmap[w], ((start + len - 1) / 64 - w + 1) * sizeof(uint64_t));
+	}
+}
+
+// Sets or clears [start, start + len) a word at a time
+static void mark_range(data_blks* blks, size_t start, size_t len, bool used) {
+	log_change(blks, start, len);
+	size_t end = start + len;
+	for (size_t w = start / 64; len > 0 && w <= (end - 1) / 64; w++) {
+		uint64_t mask = word_mask(w, start, end);
+		if (used) {
+			blks->bitmap[w] |= mask;
+		} else {
+			blks->bitmap[w] &= ~mask;
+		}
+	}
+}
+
+// Drops an owner of each block in [start, start + len), freeing those
+// that had only the one
+static void release_range(data_blks* blks, size_t start, size_t len) {
+	if (blks->shared == 0) {
+		mark_range(blks, start, len, false);
+		blks->n_free += len;
+		return;
+	}
+
+	size_t end = start + len;
+	while (start < end) {
+		size_t b = start;
+		while (b < end && refs[b] == 0) {
+			b++;
+		}
+		if (b > start) {
+			mark_range(blks, start, b - start, false);
+			blks->n_free += b - start;
+		}
+		// Lookups outside the lock read these, see blk_refs
+		for (; b < end && refs[b] > 0; b++) {
+			__atomic_store_n(&refs[b], refs[b] - 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&blks->shared, blks->shared - 1, __ATOMIC_RELAXED);
+			journal_dirty(&refs[b], sizeof(uint32_t));
+		}
+		log_change(blks, 0, 0);
+		start = b;
+	}
+}
+
+// Holds the blocks of [start, start + len) that are free in the bitmap
+static void hold_range(const data_blks* blks, size_t start, size_t len) {
+	size_t end = start + len;
+	size_t words = (end - 1) / 64 + 1;
+	if (words > held_words) {
+		held = realloc(held, words * sizeof(uint64_t));
+		assert(held != NULL);
+		memset(held + held_words, 0, (words - held_words) * sizeof(uint64_t));
+		held_words = words;
+	}
+	for (size_t w = start / 64; w < words; w++) {
+		uint64_t fresh = word_mask(w, start, end) & ~blks->bitmap[w] & ~held[w];
+		held[w] |= fresh;
+		__atomic_store_n(&n_held, n_held + __builtin_popcountll(fresh), __ATOMIC_RELAXED);
+	}
+}
+
+static void unhold_range(size_t start, size_t len) {
+	size_t end = start + len;
+	size_t words = (end - 1) / 64 + 1;
+	for (size_t w = start / 64; w < words && w < held_words; w++) {
+		uint64_t gone = word_mask(w, start, end) & held[w];
+		held[w] &= ~gone;
+		__atomic_store_n(&n_held, n_held - __builtin_popcountll(gone), __ATOMIC_RELAXED);
+	}
+}
+
+// Lets go of blocks freed with free_run_later whose commit is on disk
+static void reap(void) {
+	extent* r;
+	size_t n = journal_take_released(&r);
+	for (size_t i = 0; i < n; i++) {
+		unhold_range(r[i].start, r[i].len);
+	}
+	if (n > 0) {
+		free(r);
+	}
+}
+
+void alloc_reap(data_blks* blks) {
+	(void) blks;
+	alloc_lock();
+	reap();
+	alloc_unlock();
+}
+
+// First block in [from, to) whose bit equals used, or to if none
+static size_t find_bit(const data_blks* blks, size_t from, size_t to, bool used) {
+	if (from >= to) {
+		return to;
+	}
+
+	size_t w = from / 64;
+	uint64_t word = used ? used_bits(blks, w) : ~used_bits(blks, w);
+	word &= ~0ULL << (from % 64);
+
+	size_t last = (to - 1) / 64;
+	while (word == 0) {
+		if (++w > last) {
+			return to;
+		}
+		word = used ? used_bits(blks, w) : ~used_bits(blks, w);
+	}
+
+	size_t i = w * 64 + __builtin_ctzll(word);
+	return i < to ? i : to;
+}
+
+void alloc_init(data_blks* blks, size_t n_blks) {
+	size_t words = BITMAP_WORDS(n_blks);
+	memset(blks->bitmap, 0, words * sizeof(uint64_t));
+	blks->n_blks = n_blks;
+	blks->n_free = n_blks;
+	blks->cursor = 0;
+	blks->shared = 0;
+
+	// Bits past the last block read as used so no search returns them
+	if (n_blks % 64 != 0) {
+		blks->bitmap[words - 1] = ~0ULL << (n_blks % 64);
+	}
+}
+
+// Extends the bitmap to n_blks blocks, all of the new ones free.
+// The caller holds the allocator lock across sizing the image and this.
+void alloc_grow(data_blks* blks, size_t n_blks) {
+	size_t old = blks->n_blks;
+	size_t words = BITMAP_WORDS(n_blks);
+	for (size_t w = BITMAP_WORDS(old); w < words; w++) {
+		blks->bitmap[w] = 0;
+	}
+	mark_range(blks, old, n_blks - old, false);
+	if (n_blks % 64 != 0) {
+		blks->bitmap[words - 1] |= ~0ULL << (n_blks % 64);
+	}
+
+	blks->n_blks = n_blks;
+	blks->n_free += n_blks - old;
+	log_change(blks, old, BITMAP_WORDS(n_blks) * 64 - old);
+}
+
+// Run searches look at most this many bitmap words past the goal, so
+// their cost does not grow with the image
+#define RUN_SCAN_WORDS 256
+
+static uint64_t free_bits(const data_blks* blks, size_t w) {
+	return w < BITMAP_WORDS(blks->n_blks) ? ~used_bits(blks, w) : 0;
+}
+
+// First block of a run of len (<= 64) free blocks that starts in word w
+// at or after bit from, or -1. The run may continue into the next word.
+static long short_run(const data_blks* blks, size_t w, size_t from, size_t len) {
+	unsigned __int128 m = free_bits(blks, w) | ((unsigned __int128)free_bits(blks, w + 1) << 64);
+	for (size_t have = 1; have < len; ) {
+		size_t step = have < len - have ? have : len - have;
+		m &= m >> step;
+		have += step;
+	}
+
+	uint64_t starts = (uint64_t)m & (~0ULL << from);
+	return starts ? (long)(w * 64 + __builtin_ctzll(starts)) : -1;
+}
+
+// Start of the first run of len (<= 64) free blocks in the scan window
+// from goal, or -1
+static long scan_short(const data_blks* blks, size_t goal, size_t len) {
+	size_t words = BITMAP_WORDS(blks->n_blks);
+	size_t budget = words < RUN_SCAN_WORDS ? words : RUN_SCAN_WORDS;
+	for (size_t k = 0; k < budget; k++) {
+		long at = short_run(blks, (goal / 64 + k) % words, k == 0 ? goal % 64 : 0, len);
+		if (at >= 0) {
+			return at;
+		}
+	}
+	return -1;
+}
+
+// Length of the free run at start, capped at want
+static size_t run_len(const data_blks* blks, size_t start, size_t want) {
+	size_t cap = blks->n_blks - start < want ? blks->n_blks : start + want;
+	return find_bit(blks, start, cap, true) - start;
+}
+
+// Finds a free run of want blocks near goal: runs of up to 64 blocks are
+// matched a word at a time, longer ones start from a fully free word.
+// Otherwise settles for the longest power of two run it can find nearby,
+// then the first free block anywhere. *len is 0 only when the disk is full.
+static size_t best_run(const data_blks* blks, size_t goal, size_t want, size_t* len) {
+	if (goal >= blks->n_blks) {
+		goal = 0;
+	}
+
+	if (want <= 64) {
+		long at = scan_short(blks, goal, want);
+		if (at >= 0) {
+			*len = want;
+			return at;
+		}
+	} else {
+		size_t words = BITMAP_WORDS(blks->n_blks);
+		size_t budget = words < RUN_SCAN_WORDS ? words : RUN_SCAN_WORDS;
+		for (size_t k = 0; k < budget; k++) {
+			size_t w = (goal / 64 + k) % words;
+			if (free_bits(blks, w) != ~0ULL) {
+				continue;
+			}
+
+			// Back up over the free tail of the previous word
+			size_t start = w * 64;
+			if (w > 0 && k > 0) {
+				start -= __builtin_clzll(~free_bits(blks, w - 1) | 1);
+			}
+
+			size_t got = run_len(blks, start, want);
+			if (got >= want) {
+				*len = want;
+				return start;
+			}
+			k += (start + got) / 64 - w;
+		}
+	}
+
+	for (size_t try = (want < 64 ? want : 64) / 2; try > 0; try /= 2) {
+		long at = scan_short(blks, goal, try);
+		if (at >= 0) {
+			*len = run_len(blks, at, want);
+			return at;
+		}
+	}
+
+	size_t first = find_bit(blks, 0, blks->n_blks, false);
+	*len = first < blks->n_blks ? run_len(blks, first, want) : 0;
+	return first;
+}
+
+// Allocates up to want contiguous blocks, preferring a run that starts
+// at goal. Falls back to the longest run seen if none is long enough.
+// Returns the first block, *got is 0 when the disk is full.
+size_t get_free_run(data_blks* blks, size_t goal, size_t want, size_t* got) {
+	alloc_lock();
+	reap();
+	if (blks->n_free == n_held || want == 0) {
+		alloc_unlock();
+		*got = 0;
+		return 0;
+	}
+
+	if (goal == ALLOC_AT_CURSOR) {
+		goal = blks->cursor;
+	}
+	size_t start = best_run(blks, goal, want, got);
+	mark_range(blks, start, *got, true);
+	blks->n_free -= *got;
+	blks->cursor = start + *got < blks->n_blks ? start + *got : 0;
+	alloc_unlock();
+	return start;
+}
+
+// Allocates exactly want contiguous blocks or nothing. Looks near the
+// cursor first, then first-fit over the whole bitmap.
+int alloc_run(data_blks* blks, size_t want, size_t* start) {
+	alloc_lock();
+	reap();
+	if (want == 0 || blks->n_free - n_held < want) {
+		alloc_unlock();
+		return -ENOSPC;
+	}
+
+	size_t len;
+	size_t at = best_run(blks, blks->cursor, want, &len);
+	for (size_t i = 0; len < want; i = at + len) {
+		at = find_bit(blks, i, blks->n_blks, false);
+		if (at == blks->n_blks) {
+			alloc_unlock();
+			return -ENOSPC;
+		}
+		len = run_len(blks, at, want);
+	}
+
+	mark_range(blks, at, want, true);
+	blks->n_free -= want;
+	blks->cursor = at + want < blks->n_blks ? at + want : 0;
+	alloc_unlock();
+	*start = at;
+	return 0;
+}
+
+void free_run(data_blks* blks, size_t start, size_t len) {
+	alloc_lock();
+	release_range(blks, start, len);
+	alloc_unlock();
+}
+
+// For blocks the image on disk may still point at until the running
+// operation commits; nothing else gets them until then
+void free_run_later(data_blks* blks, size_t start, size_t len) {
+	alloc_lock();
+	release_range(blks, start, len);
+	hold_range(blks, start, len);
+	alloc_unlock();
+	journal_free_later(start, len);
+}
+
+// Free blocks an allocation can have now, exact under the allocator lock
+size_t alloc_avail(const data_blks* blks) {
+	size_t held_now = __atomic_load_n(&n_held, __ATOMIC_RELAXED);
+	size_t n_free = __atomic_load_n(&blks->n_free, __ATOMIC_RELAXED);
+	return n_free > held_now ? n_free - held_now : 0;
+}
+
+// The image's table of reference counts, one per block. Without one
+// no block is ever shared. Nothing held for the image before carries over.
+void alloc_set_refs(uint32_t* table) {
+	refs = table;
+	free(held);
+	held = NULL;
+	held_words = n_held = 0;
+}
+
+// Adds an owner to each block of [start, start + len), all in use.
+// They stay allocated until every owner has freed them.
+void share_run(data_blks* blks, size_t start, size_t len) {
+	alloc_lock();
+	assert(refs != NULL);
+	for (size_t b = start; b < start + len; b++) {
+		assert(blk_in_use(blks, b));
+		__atomic_store_n(&refs[b], refs[b] + 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&blks->shared, blks->shared + len, __ATOMIC_RELAXED);
+	journal_dirty(&refs[start], len * sizeof(uint32_t));
+	log_change(blks, 0, 0);
+	alloc_unlock();
+}
+
+// Owners of the block past the first. Without the allocator lock, so
+// only settled for a block of a file the caller holds locked.
+uint32_t blk_refs(const data_blks* blks, size_t blk_idx) {
+	if (__atomic_load_n(&blks->shared, __ATOMIC_RELAXED) == 0) {
+		return 0;
+	}
+	return __atomic_load_n(&refs[blk_idx], __ATOMIC_RELAXED);
+}
+
+// Whether any block of [start, start + len) has more than one owner
+bool run_shared(const data_blks* blks, size_t start, size_t len) {
+	if (__atomic_load_n(&blks->shared, __ATOMIC_RELAXED) == 0) {
+		return false;
+	}
+	for (size_t b = start; b < start + len; b++) {
+		if (__atomic_load_n(&refs[b], __ATOMIC_RELAXED) != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void get_alloc_stats(const data_blks* blks, alloc_stats* st) {
+	memset(st, 0, sizeof(alloc_stats));
+	alloc_lock();
+	st->n_blks = blks->n_blks;
+	st->n_free = blks->n_free;
+
+	size_t i = 0;
+	while ((i = find_bit(blks, i, blks->n_blks, false)) < blks->n_blks) {
+		size_t j = find_bit(blks, i, blks->n_blks, true);
+		st->free_runs += 1;
+		if (j - i > st->largest_run) {
+			st->largest_run = j - i;
+		}
+		i = j;
+	}
+	alloc_unlock();
+}
@@ -0,0 +1,37 @@
+#ifndef NUFS_ALLOC_H
+#define NUFS_ALLOC_H
+
+#include "data.h"
+
+typedef struct alloc_stats {
+	size_t n_blks;
+	size_t n_free;
+	size_t free_runs;   // maximal runs of free blocks
+	size_t largest_run; // longest of them, in blocks
+} alloc_stats;
+
+// Goal for get_free_run meaning wherever the last allocation left off
+#define ALLOC_AT_CURSOR SIZE_MAX
+
+void alloc_lock(void);
+void alloc_unlock(void);
+
+void alloc_init(data_blks* blks, size_t n_blks);
+void alloc_grow(data_blks* blks, size_t n_blks);
+
+size_t get_free_run(data_blks* blks, size_t goal, size_t want, size_t* got);
+int alloc_run(data_blks* blks, size_t want, size_t* start);
+void free_run(data_blks* blks, size_t start, size_t len);
+void free_run_later(data_blks* blks, size_t start, size_t len);
+void alloc_reap(data_blks* blks);
+size_t alloc_avail(const data_blks* blks);
+bool blk_in_use(const data_blks* blks, size_t blk_idx);
+
+void alloc_set_refs(uint32_t* table);
+void share_run(data_blks* blks, size_t start, size_t len);
+uint32_t blk_refs(const data_blks* blks, size_t blk_idx);
+bool run_shared(const data_blks* blks, size_t start, size_t len);
+
+void get_alloc_stats(const data_blks* blks, alloc_stats* st);
+
+#endif
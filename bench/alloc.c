@@ -0,0 +1,66 @@
+// Block allocator benchmark.
+// Runs the bitmap allocator standalone over images from 256 blocks to
+// 16M blocks, aged to ~90% full with scattered holes, and times single
+// block and 16-block run allocations. Single blocks should cost the same
+// at every size; run searches level off once the image is bigger than
+// the allocator's scan window.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "data.h"
+#include "alloc.h"
+
+#define ROUNDS (200 * 1000)
+
+static double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main() {
+	size_t sizes[] = { 256, 4096, 65536, 1 << 20, 1 << 24 };
+
+	printf("%10s %12s %12s %10s %12s\n", "blocks", "blk ns/op", "run16 ns/op", "free runs", "largest run");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(size_t); s++) {
+		size_t n = sizes[s];
+		data_blks* blks = malloc(sizeof(data_blks) + BITMAP_WORDS(n) * sizeof(uint64_t));
+		blks->blk_sz = PAGE_SIZE;
+		blks->data_offset = PAGE_SIZE;
+		alloc_init(blks, n);
+
+		// Age the image: fill it, then punch one hole in every ten blocks
+		size_t start;
+		alloc_run(blks, n, &start);
+		unsigned int seed = 7;
+		for (size_t i = 0; i < n; i += 10) {
+			free_run(blks, i + rand_r(&seed) % (n - i < 10 ? n - i : 10), 1);
+		}
+
+		double t0 = now_ns();
+		for (int i = 0; i < ROUNDS; i++) {
+			size_t got;
+			size_t at = get_free_run(blks, ALLOC_AT_CURSOR, 1, &got);
+			free_run(blks, at, got);
+		}
+		double blk_ns = (now_ns() - t0) / ROUNDS;
+
+		// Keep a few 16 block runs available so the search has work to do
+		free_run(blks, n / 2 - n / 2 % 64, n >= 256 ? 64 : 16);
+		t0 = now_ns();
+		for (int i = 0; i < ROUNDS; i++) {
+			size_t got;
+			size_t at = get_free_run(blks, blks->cursor, 16, &got);
+			free_run(blks, at, got);
+		}
+		double run_ns = (now_ns() - t0) / ROUNDS;
+
+		alloc_stats st;
+		get_alloc_stats(blks, &st);
+		printf("%10zu %12.1f %12.1f %10zu %12zu\n", n, blk_ns, run_ns, st.free_runs, st.largest_run);
+		free(blks);
+	}
+	return 0;
+}
@@ -0,0 +1,840 @@
+// Workload benchmark for the fs_* engine, or a live mount.
+//
+//   bench [-w workloads] [-n ops] [-s MiB] [-b bytes] [-i image] [-m mountpoint]
+//
+// Workloads (comma separated, default all):
+//   meta   metadata storm: create n files, stat, list, rename and unlink them
+//   churn  small files: create, write up to 8 KiB, read back, unlink
+//   seq    sequential write then read of one s MiB file in b byte calls
+//   rand   n b byte reads and writes at random offsets of an s MiB file
+//   fsync  n 4 KiB appends to a log, each followed by fsync, while an s
+//          MiB file stays dirty next to it (not in the default set)
+//   compress  s MiB of log lines written to a directory flagged for
+//          compression, compressed the way writeback does and read back;
+//          reports both rates and the ratio (engine only, not in the
+//          default set)
+//   dedup  s MiB of files, four originals each copied three times,
+//          deduplicated the way the dedup thread does; reports the
+//          ratio, overwrite rates of an unshared and of a shared (copied
+//          on write) file, and the dedup rate (engine only, not in the
+//          default set)
+//   clone  copies of one s MiB file made with copy_file_range, which
+//          shares the blocks; reports the time per copy and the blocks
+//          they took (not in the default set)
+//   snapshot  snapshots of n 4 KiB files and an s MiB file, which is
+//          overwritten twice after each; reports the time and space a
+//          snapshot takes and both overwrite rates, the first copying
+//          on write (not in the default set)
+//
+// By default the engine is linked in and driven directly on a fresh
+// image. With -m the same calls go through the kernel to a mounted nufs
+// instead, so comparing the two runs shows what FUSE costs. Note that
+// the kernel page cache may answer mount reads on its own.
+//
+// Results go to stdout as JSON: ops/s and p50/p99/p999 latency per
+// workload and per kind of call.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "data.h"
+#include "writeback.h"
+
+enum { OP_MKNOD, OP_WRITE, OP_READ, OP_GETATTR, OP_READDIR, OP_UNLINK, OP_RENAME, OP_FSYNC, OP_COMPRESS, OP_DEDUP, OP_COPY, OP_SNAPSHOT, OP_DROP, N_OPS };
+static const char* op_names[N_OPS] = { "mknod", "write", "read", "getattr", "readdir", "unlink", "rename", "fsync", "compress", "dedup", "copy", "snapshot", "drop" };
+
+// The calls a workload makes, against the engine or a mount
+typedef struct backend {
+	const char* name;
+	int (*mkdir)(const char* path);
+	int (*rmdir)(const char* path);
+	int (*mknod)(const char* path);
+	int (*write)(const char* path, const char* buf, size_t size, off_t offset);
+	int (*read)(const char* path, char* buf, size_t size, off_t offset);
+	int (*getattr)(const char* path, struct stat* st);
+	int (*readdir)(const char* path);
+	int (*unlink)(const char* path);
+	int (*rename)(const char* from, const char* to);
+	int (*fsync)(const char* path);
+	int (*copy)(const char* from, const char* to, size_t len);
+	int (*statfs)(struct statvfs* st);
+} backend;
+
+// Engine
+
+static super_blk* fs;
+
+static int eng_mkdir(const char* path) {
+	return fs_mkdir(fs, path, 0755);
+}
+
+static int eng_rmdir(const char* path) {
+	return fs_rmdir(fs, path);
+}
+
+static int eng_mknod(const char* path) {
+	return fs_mknod(fs, path, 0100644, 0);
+}
+
+static int eng_write(const char* path, const char* buf, size_t size, off_t offset) {
+	return fs_write(fs, path, buf, size, offset);
+}
+
+static int eng_read(const char* path, char* buf, size_t size, off_t offset) {
+	return fs_read(fs, path, buf, size, offset);
+}
+
+static int eng_getattr(const char* path, struct stat* st) {
+	return fs_getattr(fs, path, st);
+}
+
+static int count_ent(void* buf, const char* name, const struct stat* st, off_t off) {
+	(void) name;
+	(void) st;
+	(void) off;
+	*(int*)buf += 1;
+	return 0;
+}
+
+static int eng_readdir(const char* path) {
+	int n = 0;
+	int rv = fs_readdir(fs, path, &n, count_ent, 0);
+	return rv < 0 ? rv : n;
+}
+
+static int eng_unlink(const char* path) {
+	return fs_unlink(fs, path);
+}
+
+static int eng_rename(const char* from, const char* to) {
+	return fs_rename(fs, from, to);
+}
+
+static int eng_fsync(const char* path) {
+	return fs_fsync(fs, path);
+}
+
+// The first len bytes of from into to, the way copy_file_range does
+static int eng_copy(const char* from, const char* to, size_t len) {
+	struct stat a, b;
+	int rv = fs_getattr(fs, from, &a);
+	if (rv == 0) {
+		rv = fs_getattr(fs, to, &b);
+	}
+	for (size_t done = 0; rv >= 0 && done < len; done += rv) {
+		rv = fs_copy_range(fs, NUFS_INUM(a.st_ino), done, NUFS_INUM(b.st_ino), done, len - done);
+		if (rv == 0) {
+			return -EIO;
+		}
+	}
+	return rv < 0 ? rv : 0;
+}
+
+static int eng_statfs(struct statvfs* st) {
+	return fs_statfs(fs, st);
+}
+
+static const backend engine_be = {
+	"engine", eng_mkdir, eng_rmdir, eng_mknod, eng_write, eng_read,
+	eng_getattr, eng_readdir, eng_unlink, eng_rename, eng_fsync,
+	eng_copy, eng_statfs,
+};
+
+// Mount. The last file used stays open, the way an application keeps a
+// file open across calls, so I/O workloads time pread/pwrite alone.
+
+static const char* mnt;
+static char open_path[256];
+static int open_fd = -1;
+
+static const char* in_mnt(const char* path, char* out) {
+	snprintf(out, 512, "%s%s", mnt, path);
+	return out;
+}
+
+static void close_cached(void) {
+	if (open_fd >= 0) {
+		close(open_fd);
+		open_fd = -1;
+		open_path[0] = '\0';
+	}
+}
+
+static int cached_fd(const char* path) {
+	if (open_fd >= 0 && strcmp(open_path, path) == 0) {
+		return open_fd;
+	}
+	close_cached();
+	char full[512];
+	open_fd = open(in_mnt(path, full), O_RDWR);
+	if (open_fd >= 0) {
+		snprintf(open_path, sizeof(open_path), "%s", path);
+	}
+	return open_fd;
+}
+
+static int sys_rv(int rv) {
+	return rv < 0 ? -errno : rv;
+}
+
+static int mnt_mkdir(const char* path) {
+	char full[512];
+	return sys_rv(mkdir(in_mnt(path, full), 0755));
+}
+
+static int mnt_rmdir(const char* path) {
+	char full[512];
+	return sys_rv(rmdir(in_mnt(path, full)));
+}
+
+static int mnt_mknod(const char* path) {
+	char full[512];
+	return sys_rv(mknod(in_mnt(path, full), S_IFREG | 0644, 0));
+}
+
+static int mnt_write(const char* path, const char* buf, size_t size, off_t offset) {
+	int fd = cached_fd(path);
+	return fd < 0 ? -errno : sys_rv(pwrite(fd, buf, size, offset));
+}
+
+static int mnt_read(const char* path, char* buf, size_t size, off_t offset) {
+	int fd = cached_fd(path);
+	return fd < 0 ? -errno : sys_rv(pread(fd, buf, size, offset));
+}
+
+static int mnt_getattr(const char* path, struct stat* st) {
+	char full[512];
+	return sys_rv(stat(in_mnt(path, full), st));
+}
+
+static int mnt_readdir(const char* path) {
+	char full[512];
+	DIR* d = opendir(in_mnt(path, full));
+	if (d == NULL) {
+		return -errno;
+	}
+	int n = 0;
+	while (readdir(d) != NULL) {
+		n++;
+	}
+	closedir(d);
+	return n;
+}
+
+static int mnt_unlink(const char* path) {
+	char full[512];
+	close_cached();
+	return sys_rv(unlink(in_mnt(path, full)));
+}
+
+static int mnt_rename(const char* from, const char* to) {
+	char a[512], b[512];
+	close_cached();
+	return sys_rv(rename(in_mnt(from, a), in_mnt(to, b)));
+}
+
+static int mnt_fsync(const char* path) {
+	int fd = cached_fd(path);
+	return fd < 0 ? -errno : sys_rv(fsync(fd));
+}
+
+static int mnt_copy(const char* from, const char* to, size_t len) {
+	char a[512], b[512];
+	close_cached();
+	int in = open(in_mnt(from, a), O_RDONLY);
+	int out = open(in_mnt(to, b), O_WRONLY);
+	int rv = in < 0 || out < 0 ? -errno : 0;
+	for (size_t done = 0; rv == 0 && done < len;) {
+		ssize_t n = copy_file_range(in, NULL, out, NULL, len - done, 0);
+		rv = n < 0 ? -errno : n == 0 ? -EIO : 0;
+		done += n > 0 ? n : 0;
+	}
+	if (in >= 0) {
+		close(in);
+	}
+	if (out >= 0) {
+		close(out);
+	}
+	return rv;
+}
+
+static int mnt_statfs(struct statvfs* st) {
+	return sys_rv(statvfs(mnt, st));
+}
+
+static const backend mount_be = {
+	"mount", mnt_mkdir, mnt_rmdir, mnt_mknod, mnt_write, mnt_read,
+	mnt_getattr, mnt_readdir, mnt_unlink, mnt_rename, mnt_fsync,
+	mnt_copy, mnt_statfs,
+};
+
+// Latency samples, one growable array per kind of call
+
+typedef struct samples {
+	uint64_t* ns;
+	size_t n, cap;
+} samples;
+
+typedef struct run {
+	samples by_op[N_OPS];
+	double t0;
+	double seconds;
+	uint64_t bytes;
+	int failed;
+	double compress_mb_s; // compress workload only
+	double decompress_mb_s;
+	double ratio;
+	double dedup_mb_s; // dedup workload only
+	double overwrite_mb_s;
+	double cow_mb_s;
+	size_t copies;     // clone workload only
+	double copy_kb;    // space each copy took
+	size_t snapshots;  // snapshot workload only
+	double snapshot_kb;
+} run;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void add_sample(samples* s, uint64_t ns) {
+	if (s->n == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 1024;
+		s->ns = realloc(s->ns, s->cap * sizeof(uint64_t));
+		if (s->ns == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	s->ns[s->n++] = ns;
+}
+
+// Times one call, a failure marks the run and is reported once
+#define TIMED(r, op, call) ({ \
+		uint64_t t_ = now_ns(); \
+		int rv_ = (call); \
+		add_sample(&(r)->by_op[op], now_ns() - t_); \
+		if (rv_ < 0 && !(r)->failed) { \
+			fprintf(stderr, "%s failed: %s\n", op_names[op], strerror(-rv_)); \
+			(r)->failed = 1; \
+		} \
+		rv_; \
+	})
+
+// Workloads
+
+typedef struct config {
+	size_t ops;
+	size_t file_mb;
+	size_t io_size;
+} config;
+
+static char* io_buf;
+
+static void workload_meta(const backend* be, const config* cf, run* r) {
+	char path[64], to[64];
+	be->mkdir("/meta");
+
+	for (size_t i = 0; i < cf->ops; i++) {
+		snprintf(path, sizeof(path), "/meta/f%zu", i);
+		TIMED(r, OP_MKNOD, be->mknod(path));
+	}
+	unsigned seed = 1;
+	struct stat st;
+	for (size_t i = 0; i < cf->ops; i++) {
+		snprintf(path, sizeof(path), "/meta/f%zu", (size_t)rand_r(&seed) % cf->ops);
+		TIMED(r, OP_GETATTR, be->getattr(path, &st));
+	}
+	for (size_t i = 0; i < 16; i++) {
+		TIMED(r, OP_READDIR, be->readdir("/meta"));
+	}
+	for (size_t i = 0; i < cf->ops; i++) {
+		snprintf(path, sizeof(path), "/meta/f%zu", i);
+		snprintf(to, sizeof(to), "/meta/renamed%zu", i);
+		TIMED(r, OP_RENAME, be->rename(path, to));
+	}
+	for (size_t i = 0; i < cf->ops; i++) {
+		snprintf(path, sizeof(path), "/meta/renamed%zu", i);
+		TIMED(r, OP_UNLINK, be->unlink(path));
+	}
+
+	be->rmdir("/meta");
+}
+
+static void workload_churn(const backend* be, const config* cf, run* r) {
+	char path[64];
+	be->mkdir("/churn");
+
+	unsigned seed = 2;
+	for (size_t i = 0; i < cf->ops; i++) {
+		snprintf(path, sizeof(path), "/churn/c%zu", i % 64);
+		size_t len = 1 + rand_r(&seed) % 8192;
+		TIMED(r, OP_MKNOD, be->mknod(path));
+		TIMED(r, OP_WRITE, be->write(path, io_buf, len, 0));
+		TIMED(r, OP_READ, be->read(path, io_buf, len, 0));
+		TIMED(r, OP_UNLINK, be->unlink(path));
+		r->bytes += 2 * len;
+	}
+
+	be->rmdir("/churn");
+}
+
+static void workload_seq(const backend* be, const config* cf, run* r) {
+	size_t size = cf->file_mb << 20;
+	be->mknod("/seq");
+	for (size_t off = 0; off < size; off += cf->io_size) {
+		TIMED(r, OP_WRITE, be->write("/seq", io_buf, cf->io_size, off));
+	}
+	for (size_t off = 0; off < size; off += cf->io_size) {
+		TIMED(r, OP_READ, be->read("/seq", io_buf, cf->io_size, off));
+	}
+	r->bytes += 2 * size;
+	be->unlink("/seq");
+}
+
+static void workload_rand(const backend* be, const config* cf, run* r) {
+	size_t size = cf->file_mb << 20;
+	size_t slots = size / cf->io_size;
+
+	// Laid out up front and not timed
+	be->mknod("/rand");
+	for (size_t off = 0; off < size; off += cf->io_size) {
+		be->write("/rand", io_buf, cf->io_size, off);
+	}
+
+	r->t0 = now_ns() / 1e9;
+	unsigned seed = 3;
+	for (size_t i = 0; i < cf->ops; i++) {
+		off_t off = (off_t)(rand_r(&seed) % slots) * cf->io_size;
+		if (rand_r(&seed) & 1) {
+			TIMED(r, OP_WRITE, be->write("/rand", io_buf, cf->io_size, off));
+		} else {
+			TIMED(r, OP_READ, be->read("/rand", io_buf, cf->io_size, off));
+		}
+		r->bytes += cf->io_size;
+	}
+	r->seconds = now_ns() / 1e9 - r->t0;
+	be->unlink("/rand");
+}
+
+static void workload_fsync(const backend* be, const config* cf, run* r) {
+	size_t size = cf->file_mb << 20;
+
+	// Someone else's dirty data, an fsync of the log should not pay for it
+	be->mknod("/bulk");
+	for (size_t off = 0; off < size; off += cf->io_size) {
+		be->write("/bulk", io_buf, cf->io_size, off);
+	}
+
+	r->t0 = now_ns() / 1e9;
+	be->mknod("/log");
+	for (size_t i = 0; i < cf->ops; i++) {
+		TIMED(r, OP_WRITE, be->write("/log", io_buf, 4096, i * 4096));
+		TIMED(r, OP_FSYNC, be->fsync("/log"));
+		r->bytes += 4096;
+	}
+	r->seconds = now_ns() / 1e9 - r->t0;
+	be->unlink("/log");
+	be->unlink("/bulk");
+}
+
+// Log lines with a little variety, roughly what the images hold
+static void fill_log(char* buf, size_t size) {
+	static const char* what[] = { "request done", "cache miss, fetching", "retrying upstream", "session closed" };
+	unsigned seed = 4;
+	size_t at = 0;
+	for (unsigned i = 0; at < size; i++) {
+		char line[128];
+		unsigned n = rand_r(&seed);
+		unsigned ms = i * 7;
+		int len = snprintf(line, sizeof(line), "2026-10-17 12:%02u:%02u.%03u %s [worker-%u] id=%u %s in %u ms\n",
+		                   ms / 60000 % 60, ms / 1000 % 60, ms % 1000, n % 8 ? "INFO" : "WARN",
+		                   n % 16, 100000 + i, what[n / 16 % 4], n / 64 % 500);
+		size_t take = (size_t)len < size - at ? (size_t)len : size - at;
+		memcpy(buf + at, line, take);
+		at += take;
+	}
+}
+
+static void workload_compress(const backend* be, const config* cf, run* r) {
+	if (mnt) {
+		// Compression happens on writeback behind the mount, nothing to time
+		fprintf(stderr, "compress: engine only\n");
+		r->failed = 1;
+		return;
+	}
+
+	// Writeback would compress some of it on its own meanwhile
+	wb_limits saved_limits, l;
+	writeback_default_limits(&saved_limits);
+	l = saved_limits;
+	l.background = l.limit = SIZE_MAX;
+	l.expire_ms = l.interval_ms = 3600000;
+	writeback_set_limits(&l);
+
+	size_t size = cf->file_mb << 20;
+	char* text = malloc(size);
+	fill_log(text, size);
+	struct stat st;
+	be->mkdir("/z");
+	fs_getattr(fs, "/z", &st);
+	fs_setflags_ino(fs, NUFS_INUM(st.st_ino), FS_FL_COMPRESS);
+	be->mknod("/z/log");
+	size_t used = fs->data.n_blks - fs->data.n_free;
+	for (size_t off = 0; off < size; off += cf->io_size) {
+		size_t len = size - off < cf->io_size ? size - off : cf->io_size;
+		TIMED(r, OP_WRITE, be->write("/z/log", text + off, len, off));
+	}
+
+	fs_getattr(fs, "/z/log", &st);
+	uint64_t t = now_ns();
+	TIMED(r, OP_COMPRESS, fs_compress_ino(fs, NUFS_INUM(st.st_ino), NULL, 0));
+	r->compress_mb_s = size / ((now_ns() - t) / 1e9) / (1 << 20);
+	used = fs->data.n_blks - fs->data.n_free - used;
+	r->ratio = (double)(size / fs->data.blk_sz) / used;
+
+	t = now_ns();
+	for (size_t off = 0; off < size; off += cf->io_size) {
+		size_t len = size - off < cf->io_size ? size - off : cf->io_size;
+		TIMED(r, OP_READ, be->read("/z/log", io_buf, len, off));
+		if (memcmp(io_buf, text + off, len) != 0 && !r->failed) {
+			fprintf(stderr, "compress: read back differs at %zu\n", off);
+			r->failed = 1;
+		}
+	}
+	r->decompress_mb_s = size / ((now_ns() - t) / 1e9) / (1 << 20);
+	r->bytes += 2 * size;
+
+	be->unlink("/z/log");
+	be->rmdir("/z");
+	free(text);
+	writeback_set_limits(&saved_limits);
+}
+
+// Overwrites path in place, returns MiB/s
+static double overwrite(const backend* be, const config* cf, run* r, const char* path, size_t size, const char* data) {
+	uint64_t t = now_ns();
+	for (size_t off = 0; off < size; off += cf->io_size) {
+		size_t len = size - off < cf->io_size ? size - off : cf->io_size;
+		TIMED(r, OP_WRITE, be->write(path, data + off, len, off));
+	}
+	r->bytes += size;
+	return size / ((now_ns() - t) / 1e9) / (1 << 20);
+}
+
+static void workload_dedup(const backend* be, const config* cf, run* r) {
+	if (mnt) {
+		fprintf(stderr, "dedup: engine only\n");
+		r->failed = 1;
+		return;
+	}
+
+	// Sixteen files, four distinct ones, plus one nobody else has
+	size_t bs = fs->data.blk_sz;
+	size_t size = (cf->file_mb << 20) / 16 / bs * bs;
+	if (size < bs) {
+		size = bs;
+	}
+	char* data = malloc(5 * size);
+	unsigned seed = 5;
+	for (size_t i = 0; i < 5 * size; i += sizeof(int)) {
+		int v = rand_r(&seed);
+		memcpy(data + i, &v, sizeof(int));
+	}
+
+	char path[64];
+	be->mkdir("/dd");
+	size_t used = fs->data.n_blks - fs->data.n_free;
+	for (int i = 0; i < 16; i++) {
+		snprintf(path, sizeof(path), "/dd/f%d", i);
+		be->mknod(path);
+		overwrite(be, cf, r, path, size, data + i % 4 * size);
+	}
+	be->mknod("/dd/own");
+	overwrite(be, cf, r, "/dd/own", size, data + 4 * size);
+	size_t before = fs->data.n_blks - fs->data.n_free - used;
+	size_t shared = fs->data.shared;
+
+	uint32_t max = (1 << 20) / bs;
+	uint64_t t = now_ns();
+	for (int i = 0; i < 16; i++) {
+		struct stat st;
+		snprintf(path, sizeof(path), "/dd/f%d", i);
+		fs_getattr(fs, path, &st);
+		uint32_t lblk = 0;
+		while (TIMED(r, OP_DEDUP, fs_dedup_ino(fs, NUFS_INUM(st.st_ino), &lblk, max, 0)) > 0) {
+		}
+	}
+	r->dedup_mb_s = 16 * size / ((now_ns() - t) / 1e9) / (1 << 20);
+	// Blocks given up are freed a commit later, the shared count is exact
+	r->ratio = (double)before / (before - (fs->data.shared - shared));
+
+	// The same writes, to blocks of its own and to blocks it shares
+	r->overwrite_mb_s = overwrite(be, cf, r, "/dd/own", size, data + 4 * size);
+	r->cow_mb_s = overwrite(be, cf, r, "/dd/f15", size, data + 3 * size);
+
+	for (int i = 0; i < 16; i++) {
+		snprintf(path, sizeof(path), "/dd/f%d", i);
+		TIMED(r, OP_READ, be->read(path, io_buf, cf->io_size, 0));
+		if (memcmp(io_buf, data + i % 4 * size, cf->io_size < size ? cf->io_size : size) != 0 && !r->failed) {
+			fprintf(stderr, "dedup: %s reads back wrong\n", path);
+			r->failed = 1;
+		}
+		be->unlink(path);
+	}
+	be->unlink("/dd/own");
+	be->rmdir("/dd");
+	free(data);
+}
+
+static void workload_clone(const backend* be, const config* cf, run* r) {
+	size_t size = cf->file_mb << 20;
+	be->mkdir("/cl");
+	be->mknod("/cl/src");
+	for (size_t off = 0; off < size; off += cf->io_size) {
+		be->write("/cl/src", io_buf, cf->io_size, off);
+	}
+	be->fsync("/cl/src");
+
+	struct statvfs before, after;
+	be->statfs(&before);
+	r->t0 = now_ns() / 1e9;
+	char path[64];
+	for (r->copies = 0; r->copies < 16; r->copies++) {
+		snprintf(path, sizeof(path), "/cl/c%zu", r->copies);
+		be->mknod(path);
+		TIMED(r, OP_COPY, be->copy("/cl/src", path, size));
+		r->bytes += size;
+	}
+	r->seconds = now_ns() / 1e9 - r->t0;
+	be->statfs(&after);
+	r->copy_kb = (double)(before.f_bfree - after.f_bfree) * after.f_frsize / r->copies / 1024;
+
+	TIMED(r, OP_READ, be->read("/cl/c15", io_buf, cf->io_size, size - cf->io_size));
+	for (size_t i = 0; i < r->copies; i++) {
+		snprintf(path, sizeof(path), "/cl/c%zu", i);
+		be->unlink(path);
+	}
+	be->unlink("/cl/src");
+	be->rmdir("/cl");
+}
+
+static void workload_snapshot(const backend* be, const config* cf, run* r) {
+	size_t size = cf->file_mb << 20;
+	char* data = malloc(size);
+	for (size_t i = 0; i < size; i++) {
+		data[i] = 'a' + i % 23;
+	}
+
+	char path[64];
+	be->mkdir("/sn");
+	for (size_t i = 0; i < cf->ops; i++) {
+		snprintf(path, sizeof(path), "/sn/f%zu", i);
+		be->mknod(path);
+		be->write(path, io_buf, 4096, 0);
+	}
+	be->mknod("/sn/big");
+	overwrite(be, cf, r, "/sn/big", size, data);
+	be->fsync("/sn/big");
+
+	// Space is what the snapshots themselves took, not the copies the
+	// overwrites made
+	double cow = 0, own = 0, kb = 0;
+	for (r->snapshots = 0; r->snapshots < 4; r->snapshots++) {
+		struct statvfs before, after;
+		be->statfs(&before);
+		snprintf(path, sizeof(path), "/.snapshots/bench%zu", r->snapshots);
+		TIMED(r, OP_SNAPSHOT, be->mkdir(path));
+		be->statfs(&after);
+		kb += (double)(before.f_bfree - after.f_bfree) * after.f_frsize / 1024;
+
+		data[r->snapshots] += 1;
+		cow += overwrite(be, cf, r, "/sn/big", size, data);
+		own += overwrite(be, cf, r, "/sn/big", size, data);
+	}
+	r->snapshot_kb = kb / r->snapshots;
+	r->cow_mb_s = cow / r->snapshots;
+	r->overwrite_mb_s = own / r->snapshots;
+
+	snprintf(path, sizeof(path), "/.snapshots/bench0/sn/f%zu", cf->ops - 1);
+	TIMED(r, OP_READ, be->read(path, io_buf, 4096, 0));
+	for (size_t i = 0; i < r->snapshots; i++) {
+		snprintf(path, sizeof(path), "/.snapshots/bench%zu", i);
+		TIMED(r, OP_DROP, be->rmdir(path));
+	}
+	for (size_t i = 0; i < cf->ops; i++) {
+		snprintf(path, sizeof(path), "/sn/f%zu", i);
+		be->unlink(path);
+	}
+	be->unlink("/sn/big");
+	be->rmdir("/sn");
+	free(data);
+}
+
+typedef struct workload {
+	const char* name;
+	void (*fn)(const backend* be, const config* cf, run* r);
+} workload;
+
+static const workload workloads[] = {
+	{ "meta", workload_meta },
+	{ "churn", workload_churn },
+	{ "seq", workload_seq },
+	{ "rand", workload_rand },
+	{ "fsync", workload_fsync },
+	{ "compress", workload_compress },
+	{ "dedup", workload_dedup },
+	{ "clone", workload_clone },
+	{ "snapshot", workload_snapshot },
+};
+#define N_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// Reporting
+
+static int cmp_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t pct(const samples* s, double p) {
+	if (s->n == 0) {
+		return 0;
+	}
+	size_t i = (size_t)(p * s->n);
+	return s->ns[i < s->n ? i : s->n - 1];
+}
+
+static void print_latency(const samples* s) {
+	printf("\"count\": %zu, \"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu",
+	       s->n, pct(s, 0.50), pct(s, 0.99), pct(s, 0.999));
+}
+
+static void report(const char* name, run* r, int first) {
+	samples all = { 0 };
+	for (int op = 0; op < N_OPS; op++) {
+		samples* s = &r->by_op[op];
+		qsort(s->ns, s->n, sizeof(uint64_t), cmp_u64);
+		for (size_t i = 0; i < s->n; i++) {
+			add_sample(&all, s->ns[i]);
+		}
+	}
+	qsort(all.ns, all.n, sizeof(uint64_t), cmp_u64);
+
+	printf("%s    {\"name\": \"%s\", \"ok\": %s, \"seconds\": %.6f, \"ops_per_sec\": %.1f, ",
+	       first ? "" : ",\n", name, r->failed ? "false" : "true", r->seconds, all.n / r->seconds);
+	if (r->bytes) {
+		printf("\"mb_per_sec\": %.1f, ", r->bytes / r->seconds / (1 << 20));
+	}
+	if (r->copies) {
+		printf("\"copies\": %zu, \"kb_per_copy\": %.1f, ", r->copies, r->copy_kb);
+	}
+	if (r->snapshots) {
+		printf("\"snapshots\": %zu, \"kb_per_snapshot\": %.1f, \"overwrite_mb_per_sec\": %.1f, \"cow_mb_per_sec\": %.1f, ",
+		       r->snapshots, r->snapshot_kb, r->overwrite_mb_s, r->cow_mb_s);
+	}
+	if (r->dedup_mb_s) {
+		printf("\"dedup_mb_per_sec\": %.1f, \"overwrite_mb_per_sec\": %.1f, \"cow_mb_per_sec\": %.1f, \"ratio\": %.2f, ",
+		       r->dedup_mb_s, r->overwrite_mb_s, r->cow_mb_s, r->ratio);
+	} else if (r->ratio) {
+		printf("\"compress_mb_per_sec\": %.1f, \"decompress_mb_per_sec\": %.1f, \"ratio\": %.2f, ",
+		       r->compress_mb_s, r->decompress_mb_s, r->ratio);
+	}
+	print_latency(&all);
+	printf(",\n      \"ops\": {");
+	int listed = 0;
+	for (int op = 0; op < N_OPS; op++) {
+		if (r->by_op[op].n == 0) {
+			continue;
+		}
+		printf("%s\n        \"%s\": {", listed++ ? "," : "", op_names[op]);
+		print_latency(&r->by_op[op]);
+		printf("}");
+		free(r->by_op[op].ns);
+	}
+	printf("}}");
+	free(all.ns);
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-w meta,churn,seq,rand,fsync,compress,dedup,clone,snapshot] [-n ops] [-s MiB] [-b bytes] [-i image] [-m mountpoint]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char* argv[]) {
+	config cf = { 20000, 64, 128 * 1024 };
+	const char* image = "bench.nufs";
+	const char* which = "meta,churn,seq,rand";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "w:n:s:b:i:m:")) != -1) {
+		switch (opt) {
+		case 'w': which = optarg; break;
+		case 'n': cf.ops = strtoull(optarg, NULL, 10); break;
+		case 's': cf.file_mb = strtoull(optarg, NULL, 10); break;
+		case 'b': cf.io_size = strtoull(optarg, NULL, 10); break;
+		case 'i': image = optarg; break;
+		case 'm': mnt = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc || cf.ops == 0 || cf.file_mb == 0 || cf.io_size == 0
+	    || (cf.file_mb << 20) < cf.io_size) {
+		usage(argv[0]);
+	}
+
+	const backend* be = mnt ? &mount_be : &engine_be;
+	if (!mnt) {
+		unlink(image);
+		if ((fs = init_fs(image)) == NULL) {
+			return 1;
+		}
+	}
+
+	io_buf = malloc(cf.io_size > 8192 ? cf.io_size : 8192);
+	for (size_t i = 0; i < cf.io_size || i < 8192; i++) {
+		io_buf[i] = 'a' + i % 26;
+	}
+
+	printf("{\"backend\": \"%s\", \"ops\": %zu, \"file_mb\": %zu, \"io_size\": %zu,\n  \"workloads\": [\n",
+	       be->name, cf.ops, cf.file_mb, cf.io_size);
+
+	int failed = 0, first = 1;
+	for (size_t w = 0; w < N_WORKLOADS; w++) {
+		const char* at = strstr(which, workloads[w].name);
+		size_t len = strlen(workloads[w].name);
+		if (at == NULL || (at[len] != '\0' && at[len] != ',')) {
+			continue;
+		}
+
+		run r = { 0 };
+		r.t0 = now_ns() / 1e9;
+		workloads[w].fn(be, &cf, &r);
+		if (r.seconds == 0) {
+			r.seconds = now_ns() / 1e9 - r.t0;
+		}
+		failed |= r.failed;
+		report(workloads[w].name, &r, first);
+		first = 0;
+	}
+	printf("\n  ]}\n");
+
+	close_cached();
+	if (!mnt) {
+		close_fs(fs);
+		unlink(image);
+	}
+	free(io_buf);
+	return failed;
+}
@@ -0,0 +1,97 @@
+// Sequential read throughput on an aged image, before and after a
+// defragmentation pass, against the same files written fresh.
+// Aging writes NF files 4 KiB at a time in turn, so every block of a
+// file lands in an extent of its own.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "data.h"
+#include "defrag.h"
+
+#define NF 16
+#define FILE_SIZE (8 << 20)
+#define CHUNK (128 * 1024)
+
+static char buf[CHUNK];
+
+static double now_s() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char* name(int f) {
+	static char path[32];
+	snprintf(path, sizeof(path), "/f%d", f);
+	return path;
+}
+
+static size_t extents(const super_blk* fs) {
+	size_t n = 0;
+	for (int f = 0; f < NF; f++) {
+		struct stat st;
+		fs_getattr(fs, name(f), &st);
+		n += fs_inode(fs, NUFS_INUM(st.st_ino))->n_ext;
+	}
+	return n;
+}
+
+// MB/s reading every file front to back, the second of two runs
+static double read_all(const super_blk* fs) {
+	double t0 = 0;
+	for (int run = 0; run < 2; run++) {
+		t0 = now_s();
+		for (int f = 0; f < NF; f++) {
+			for (off_t off = 0; off < FILE_SIZE; off += CHUNK) {
+				fs_read(fs, name(f), buf, CHUNK, off);
+			}
+		}
+	}
+	return (double)NF * FILE_SIZE / (1024.0 * 1024.0) / (now_s() - t0);
+}
+
+int main(int argc, char* argv[]) {
+	const char* image = argc > 1 ? argv[1] : "bench-defrag.nufs";
+	unlink(image);
+
+	// No passes of its own, only the one asked for below
+	df_limits l;
+	defrag_default_limits(&l);
+	l.rate = 1 << 30;
+	l.interval_ms = 24 * 3600 * 1000;
+	defrag_set_limits(&l);
+	super_blk* fs = init_fs(image);
+
+	for (int f = 0; f < NF; f++) {
+		fs_mknod(fs, name(f), 0100644, 0);
+	}
+	for (off_t off = 0; off < FILE_SIZE; off += 4096) {
+		for (int f = 0; f < NF; f++) {
+			fs_write(fs, name(f), buf, 4096, off);
+		}
+	}
+
+	printf("%10s %12s %8s\n", "", "read MB/s", "extents");
+	printf("%10s %12.1f %8zu\n", "aged", read_all(fs), extents(fs));
+
+	double t0 = now_s();
+	defrag_now();
+	double t1 = now_s();
+	printf("%10s %12.1f %8zu   (pass took %.2f s)\n", "defragged", read_all(fs), extents(fs), t1 - t0);
+
+	for (int f = 0; f < NF; f++) {
+		fs_truncate(fs, name(f), 0);
+		for (off_t off = 0; off < FILE_SIZE; off += CHUNK) {
+			fs_write(fs, name(f), buf, CHUNK, off);
+		}
+	}
+	printf("%10s %12.1f %8zu\n", "fresh", read_all(fs), extents(fs));
+
+	close_fs(fs);
+	unlink(image);
+	return 0;
+}
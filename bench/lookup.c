@@ -0,0 +1,58 @@
+// Path lookup microbenchmark.
+// Fills a fresh image step by step and times fs_getattr hits and
+// misses at each size; with the hashed index ns/op should stay flat.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "data.h"
+
+#define ROUNDS (1000 * 1000)
+
+static double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_lookups(super_blk* fs, char names[][32], int n) {
+	struct stat st;
+	unsigned int seed = 42;
+	double t0 = now_ns();
+	for (int i = 0; i < ROUNDS; i++) {
+		fs_getattr(fs, names[rand_r(&seed) % n], &st);
+	}
+	return (now_ns() - t0) / ROUNDS;
+}
+
+int main(int argc, char* argv[]) {
+	const char* image = argc > 1 ? argv[1] : "bench-lookup.nufs";
+	unlink(image);
+	super_blk* fs = init_fs(image);
+
+	#define MAX_FILES (256 * 1024)
+	static char names[MAX_FILES][32];
+	static char misses[MAX_FILES][32];
+	int steps[] = { 8, 64, 1024, 16 * 1024, MAX_FILES };
+	int made = 0;
+
+	printf("%8s %12s %12s\n", "files", "hit ns/op", "miss ns/op");
+	for (size_t s = 0; s < sizeof(steps) / sizeof(int); s++) {
+		for (; made < steps[s]; made++) {
+			snprintf(names[made], sizeof(names[made]), "/file%06d.txt", made);
+			snprintf(misses[made], sizeof(misses[made]), "/nope%06d.txt", made);
+			if (fs_mknod(fs, names[made], 0100644, 0) != 0) {
+				fprintf(stderr, "mknod %s failed\n", names[made]);
+				return 1;
+			}
+		}
+		printf("%8d %12.1f %12.1f\n", made,
+		       time_lookups(fs, names, made), time_lookups(fs, misses, made));
+	}
+
+	close_fs(fs);
+	unlink(image);
+	return 0;
+}
@@ -0,0 +1,73 @@
+// Sequential I/O throughput benchmark.
+// Writes and reads back files from 1 MiB up to 1 GiB in FUSE sized
+// chunks. The image starts small and grows as the files get bigger;
+// sizes that do not fit its maximum are skipped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "data.h"
+
+#define CHUNK (128 * 1024)
+
+static double now_s() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t free_bytes(const super_blk* fs) {
+	return (fs->data.n_free + fs->max_blks - fs->data.n_blks) * fs->data.blk_sz;
+}
+
+int main(int argc, char* argv[]) {
+	const char* image = argc > 1 ? argv[1] : "bench-seqio.nufs";
+	unlink(image);
+	super_blk* fs = init_fs(image);
+
+	static char buf[CHUNK];
+	for (size_t i = 0; i < CHUNK; i++) {
+		buf[i] = 'a' + i % 26;
+	}
+
+	printf("%10s %12s %12s %8s\n", "size", "write MB/s", "read MB/s", "extents");
+	for (size_t size = 1 << 20; size <= (1 << 30); size <<= 2) {
+		if (size > free_bytes(fs)) {
+			printf("%9zuM %12s %12s %8s\n", size >> 20, "skip", "skip", "-");
+			continue;
+		}
+
+		fs_mknod(fs, "/seq", 0100644, 0);
+
+		double t0 = now_s();
+		for (size_t off = 0; off < size; off += CHUNK) {
+			if (fs_write(fs, "/seq", buf, CHUNK, off) != CHUNK) {
+				fprintf(stderr, "write failed at %zu\n", off);
+				return 1;
+			}
+		}
+		double t1 = now_s();
+		for (size_t off = 0; off < size; off += CHUNK) {
+			if (fs_read(fs, "/seq", buf, CHUNK, off) != CHUNK) {
+				fprintf(stderr, "read failed at %zu\n", off);
+				return 1;
+			}
+		}
+		double t2 = now_s();
+
+		struct stat st;
+		fs_getattr(fs, "/seq", &st);
+		double mb = size / (1024.0 * 1024.0);
+		printf("%9zuM %12.1f %12.1f %8u\n", size >> 20, mb / (t1 - t0), mb / (t2 - t1),
+		       fs_inode(fs, st.st_ino)->n_ext);
+
+		fs_unlink(fs, "/seq");
+	}
+
+	close_fs(fs);
+	unlink(image);
+	return 0;
+}
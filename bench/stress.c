@@ -0,0 +1,378 @@
+// Concurrency stress test for the fs_* engine.
+//
+//   stress [threads] [seconds] [image]
+//
+// Every thread creates, writes, reads back, renames and unlinks files
+// in a directory of its own, fights over a shared directory with the
+// others, and keeps re-reading a set of hot files nobody writes. Contents
+// are checked on every read. Shared files are also read by inode, the way
+// the mount does, while others unlink them. When the threads are done
+// everything they made is removed and the blocks and inodes in use must
+// be back where they started, with the bitmap agreeing with the free count.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "data.h"
+#include "alloc.h"
+#include "directory.h"
+
+#define FILES 32      // per thread
+#define SHARED 16     // in the shared directory, fixed size
+#define HOT 8         // read only
+#define MAX_LEN (96 * 1024)
+#define SHARED_LEN (3 * 4096 + 17)
+#define CHUNK (16 * 1024)
+
+enum { OP_CREATE, OP_READ, OP_UNLINK, OP_RENAME, OP_SHARED, OP_HOT, N_OPS };
+static const char* op_names[N_OPS] = { "create+write", "read", "unlink", "rename", "shared", "hot read" };
+
+static super_blk* fs;
+static int shared_dir;
+static double deadline;
+static atomic_int failed;
+static atomic_long op_count[N_OPS];
+
+static double now_s() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define FAIL(...) do { \
+		fprintf(stderr, __VA_ARGS__); \
+		fputc('\n', stderr); \
+		atomic_store(&failed, 1); \
+	} while (0)
+
+// Byte i of a file written with seed
+static char pattern(unsigned seed, size_t i) {
+	return (char)((seed * 2654435761u + i * 31) >> 3);
+}
+
+typedef struct file_state {
+	int exists;
+	unsigned seed;
+	size_t len;
+} file_state;
+
+typedef struct worker {
+	pthread_t thread;
+	int id;
+	unsigned rng;
+	file_state files[FILES];
+	char buf[MAX_LEN];
+} worker;
+
+static void file_path(char* out, int id, int k) {
+	sprintf(out, "/t%d/f%d", id, k);
+}
+
+// Writes the whole file in FUSE sized chunks
+static int write_file(const char* path, unsigned seed, size_t len, char* buf) {
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = pattern(seed, i);
+	}
+	for (size_t off = 0; off < len; off += CHUNK) {
+		size_t n = len - off < CHUNK ? len - off : CHUNK;
+		int rv = fs_write(fs, path, buf + off, n, off);
+		if (rv != (int)n) {
+			return rv < 0 ? rv : -EIO;
+		}
+	}
+	return 0;
+}
+
+static void check_file(worker* w, int k) {
+	char path[64];
+	file_path(path, w->id, k);
+	file_state* f = &w->files[k];
+
+	struct stat st;
+	int rv = fs_getattr(fs, path, &st);
+	if (!f->exists) {
+		if (rv != -ENOENT) {
+			FAIL("%s: expected ENOENT, got %d", path, rv);
+		}
+		return;
+	}
+	if (rv != 0 || (size_t)st.st_size != f->len) {
+		FAIL("%s: getattr %d, size %ld want %zu", path, rv, (long)st.st_size, f->len);
+		return;
+	}
+
+	size_t got = 0;
+	while (got < f->len) {
+		rv = fs_read(fs, path, w->buf + got, CHUNK, got);
+		if (rv <= 0) {
+			FAIL("%s: read at %zu returned %d", path, got, rv);
+			return;
+		}
+		got += rv;
+	}
+	for (size_t i = 0; i < f->len; i++) {
+		if (w->buf[i] != pattern(f->seed, i)) {
+			FAIL("%s: byte %zu differs", path, i);
+			return;
+		}
+	}
+}
+
+// Shared files are only ever written whole in a single call and read the
+// same way, so a reader must see one writer's bytes and nothing else
+static void shared_op(worker* w) {
+	char path[64];
+	sprintf(path, "/shared/s%d", rand_r(&w->rng) % SHARED);
+
+	switch (rand_r(&w->rng) % 4) {
+	case 0: {
+		int rv = fs_mknod(fs, path, 0100644, 0);
+		if (rv != 0 && rv != -EEXIST) {
+			FAIL("%s: mknod %d", path, rv);
+		}
+		memset(w->buf, 'A' + w->id % 26, SHARED_LEN);
+		rv = fs_write(fs, path, w->buf, SHARED_LEN, 0);
+		if (rv != SHARED_LEN && rv != -ENOENT) {
+			FAIL("%s: write %d", path, rv);
+		}
+		break;
+	}
+	case 1: {
+		int rv = fs_read(fs, path, w->buf, SHARED_LEN, 0);
+		if (rv == -ENOENT || rv == 0) {
+			break;
+		}
+		if (rv != SHARED_LEN) {
+			FAIL("%s: read %d", path, rv);
+			break;
+		}
+		for (int i = 1; i < rv; i++) {
+			if (w->buf[i] != w->buf[0]) {
+				FAIL("%s: torn read at %d", path, i);
+				break;
+			}
+		}
+		break;
+	}
+	case 2: {
+		// Like an open file: an unlink meanwhile must not take the data away
+		fs_entry e;
+		if (fs_lookup(fs, shared_dir, path + strlen("/shared/"), &e) != 0) {
+			break;
+		}
+		for (int pass = 0; pass < 2; pass++) {
+			int rv = fs_read_ino(fs, e.inum, w->buf, SHARED_LEN, 0);
+			if (rv < 0 || (rv > 0 && rv != SHARED_LEN)) {
+				FAIL("%s: read by inode %d", path, rv);
+				break;
+			}
+			for (int i = 1; i < rv; i++) {
+				if (w->buf[i] != w->buf[0]) {
+					FAIL("%s: torn read by inode at %d", path, i);
+					break;
+				}
+			}
+		}
+		fs_forget(fs, e.inum, 1);
+		break;
+	}
+	default: {
+		int rv = fs_unlink(fs, path);
+		if (rv != 0 && rv != -ENOENT) {
+			FAIL("%s: unlink %d", path, rv);
+		}
+	}
+	}
+}
+
+static void hot_read(worker* w) {
+	char path[64];
+	int h = rand_r(&w->rng) % HOT;
+	sprintf(path, "/hot/h%d", h);
+
+	int rv = fs_read(fs, path, w->buf, MAX_LEN, 0);
+	if (rv != MAX_LEN) {
+		FAIL("%s: read %d", path, rv);
+		return;
+	}
+	for (size_t i = 0; i < MAX_LEN; i += 509) {
+		if (w->buf[i] != pattern(1000 + h, i)) {
+			FAIL("%s: byte %zu differs", path, i);
+			return;
+		}
+	}
+}
+
+static void* run_worker(void* arg) {
+	worker* w = arg;
+	char path[64], to[64];
+
+	while (!atomic_load(&failed) && now_s() < deadline) {
+		int k = rand_r(&w->rng) % FILES;
+		file_state* f = &w->files[k];
+		file_path(path, w->id, k);
+
+		int op = rand_r(&w->rng) % N_OPS;
+		switch (op) {
+		case OP_CREATE: {
+			if (f->exists && fs_unlink(fs, path) != 0) {
+				FAIL("%s: unlink before create", path);
+			}
+			int rv = fs_mknod(fs, path, 0100644, 0);
+			if (rv != 0) {
+				FAIL("%s: mknod %d", path, rv);
+				break;
+			}
+			f->exists = 1;
+			f->seed = rand_r(&w->rng);
+			f->len = rand_r(&w->rng) % MAX_LEN;
+			rv = write_file(path, f->seed, f->len, w->buf);
+			if (rv != 0) {
+				FAIL("%s: write %d", path, rv);
+			}
+			break;
+		}
+		case OP_READ:
+			check_file(w, k);
+			break;
+		case OP_UNLINK: {
+			int rv = fs_unlink(fs, path);
+			if (rv != (f->exists ? 0 : -ENOENT)) {
+				FAIL("%s: unlink %d", path, rv);
+			}
+			f->exists = 0;
+			break;
+		}
+		case OP_RENAME: {
+			int j = rand_r(&w->rng) % FILES;
+			file_path(to, w->id, j);
+			int rv = fs_rename(fs, path, to);
+			if (rv != (f->exists ? 0 : -ENOENT)) {
+				FAIL("%s -> %s: rename %d", path, to, rv);
+			}
+			if (f->exists && j != k) {
+				w->files[j] = *f;
+				f->exists = 0;
+			}
+			break;
+		}
+		case OP_SHARED:
+			shared_op(w);
+			break;
+		case OP_HOT:
+			hot_read(w);
+			break;
+		}
+		atomic_fetch_add(&op_count[op], 1);
+	}
+	return NULL;
+}
+
+static size_t count_free_bits(const super_blk* fs) {
+	size_t n = 0;
+	for (size_t i = 0; i < fs->data.n_blks; i++) {
+		n += !blk_in_use(&fs->data, i);
+	}
+	return n;
+}
+
+int main(int argc, char* argv[]) {
+	int n_threads = argc > 1 ? atoi(argv[1]) : 8;
+	double seconds = argc > 2 ? atof(argv[2]) : 5;
+	const char* image = argc > 3 ? argv[3] : "bench-stress.nufs";
+	if (n_threads < 1 || n_threads > 256) {
+		fprintf(stderr, "usage: %s [threads 1-256] [seconds] [image]\n", argv[0]);
+		return 2;
+	}
+
+	// Start small so the image and inode table grow under load
+	fs_geometry geo;
+	default_geometry(&geo);
+	geo.n_blks = 64;
+	geo.n_inodes = 16;
+	if (format_fs(image, &geo) != 0 || (fs = init_fs(image)) == NULL) {
+		fprintf(stderr, "cannot set up %s\n", image);
+		return 1;
+	}
+
+	char path[64];
+	static char hot[MAX_LEN];
+	fs_mkdir(fs, "/shared", 0755);
+	fs_entry e;
+	fs_lookup(fs, ROOT_INUM, "shared", &e);
+	shared_dir = e.inum;
+	fs_mkdir(fs, "/hot", 0755);
+	for (int h = 0; h < HOT; h++) {
+		sprintf(path, "/hot/h%d", h);
+		fs_mknod(fs, path, 0100444 | 0200, 0);
+		write_file(path, 1000 + h, MAX_LEN, hot);
+	}
+	for (int t = 0; t < n_threads; t++) {
+		sprintf(path, "/t%d", t);
+		fs_mkdir(fs, path, 0755);
+	}
+	size_t used_before = fs->data.n_blks - fs->data.n_free;
+	size_t inodes_before = fs->n_inodes - fs->free_inodes;
+
+	worker* workers = calloc(n_threads, sizeof(worker));
+	deadline = now_s() + seconds;
+	double t0 = now_s();
+	for (int t = 0; t < n_threads; t++) {
+		workers[t].id = t;
+		workers[t].rng = 12345 + t;
+		pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+	}
+	for (int t = 0; t < n_threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+	}
+	double elapsed = now_s() - t0;
+
+	// Survivors must still hold what was last written, then all goes
+	for (int t = 0; t < n_threads && !failed; t++) {
+		for (int k = 0; k < FILES; k++) {
+			check_file(&workers[t], k);
+			if (workers[t].files[k].exists) {
+				file_path(path, t, k);
+				fs_unlink(fs, path);
+			}
+		}
+	}
+	for (int s = 0; s < SHARED; s++) {
+		sprintf(path, "/shared/s%d", s);
+		fs_unlink(fs, path);
+	}
+
+	if (fs->data.n_blks - fs->data.n_free != used_before) {
+		FAIL("blocks in use %zu, was %zu before the run", fs->data.n_blks - fs->data.n_free, used_before);
+	}
+	if (fs->n_inodes - fs->free_inodes != inodes_before) {
+		FAIL("inodes in use %zu, was %zu before the run", fs->n_inodes - fs->free_inodes, inodes_before);
+	}
+	if (count_free_bits(fs) != fs->data.n_free) {
+		FAIL("bitmap has %zu free blocks, counter says %zu", count_free_bits(fs), fs->data.n_free);
+	}
+
+	long total = 0;
+	for (int op = 0; op < N_OPS; op++) {
+		printf("%-14s %10ld ops %12.0f ops/s\n", op_names[op], op_count[op], op_count[op] / elapsed);
+		total += op_count[op];
+	}
+	printf("%-14s %10ld ops %12.0f ops/s, %d threads\n", "total", total, total / elapsed, n_threads);
+
+	close_fs(fs);
+	free(workers);
+	unlink(image);
+
+	if (failed) {
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
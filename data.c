@@ -1,425 +1,3362 @@
+#define _GNU_SOURCE
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
-
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "data.h"
+#include "directory.h"
+#include "extent.h"
+#include "alloc.h"
+#include "journal.h"
+#include "writeback.h"
+#include "defrag.h"
+#include "dedup.h"
+#include "lz.h"
+
+// Backing file of the mounted image and the address space reserved for it
+static int image_fd = -1;
+static size_t map_size = 0;
+
+char* fs_blkptr(const super_blk* fs, size_t blk_idx) {
+        return ((char*)fs) + fs->data.data_offset + blk_idx * fs->data.blk_sz;
+}
 
-data_blk_info get_free_blk(data_blks* blks) {
-	size_t free_idx = 0;
-	for (size_t i = 0; i < blks->n_blks; i++) {
-		if (blks->blk_status[i] == false) {
-			free_idx = i;
-			blks->blk_status[i] = true;
-			break;
+enum io_op { IO_READ, IO_WRITE, IO_ZERO };
+
+// Moves bytes between buf and [offset, offset + size) of the file, one
+// contiguous run of blocks per memcpy. The range must already be mapped,
+// holes only read.
+static void file_io(const super_blk* fs, const inode* n, enum io_op op, char* buf, size_t size, off_t offset) {
+	if (n->is_inline) {
+		char* ptr = (char*)n->inline_data + offset;
+		if (op == IO_READ) {
+			memcpy(buf, ptr, size);
+		} else if (op == IO_WRITE) {
+			memcpy(ptr, buf, size);
+		} else {
+			memset(ptr, 0, size);
 		}
+		return;
 	}
 
-	data_blk_info r;
-	r.blk_status_idx = free_idx;
-	r.offset = blks->data_offset + (free_idx * blks->blk_sz);
+	size_t bs = fs->data.blk_sz;
+	ext_pos pos = EXT_POS_START;
+	while (size > 0) {
+		uint32_t run;
+		int blk = inode_map_at(fs, n, offset / bs, &run, &pos);
+		assert(blk >= 0 || op != IO_WRITE);
+
+		size_t in_blk = offset % bs;
+		size_t chunk = (size_t)run * bs - in_blk;
+		if (chunk > size) {
+			chunk = size;
+		}
+
+		char* ptr = blk >= 0 ? fs_blkptr(fs, blk) + in_blk : NULL;
+		if (ptr == NULL) {
+			// A hole, zeros already
+			if (op == IO_READ) {
+				memset(buf, 0, chunk);
+			}
+		} else if (op == IO_READ) {
+			memcpy(buf, ptr, chunk);
+		} else if (op == IO_WRITE) {
+			memcpy(ptr, buf, chunk);
+		} else {
+			memset(ptr, 0, chunk);
+		}
 
-	return r;
+		if (buf) {
+			buf += chunk;
+		}
+		size -= chunk;
+		offset += chunk;
+	}
 }
 
-char* fs_dataptr(const super_blk* fs,  inode* n) {
-        return ((char*)fs) + n->db_info.offset;
+// Per-thread room for decompressing clusters. The last cluster
+// decompressed stays, so small reads through it decompress it once.
+// zgen moves whenever a compressed extent is made: its blocks may have
+// held another one before.
+typedef struct zbuf {
+	uint64_t gen;
+	extent e;        // the cluster in data, len 0 for none
+	char* copy;      // fs_read_begin of a compressed file
+	size_t copy_cap;
+	char data[CLUSTER_SIZE];
+} zbuf;
+
+static uint64_t zgen;
+static pthread_key_t zkey;
+static pthread_once_t zkey_once = PTHREAD_ONCE_INIT;
+
+static void zbuf_free(void* p) {
+	zbuf* z = p;
+	free(z->copy);
+	free(z);
 }
 
-void init_default(super_blk* fs) {
-	struct stat st;
-	if (fs_getattr(fs, "/", &st) != 0) {
-		fs_mknod(fs, "/", 0040755, 0);		
-	}
+static void zkey_init(void) {
+	assert(pthread_key_create(&zkey, zbuf_free) == 0);
+}
 
-	if (fs_getattr(fs, "/hello.txt", &st) != 0) {
-		fs_mknod(fs, "/hello.txt", 0100644, 0);
-		fs_write(fs, "/hello.txt", "hello\n", 6, 0, NULL);
+static zbuf* thread_zbuf(void) {
+	pthread_once(&zkey_once, zkey_init);
+	zbuf* z = pthread_getspecific(zkey);
+	if (z == NULL) {
+		z = calloc(1, sizeof(zbuf));
+		assert(z != NULL);
+		pthread_setspecific(zkey, z);
 	}
+	return z;
 }
 
-super_blk* init_fs(const char* path) {
-	int fd = open(path, O_CREAT | O_RDWR, 0644);
-	assert(fd != -1);
+// The cluster compressed in e, or NULL if it does not decompress. Valid
+// until the thread loads another one.
+static const char* load_cluster(const super_blk* fs, extent e) {
+	zbuf* z = thread_zbuf();
+	uint64_t gen = __atomic_load_n(&zgen, __ATOMIC_ACQUIRE);
+	if (z->gen == gen && z->e.start == e.start && z->e.len == e.len) {
+		return z->data;
+	}
 
-	int sz = NUFS_SIZE + sizeof(super_blk);
-	assert(ftruncate(fd, sz) == 0);
-	super_blk* fs = NULL;
-	assert((fs = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED);
+	z->e.len = 0;
+	const cluster_hdr* h = (const cluster_hdr*)fs_blkptr(fs, e.start);
+	size_t room = (size_t)ext_phys(e) * fs->data.blk_sz - sizeof(cluster_hdr);
+	if (h->bytes > room || lz_decompress(h + 1, h->bytes, z->data, CLUSTER_SIZE) != CLUSTER_SIZE) {
+		return NULL;
+	}
+	z->gen = gen;
+	z->e = e;
+	return z->data;
+}
+
+// IO_READ of file_io for a file that may have compressed clusters.
+// Returns 0, or -EIO when one of them is damaged.
+static int read_range(const super_blk* fs, const inode* n, char* buf, size_t size, off_t offset) {
+	if (n->is_inline || !n->is_compressed) {
+		file_io(fs, n, IO_READ, buf, size, offset);
+		return 0;
+	}
 
-	fs->data.blk_sz = NUFS_SIZE / PAGE_COUNT;
-	fs->data.n_blks = PAGE_COUNT;
-	fs->data.data_offset = sizeof(super_blk);
+	size_t bs = fs->data.blk_sz;
+	ext_pos pos = EXT_POS_START;
+	while (size > 0) {
+		extent e = inode_find(fs, n, offset / bs, &pos);
+		size_t from = offset - (off_t)pos.base * bs;
+		size_t chunk = (size_t)extent_blocks(fs, e) * bs - from;
+		if (chunk > size) {
+			chunk = size;
+		}
 
-	init_default(fs);
-	
-	return fs;
+		if (ext_compressed(e)) {
+			const char* data = load_cluster(fs, e);
+			if (data == NULL) {
+				return -EIO;
+			}
+			memcpy(buf, data + from, chunk);
+		} else if (ext_hole(e)) {
+			memset(buf, 0, chunk);
+		} else {
+			memcpy(buf, fs_blkptr(fs, e.start) + from, chunk);
+		}
+		buf += chunk;
+		size -= chunk;
+		offset += chunk;
+	}
+	return 0;
 }
 
-int find_inode_idx(const super_blk* fs, const char* path) {
-	size_t path_len = strlen(path);
-	for (size_t i = 0; i < sizeof(fs->inodes) / sizeof(inode); i++) {
-		const inode* node = &fs->inodes[i];
-		if (node->references < 1) {
-			continue;
+// Never written, holes are handed out as spans of it. It is as long as
+// the largest block, so a hole never needs more spans than blocks.
+static char zeros[1 << 20];
+
+// Describes [offset, offset + size) of the file as spans of the mapped
+// image, one per contiguous run of blocks, and of zeros for holes. The
+// range must be mapped and iov must have room for fs_max_spans(fs, size)
+// entries.
+static int map_range(const super_blk* fs, const inode* n, size_t size, off_t offset, struct iovec* iov) {
+	if (n->is_inline) {
+		iov[0].iov_base = (char*)n->inline_data + offset;
+		iov[0].iov_len = size;
+		return size > 0;
+	}
+
+	size_t bs = fs->data.blk_sz;
+	ext_pos pos = EXT_POS_START;
+	int count = 0;
+	while (size > 0) {
+		uint32_t run;
+		int blk = inode_map_at(fs, n, offset / bs, &run, &pos);
+
+		size_t in_blk = offset % bs;
+		size_t chunk = (size_t)run * bs - in_blk;
+		if (blk < 0 && chunk > sizeof(zeros)) {
+			chunk = sizeof(zeros);
+		}
+		if (chunk > size) {
+			chunk = size;
 		}
 
-		if (node->path[0] == '\0') {
-			continue;
+		iov[count].iov_base = blk >= 0 ? fs_blkptr(fs, blk) + in_blk : zeros;
+		iov[count].iov_len = chunk;
+		count++;
+		size -= chunk;
+		offset += chunk;
+	}
+	return count;
+}
+
+int fs_max_spans(const super_blk* fs, size_t size) {
+	return size / fs->data.blk_sz + 2;
+}
+
+// Tells writeback which pages of the image [offset, offset + size) of
+// the file changed, under the write lock and after the bytes are in.
+// Inline data is part of the inode, the journal has it.
+static void mark_dirty(const super_blk* fs, const inode* n, off_t offset, size_t size) {
+	if (n->is_inline) {
+		return;
+	}
+
+	size_t bs = fs->data.blk_sz;
+	int inum = inode_num(fs, n);
+	ext_pos pos = EXT_POS_START;
+	while (size > 0) {
+		uint32_t run;
+		int blk = inode_map_at(fs, n, offset / bs, &run, &pos);
+
+		size_t in_blk = offset % bs;
+		size_t chunk = (size_t)run * bs - in_blk;
+		if (chunk > size) {
+			chunk = size;
 		}
 
-		size_t node_len = strlen(node->path);
-		if (node_len == path_len && strncmp(path, node->path, node_len) == 0) {
-			return i;
+		if (blk >= 0) {
+			writeback_dirty(inum, fs_blkptr(fs, blk) + in_blk, chunk, n->is_compressed);
 		}
+		size -= chunk;
+		offset += chunk;
 	}
-	return -1;
 }
 
-const inode* get_inode(const super_blk* fs, const char* path) {
-	int index = find_inode_idx(fs, path);
-
-        if (index == -1) {
-                return NULL;
-        }
+// Adds a changed inode or header to the running journal transaction
+static void log_inode(const inode* n) {
+	journal_dirty(n, sizeof(inode));
+}
 
-	return &fs->inodes[index];
+static void log_header(const super_blk* fs) {
+	journal_dirty(fs, sizeof(super_blk));
 }
 
-const inode* get_hlink_root(const super_blk* fs, const char* path) {
-        const inode* node = get_inode(fs, path);
-                
-        if (!node) {
-                return NULL;
-        }
+// Sets or clears the in-use bit of slot i, under inode_table_lock
+static void mark_slot(super_blk* fs, size_t i, bool used) {
+	uint64_t* w = &fs_inode_bitmap(fs)[i / 64];
+	if (used) {
+		*w |= 1ULL << (i % 64);
+	} else {
+		*w &= ~(1ULL << (i % 64));
+	}
+	journal_dirty(w, sizeof(*w));
+}
 
-        if (node->is_hlink) {
-                inode next = fs->inodes[node->link_idx];
-                return get_hlink_root(fs, next.path);
-        } else {
-                return node;
-        }
+static uint32_t blocks_for(const super_blk* fs, off_t size) {
+	return (size + fs->data.blk_sz - 1) / fs->data.blk_sz;
 }
 
-int check_mode(const inode* n, int mode) {
-	// NOTE: we only check owner perms
-	int flags = (n->mode & 0b111000000) >> 6;
-	return (flags & mode) != 0;
+// Moves the bytes of an inline file out to a data block, it is about
+// to outgrow the inode
+static int promote_inline(super_blk* fs, inode* n) {
+	char data[INLINE_MAX];
+	memcpy(data, n->inline_data, n->data_size);
+	memset(n->inline_data, 0, INLINE_MAX);
+	n->is_inline = false;
+
+	int rv = inode_grow(fs, n, blocks_for(fs, n->data_size));
+	if (rv < 0) {
+		inode_shrink(fs, n, 0);
+		n->is_inline = true;
+		memcpy(n->inline_data, data, n->data_size);
+		return rv;
+	}
+
+	file_io(fs, n, IO_WRITE, data, n->data_size, 0);
+	mark_dirty(fs, n, 0, n->data_size);
+	return 0;
 }
 
-int fs_access(const super_blk* fs, const char* path, int mask) {
-	inode* n = (inode*)get_inode(fs, path);
-	if (!n) {
-		return -ENOENT;
+// Turns cluster k of n, compressed in e, back into plain blocks so it
+// can be changed in place. The compressed blocks are freed once that
+// commits.
+static int expand_cluster(super_blk* fs, inode* n, uint32_t k, extent e) {
+	const char* data = load_cluster(fs, e);
+	if (data == NULL) {
+		return -EIO;
 	}
 
-	if (mask == F_OK) {
-		return 0;
+	uint32_t cb = cluster_blks(fs);
+	size_t start;
+	fs_grow_blocks(fs, cb);
+	if (alloc_run(&fs->data, cb, &start) != 0) {
+		return -ENOSPC;
 	}
 
-	if (!check_mode(n, mask)) {
-		return -EACCES;
+	// The data was durable compressed, it has to be again before the
+	// commit that points the file at the copy
+	char* to = fs_blkptr(fs, start);
+	memcpy(to, data, CLUSTER_SIZE);
+	if (msync(to, CLUSTER_SIZE, MS_SYNC) != 0) {
+		int rv = -errno;
+		free_run(&fs->data, start, cb);
+		return rv;
 	}
 
+	// One extent for another, the chain does not grow
+	extent plain = { start, cb };
+	assert(inode_splice(fs, n, k, k + 1, &plain, 1) == 0);
+	free_run_later(&fs->data, e.start, ext_phys(e));
 	return 0;
 }
 
-int fs_getattr(const super_blk* fs, const char* path, struct stat *st) {
-	const inode* n = get_inode(fs, path);
-	if (n == NULL) {
-		return -ENOENT;
+// Expands the compressed clusters of n among [offset, offset + len),
+// which is about to be written over or cut into
+static int expand_range(super_blk* fs, inode* n, off_t offset, off_t len) {
+	if (n->is_inline || !n->is_compressed || len <= 0) {
+		return 0;
 	}
 
-	memset(st, 0, sizeof(struct stat));
-	st->st_uid = getuid();
-	st->st_gid = getgid();
-	st->st_mode = n->mode;
-	st->st_atim.tv_sec = n->accessed_at;
-	st->st_mtim.tv_sec = n->modified_at;
-	st->st_ctim.tv_sec = n->changed_at;
-	st->st_nlink = n->references;
-	if (n->is_hlink) {
-		const inode* r = get_hlink_root(fs, path);
-		if (r == NULL) {
-			return -ENOENT;
-		}
-		st->st_size = r->data_size;
-	} else if (n->db_info.offset != 0) {
-		st->st_size = n->data_size;
-	} else {
-		st->st_size = 0;
+	uint32_t lblk = offset / fs->data.blk_sz;
+	uint32_t end = blocks_for(fs, offset + len);
+	if (end > n->n_blocks) {
+		end = n->n_blocks;
+	}
+	// An expanded cluster takes the place of its extent, pos stays good
+	ext_pos pos = EXT_POS_START;
+	while (lblk < end) {
+		extent e = inode_find(fs, n, lblk, &pos);
+		if (ext_compressed(e)) {
+			int rv = expand_cluster(fs, n, pos.k, e);
+			if (rv < 0) {
+				return rv;
+			}
+		}
+		lblk = pos.base + extent_blocks(fs, e);
 	}
-	
 	return 0;
 }
 
-int fs_readdir(const super_blk* fs, const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
-	(void) offset;
-	(void) fi;
-	if (strncmp(path, "/", 1) != 0) {
-		return -ENOENT;
+// Gives n its own copy of the blocks it shares among [offset, offset +
+// len), which is about to be written to. Like an expanded cluster the
+// copy is synced before the commit that points n at it, save for blocks
+// the write covers whole, and n lets go of the shared blocks once that
+// is on disk.
+static int unshare_range(super_blk* fs, inode* n, off_t offset, off_t len) {
+	if (n->is_inline || len <= 0 || __atomic_load_n(&fs->data.shared, __ATOMIC_RELAXED) == 0) {
+		return 0;
 	}
 
-	struct stat st;
-	if (fs_getattr(fs, path, &st) != 0) {
-		return -ENOENT;
+	size_t bs = fs->data.blk_sz;
+	uint32_t lblk = offset / bs;
+	uint32_t end = blocks_for(fs, offset + len);
+	if (end > n->n_blocks) {
+		end = n->n_blocks;
 	}
-	
-	filler(buf, ".", &st, 0);
-	filler(buf, "..", &st, 0);
-	
-	size_t path_len = strlen(path);
-	for (size_t i = 0; i < sizeof(fs->inodes) / sizeof(inode); i++) {
-		inode n = fs->inodes[i];
-		if (n.mode == 0) {
+	ext_pos pos = EXT_POS_START;
+	while (lblk < end) {
+		uint32_t run;
+		int blk = inode_map_at(fs, n, lblk, &run, &pos);
+		if (blk < 0) {
+			// A hole or compressed cluster, nothing shares it
+			lblk += run;
+			continue;
+		}
+		if (blk_refs(&fs->data, blk) == 0) {
+			lblk++;
 			continue;
 		}
-		
-		if (strncmp(n.path, path, path_len) == 0 && strlen(n.path) != path_len) {
-			if(fs_getattr(fs, n.path, &st) != 0) {
-				return -ENOENT;
+		uint32_t want = 1;
+		while (want < run && lblk + want < end && blk_refs(&fs->data, blk + want) > 0) {
+			want++;
+		}
+
+		size_t got;
+		fs_grow_blocks(fs, want);
+		size_t start = get_free_run(&fs->data, ALLOC_AT_CURSOR, want, &got);
+		if (got == 0) {
+			return -ENOSPC;
+		}
+		memcpy(fs_blkptr(fs, start), fs_blkptr(fs, blk), got * bs);
+		for (uint32_t i = 0; i < got; i++) {
+			off_t at = (off_t)(lblk + i) * bs;
+			if (at >= offset && at + (off_t)bs <= offset + len) {
+				continue;
 			}
-			filler(buf, n.path + path_len, NULL, 0);
+			if (msync(fs_blkptr(fs, start + i), bs, MS_SYNC) != 0) {
+				int rv = -errno;
+				free_run(&fs->data, start, got);
+				return rv;
+			}
+		}
+		if (inode_replace(fs, n, lblk, got, start, &pos) != 0) {
+			free_run(&fs->data, start, got);
+			return -ENOSPC;
 		}
+		free_run_later(&fs->data, blk, got);
+		lblk += got;
 	}
-	
 	return 0;
 }
 
-int fs_rename(const super_blk* fs, const char* from, const char* to) {
-        // Get respective inode
-        inode* node = (inode*)get_inode(fs, from);
-
-        if (node == NULL) {
-                return -ENOENT;
-        }
-
-        memset(node->path, '\0', strlen(node->path));
-        memcpy(node->path, to, strlen(to));
-
-        time_t t = time(NULL);
-        node->changed_at = t;
-
-        return 0;
+// Files stay shorter than this, so any hole fits one extent
+static off_t max_size(const super_blk* fs) {
+	return (off_t)(EXT_HOLE - 1) * fs->data.blk_sz;
 }
 
-int fs_read(const super_blk* fs, const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	inode* node = (inode*)get_inode(fs, path);
-        inode* root = (inode*)get_hlink_root(fs, path);
+// Runs at least this long are zeroed by the file system under the
+// image, which writes nothing
+#define ZERO_BY_HOST (1 << 20)
 
-        if (node == NULL || root == NULL) {
-                return -ENOENT;
-        }
-        
-        if (!check_mode(node, 4)) {
-                return -EACCES;
-        }
-
-        char* data = fs_dataptr(fs, root);
+// Zeroes count blocks from start, just mapped into n
+static void zero_run(const super_blk* fs, const inode* n, size_t start, size_t count) {
+	size_t len = count * fs->data.blk_sz;
+	off_t at = fs->data.data_offset + (off_t)start * fs->data.blk_sz;
+	if (len >= ZERO_BY_HOST && fallocate(image_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, at, len) == 0) {
+		return;
+	}
+	memset(fs_blkptr(fs, start), 0, len);
+	writeback_dirty(inode_num(fs, n), fs_blkptr(fs, start), len, n->is_compressed);
+}
 
-        // Can't read past data inside file
-        if (offset > root->data_size) {
-                return -ENOMEM;
-        }
+// Maps zeroed blocks for the holes among logical blocks [lblk, end) of
+// n, one run for each hole wherever the free space has one that long.
+// What fits already stays where it is, blocks past the map too.
+static int fill_holes(super_blk* fs, inode* n, uint32_t lblk, uint32_t end) {
+	if (n->is_inline || n->holes == 0) {
+		return 0;
+	}
 
-        int read_size = root->data_size;
-        char* read_ptr = data + offset;
+	if (end > n->n_blocks) {
+		end = n->n_blocks;
+	}
+	ext_pos pos = EXT_POS_START;
+	while (lblk < end) {
+		extent e = inode_find(fs, n, lblk, &pos);
+		uint32_t want = pos.base + extent_blocks(fs, e) - lblk;
+		if (want > end - lblk) {
+			want = end - lblk;
+		}
+		if (!ext_hole(e)) {
+			lblk += want;
+			continue;
+		}
 
-        // min(size to read, size of file from read_start to EOF)
-        read_size = size < read_size ? size : read_size;
+		// Next to the block before if it can, else in one piece anywhere.
+		// Inside the hole that is in it too, so only its first block can
+		// follow a mapped one.
+		int prev = -1;
+		if (lblk == pos.base && pos.k > 0) {
+			extent before = inode_extent(fs, n, pos.k - 1);
+			if (!ext_hole(before) && !ext_compressed(before)) {
+				prev = before.start + before.len - 1;
+			}
+		}
+		size_t got;
+		fs_grow_blocks(fs, want);
+		size_t start = get_free_run(&fs->data, prev >= 0 ? (size_t)prev + 1 : ALLOC_AT_CURSOR, want, &got);
+		if (got < want) {
+			size_t at;
+			if (alloc_run(&fs->data, want, &at) == 0) {
+				if (got > 0) {
+					free_run(&fs->data, start, got);
+				}
+				start = at;
+				got = want;
+			} else if (got == 0) {
+				return -ENOSPC;
+			}
+		}
+		if (inode_replace(fs, n, lblk, got, start, &pos) != 0) {
+			free_run(&fs->data, start, got);
+			return -ENOSPC;
+		}
+		zero_run(fs, n, start, got);
+		lblk += got;
+	}
+	return 0;
+}
 
-        int to_end = root->data_size - offset;
-        read_size = to_end < read_size ? to_end : read_size;
+// Resize the file to size bytes, freeing whole blocks past the end or
+// zeroing the newly exposed range where blocks are mapped and leaving a
+// hole after. A regular file cut to nothing goes back to being inline.
+static int resize_file(super_blk* fs, inode* n, off_t size) {
+	if (size < n->data_size) {
+		// A compressed cluster is only ever dropped whole
+		int rv = size % CLUSTER_SIZE != 0 ? expand_range(fs, n, size, 1) : 0;
+		if (rv < 0) {
+			return rv;
+		}
+		inode_shrink(fs, n, blocks_for(fs, size));
+		n->data_size = size;
+		if (size == 0 && S_ISREG(n->mode) && !n->is_inline) {
+			memset(n->inline_data, 0, INLINE_MAX);
+			n->is_inline = true;
+		}
+		return 0;
+	}
 
-        memcpy(buf, read_ptr, read_size);
+	if (size > max_size(fs)) {
+		return -EFBIG;
+	}
+	if (n->is_inline && size > INLINE_MAX) {
+		int rv = promote_inline(fs, n);
+		if (rv < 0) {
+			return rv;
+		}
+	}
 
-        time_t t = time(NULL);
-        node->accessed_at = t;
+	// Zeroing the tail of the last block writes to it, and to blocks
+	// fallocate mapped past the end
+	off_t mapped = n->is_inline ? size : (off_t)(n->n_blocks * fs->data.blk_sz);
+	off_t to = size < mapped ? size : mapped;
+	int rv = unshare_range(fs, n, n->data_size, to - n->data_size);
+	if (rv == 0 && blocks_for(fs, size) > n->n_blocks && !n->is_inline) {
+		rv = inode_append_hole(fs, n, blocks_for(fs, size) - n->n_blocks);
+	}
+	if (rv < 0) {
+		return rv;
+	}
 
-        // Number of bytes read
-        return read_size;
+	file_io(fs, n, IO_ZERO, NULL, to - n->data_size, n->data_size);
+	mark_dirty(fs, n, n->data_size, to - n->data_size);
+	n->data_size = size;
+	return 0;
 }
 
-// Write data to file
-int fs_write(const super_blk* fs, const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-        inode* node = (inode*)get_hlink_root(fs, path);
-
-        if (node == NULL) {
-                return -ENOENT;
-        }
-
-        if (!check_mode(node, 2)) {
-                return -EACCES;
-        }
-        
-        char* data = fs_dataptr(fs, node);
-        
-        char* write_ptr = data + offset;
+// The root directory always lives in inode 0
+static void init_root(super_blk* fs) {
+	inode* root = fs_inode(fs, ROOT_INUM);
+	bool compressed = root->is_compressed;
+	memset(root, 0, sizeof(inode));
+	root->is_compressed = compressed;
+	mark_slot(fs, ROOT_INUM, true);
+	fs->free_inodes -= 1;
+	log_inode(root);
+	log_header(fs);
+	assert(inode_grow(fs, root, 1) == 0);
+	root->data_size = fs->data.blk_sz;
+
+	root->mode = 0040755;
+	root->references = 1;
+	time_t t = time(NULL);
+	root->accessed_at = t;
+	root->modified_at = t;
+	root->changed_at = t;
+	directory_init_page(fs, ROOT_INUM, ROOT_INUM);
+}
 
-        // If end of write puts you past allocated memory
-        if (write_ptr + size > data + fs->data.blk_sz
-            || offset > fs->data.blk_sz) { // Or would start you OOB
-                return -ENOMEM;
-        }
+// Snapshots are taken and dropped in this directory of the root, which
+// listings of the root leave out. See take_snapshot.
+#define SNAP_DIR ".snapshots"
+static int snap_dir = -1;
 
-        memcpy(write_ptr, buf, size);
+void init_default(super_blk* fs) {
+	struct stat st;
+	journal_begin();
+	if (fs_inode(fs, ROOT_INUM)->references < 1) {
+		init_root(fs);
+	}
 
-        time_t t = time(NULL);
-        node->modified_at = t;
-        node->accessed_at = t;
-        node->changed_at = t;
+	if (fs_getattr(fs, "/hello.txt", &st) != 0) {
+		fs_mknod(fs, "/hello.txt", 0100644, 0);
+		fs_write(fs, "/hello.txt", "hello\n", 6, 0);
+	}
 
-        node->data_size = node->data_size + size;
-        
-        // Number of bytes written
-        return size;
+	snap_dir = tree_lookup_inum(fs, "/" SNAP_DIR);
+	if (snap_dir < 0 && fs_mkdir(fs, "/" SNAP_DIR, 0755) == 0) {
+		snap_dir = tree_lookup_inum(fs, "/" SNAP_DIR);
+		fs_inode(fs, snap_dir)->is_snapshot = true;
+		log_inode(fs_inode(fs, snap_dir));
+	}
+	if (snap_dir >= 0 && !fs_inode(fs, snap_dir)->is_snapshot) {
+		fprintf(stderr, "nufs: /%s is taken by something else, no snapshots can be made\n", SNAP_DIR);
+		snap_dir = -1;
+	}
+	journal_end();
 }
 
+// Locking, always taken in this order:
+//  ns_lock     the directory tree and its index. Name lookups hold it
+//              shared, anything that adds, removes or moves a dirent or
+//              claims or frees an inode holds it exclusive.
+//  inode lock  one rwlock per inode slot over its data, size and times.
+//  alloc lock  the block bitmap (alloc.c), innermost.
+// Path operations hold ns_lock shared across the whole call so nothing
+// they resolved can go away. Inode operations skip it: the kernel keeps
+// an inode alive by its lookup count (see fs_forget), so they only need
+// the inode lock. The inode table is claimed from and released to
+// under inode_table_lock.
+static pthread_rwlock_t ns_lock;
+static pthread_mutex_t inode_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// In-memory state of an inode slot
+typedef struct inode_state {
+	pthread_rwlock_t lock;
+	uint64_t lookups; // entries the kernel was given and has not forgotten
+	bool orphan;      // unlinked while the kernel still knew it, freed on the last forget
+	uint32_t mapped;  // n_blocks before the write under way, under the write lock
+} inode_state;
+
+// Kept in chunks allocated on first use, so mounting a table of a
+// million slots costs nothing up front
+#define STATE_CHUNK 4096
+static inode_state** inode_states;
+static size_t n_state_chunks;
+static pthread_mutex_t state_chunk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_locks(const super_blk* fs) {
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	// Creates and unlinks must not starve behind a steady stream of reads
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&ns_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	n_state_chunks = (fs->max_inodes + STATE_CHUNK - 1) / STATE_CHUNK;
+	inode_states = calloc(n_state_chunks, sizeof(*inode_states));
+	assert(inode_states != NULL);
+}
 
-inode* fs_get_free_inode(super_blk* fs) {
-	for (size_t i = 0; i < sizeof(fs->inodes) / sizeof(inode); i++) {
-		inode* n = &fs->inodes[i];
-		if (n->path[0] == 0) {
-			return n;
+static void free_locks(void) {
+	for (size_t c = 0; c < n_state_chunks; c++) {
+		inode_state* chunk = inode_states[c];
+		if (chunk == NULL) {
+			continue;
 		}
+		for (size_t i = 0; i < STATE_CHUNK; i++) {
+			pthread_rwlock_destroy(&chunk[i].lock);
+		}
+		free(chunk);
 	}
-
-	return NULL;
+	free(inode_states);
+	inode_states = NULL;
+	n_state_chunks = 0;
+	pthread_rwlock_destroy(&ns_lock);
 }
 
-
-int fs_mknod(super_blk* fs, const char* path, mode_t mode, dev_t dev) {
-	(void) dev;
-	
-	inode* n = fs_get_free_inode(fs);
-	if (n == NULL) {
-		return -ENOMEM;
+static inode_state* istate(size_t inum) {
+	size_t c = inum / STATE_CHUNK;
+	assert(c < n_state_chunks);
+
+	inode_state* chunk = __atomic_load_n(&inode_states[c], __ATOMIC_ACQUIRE);
+	if (chunk == NULL) {
+		pthread_mutex_lock(&state_chunk_mutex);
+		chunk = inode_states[c];
+		if (chunk == NULL) {
+			chunk = calloc(STATE_CHUNK, sizeof(inode_state));
+			assert(chunk != NULL);
+			for (size_t i = 0; i < STATE_CHUNK; i++) {
+				pthread_rwlock_init(&chunk[i].lock, NULL);
+			}
+			__atomic_store_n(&inode_states[c], chunk, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&state_chunk_mutex);
 	}
-	
-	data_blk_info data_blk = get_free_blk(&fs->data);
-	if (data_blk.offset == 0) {
-		return -ENOMEM;
+	return &chunk[inum % STATE_CHUNK];
+}
+
+static void lock_inode(const super_blk* fs, const inode* n, bool write) {
+	pthread_rwlock_t* l = &istate(inode_num(fs, n))->lock;
+	if (write) {
+		pthread_rwlock_wrlock(l);
+	} else {
+		pthread_rwlock_rdlock(l);
 	}
-	
-	n->mode = mode;
-	memcpy(n->path, path, strlen(path));
-	n->db_info = data_blk;
-        n->references = 1;
+}
 
-	return 0;
+static void unlock_inode(const super_blk* fs, const inode* n) {
+	pthread_rwlock_unlock(&istate(inode_num(fs, n))->lock);
 }
 
-int fs_utimens(super_blk* fs, const char* path, const struct timespec ts[2]) {
-	inode* n = (inode*)get_inode(fs, path);
+// Told about changes the kernel did not make itself, see fs_set_inval.
+// Name changes are reported even when the kernel asked for them: the
+// by path calls and the snapshot code make them behind its back, and the
+// attributes of the inodes involved change with them.
+static fs_inval_t inval_fn;
+static fs_inval_entry_t inval_entry_fn;
+static void* inval_ctx;
+
+void fs_set_inval(fs_inval_t fn, fs_inval_entry_t entry_fn, void* ctx) {
+	inval_fn = fn;
+	inval_entry_fn = entry_fn;
+	inval_ctx = ctx;
+}
 
-	if (n == NULL) {
-		return -ENOENT;
+static void inval_attrs(int inum) {
+	if (inval_fn) {
+		inval_fn(inval_ctx, inum, -1, 0);
 	}
-	n->accessed_at = ts[0].tv_sec;
-	n->modified_at = ts[1].tv_sec;
-	n->changed_at = n->modified_at;
+}
 
-	return 0;
+static void inval_entry(int dir, const char* name) {
+	if (inval_entry_fn) {
+		inval_entry_fn(inval_ctx, dir, name);
+	}
+}
+
+static void ns_read(void) {
+	pthread_rwlock_rdlock(&ns_lock);
 }
 
-int fs_chmod(const super_blk* fs, const char* path, mode_t mode) {
-        inode* n = (inode*)get_inode(fs, path);
+static void ns_write(void) {
+	pthread_rwlock_wrlock(&ns_lock);
+}
 
-        n->mode = mode;
-        
-        time_t t = time(NULL);
-        n->changed_at = t;
+static void ns_unlock(void) {
+	pthread_rwlock_unlock(&ns_lock);
+}
 
-        return 0;
+static size_t align_up(size_t x, size_t a) {
+	return (x + a - 1) / a * a;
 }
 
-int fs_unlink(super_blk* fs, const char* path) {
-	inode* n = (inode*)get_inode(fs, path);
-	if (n == NULL) {
-		return -ENOENT;
+void default_geometry(fs_geometry* geo) {
+	geo->blk_sz = PAGE_SIZE;
+	geo->n_blks = 256;       // 1 MiB to start with
+	geo->max_blks = 1 << 22; // grows up to 16 GiB
+	geo->n_inodes = 256;
+	geo->max_inodes = 1 << 20;
+	geo->journal_size = JOURNAL_DEFAULT_SIZE;
+	geo->compress = false;
+}
+
+static int check_geometry(const fs_geometry* geo) {
+	if (geo->blk_sz < PAGE_SIZE || geo->blk_sz > (1 << 20) || (geo->blk_sz & (geo->blk_sz - 1)) != 0) {
+		return -EINVAL;
+	}
+	// Extents address blocks with 32 bits, dirents inodes with an int
+	if (geo->n_blks < 1 || geo->n_blks > geo->max_blks || geo->max_blks > UINT32_MAX) {
+		return -EINVAL;
+	}
+	if (geo->n_inodes < 1 || geo->n_inodes > geo->max_inodes || geo->max_inodes > INT32_MAX) {
+		return -EINVAL;
+	}
+	// A dirent's position is an int, block times entries per page plus slot
+	if (geo->max_blks > INT32_MAX / (geo->blk_sz / sizeof(dirent))) {
+		return -EINVAL;
+	}
+	if (geo->journal_size != 0 && (geo->journal_size < JOURNAL_MIN_SIZE || geo->journal_size % PAGE_SIZE != 0)) {
+		return -EINVAL;
+	}
+	if (geo->compress && CLUSTER_SIZE / geo->blk_sz < 2) {
+		return -EINVAL;
 	}
+	return 0;
+}
 
-	if (n->is_hlink) {
-		inode* root = (inode*)get_hlink_root(fs, path);
-		root->references -= 1;
-	} else {
-		if (n->references == 0) {
-			fs->data.blk_status[n->db_info.blk_status_idx] = false;
-			n->db_info.blk_status_idx = -1;
-			n->db_info.offset = 0;
-			n->data_size = 0;
+// Writes the header and an empty allocator for geo into an empty file
+static int format_image(int fd, const fs_geometry* geo) {
+	size_t refs_off = align_up(sizeof(super_blk) + BITMAP_WORDS(geo->max_blks) * sizeof(uint64_t), PAGE_SIZE);
+	size_t ibitmap_off = refs_off + geo->max_blks * sizeof(uint32_t);
+	size_t inode_off = align_up(ibitmap_off + BITMAP_WORDS(geo->max_inodes) * sizeof(uint64_t), PAGE_SIZE);
+	size_t journal_off = align_up(inode_off + geo->max_inodes * sizeof(inode), PAGE_SIZE);
+	size_t data_off = align_up(journal_off + geo->journal_size, geo->blk_sz);
+
+	if (ftruncate(fd, data_off + geo->n_blks * geo->blk_sz) != 0) {
+		return -errno;
+	}
+	if (geo->journal_size != 0) {
+		int rv = journal_format(fd, journal_off, geo->journal_size);
+		if (rv < 0) {
+			return rv;
 		}
 	}
 
-	n->mode = 0;
-	n->references -= 1;
-	n->accessed_at = 0;
-	n->modified_at = 0;
-	n->changed_at = 0;
+	super_blk* fs = mmap(0, inode_off, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (fs == MAP_FAILED) {
+		return -errno;
+	}
 
+	fs->magic = NUFS_MAGIC;
+	fs->version = NUFS_VERSION;
+	fs->n_inodes = geo->n_inodes;
+	fs->max_inodes = geo->max_inodes;
+	fs->free_inodes = geo->n_inodes;
+	fs->inode_cursor = 0;
+	fs->max_blks = geo->max_blks;
+	fs->refs_offset = refs_off;
+	fs->inode_offset = inode_off;
+	fs->inode_bitmap = ibitmap_off;
+	fs->journal_offset = journal_off;
+	fs->journal_size = geo->journal_size;
+	fs->data.blk_sz = geo->blk_sz;
+	fs->data.data_offset = data_off;
+	alloc_init(&fs->data, geo->n_blks);
+	fs->clean = 1;
+	fs->checksum = fs_checksum(fs);
+	munmap(fs, inode_off);
+
+	// The root is made on first mount, it keeps the flag it finds
+	if (geo->compress) {
+		inode root;
+		memset(&root, 0, sizeof(root));
+		root.is_compressed = true;
+		if (pwrite(fd, &root, sizeof(root), inode_off) != sizeof(root)) {
+			return -errno;
+		}
+	}
 	return 0;
 }
 
-int fs_truncate(super_blk* fs, const char* path, off_t size) {
-	inode* n = (inode*)get_hlink_root(fs, path);
-	if (n == NULL) {
-		return -ENOENT;
+int format_fs(const char* path, const fs_geometry* geo) {
+	int rv = check_geometry(geo);
+	if (rv < 0) {
+		return rv;
 	}
 
-	if (n->db_info.offset == 0) {
-		return -1;
+	int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd == -1) {
+		return -errno;
 	}
 
-	if (size > PAGE_SIZE) {
-		return -ENOMEM;
-	} 
-
-	n->data_size = size;
-	return 0;
+	rv = format_image(fd, geo);
+	close(fd);
+	return rv;
 }
 
+// crc32c of the fixed part of the header with the checksum taken as 0.
+// Only an image closed cleanly carries one, see close_fs.
+uint32_t fs_checksum(const super_blk* fs) {
+	super_blk hdr = *fs;
+	hdr.checksum = 0;
+	return crc32c(0, &hdr, sizeof(hdr));
+}
 
+static void reclaim_orphans(super_blk* fs);
 
-int fs_link(super_blk* fs, const char* src, const char* dst) {
-        const inode* source = get_inode(fs, src);
+// How long a mount waits for the image lock. Right after fusermount -u
+// the old daemon still holds it while close_fs writes the image out.
+#define LOCK_WAIT_MS 30000
+#define LOCK_POLL_MS 20
 
-        int idx = find_inode_idx(fs, src);
+// One mount or fsck.nufs at a time, held until close_fs. fsck.nufs
+// gives up at once, a mount waits for the one before it to finish.
+static int lock_image(int fd) {
+	struct timespec nap = { 0, LOCK_POLL_MS * 1000000L };
+	for (int waited = 0; flock(fd, LOCK_EX | LOCK_NB) != 0; waited += LOCK_POLL_MS) {
+		if (errno != EWOULDBLOCK || waited >= LOCK_WAIT_MS) {
+			return -1;
+		}
+		nanosleep(&nap, NULL);
+	}
+	return 0;
+}
 
-        if (idx == -1) {
-                return -ENOENT;
-        }
+// The name index of a clean image is built behind the mount, lookups
+// scan the directory pages until it is done (see directory.c)
+static pthread_t index_thread;
+static bool index_pending, index_building;
 
-        inode* original = &fs->inodes[idx];
+static void* index_main(void* arg) {
+	ns_read();
+	directory_init(arg, false);
+	ns_unlock();
+	return NULL;
+}
 
-        if (source->references == 0) {
-                return -ENOENT;
-        }
+// Opens and recovers the image without starting any thread, a process
+// that forks (fuse_daemonize) starts them in the child with start_fs
+super_blk* open_fs(const char* path) {
+	int fd = open(path, O_CREAT | O_RDWR, 0644);
+	assert(fd != -1);
 
-        original->references += 1;
+	if (lock_image(fd) != 0) {
+		fprintf(stderr, "%s: in use by another mount or fsck.nufs\n", path);
+		close(fd);
+		return NULL;
+	}
 
-        inode* node = fs_get_free_inode(fs);
-        memcpy(node->path, dst, strlen(dst));
-        node->mode = original->mode;
-        node->references = 1;
-        node->is_hlink = true;
-        node->link_idx = idx;
+	// A missing or empty image gets the default geometry
+	struct stat st;
+	assert(fstat(fd, &st) == 0);
+	if (st.st_size == 0) {
+		fs_geometry geo;
+		default_geometry(&geo);
+		assert(format_image(fd, &geo) == 0);
+	}
+
+	super_blk hdr;
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	    || hdr.magic != NUFS_MAGIC || hdr.version != NUFS_VERSION) {
+		if (hdr.magic == NUFS_MAGIC && hdr.version >= 2 && hdr.version < NUFS_VERSION) {
+			fprintf(stderr, "%s: version %u image, convert it with convert.nufs\n", path, hdr.version);
+		} else {
+			fprintf(stderr, "%s: not a nufs image, or made by an unsupported version\n", path);
+		}
+		close(fd);
+		return NULL;
+	}
+
+	// A cleanly closed image is complete as it is: no replay, no orphans
+	// and no entries ahead of their inodes, so the mount skips looking
+	bool clean = hdr.clean != 0;
+	if (clean && fs_checksum(&hdr) != hdr.checksum) {
+		fprintf(stderr, "%s: damaged superblock, check the image with fsck.nufs\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	// Whatever was committed before a crash goes back in first
+	if (!clean && (journal_replay(fd, &hdr) != 0 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))) {
+		fprintf(stderr, "%s: cannot replay the journal\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	// Cleared on disk before anything can change, a crash from here on
+	// leaves the image to be recovered
+	if (clean) {
+		hdr.clean = 0;
+		if (pwrite(fd, &hdr.clean, sizeof(hdr.clean), offsetof(super_blk, clean)) != sizeof(hdr.clean)
+		    || fdatasync(fd) != 0) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			close(fd);
+			return NULL;
+		}
+	}
+
+	// A crash can also lose a growth of the file the journal has
+	size_t used_size = hdr.data.data_offset + hdr.data.n_blks * hdr.data.blk_sz;
+	assert(fstat(fd, &st) == 0);
+	if ((size_t)st.st_size < used_size) {
+		assert(ftruncate(fd, used_size) == 0);
+	}
+
+	// Map the largest the image may grow to, so growing it only needs an
+	// ftruncate and the mapping (and every pointer into it) never moves
+	map_size = hdr.data.data_offset + hdr.max_blks * hdr.data.blk_sz;
+	super_blk* fs = NULL;
+	assert((fs = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED);
+	image_fd = fd;
+	assert(journal_open(fs, path, fd) == 0);
+	alloc_set_refs(fs_refs(fs));
+	writeback_open(fs, map_size);
+
+	init_locks(fs);
+	// Clusters threads kept from an image mounted before are not this one's
+	__atomic_add_fetch(&zgen, 1, __ATOMIC_RELEASE);
+	if (!clean) {
+		reclaim_orphans(fs);
+		journal_begin();
+		directory_init(fs, true);
+		journal_end();
+	}
+	init_default(fs);
+	index_pending = clean;
+
+	return fs;
+}
+
+// Starts the journal commit, writeback, index, defrag and dedup threads
+void start_fs(super_blk* fs) {
+	journal_run();
+	writeback_run();
+	if (index_pending) {
+		assert(pthread_create(&index_thread, NULL, index_main, fs) == 0);
+		index_pending = false;
+		index_building = true;
+	}
+	defrag_start(fs);
+	dedup_start(fs);
+}
+
+super_blk* init_fs(const char* path) {
+	super_blk* fs = open_fs(path);
+	if (fs != NULL) {
+		start_fs(fs);
+	}
+	return fs;
+}
+
+// Flags the image on disk as complete once all of it is there. The front
+// of a journaled image is mapped private, so the header goes out by hand.
+static void mark_clean(const super_blk* fs) {
+	size_t used_size = fs->data.data_offset + fs->data.n_blks * fs->data.blk_sz;
+	if (fs->journal_size == 0 && msync((void*)fs, used_size, MS_SYNC) != 0) {
+		return;
+	}
+
+	super_blk hdr = *fs;
+	hdr.clean = 1;
+	hdr.checksum = fs_checksum(&hdr);
+	if (pwrite(image_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(image_fd) != 0) {
+		fprintf(stderr, "nufs: cannot mark the image clean: %s\n", strerror(errno));
+	}
+}
+
+void close_fs(super_blk* fs) {
+	index_pending = false;
+	if (index_building) {
+		pthread_join(index_thread, NULL);
+		index_building = false;
+	}
+	dedup_stop();
+	defrag_stop();
+	reclaim_orphans(fs);
+	directory_free(fs);
+	writeback_stop();
+	// Blocks freed by the last operations go back before the end
+	journal_flush();
+	journal_begin();
+	alloc_reap(&fs->data);
+	journal_end();
+	if (journal_stop() == 0) {
+		mark_clean(fs);
+	}
+	alloc_set_refs(NULL);
+	free_locks();
+	munmap(fs, map_size);
+	close(image_fd);
+	image_fd = -1;
+}
+
+static int grow_blocks(super_blk* fs, size_t want) {
+	data_blks* d = &fs->data;
+	size_t low = want + d->n_blks / 16;
+	size_t avail = alloc_avail(d);
+	if (avail >= low) {
+		return 0;
+	}
+
+	size_t n = d->n_blks * 2;
+	if (n < d->n_blks + (low - avail)) {
+		n = d->n_blks + (low - avail);
+	}
+	if (n > fs->max_blks) {
+		n = fs->max_blks;
+	}
+	if (n <= d->n_blks) {
+		return avail >= want ? 0 : -ENOSPC;
+	}
+
+	if (ftruncate(image_fd, d->data_offset + n * d->blk_sz) != 0) {
+		return -errno;
+	}
+	alloc_grow(d, n);
+	return 0;
+}
+
+// Makes sure at least want blocks are free by growing the backing file
+// once it runs low, at least doubling the block count so growth stays rare
+int fs_grow_blocks(super_blk* fs, size_t want) {
+	alloc_lock();
+	int rv = grow_blocks(fs, want);
+	alloc_unlock();
+	return rv;
+}
+
+// Doubles the usable part of the inode table, the slots are already
+// zero since the table region is reserved up front
+int fs_grow_inodes(super_blk* fs) {
+	size_t n = fs->n_inodes * 2;
+	if (n > fs->max_inodes) {
+		n = fs->max_inodes;
+	}
+	if (n <= fs->n_inodes) {
+		return -ENOSPC;
+	}
+
+	fs->free_inodes += n - fs->n_inodes;
+	fs->n_inodes = n;
+	log_header(fs);
+	return 0;
+}
+
+int find_inode_idx(const super_blk* fs, const char* path) {
+	int inum = tree_lookup_inum(fs, path);
+	return inum < 0 ? -1 : inum;
+}
+
+const inode* get_inode(const super_blk* fs, const char* path) {
+	int index = find_inode_idx(fs, path);
+
+        if (index == -1) {
+                return NULL;
+        }
+
+	return fs_inode(fs, index);
+}
+
+int check_mode(const inode* n, int mode) {
+	// NOTE: we only check owner perms
+	int flags = (n->mode & 0b111000000) >> 6;
+	return (flags & mode) != 0;
+}
+
+// Inode numbers come from the kernel, which only hands back ones it got
+// from us, but a bad one must not index past the table
+static bool valid_inum(const super_blk* fs, int inum) {
+	return inum >= 0 && (size_t)inum < fs->max_inodes;
+}
+
+static int is_dir_inode(const super_blk* fs, int inum) {
+	const inode* n = fs_inode(fs, inum);
+	return S_ISDIR(n->mode);
+}
+
+static int check_dir(const super_blk* fs, int dir) {
+	if (!valid_inum(fs, dir) || fs_inode(fs, dir)->references < 1) {
+		return -ESTALE;
+	}
+	return is_dir_inode(fs, dir) ? 0 : -ENOTDIR;
+}
+
+int fs_statfs(const super_blk* fs, struct statvfs* st) {
+	memset(st, 0, sizeof(struct statvfs));
+	st->f_bsize = fs->data.blk_sz;
+	st->f_frsize = fs->data.blk_sz;
+	st->f_blocks = fs->data.n_blks;
+	st->f_bfree = alloc_avail(&fs->data);
+	st->f_bavail = st->f_bfree;
+
+	st->f_files = fs->max_inodes;
+	st->f_ffree = fs->free_inodes + (fs->max_inodes - fs->n_inodes);
+	st->f_favail = st->f_ffree;
+	st->f_namemax = DIR_NAME - 1;
+	return 0;
+}
+
+static int access_inode(const super_blk* fs, const inode* n, int mask) {
+	lock_inode(fs, n, false);
+
+	int rv = 0;
+	if (n->mode == 0) {
+		rv = -ENOENT;
+	} else if (mask != F_OK && !check_mode(n, mask)) {
+		rv = -EACCES;
+	}
+
+	unlock_inode(fs, n);
+	return rv;
+}
+
+int fs_access(const super_blk* fs, const char* path, int mask) {
+	ns_read();
+	const inode* n = get_inode(fs, path);
+	int rv = n ? access_inode(fs, n, mask) : -ENOENT;
+	ns_unlock();
+	return rv;
+}
+
+int fs_access_ino(const super_blk* fs, int inum, int mask) {
+	return valid_inum(fs, inum) ? access_inode(fs, fs_inode(fs, inum), mask) : -ESTALE;
+}
+
+static int stat_inode(const super_blk* fs, const inode* n, struct stat *st) {
+	lock_inode(fs, n, false);
+	if (n->mode == 0) {
+		unlock_inode(fs, n);
+		return -ENOENT;
+	}
+
+	memset(st, 0, sizeof(struct stat));
+	st->st_ino = NUFS_INO(inode_num(fs, n));
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_mode = n->mode;
+	st->st_atim.tv_sec = __atomic_load_n(&n->accessed_at, __ATOMIC_RELAXED);
+	st->st_mtim.tv_sec = n->modified_at;
+	st->st_ctim.tv_sec = n->changed_at;
+	st->st_nlink = n->references;
+	st->st_size = n->data_size;
+	st->st_blocks = (n->n_blocks - n->holes) * (fs->data.blk_sz / 512);
+	st->st_blksize = fs->data.blk_sz;
+	unlock_inode(fs, n);
+
+	return 0;
+}
+
+int fs_getattr(const super_blk* fs, const char* path, struct stat *st) {
+	ns_read();
+	const inode* n = get_inode(fs, path);
+	int rv = n ? stat_inode(fs, n, st) : -ENOENT;
+	ns_unlock();
+	return rv;
+}
+
+int fs_getattr_ino(const super_blk* fs, int inum, struct stat* st) {
+	return valid_inum(fs, inum) ? stat_inode(fs, fs_inode(fs, inum), st) : -ESTALE;
+}
+
+// Fills e for inum and counts it as one more entry the kernel holds
+static int make_entry(const super_blk* fs, int inum, fs_entry* e) {
+	int rv = stat_inode(fs, fs_inode(fs, inum), &e->st);
+	if (rv < 0) {
+		return rv;
+	}
+
+	e->inum = inum;
+	e->generation = fs_inode(fs, inum)->generation;
+	__atomic_add_fetch(&istate(inum)->lookups, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int fs_lookup(const super_blk* fs, int dir, const char* name, fs_entry* e) {
+	ns_read();
+	int rv = check_dir(fs, dir);
+	if (rv == 0) {
+		int inum = directory_lookup_inum(fs, dir, name);
+		rv = inum < 0 ? inum : make_entry(fs, inum, e);
+	}
+	ns_unlock();
+	return rv;
+}
+
+static void free_inode(super_blk* fs, inode* n);
+
+// The kernel dropped n of its entries for inum. An inode unlinked while
+// the kernel still knew it was only marked orphan, the last forget frees it.
+void fs_forget(super_blk* fs, int inum, uint64_t n) {
+	if (!valid_inum(fs, inum)) {
+		return;
+	}
+
+	inode_state* s = istate(inum);
+	if (__atomic_sub_fetch(&s->lookups, n, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+
+	journal_begin();
+	ns_write();
+	if (s->orphan && __atomic_load_n(&s->lookups, __ATOMIC_ACQUIRE) == 0) {
+		free_inode(fs, fs_inode(fs, inum));
+	}
+	ns_unlock();
+	journal_end();
+}
+
+typedef struct readdir_ctx {
+	const super_blk* fs;
+	bool stats;             // full attributes, not just the type
+	fs_filler_t filler;
+	fs_entry_filler_t plus; // or hand out entries, see fs_readdirplus_ino
+	void* ctx;
+} readdir_ctx;
+
+// Offsets: "." is at 1, ".." at 2 and the entry at directory position
+// pos at pos + 3, each the place a later listing resumes after it
+#define POS_OFF(pos) ((off_t)(pos) + 3)
+#define OFF_POS(off) ((size_t)((off) < 2 ? 0 : (off) - 2))
+
+static int readdir_visit(const dirent* ent, size_t pos, void* ctx) {
+	readdir_ctx* rc = ctx;
+	if (ent->inum == snap_dir) {
+		return 0;
+	}
+	if (rc->plus) {
+		fs_entry e;
+		if (make_entry(rc->fs, ent->inum, &e) != 0) {
+			return 0;
+		}
+		if (rc->plus(rc->ctx, ent->name, &e, POS_OFF(pos)) != 0) {
+			// Did not fit, the kernel never gets it. The namespace lock
+			// keeps it linked, so this is not the last reference.
+			__atomic_sub_fetch(&istate(ent->inum)->lookups, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+		return 0;
+	}
+
+	struct stat st = { 0 };
+	if (rc->stats) {
+		if (stat_inode(rc->fs, fs_inode(rc->fs, ent->inum), &st) != 0) {
+			return 0;
+		}
+	} else {
+		// A plain listing only needs the type, the rest comes from lookup
+		st.st_ino = NUFS_INO(ent->inum);
+		st.st_mode = fs_inode(rc->fs, ent->inum)->mode;
+	}
+	return rc->filler(rc->ctx, ent->name, &st, POS_OFF(pos));
+}
+
+// "." and ".." are not entries the kernel holds, nothing is counted
+static int readdir_dot(readdir_ctx* rc, const char* name, const struct stat* st, off_t off) {
+	if (rc->plus) {
+		fs_entry e = { NUFS_INUM(st->st_ino), 0, *st };
+		return rc->plus(rc->ctx, name, &e, off);
+	}
+	return rc->filler(rc->ctx, name, st, off);
+}
+
+// Lists dir from the entry after offset off, in page order. Stops early
+// once the filler returns nonzero.
+static int readdir_locked(const super_blk* fs, int dir, off_t off, readdir_ctx* rc) {
+	struct stat st;
+	if (stat_inode(fs, fs_inode(fs, dir), &st) != 0) {
+		return -ENOENT;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		return -ENOTDIR;
+	}
+
+	if (off < 1 && readdir_dot(rc, ".", &st, 1) != 0) {
+		return 0;
+	}
+
+	int parent = directory_parent(fs, dir);
+	struct stat up = { 0 };
+	if (!(rc->stats || rc->plus) || stat_inode(fs, fs_inode(fs, parent), &up) != 0) {
+		up.st_ino = NUFS_INO(parent);
+		up.st_mode = S_IFDIR;
+	}
+	if (off < 2 && readdir_dot(rc, "..", &up, 2) != 0) {
+		return 0;
+	}
+
+	directory_list(fs, dir, OFF_POS(off), readdir_visit, rc);
+	return 0;
+}
+
+// By path every entry comes with its full attributes
+int fs_readdir(const super_blk* fs, const char* path, void* ctx, fs_filler_t filler, off_t offset) {
+	readdir_ctx rc = { fs, true, filler, NULL, ctx };
+	ns_read();
+	int dir = tree_lookup_inum(fs, path);
+	int rv = dir < 0 ? dir : readdir_locked(fs, dir, offset, &rc);
+	ns_unlock();
+	return rv;
+}
+
+int fs_readdir_ino(const super_blk* fs, int dir, off_t offset, fs_filler_t filler, void* ctx) {
+	if (!valid_inum(fs, dir)) {
+		return -ESTALE;
+	}
+
+	readdir_ctx rc = { fs, false, filler, NULL, ctx };
+	ns_read();
+	int rv = readdir_locked(fs, dir, offset, &rc);
+	ns_unlock();
+	return rv;
+}
+
+// Like fs_readdir_ino, but each entry is a full fs_entry the way lookup
+// makes it, so the kernel needs no lookup or getattr per name. Every
+// entry the filler accepts counts as one the kernel holds, except "."
+// and "..".
+int fs_readdirplus_ino(const super_blk* fs, int dir, off_t offset, fs_entry_filler_t filler, void* ctx) {
+	if (!valid_inum(fs, dir)) {
+		return -ESTALE;
+	}
+
+	readdir_ctx rc = { fs, true, NULL, filler, ctx };
+	ns_read();
+	int rv = readdir_locked(fs, dir, offset, &rc);
+	ns_unlock();
+	return rv;
+}
+
+// Directory pages grow with their entries, so changing them also takes
+// the directory's own lock against a getattr that skips the namespace lock
+static int put_ent(super_blk* fs, int dir, const char* name, int inum) {
+	lock_inode(fs, fs_inode(fs, dir), true);
+	int rv = directory_put_ent(fs, dir, name, inum);
+	unlock_inode(fs, fs_inode(fs, dir));
+	return rv;
+}
+
+static void delete_ent(super_blk* fs, int dir, const char* name) {
+	lock_inode(fs, fs_inode(fs, dir), true);
+	directory_delete(fs, dir, name);
+	unlock_inode(fs, fs_inode(fs, dir));
+}
+
+static void release_inode(super_blk* fs, inode* n);
+static void drop_tree(super_blk* fs, int dir);
+
+// Drops the entry name from dir, which must be an empty directory when
+// want_dir is set and anything else when not. A snapshot goes whole,
+// nothing else in one can be removed. Needs ns_lock exclusive.
+static int remove_ent(super_blk* fs, int dir, const char* name, bool want_dir) {
+	int inum = directory_lookup_inum(fs, dir, name);
+	if (inum < 0) {
+		return inum;
+	}
+	if (inum == snap_dir) {
+		return -EBUSY;
+	}
+
+	bool dropping = dir == snap_dir && want_dir;
+	if (fs_inode(fs, dir)->is_snapshot && !dropping) {
+		return -EROFS;
+	}
+
+	inode* n = fs_inode(fs, inum);
+	if (want_dir) {
+		if (!is_dir_inode(fs, inum)) {
+			return -ENOTDIR;
+		}
+		if (dropping) {
+			drop_tree(fs, inum);
+		} else if (!directory_is_empty(fs, inum)) {
+			return -ENOTEMPTY;
+		}
+	} else {
+		if (is_dir_inode(fs, inum)) {
+			return -EISDIR;
+		}
+	}
+
+	delete_ent(fs, dir, name);
+	release_inode(fs, n);
+	inval_entry(dir, name);
+	inval_attrs(inum);
+
+	return 0;
+}
+
+// Whether directory d is top or somewhere under it
+static bool in_subtree(const super_blk* fs, int d, int top) {
+        for (; d != top; d = directory_parent(fs, d)) {
+                if (d == ROOT_INUM) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+static void touch_inode(super_blk* fs, int inum) {
+        inode* n = fs_inode(fs, inum);
+        lock_inode(fs, n, true);
+        n->changed_at = time(NULL);
+        log_inode(n);
+        unlock_inode(fs, n);
+}
+
+// Only dirents change, so a rename costs the same whatever hangs below
+// what it moves. An existing target is pointed at the new inode in
+// place, no other thread sees the name missing and nothing needs room.
+static int rename_locked(super_blk* fs, int from_dir, const char* from_name, int to_dir, const char* to_name, unsigned int flags) {
+        int inum = directory_lookup_inum(fs, from_dir, from_name);
+        if (inum < 0) {
+                return inum;
+        }
+
+        if (fs_inode(fs, from_dir)->is_snapshot || fs_inode(fs, to_dir)->is_snapshot) {
+                return -EROFS;
+        }
+
+        int existing = directory_lookup_inum(fs, to_dir, to_name);
+        if (inum == snap_dir || existing == snap_dir) {
+                return -EBUSY;
+        }
+        if ((flags & RENAME_NOREPLACE) && existing >= 0) {
+                return -EEXIST;
+        }
+        bool exchange = flags & RENAME_EXCHANGE;
+        if (exchange && existing < 0) {
+                return existing;
+        }
+
+        bool moving_dir = is_dir_inode(fs, inum);
+        if (moving_dir && in_subtree(fs, to_dir, inum)) {
+                return -EINVAL;
+        }
+        bool over_dir = existing >= 0 && is_dir_inode(fs, existing);
+        if (exchange && over_dir && in_subtree(fs, from_dir, existing)) {
+                return -EINVAL;
+        }
+
+        if (existing == inum) {
+                return 0;
+        }
+
+        if (exchange) {
+                directory_set_inum(fs, from_dir, from_name, existing);
+                directory_set_inum(fs, to_dir, to_name, inum);
+                if (over_dir) {
+                        directory_set_parent(fs, existing, from_dir);
+                }
+                touch_inode(fs, existing);
+        } else if (existing >= 0) {
+                if (over_dir != moving_dir) {
+                        return over_dir ? -EISDIR : -ENOTDIR;
+                }
+                if (over_dir && !directory_is_empty(fs, existing)) {
+                        return -ENOTEMPTY;
+                }
+
+                directory_set_inum(fs, to_dir, to_name, inum);
+                delete_ent(fs, from_dir, from_name);
+                release_inode(fs, fs_inode(fs, existing));
+        } else {
+                int rv = put_ent(fs, to_dir, to_name, inum);
+                if (rv < 0) {
+                        return rv;
+                }
+                delete_ent(fs, from_dir, from_name);
+        }
+
+        if (moving_dir) {
+                directory_set_parent(fs, inum, to_dir);
+        }
+        touch_inode(fs, inum);
+        inval_entry(from_dir, from_name);
+        inval_entry(to_dir, to_name);
+        inval_attrs(inum);
+        if (existing >= 0) {
+                inval_attrs(existing);
+        }
+        return 0;
+}
+
+// Moves the dirent for from into the directory holding to, replacing
+// any entry there. A directory is never moved into its own subtree.
+int fs_rename(super_blk* fs, const char* from, const char* to) {
+        journal_begin();
+        ns_write();
+        const char* from_name;
+        const char* to_name;
+        int from_dir = tree_lookup_parent(fs, from, &from_name);
+        int to_dir = from_dir < 0 ? from_dir : tree_lookup_parent(fs, to, &to_name);
+        int rv = to_dir < 0 ? to_dir : rename_locked(fs, from_dir, from_name, to_dir, to_name, 0);
+        ns_unlock();
+        journal_end();
+        return rv;
+}
+
+// flags are those of renameat2: RENAME_NOREPLACE fails with EEXIST
+// rather than replace, RENAME_EXCHANGE swaps the two entries
+int fs_rename_at(super_blk* fs, int from_dir, const char* from_name, int to_dir, const char* to_name, unsigned int flags) {
+        if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) != 0
+            || flags == (RENAME_NOREPLACE | RENAME_EXCHANGE)) {
+                return -EINVAL;
+        }
+
+        journal_begin();
+        ns_write();
+        int rv = check_dir(fs, from_dir);
+        if (rv == 0) {
+                rv = check_dir(fs, to_dir);
+        }
+        if (rv == 0) {
+                rv = rename_locked(fs, from_dir, from_name, to_dir, to_name, flags);
+        }
+        ns_unlock();
+        journal_end();
+        return rv;
+}
+
+// Checks and sizes a read of node under its lock, the bytes available
+// at offset or an error
+static int start_read(inode* node, size_t size, off_t offset, bool check) {
+        if (node->mode == 0) {
+                return -ENOENT;
+        }
+
+        if (check && !check_mode(node, 4)) {
+                return -EACCES;
+        }
+
+        if (!node->is_snapshot) {
+                __atomic_store_n(&node->accessed_at, time(NULL), __ATOMIC_RELAXED);
+        }
+
+        // Reading at or past EOF gets nothing
+        if (offset >= node->data_size) {
+                return 0;
+        }
+
+        // min(size to read, size of file from read_start to EOF)
+        off_t to_end = node->data_size - offset;
+        return size < (size_t)to_end ? (off_t)size : to_end;
+}
+
+static int read_inode(const super_blk* fs, inode* node, char* buf, size_t size, off_t offset) {
+        // Readers of one file share its lock, a writer elsewhere never blocks them
+        lock_inode(fs, node, false);
+        int rv = start_read(node, size, offset, true);
+        if (rv > 0 && read_range(fs, node, buf, rv, offset) < 0) {
+                rv = -EIO;
+        }
+        unlock_inode(fs, node);
+
+        // Number of bytes read
+        return rv;
+}
+
+int fs_read(const super_blk* fs, const char *path, char *buf, size_t size, off_t offset) {
+        ns_read();
+        inode* node = (inode*)get_inode(fs, path);
+        int rv = node ? read_inode(fs, node, buf, size, offset) : -ENOENT;
+        ns_unlock();
+        return rv;
+}
+
+// By inode the namespace lock is not needed, the kernel's reference
+// keeps the inode from being freed underneath
+int fs_read_ino(const super_blk* fs, int inum, char* buf, size_t size, off_t offset) {
+        if (!valid_inum(fs, inum)) {
+                return -ESTALE;
+        }
+        return read_inode(fs, fs_inode(fs, inum), buf, size, offset);
+}
+
+// Like fs_read_ino, but instead of copying hands back where the bytes sit
+// in the mapped image, *n_iov spans of them. The inode stays read locked
+// until fs_read_end, so the spans hold still while they are sent. A
+// compressed file is read into a buffer of the calling thread instead.
+// A cached read fills the kernel's page cache, which it also does around
+// writes to a file opened write only: read permission is checked at open.
+int fs_read_begin(const super_blk* fs, int inum, size_t size, off_t offset, bool cached, struct iovec* iov, int* n_iov) {
+        if (!valid_inum(fs, inum)) {
+                return -ESTALE;
+        }
+
+        inode* node = fs_inode(fs, inum);
+        lock_inode(fs, node, false);
+        int rv = start_read(node, size, offset, !cached);
+        if (rv < 0) {
+                unlock_inode(fs, node);
+                return rv;
+        }
+
+        if (!node->is_compressed || node->is_inline) {
+                *n_iov = map_range(fs, node, rv, offset, iov);
+                return rv;
+        }
+
+        zbuf* z = thread_zbuf();
+        if (z->copy_cap < (size_t)rv) {
+                free(z->copy);
+                z->copy_cap = rv;
+                z->copy = malloc(z->copy_cap);
+                assert(z->copy != NULL);
+        }
+        if (read_range(fs, node, z->copy, rv, offset) < 0) {
+                unlock_inode(fs, node);
+                return -EIO;
+        }
+        iov[0].iov_base = z->copy;
+        iov[0].iov_len = rv;
+        *n_iov = rv > 0;
+        return rv;
+}
+
+void fs_read_end(const super_blk* fs, int inum) {
+        unlock_inode(fs, fs_inode(fs, inum));
+}
+
+// Maps blocks up to offset + size under the write lock, zeroing any gap
+// left between the old end of file and offset where blocks are mapped
+// and leaving a hole after. Compressed clusters in the way are expanded,
+// shared blocks copied and holes filled. The size only moves once the
+// data is in, see finish_write.
+static int start_write(super_blk* fs, inode* node, size_t size, off_t offset) {
+        if (node->mode == 0) {
+                return -ENOENT;
+        }
+
+        if (node->is_snapshot) {
+                return -EROFS;
+        }
+
+        if (!check_mode(node, 2)) {
+                return -EACCES;
+        }
+
+        off_t end = offset + size;
+        if (end > max_size(fs)) {
+                return -EFBIG;
+        }
+
+        size_t bs = fs->data.blk_sz;
+        uint32_t mapped = node->n_blocks;
+        istate(inode_num(fs, node))->mapped = mapped;
+        int rv = expand_range(fs, node, offset, (end < node->data_size ? end : node->data_size) - offset);
+        if (rv == 0) {
+                // From the old end of file on too, a gap is zeroed
+                off_t from = offset < node->data_size ? offset : node->data_size;
+                rv = unshare_range(fs, node, from, end - from);
+        }
+        if (rv == 0) {
+                rv = fill_holes(fs, node, offset / bs, blocks_for(fs, end));
+        }
+        if (rv < 0 || end <= node->data_size) {
+                return rv;
+        }
+
+        if (node->is_inline) {
+                if (end <= INLINE_MAX) {
+                        if (offset > node->data_size) {
+                                file_io(fs, node, IO_ZERO, NULL, offset - node->data_size, node->data_size);
+                        }
+                        return 0;
+                }
+                rv = promote_inline(fs, node);
+                if (rv < 0) {
+                        return rv;
+                }
+        }
+
+        if (offset / bs > node->n_blocks) {
+                rv = inode_append_hole(fs, node, offset / bs - node->n_blocks);
+        }
+        if (rv == 0) {
+                rv = inode_grow(fs, node, blocks_for(fs, end));
+        }
+        if (rv < 0) {
+                uint32_t keep = blocks_for(fs, node->data_size);
+                inode_shrink(fs, node, keep > mapped ? keep : mapped);
+                return rv;
+        }
+
+        // The range being written is left alone, it is about to be overwritten
+        if (offset > node->data_size) {
+                file_io(fs, node, IO_ZERO, NULL, offset - node->data_size, node->data_size);
+        }
+        return 0;
+}
+
+// done bytes landed at offset. Blocks mapped for a write that came up
+// short are given back, ones fallocate mapped past the end stay.
+static void finish_write(super_blk* fs, inode* node, off_t offset, size_t done) {
+        // Along with any gap start_write zeroed
+        off_t from = offset < node->data_size ? offset : node->data_size;
+        if (done > 0) {
+                mark_dirty(fs, node, from, offset + done - from);
+        }
+
+        if (done > 0 && offset + (off_t)done > node->data_size) {
+                node->data_size = offset + done;
+        }
+        uint32_t keep = blocks_for(fs, node->data_size);
+        uint32_t mapped = istate(inode_num(fs, node))->mapped;
+        if (keep < mapped) {
+                keep = mapped;
+        }
+        if (node->n_blocks > keep) {
+                inode_shrink(fs, node, keep);
+        }
+
+        time_t t = time(NULL);
+        node->modified_at = t;
+        node->accessed_at = t;
+        node->changed_at = t;
+        log_inode(node);
+}
+
+static int write_inode(super_blk* fs, inode* node, const char* buf, size_t size, off_t offset) {
+        lock_inode(fs, node, true);
+
+        int rv = start_write(fs, node, size, offset);
+        if (rv == 0) {
+                file_io(fs, node, IO_WRITE, (char*)buf, size, offset);
+                finish_write(fs, node, offset, size);
+                rv = size;
+        }
+
+        unlock_inode(fs, node);
+        writeback_balance(inode_num(fs, node));
+
+        // Number of bytes written
+        return rv;
+}
+
+// Write data to file
+int fs_write(super_blk* fs, const char *path, const char *buf, size_t size, off_t offset) {
+        journal_begin();
+        ns_read();
+        inode* node = (inode*)get_inode(fs, path);
+        int rv = node ? write_inode(fs, node, buf, size, offset) : -ENOENT;
+        ns_unlock();
+        journal_end();
+        return rv;
+}
+
+int fs_write_ino(super_blk* fs, int inum, const char* buf, size_t size, off_t offset) {
+        if (!valid_inum(fs, inum)) {
+                return -ESTALE;
+        }
+        journal_begin();
+        int rv = write_inode(fs, fs_inode(fs, inum), buf, size, offset);
+        journal_end();
+        return rv;
+}
+
+// The write side of fs_read_begin: maps room for size bytes at offset
+// and hands back the *n_iov spans to fill. The inode stays write locked
+// until fs_write_end says how many bytes actually arrived.
+int fs_write_begin(super_blk* fs, int inum, size_t size, off_t offset, struct iovec* iov, int* n_iov) {
+        if (!valid_inum(fs, inum)) {
+                return -ESTALE;
+        }
+
+        journal_begin();
+        inode* node = fs_inode(fs, inum);
+        lock_inode(fs, node, true);
+        int rv = start_write(fs, node, size, offset);
+        if (rv < 0) {
+                unlock_inode(fs, node);
+                journal_end();
+                return rv;
+        }
+
+        *n_iov = map_range(fs, node, size, offset, iov);
+        return size;
+}
+
+int fs_write_end(super_blk* fs, int inum, off_t offset, size_t done) {
+        inode* node = fs_inode(fs, inum);
+        finish_write(fs, node, offset, done);
+        unlock_inode(fs, node);
+        journal_end();
+        writeback_balance(inode_num(fs, node));
+        return done;
+}
+
+// Most bytes one copy moves, so the count fits the int it returns
+#define COPY_MAX (1 << 30)
+
+// Copies len bytes of src at off_in to dst at off_out through a buffer,
+// both locked by the caller. Returns the bytes copied, or an error if
+// none were.
+static int copy_bytes(super_blk* fs, inode* src, off_t off_in, inode* dst, off_t off_out, size_t len) {
+        size_t chunk = len < (1 << 20) ? len : (1 << 20);
+        char* buf = chunk > 0 ? malloc(chunk) : NULL;
+        if (chunk > 0 && buf == NULL) {
+                return -ENOMEM;
+        }
+
+        size_t done = 0;
+        int rv = 0;
+        while (done < len) {
+                size_t n = len - done < chunk ? len - done : chunk;
+                if (read_range(fs, src, buf, n, off_in + done) < 0) {
+                        rv = -EIO;
+                        break;
+                }
+                rv = start_write(fs, dst, n, off_out + done);
+                if (rv < 0) {
+                        break;
+                }
+                file_io(fs, dst, IO_WRITE, buf, n, off_out + done);
+                finish_write(fs, dst, off_out + done, n);
+                done += n;
+        }
+        free(buf);
+        return done > 0 ? (int)done : rv;
+}
+
+// Points count blocks of dst from logical block to at the blocks src
+// maps from logical block from on, which both then share, and its holes
+// become holes of dst. The blocks dst had there are freed once that
+// commits, past its end its map grows. A longer map may need blocks for
+// the chain, -ENOSPC stops part way.
+static int share_range(super_blk* fs, inode* src, uint32_t from, inode* dst, uint32_t to, uint32_t count) {
+        // Appending leaves dst_pos good, it stands at most at the last extent
+        ext_pos src_pos = EXT_POS_START, dst_pos = EXT_POS_START;
+        for (uint32_t i = 0; i < count;) {
+                uint32_t run;
+                int blk = inode_map_at(fs, src, from + i, &run, &src_pos);
+                uint32_t len = count - i < run ? count - i : run;
+                int rv;
+                if (to + i < dst->n_blocks) {
+                        uint32_t old_run;
+                        int old = inode_map_at(fs, dst, to + i, &old_run, &dst_pos);
+                        len = len < old_run ? len : old_run;
+                        if (old == blk) {
+                                // Cloned before, or holes on both sides
+                                i += len;
+                                continue;
+                        }
+                        rv = blk >= 0 ? inode_replace(fs, dst, to + i, len, blk, &dst_pos)
+                                      : inode_punch(fs, dst, to + i, len, &dst_pos);
+                        if (rv == 0 && old >= 0) {
+                                free_run_later(&fs->data, old, len);
+                        }
+                } else {
+                        rv = blk >= 0 ? inode_append(fs, dst, blk, len) : inode_append_hole(fs, dst, len);
+                }
+                if (rv < 0) {
+                        return rv;
+                }
+                if (blk >= 0) {
+                        share_run(&fs->data, blk, len);
+                }
+                if (src == dst) {
+                        // Within one file the map just changed under src_pos
+                        src_pos = dst_pos;
+                }
+                i += len;
+        }
+        return 0;
+}
+
+// The bytes before the first and after the last block both ranges
+// cover whole are copied, the blocks between are shared. The last block
+// of src goes whole when dst ends where the copy does, bytes past the
+// end of a file are never read.
+static int copy_range(super_blk* fs, inode* src, off_t off_in, inode* dst, off_t off_out, size_t len) {
+        if (src->mode == 0 || dst->mode == 0) {
+                return -ENOENT;
+        }
+        if (S_ISDIR(src->mode) || S_ISDIR(dst->mode)) {
+                return -EISDIR;
+        }
+        if (!S_ISREG(src->mode) || !S_ISREG(dst->mode)) {
+                return -EINVAL;
+        }
+        if (dst->is_snapshot) {
+                return -EROFS;
+        }
+        if (!check_mode(src, 4) || !check_mode(dst, 2)) {
+                return -EACCES;
+        }
+        if (off_in >= src->data_size) {
+                return 0;
+        }
+        if (len > (size_t)(src->data_size - off_in)) {
+                len = src->data_size - off_in;
+        }
+        if (len > COPY_MAX) {
+                len = COPY_MAX;
+        }
+        if (src == dst && off_in < off_out + (off_t)len && off_out < off_in + (off_t)len) {
+                return -EINVAL;
+        }
+
+        size_t bs = fs->data.blk_sz;
+        size_t head = len;
+        size_t body = 0;
+        if (off_in % bs == off_out % bs && !src->is_inline && !src->is_compressed && !dst->is_compressed) {
+                head = (bs - off_in % bs) % bs;
+                head = head < len ? head : len;
+                body = (len - head) / bs * bs;
+                if (off_in + (off_t)len == src->data_size && off_out + (off_t)len >= dst->data_size) {
+                        body = len - head;
+                }
+        }
+
+        int rv = copy_bytes(fs, src, off_in, dst, off_out, head);
+        if (rv < (int)head) {
+                return rv;
+        }
+
+        if (body > 0) {
+                uint32_t mapped = dst->n_blocks;
+                off_t at = off_out + head;
+                rv = at > dst->data_size ? resize_file(fs, dst, at) : 0;
+                if (rv == 0 && dst->is_inline) {
+                        rv = promote_inline(fs, dst);
+                }
+                if (rv == 0) {
+                        rv = share_range(fs, src, (off_in + head) / bs, dst, at / bs, blocks_for(fs, body));
+                }
+                if (rv == 0 && at + (off_t)body > dst->data_size) {
+                        dst->data_size = at + body;
+                }
+                // Nothing to write back, unlike finish_write. Blocks a
+                // share cut short mapped past the end go again.
+                uint32_t keep = blocks_for(fs, dst->data_size);
+                if (dst->n_blocks > (keep > mapped ? keep : mapped)) {
+                        inode_shrink(fs, dst, keep > mapped ? keep : mapped);
+                }
+                time_t t = time(NULL);
+                dst->modified_at = t;
+                dst->changed_at = t;
+                log_inode(dst);
+                if (rv < 0) {
+                        return head > 0 ? (int)head : rv;
+                }
+        }
+
+        size_t tail = len - head - body;
+        rv = copy_bytes(fs, src, off_in + head + body, dst, off_out + head + body, tail);
+        if (rv < 0 && head + body > 0) {
+                return head + body;
+        }
+        return rv < 0 ? rv : (int)(head + body + rv);
+}
+
+// copy_file_range: copies len bytes of in from off_in to out at off_out
+// and returns how many, at most COPY_MAX and never past the end of in.
+// Where both offsets sit the same way in a block the blocks are shared
+// instead of copied, see copy_range, so a whole file copies in the time
+// its map takes. in is written back first, so the blocks out is pointed
+// at are as much on disk as anything out had written itself.
+int fs_copy_range(super_blk* fs, int in, off_t off_in, int out, off_t off_out, size_t len) {
+        if (!valid_inum(fs, in) || !valid_inum(fs, out)) {
+                return -ESTALE;
+        }
+
+        inode* src = fs_inode(fs, in);
+        inode* dst = fs_inode(fs, out);
+        int rv = writeback_sync(inode_num(fs, src));
+        if (rv < 0) {
+                return rv;
+        }
+
+        // Two files are locked in inode order, src to read and dst to write
+        journal_begin();
+        if (src == dst) {
+                lock_inode(fs, dst, true);
+        } else if (src < dst) {
+                lock_inode(fs, src, false);
+                lock_inode(fs, dst, true);
+        } else {
+                lock_inode(fs, dst, true);
+                lock_inode(fs, src, false);
+        }
+        rv = copy_range(fs, src, off_in, dst, off_out, len);
+        if (src != dst) {
+                unlock_inode(fs, src);
+        }
+        unlock_inode(fs, dst);
+        journal_end();
+        writeback_balance(inode_num(fs, dst));
+        return rv;
+}
+
+// Makes what was written to the file, and every metadata change before
+// the call, durable. Only the file's own pages are written; the journal
+// commit is shared with everyone, so datasync saves nothing here.
+static int fsync_inode(const super_blk* fs, const inode* node) {
+        if (fs->journal_size == 0) {
+                // Nothing orders the metadata without a journal, all of it goes
+                size_t used = fs->data.data_offset + fs->data.n_blks * fs->data.blk_sz;
+                return msync((void*)fs, used, MS_SYNC) == 0 ? 0 : -errno;
+        }
+
+        int rv = writeback_sync(inode_num(fs, node));
+        int jrv = journal_flush();
+        return rv < 0 ? rv : jrv;
+}
+
+int fs_fsync(const super_blk* fs, const char* path) {
+        ns_read();
+        const inode* node = get_inode(fs, path);
+        ns_unlock();
+        return node ? fsync_inode(fs, node) : -ENOENT;
+}
+
+int fs_fsync_ino(const super_blk* fs, int inum) {
+        if (!valid_inum(fs, inum)) {
+                return -ESTALE;
+        }
+        return fsync_inode(fs, fs_inode(fs, inum));
+}
+
+// The first run from logical block *lblk on of at least two extents
+// shorter than max that together are at most max blocks, as extents
+// at->k to k1 - 1 starting at *lblk. Compressed clusters, holes and
+// shared blocks stay where they are.
+static bool find_piece(const super_blk* fs, const inode* n, uint32_t max, uint32_t* lblk, ext_pos* at, uint32_t* k1) {
+	if (*lblk >= n->n_blocks) {
+		return false;
+	}
+	ext_pos pos = EXT_POS_START;
+	extent e = inode_find(fs, n, *lblk, &pos);
+
+	while (pos.k < n->n_ext) {
+		ext_pos first = pos;
+		uint32_t len = 0;
+		for (; pos.k < n->n_ext; e = inode_extent_at(fs, n, pos.k + 1, &pos)) {
+			if (ext_compressed(e) || ext_hole(e) || e.len >= max || len + e.len > max
+			    || run_shared(&fs->data, e.start, e.len)) {
+				break;
+			}
+			len += e.len;
+		}
+		if (pos.k - first.k >= 2) {
+			*at = first;
+			*k1 = pos.k;
+			*lblk = first.base;
+			return true;
+		}
+		if (pos.k == first.k) {
+			// Long enough already, compressed, a hole or shared
+			e = inode_extent_at(fs, n, pos.k + 1, &pos);
+		}
+	}
+	return false;
+}
+
+// Copies extents at.k to k1 - 1 of n to one free run and points n there.
+// The new run goes right after extent at.k - 1 if it can, the front of
+// the image for the first extent, so files and the space between them
+// both come together. The blocks moved out of are freed once the move
+// commits.
+static int move_piece(super_blk* fs, inode* n, ext_pos at, uint32_t k1) {
+	size_t bs = fs->data.blk_sz;
+	uint32_t k0 = at.k;
+	uint32_t len = 0;
+	ext_pos pos = at;
+	for (uint32_t k = k0; k < k1; k++) {
+		len += inode_extent_at(fs, n, k, &pos).len;
+	}
+
+	extent prev = k0 > 0 ? inode_extent(fs, n, k0 - 1) : (extent){ 0, 0 };
+	size_t got;
+	size_t start = get_free_run(&fs->data, prev.start + ext_phys(prev), len, &got);
+	if (got < len) {
+		if (got > 0) {
+			free_run(&fs->data, start, got);
+		}
+		if (alloc_run(&fs->data, len, &start) != 0) {
+			return -ENOSPC;
+		}
+	}
+
+	char* to = fs_blkptr(fs, start);
+	pos = at;
+	for (uint32_t k = k0; k < k1; k++) {
+		extent e = inode_extent_at(fs, n, k, &pos);
+		memcpy(to, fs_blkptr(fs, e.start), (size_t)e.len * bs);
+		to += (size_t)e.len * bs;
+	}
+
+	// The copy has to be on disk before the commit that points the file at it
+	if (msync(fs_blkptr(fs, start), (size_t)len * bs, MS_SYNC) != 0) {
+		int rv = -errno;
+		free_run(&fs->data, start, len);
+		return rv;
+	}
+
+	pos = at;
+	for (uint32_t k = k0; k < k1; k++) {
+		extent e = inode_extent_at(fs, n, k, &pos);
+		free_run_later(&fs->data, e.start, e.len);
+	}
+	inode_remap(fs, n, k0, k1, start);
+	return len;
+}
+
+// The first inode slot in use from inum on, or -1
+int fs_defrag_next(const super_blk* fs, int inum) {
+	ns_read();
+	size_t i = fs_next_inode(fs, inum);
+	int rv = i < fs->n_inodes ? (int)i : -1;
+	ns_unlock();
+	return rv;
+}
+
+// Holds inum like a kernel entry, so an unlink leaves it an orphan,
+// until fs_forget(fs, inum, 1). False if the slot is not in use.
+static bool pin_inode(const super_blk* fs, int inum) {
+	ns_read();
+	bool used = (size_t)inum < fs->n_inodes && (fs_inode_bitmap(fs)[inum / 64] & (1ULL << (inum % 64))) != 0;
+	if (used) {
+		__atomic_add_fetch(&istate(inum)->lookups, 1, __ATOMIC_RELAXED);
+	}
+	ns_unlock();
+	return used;
+}
+
+// Moves the next run of small extents of inum from logical block *lblk
+// on, at most max blocks, to one contiguous run and advances *lblk past
+// it, under the inode's write lock so reads and writes see the file
+// either before or after. Returns the blocks moved, 0 when there is
+// nothing more to move in the file. See defrag.c.
+int fs_defrag_ino(super_blk* fs, int inum, uint32_t* lblk, uint32_t max) {
+	if (!valid_inum(fs, inum)) {
+		return -ESTALE;
+	}
+
+	journal_begin();
+	if (!pin_inode(fs, inum)) {
+		journal_end();
+		return 0;
+	}
+
+	inode* n = fs_inode(fs, inum);
+	ext_pos at;
+	uint32_t k1;
+	int rv = 0;
+	lock_inode(fs, n, true);
+	if (n->references > 0 && !n->is_inline && S_ISREG(n->mode)
+	    && find_piece(fs, n, max, lblk, &at, &k1)) {
+		rv = move_piece(fs, n, at, k1);
+		if (rv > 0) {
+			*lblk += rv;
+		}
+	}
+	unlock_inode(fs, n);
+	journal_end();
+
+	fs_forget(fs, inum, 1);
+	return rv;
+}
+
+// Clusters fs_compress_ino compresses in one transaction
+#define COMPRESS_BATCH 64
+
+static bool in_spans(const struct iovec* spans, int n, const char* p, size_t len) {
+	for (int i = 0; i < n; i++) {
+		const char* b = spans[i].iov_base;
+		if (p < b + spans[i].iov_len && b < p + len) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Compresses the plain cluster at logical block lblk of n, starting in
+// the extent pos stands at, if one of its blocks is among the dirty
+// spans and it comes out at least a block smaller. Its plain blocks go
+// in *old and pos moves to the compressed extent. Returns the blocks
+// saved.
+static int compress_cluster(super_blk* fs, inode* n, uint32_t lblk, ext_pos* pos,
+                            const struct iovec* dirty, int n_dirty, char* buf, extent** old, size_t* n_old) {
+	size_t bs = fs->data.blk_sz;
+	uint32_t cb = cluster_blks(fs);
+
+	// Its pieces, from extent pos->k to k1 - 1, may be anywhere on disk
+	extent pieces[CLUSTER_SIZE / PAGE_SIZE];
+	uint32_t n_pieces = 0;
+	ext_pos p = *pos;
+	extent first = inode_extent_at(fs, n, p.k, &p);
+	extent last = first;
+	uint32_t k1 = p.k;
+	uint32_t b = p.base;
+	bool hit = dirty == NULL;
+	for (uint32_t at = lblk; at < lblk + cb; k1++) {
+		extent e = last = inode_extent_at(fs, n, k1, &p);
+		if (ext_hole(e)) {
+			// Not all of it written, the hole costs nothing as it is
+			return 0;
+		}
+		uint32_t skip = at - b;
+		uint32_t take = e.len - skip < lblk + cb - at ? e.len - skip : lblk + cb - at;
+		if (run_shared(&fs->data, e.start + skip, take)) {
+			// Other files read these blocks as they are
+			return 0;
+		}
+		pieces[n_pieces++] = (extent){ e.start + skip, take };
+		hit = hit || in_spans(dirty, n_dirty, fs_blkptr(fs, e.start + skip), (size_t)take * bs);
+		at += take;
+		b += e.len;
+	}
+	if (!hit) {
+		return 0;
+	}
+
+	// Anything that does not save a block is left as it is
+	char* raw = buf + CLUSTER_SIZE;
+	file_io(fs, n, IO_READ, raw, CLUSTER_SIZE, (off_t)lblk * bs);
+	cluster_hdr* h = (cluster_hdr*)buf;
+	int bytes = lz_compress(raw, CLUSTER_SIZE, h + 1, (cb - 1) * bs - sizeof(cluster_hdr));
+	if (bytes == 0) {
+		return 0;
+	}
+	h->bytes = bytes;
+	h->pad = 0;
+	uint32_t phys = (sizeof(cluster_hdr) + bytes + bs - 1) / bs;
+	memset((char*)(h + 1) + bytes, 0, (size_t)phys * bs - sizeof(cluster_hdr) - bytes);
+
+	// The plain blocks only come free after the commit
+	size_t start;
+	fs_grow_blocks(fs, phys);
+	if (alloc_run(&fs->data, phys, &start) != 0) {
+		return -ENOSPC;
+	}
+	char* to = fs_blkptr(fs, start);
+	memcpy(to, buf, (size_t)phys * bs);
+	if (msync(to, (size_t)phys * bs, MS_SYNC) != 0) {
+		int rv = -errno;
+		free_run(&fs->data, start, phys);
+		return rv;
+	}
+
+	// The first and last extent may run on past the cluster
+	uint32_t tail = lblk + cb - (b - last.len);
+	extent list[3];
+	uint32_t count = 0;
+	if (lblk > pos->base) {
+		list[count++] = (extent){ first.start, lblk - pos->base };
+	}
+	list[count++] = (extent){ start, EXT_COMPRESSED | phys };
+	if (tail < last.len) {
+		list[count++] = (extent){ last.start + tail, last.len - tail };
+	}
+
+	*old = realloc(*old, (*n_old + n_pieces) * sizeof(extent));
+	assert(*old != NULL);
+	__atomic_add_fetch(&zgen, 1, __ATOMIC_RELEASE);
+	if (inode_splice(fs, n, pos->k, k1, list, count) != 0) {
+		free_run(&fs->data, start, phys);
+		return -ENOSPC;
+	}
+	memcpy(*old + *n_old, pieces, n_pieces * sizeof(extent));
+	*n_old += n_pieces;
+	*pos = inode_pos(fs, n, pos->k + (lblk > pos->base), lblk);
+	return cb - phys;
+}
+
+// Compresses the full clusters of inum stored plain that have a block
+// among the dirty spans of the image (all of them for NULL), a batch at
+// a time. The compressed copy is synced and the map switched in one
+// transaction; once that is committed the plain blocks are punched out
+// of the backing file, so their dirty pages are never written, and
+// freed. Called by the writeback thread. Returns the blocks saved.
+int fs_compress_ino(super_blk* fs, int inum, const struct iovec* dirty, int n_dirty) {
+	if (!valid_inum(fs, inum) || cluster_blks(fs) < 2) {
+		return 0;
+	}
+	if (!pin_inode(fs, inum)) {
+		return 0;
+	}
+
+	uint32_t cb = cluster_blks(fs);
+	size_t bs = fs->data.blk_sz;
+	char* buf = malloc(2 * CLUSTER_SIZE);
+	assert(buf != NULL);
+	extent* old = NULL;
+	int saved = 0;
+	int rv = 0;
+	bool more = true;
+	for (uint32_t c = 0; more && rv >= 0;) {
+		size_t n_old = 0;
+		journal_begin();
+		inode* n = fs_inode(fs, inum);
+		lock_inode(fs, n, true);
+		more = false;
+		if (n->references > 0 && !n->is_inline && n->is_compressed && S_ISREG(n->mode)) {
+			uint32_t full = n->data_size / CLUSTER_SIZE;
+			ext_pos pos = EXT_POS_START;
+			for (int done = 0; c < full && done < COMPRESS_BATCH && rv >= 0; c++) {
+				uint32_t lblk = c * cb;
+				extent e = inode_find(fs, n, lblk, &pos);
+				if (ext_compressed(e)) {
+					continue;
+				}
+				rv = compress_cluster(fs, n, lblk, &pos, dirty, n_dirty, buf, &old, &n_old);
+				if (rv > 0) {
+					saved += rv;
+					done++;
+				}
+			}
+			more = c < full;
+		}
+		unlock_inode(fs, n);
+		journal_end();
+
+		if (n_old > 0) {
+			if (journal_flush() != 0) {
+				// Left in use, the map on disk may still point there
+				rv = -EIO;
+				break;
+			}
+			for (size_t i = 0; i < n_old; i++) {
+				fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				          fs->data.data_offset + (off_t)old[i].start * bs, (off_t)old[i].len * bs);
+			}
+			journal_begin();
+			for (size_t i = 0; i < n_old; i++) {
+				free_run(&fs->data, old[i].start, old[i].len);
+			}
+			journal_end();
+		}
+	}
+	free(old);
+	free(buf);
+	if (saved > 0) {
+		inval_attrs(inum);
+	}
+
+	fs_forget(fs, inum, 1);
+	// Out of room for a compressed copy, what is left stays plain
+	return rv < 0 && rv != -ENOSPC ? rv : saved;
+}
+
+// Files fs_dedup_ino looks at, and shares blocks with
+static bool dedup_kind(const inode* n) {
+	return n->references > 0 && !n->is_inline && !n->is_compressed && !n->is_snapshot && S_ISREG(n->mode);
+}
+
+// Whether the block e was seen in is still mapped where it was and
+// holds the same bytes as data, and if so adds an owner to it. With n
+// locked the lock of another file is only tried, never waited for;
+// ns_lock held shared keeps that file from being freed meanwhile.
+static bool claim_match(super_blk* fs, const inode* n, const dd_entry* e, const char* data) {
+	bool other = e->inum != inode_num(fs, n);
+	if (other) {
+		if ((size_t)e->inum >= fs->n_inodes || (fs_inode_bitmap(fs)[e->inum / 64] & (1ULL << (e->inum % 64))) == 0) {
+			return false;
+		}
+		if (pthread_rwlock_tryrdlock(&istate(e->inum)->lock) != 0) {
+			return false;
+		}
+	}
+
+	const inode* o = fs_inode(fs, e->inum);
+	bool same = o->generation == e->generation && dedup_kind(o) && e->lblk < o->n_blocks
+	            && inode_map(fs, o, e->lblk, NULL) == (int)e->blk
+	            && memcmp(fs_blkptr(fs, e->blk), data, fs->data.blk_sz) == 0;
+	if (same) {
+		share_run(&fs->data, e->blk, 1);
+	}
+	if (other) {
+		unlock_inode(fs, o);
+	}
+	return same;
+}
+
+// Every extent costs lookups in the file a step, so a run of shared
+// blocks shorter than this is only worth it while the map fits in the
+// inode
+#define DEDUP_MIN_RUN 8
+
+// Fingerprints blocks lblk to lblk + max - 1 of n, as far as it goes,
+// and maps each one found elsewhere to that block instead, a run at a
+// time. Its own blocks are freed once that commits. Returns the blocks
+// looked at.
+static int dedup_range(super_blk* fs, inode* n, uint32_t lblk, uint32_t max) {
+	size_t bs = fs->data.blk_sz;
+	int inum = inode_num(fs, n);
+	uint32_t end = n->n_blocks - lblk < max ? n->n_blocks : lblk + max;
+	uint32_t* target = malloc((end - lblk) * sizeof(uint32_t));
+	extent* old = malloc((end - lblk) * sizeof(extent));
+	assert(target != NULL && old != NULL);
+	bool remapped = false;
+
+	ext_pos pos = EXT_POS_START;
+	for (uint32_t l = lblk; l < end; l++) {
+		int blk = inode_map_at(fs, n, l, NULL, &pos);
+		target[l - lblk] = blk;
+		if (blk < 0) {
+			// A hole has nothing to share
+			continue;
+		}
+		const char* data = fs_blkptr(fs, blk);
+		uint64_t hash = dedup_hash(data, bs);
+		dd_entry e;
+		bool found = dedup_find(hash, &e);
+		if (found && e.blk == (uint32_t)blk) {
+			continue;
+		}
+		if (found && claim_match(fs, n, &e, data)) {
+			target[l - lblk] = e.blk;
+			continue;
+		}
+		dd_entry seen = { hash, blk, l, inum, n->generation };
+		dedup_add(&seen);
+	}
+
+	pos = EXT_POS_START;
+	for (uint32_t l = lblk; l < end;) {
+		uint32_t to = target[l - lblk];
+		if ((int)to == inode_map_at(fs, n, l, NULL, &pos)) {
+			l++;
+			continue;
+		}
+		uint32_t len = 1;
+		while (l + len < end && target[l + len - lblk] == to + len) {
+			len++;
+		}
+		if (len < DEDUP_MIN_RUN && n->n_ext + 2 > N_DIRECT) {
+			free_run(&fs->data, to, len);
+			l += len;
+			continue;
+		}
 
-        node->db_info.blk_status_idx = -1;
-        node->db_info.offset = 0;
-        
-        time_t t = time(NULL);
-        node->modified_at = t;
-        node->accessed_at = t;
-        node->changed_at = t;
+		uint32_t n_old = 0;
+		ext_pos from = pos;
+		for (uint32_t at = l, run; at < l + len; at += run) {
+			int blk = inode_map_at(fs, n, at, &run, &from);
+			if (run > l + len - at) {
+				run = l + len - at;
+			}
+			old[n_old++] = (extent){ blk, run };
+		}
+		// The run may hold its other owner's writes that are not on disk
+		// yet; shared now it no longer changes, and goes out before the
+		// commit that points this file at it
+		if (msync(fs_blkptr(fs, to), (size_t)len * bs, MS_SYNC) != 0
+		    || inode_replace(fs, n, l, len, to, &pos) != 0) {
+			// Not synced or no room to split the map, the owners just
+			// added go again
+			for (uint32_t at = l; at < end; at++) {
+				if ((int)target[at - lblk] != inode_map_at(fs, n, at, NULL, &pos)) {
+					free_run(&fs->data, target[at - lblk], 1);
+				}
+			}
+			break;
+		}
+		for (uint32_t i = 0; i < n_old; i++) {
+			free_run_later(&fs->data, old[i].start, old[i].len);
+		}
+		remapped = true;
+		l += len;
+	}
+	free(old);
+	free(target);
+	// Same bytes, but the kernel's st_blocks may be stale
+	if (remapped) {
+		inval_attrs(inum);
+	}
+	return end - lblk;
+}
+
+// Looks at the blocks of inum from logical block *lblk on, at most max
+// of them, if it was written since since: those with the same bytes as
+// a block seen before now share that block, the others are remembered.
+// Advances *lblk and returns the blocks looked at, 0 when there is
+// nothing more to look at in the file. See dedup.c.
+int fs_dedup_ino(super_blk* fs, int inum, uint32_t* lblk, uint32_t max, time_t since) {
+	if (!valid_inum(fs, inum)) {
+		return -ESTALE;
+	}
+
+	journal_begin();
+	if (!pin_inode(fs, inum)) {
+		journal_end();
+		return 0;
+	}
+
+	inode* n = fs_inode(fs, inum);
+	int rv = 0;
+	ns_read();
+	lock_inode(fs, n, true);
+	if (dedup_kind(n) && n->modified_at >= since && *lblk < n->n_blocks) {
+		rv = dedup_range(fs, n, *lblk, max);
+		*lblk += rv;
+	}
+	unlock_inode(fs, n);
+	ns_unlock();
+	journal_end();
+
+	fs_forget(fs, inum, 1);
+	return rv;
+}
+
+// Claims an unused inode, searching the inode bitmap next-fit from the
+// inode cursor and growing the table when it is full. The inode comes back zeroed with
+// one reference and the next generation of its slot, so the kernel can
+// tell it from whatever used the slot before.
+inode* fs_get_free_inode(super_blk* fs) {
+	pthread_mutex_lock(&inode_table_lock);
+	if (fs->free_inodes == 0 && fs_grow_inodes(fs) != 0) {
+		pthread_mutex_unlock(&inode_table_lock);
+		return NULL;
+	}
+
+	// An orphan has no references left but keeps its bit until freed
+	const uint64_t* map = fs_inode_bitmap(fs);
+	size_t words = BITMAP_WORDS(fs->n_inodes);
+	size_t start = fs->inode_cursor / 64 % words;
+	inode* found = NULL;
+	for (size_t k = 0; k <= words; k++) {
+		size_t w = (start + k) % words;
+		uint64_t free = ~map[w];
+		if (w == words - 1 && fs->n_inodes % 64 != 0) {
+			free &= (1ULL << (fs->n_inodes % 64)) - 1;
+		}
+		if (free == 0) {
+			continue;
+		}
+
+		size_t i = w * 64 + __builtin_ctzll(free);
+		inode* n = fs_inode(fs, i);
+		uint32_t gen = n->generation;
+		memset(n, 0, sizeof(inode));
+		n->generation = gen + 1;
+		n->references = 1;
+		mark_slot(fs, i, true);
+		fs->free_inodes -= 1;
+		fs->inode_cursor = i + 1;
+		log_inode(n);
+		log_header(fs);
+		found = n;
+		break;
+	}
+
+	pthread_mutex_unlock(&inode_table_lock);
+	return found;
+}
+
+// Gives back the blocks and slot of an inode nothing refers to any more
+static void free_inode(super_blk* fs, inode* n) {
+	lock_inode(fs, n, true);
+	inode_shrink(fs, n, 0);
+	unlock_inode(fs, n);
+
+	pthread_mutex_lock(&inode_table_lock);
+	uint32_t gen = n->generation;
+	memset(n, 0, sizeof(inode));
+	n->generation = gen;
+	mark_slot(fs, inode_num(fs, n), false);
+	istate(inode_num(fs, n))->orphan = false;
+	writeback_forget(inode_num(fs, n));
+	fs->free_inodes += 1;
+	log_inode(n);
+	log_header(fs);
+	pthread_mutex_unlock(&inode_table_lock);
+}
+
+// Drop one reference. An inode with none left is freed, unless the kernel
+// still holds entries for it, then fs_forget frees it later.
+static void release_inode(super_blk* fs, inode* n) {
+	lock_inode(fs, n, true);
+	n->references -= 1;
+	n->changed_at = time(NULL);
+	log_inode(n);
+	bool gone = n->references < 1;
+	unlock_inode(fs, n);
+
+	if (!gone) {
+		return;
+	}
+
+	inode_state* s = istate(inode_num(fs, n));
+	if (__atomic_load_n(&s->lookups, __ATOMIC_ACQUIRE) > 0) {
+		s->orphan = true;
+		return;
+	}
+	free_inode(fs, n);
+}
+
+// Frees what was orphaned when the image was last closed, or crashed
+static void reclaim_orphans(super_blk* fs) {
+	journal_begin();
+	for (size_t i = fs_next_inode(fs, 0); i < fs->n_inodes; i = fs_next_inode(fs, i + 1)) {
+		inode* n = fs_inode(fs, i);
+		if (n->references < 1 && n->mode != 0) {
+			free_inode(fs, n);
+		}
+	}
+	journal_end();
+}
+
+// Snapshots. Making a directory in /.snapshots copies the tree under
+// the root into it: directories get dirent pages of their own, files a
+// copy of their extent map pointing at the same blocks, each of which
+// gains an owner (see alloc.c). No data is copied, writes pay for that
+// later, and only to blocks still shared: unshare_range gives the file
+// its own copy of those first. Everything copied is flagged is_snapshot
+// and stays as it was; an rmdir in /.snapshots drops a snapshot whole.
+//
+// The tree holds still while it is copied, the files in it do not. Each
+// one is copied under its read lock, as it was at that moment, with
+// data not written back yet as safe on disk as it is in the file.
+
+typedef struct snap_ctx {
+	super_blk* fs;
+	int* copies; // the copy of each slot plus one, 0 until it is made
+	int dir;     // the copy entries are added to
+	int rv;
+} snap_ctx;
+
+// Makes the copy of inum, a directory going into parent, unless there
+// is one already: a file with several names is copied once. It starts
+// out with no references, the caller counts each entry it adds for it.
+static int snap_inode(snap_ctx* sc, int inum, int parent) {
+	super_blk* fs = sc->fs;
+	if (sc->copies[inum] > 0) {
+		return sc->copies[inum] - 1;
+	}
+
+	const inode* from = fs_inode(fs, inum);
+	inode* n = fs_get_free_inode(fs);
+	if (n == NULL) {
+		return -ENOMEM;
+	}
+	int copy = inode_num(fs, n);
+	n->references = 0;
+	n->is_snapshot = true;
+
+	lock_inode(fs, from, false);
+	n->mode = from->mode;
+	n->accessed_at = __atomic_load_n(&from->accessed_at, __ATOMIC_RELAXED);
+	n->modified_at = from->modified_at;
+	n->changed_at = from->changed_at;
+	n->is_compressed = from->is_compressed;
+
+	int rv = 0;
+	if (S_ISDIR(from->mode)) {
+		rv = inode_grow(fs, n, 1);
+		if (rv == 0) {
+			directory_init_page(fs, copy, parent);
+			n->data_size = fs->data.blk_sz;
+		}
+	} else {
+		n->is_inline = from->is_inline;
+		n->data_size = from->data_size;
+		if (from->is_inline) {
+			memcpy(n->inline_data, from->inline_data, INLINE_MAX);
+		} else {
+			rv = inode_copy_map(fs, n, from);
+			ext_pos pos = EXT_POS_START;
+			for (uint32_t k = 0; rv == 0 && k < n->n_ext; k++) {
+				extent e = inode_extent_at(fs, n, k, &pos);
+				if (!ext_hole(e)) {
+					share_run(&fs->data, e.start, ext_phys(e));
+				}
+			}
+		}
+	}
+	unlock_inode(fs, from);
+	log_inode(n);
+
+	if (rv < 0) {
+		free_inode(fs, n);
+		return rv;
+	}
+	sc->copies[inum] = copy + 1;
+	return copy;
+}
+
+static int snap_visit(const dirent* ent, size_t pos, void* ctx);
+
+// Copies inum into the snapshot directory sc->dir as name, and what is
+// in it when it is a directory
+static int snap_entry(snap_ctx* sc, int inum, const char* name) {
+	super_blk* fs = sc->fs;
+	int dir = sc->dir;
+	int copy = snap_inode(sc, inum, dir);
+	if (copy < 0) {
+		return copy;
+	}
+
+	inode* n = fs_inode(fs, copy);
+	int rv = put_ent(fs, dir, name, copy);
+	if (rv < 0) {
+		if (n->references < 1) {
+			free_inode(fs, n);
+			sc->copies[inum] = 0;
+		}
+		return rv;
+	}
+	n->references += 1;
+	log_inode(n);
+
+	if (is_dir_inode(fs, copy)) {
+		sc->dir = copy;
+		directory_list(fs, inum, 0, snap_visit, sc);
+		sc->dir = dir;
+	}
+	return sc->rv;
+}
+
+static int snap_visit(const dirent* ent, size_t pos, void* ctx) {
+	(void) pos;
+	snap_ctx* sc = ctx;
+	if (ent->inum == snap_dir) {
+		return 0;
+	}
+	sc->rv = snap_entry(sc, ent->inum, ent->name);
+	return sc->rv != 0;
+}
+
+// Makes the snapshot name of the whole tree. Needs ns_lock exclusive.
+static int take_snapshot(super_blk* fs, const char* name, fs_entry* e) {
+	snap_ctx sc = { fs, calloc(fs->n_inodes, sizeof(int)), snap_dir, 0 };
+	if (sc.copies == NULL) {
+		return -ENOMEM;
+	}
+
+	int rv = snap_entry(&sc, ROOT_INUM, name);
+	free(sc.copies);
+	int inum = directory_lookup_inum(fs, snap_dir, name);
+	if (rv < 0) {
+		// What was copied before running out goes again
+		if (inum >= 0) {
+			remove_ent(fs, snap_dir, name, true);
+		}
+		return rv;
+	}
+	inval_entry(snap_dir, name);
+	inval_attrs(snap_dir);
+	return e ? make_entry(fs, inum, e) : 0;
+}
+
+typedef struct snap_list {
+	dirent* ents;
+	size_t n, cap;
+} snap_list;
+
+static int snap_collect(const dirent* ent, size_t pos, void* ctx) {
+	(void) pos;
+	snap_list* l = ctx;
+	if (l->n == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 64;
+		l->ents = realloc(l->ents, l->cap * sizeof(dirent));
+		assert(l->ents != NULL);
+	}
+	l->ents[l->n++] = *ent;
+	return 0;
+}
+
+// Removes everything under the snapshot directory dir, depth first
+static void drop_tree(super_blk* fs, int dir) {
+	snap_list l = { NULL, 0, 0 };
+	directory_list(fs, dir, 0, snap_collect, &l);
+	for (size_t i = 0; i < l.n; i++) {
+		int inum = l.ents[i].inum;
+		if (is_dir_inode(fs, inum)) {
+			drop_tree(fs, inum);
+		}
+		delete_ent(fs, dir, l.ents[i].name);
+		release_inode(fs, fs_inode(fs, inum));
+		inval_entry(dir, l.ents[i].name);
+		inval_attrs(inum);
+	}
+	free(l.ents);
+}
+
+static int mknod_locked(super_blk* fs, int dir, const char* name, mode_t mode, fs_entry* e) {
+	if (directory_lookup_inum(fs, dir, name) >= 0) {
+		return -EEXIST;
+	}
+
+	if (fs_inode(fs, dir)->is_snapshot) {
+		return dir == snap_dir && S_ISDIR(mode) ? take_snapshot(fs, name, e) : -EROFS;
+	}
+	
+	inode* n = fs_get_free_inode(fs);
+	if (n == NULL) {
+		return -ENOMEM;
+	}
+	
+	int inum = inode_num(fs, n);
+	n->mode = mode;
+	n->is_inline = S_ISREG(mode);
+	n->is_compressed = fs_inode(fs, dir)->is_compressed && (S_ISREG(mode) || S_ISDIR(mode));
+	log_inode(n);
+
+	time_t t = time(NULL);
+	n->accessed_at = t;
+	n->modified_at = t;
+	n->changed_at = t;
+
+	// Files start out empty, a directory gets its first dirent page
+	if (S_ISDIR(mode)) {
+		if (inode_grow(fs, n, 1) != 0) {
+			release_inode(fs, n);
+			return -ENOSPC;
+		}
+		directory_init_page(fs, inum, dir);
+		n->data_size = fs->data.blk_sz;
+	}
+
+	int rv = put_ent(fs, dir, name, inum);
+	if (rv < 0) {
+		release_inode(fs, n);
+		return rv;
+	}
+
+	return e ? make_entry(fs, inum, e) : 0;
+}
+
+int fs_mknod(super_blk* fs, const char* path, mode_t mode, dev_t dev) {
+	(void) dev;
+
+	journal_begin();
+	ns_write();
+	const char* name;
+	int dir = tree_lookup_parent(fs, path, &name);
+	int rv = dir < 0 ? dir : mknod_locked(fs, dir, name, mode, NULL);
+	ns_unlock();
+	journal_end();
+	return rv;
+}
+
+int fs_mknod_at(super_blk* fs, int dir, const char* name, mode_t mode, fs_entry* e) {
+	journal_begin();
+	ns_write();
+	int rv = check_dir(fs, dir);
+	if (rv == 0) {
+		rv = strlen(name) >= DIR_NAME ? -ENAMETOOLONG : mknod_locked(fs, dir, name, mode, e);
+	}
+	ns_unlock();
+	journal_end();
+	return rv;
+}
+
+int fs_mkdir(super_blk* fs, const char* path, mode_t mode) {
+	return fs_mknod(fs, path, mode | S_IFDIR, 0);
+}
+
+int fs_mkdir_at(super_blk* fs, int dir, const char* name, mode_t mode, fs_entry* e) {
+	return fs_mknod_at(fs, dir, name, mode | S_IFDIR, e);
+}
+
+int fs_rmdir(super_blk* fs, const char* path) {
+	journal_begin();
+	ns_write();
+	const char* name;
+	int dir = tree_lookup_parent(fs, path, &name);
+	int rv = dir < 0 ? dir : remove_ent(fs, dir, name, true);
+	ns_unlock();
+	journal_end();
+	return rv;
+}
+
+int fs_rmdir_at(super_blk* fs, int dir, const char* name) {
+	journal_begin();
+	ns_write();
+	int rv = check_dir(fs, dir);
+	if (rv == 0) {
+		rv = remove_ent(fs, dir, name, true);
+	}
+	ns_unlock();
+	journal_end();
+	return rv;
+}
+
+int fs_unlink(super_blk* fs, const char* path) {
+	journal_begin();
+	ns_write();
+	const char* name;
+	int dir = tree_lookup_parent(fs, path, &name);
+	int rv = dir < 0 ? dir : remove_ent(fs, dir, name, false);
+	ns_unlock();
+	journal_end();
+	return rv;
+}
+
+int fs_unlink_at(super_blk* fs, int dir, const char* name) {
+	journal_begin();
+	ns_write();
+	int rv = check_dir(fs, dir);
+	if (rv == 0) {
+		rv = remove_ent(fs, dir, name, false);
+	}
+	ns_unlock();
+	journal_end();
+	return rv;
+}
+
+static int truncate_locked(super_blk* fs, inode* n, off_t size) {
+	if (S_ISDIR(n->mode)) {
+		return -EISDIR;
+	}
+
+	if (size < 0) {
+		return -EINVAL;
+	}
+
+	int rv = resize_file(fs, n, size);
+	if (rv < 0) {
+		return rv;
+	}
+
+	time_t t = time(NULL);
+	n->modified_at = t;
+	n->changed_at = t;
+	return 0;
+}
+
+// Applies the FS_SET_* fields of attr to n
+static int setattr_inode(super_blk* fs, inode* n, const struct stat* attr, int to_set) {
+	lock_inode(fs, n, true);
+
+	int rv = n->mode == 0 ? -ENOENT : 0;
+	if (rv == 0 && n->is_snapshot) {
+		rv = -EROFS;
+	}
+	if (rv == 0 && (to_set & FS_SET_SIZE)) {
+		rv = truncate_locked(fs, n, attr->st_size);
+	}
+
+	if (rv == 0 && (to_set & FS_SET_MODE)) {
+		n->mode = (n->mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+		n->changed_at = time(NULL);
+	}
+
+	if (rv == 0 && (to_set & (FS_SET_ATIME | FS_SET_MTIME))) {
+		if (to_set & FS_SET_ATIME) {
+			n->accessed_at = attr->st_atim.tv_sec;
+		}
+		if (to_set & FS_SET_MTIME) {
+			n->modified_at = attr->st_mtim.tv_sec;
+		}
+		n->changed_at = time(NULL);
+	}
+
+	log_inode(n);
+	unlock_inode(fs, n);
+	return rv;
+}
+
+int fs_setattr_ino(super_blk* fs, int inum, const struct stat* attr, int to_set, struct stat* st) {
+	if (!valid_inum(fs, inum)) {
+		return -ESTALE;
+	}
+
+	journal_begin();
+	int rv = setattr_inode(fs, fs_inode(fs, inum), attr, to_set);
+	journal_end();
+	if (rv == 0 && st != NULL) {
+		rv = stat_inode(fs, fs_inode(fs, inum), st);
+	}
+	return rv;
+}
+
+static int setattr_path(super_blk* fs, const char* path, const struct stat* attr, int to_set) {
+	journal_begin();
+	ns_read();
+	inode* n = (inode*)get_inode(fs, path);
+	int rv = n ? setattr_inode(fs, n, attr, to_set) : -ENOENT;
+	ns_unlock();
+	journal_end();
+	return rv;
+}
+
+int fs_utimens(super_blk* fs, const char* path, const struct timespec ts[2]) {
+	struct stat attr = { 0 };
+	attr.st_atim = ts[0];
+	attr.st_mtim = ts[1];
+	return setattr_path(fs, path, &attr, FS_SET_ATIME | FS_SET_MTIME);
+}
+
+int fs_chmod(super_blk* fs, const char* path, mode_t mode) {
+	struct stat attr = { 0 };
+	attr.st_mode = mode;
+	return setattr_path(fs, path, &attr, FS_SET_MODE);
+}
+
+int fs_truncate(super_blk* fs, const char* path, off_t size) {
+	struct stat attr = { 0 };
+	attr.st_size = size;
+	return setattr_path(fs, path, &attr, FS_SET_SIZE);
+}
+
+// Maps zeroed blocks for the holes and whatever is past the map in
+// [offset, end), and with grow moves the end of file to end if that is
+// further. Nothing changes when that runs out of space.
+static int prealloc_range(super_blk* fs, inode* n, off_t offset, off_t end, bool grow) {
+	if (n->is_inline && end <= INLINE_MAX) {
+		// The inode has room already
+		return grow && end > n->data_size ? resize_file(fs, n, end) : 0;
+	}
+
+	// Blocks it needs, more than the image can ever have free fails
+	// before anything changes
+	size_t bs = fs->data.blk_sz;
+	uint32_t last = blocks_for(fs, end);
+	uint64_t need = last > n->n_blocks ? last - n->n_blocks : 0;
+	ext_pos pos = EXT_POS_START;
+	for (uint32_t l = offset / bs; n->holes > 0 && l < last && l < n->n_blocks;) {
+		extent e = inode_find(fs, n, l, &pos);
+		uint32_t to = pos.base + extent_blocks(fs, e);
+		if (ext_hole(e)) {
+			need += (to < last ? to : last) - l;
+		}
+		l = to;
+	}
+	size_t room = fs->max_blks - __atomic_load_n(&fs->data.n_blks, __ATOMIC_RELAXED);
+	if (need > alloc_avail(&fs->data) + room) {
+		return -ENOSPC;
+	}
+	if (n->is_inline) {
+		int rv = promote_inline(fs, n);
+		if (rv < 0) {
+			return rv;
+		}
+	}
+
+	off_t old_size = n->data_size;
+	uint32_t mapped = n->n_blocks;
+	int rv = grow && end > old_size ? resize_file(fs, n, end) : 0;
+	if (rv == 0 && last > n->n_blocks) {
+		rv = inode_append_hole(fs, n, last - n->n_blocks);
+	}
+	if (rv == 0) {
+		rv = fill_holes(fs, n, offset / bs, last);
+	}
+	if (rv < 0) {
+		// What resize_file zeroed was past the end
+		n->data_size = old_size;
+		uint32_t keep = blocks_for(fs, old_size);
+		inode_shrink(fs, n, keep > mapped ? keep : mapped);
+	}
+	return rv;
+}
+
+// Zeroes [offset, offset + len) of n: the blocks it covers whole are
+// freed once that commits and read as zeros from then on, the bytes
+// around them are written. Blocks fallocate mapped past the end of file
+// that are left with nothing after them go at once.
+static int punch_range(super_blk* fs, inode* n, off_t offset, off_t len) {
+	off_t end = offset + len;
+	if (n->is_inline) {
+		if (offset < n->data_size) {
+			file_io(fs, n, IO_ZERO, NULL, (end < n->data_size ? end : n->data_size) - offset, offset);
+		}
+		return 0;
+	}
+
+	size_t bs = fs->data.blk_sz;
+	if (end > (off_t)(n->n_blocks * bs)) {
+		end = n->n_blocks * bs;
+	}
+	if (offset >= end) {
+		return 0;
+	}
+
+	// A compressed cluster only goes whole, one cut into is expanded
+	int rv = offset % CLUSTER_SIZE != 0 ? expand_range(fs, n, offset, 1) : 0;
+	if (rv == 0 && end % CLUSTER_SIZE != 0) {
+		rv = expand_range(fs, n, end - 1, 1);
+	}
 
-        node->data_size = -1;
-        
+	// The bytes of blocks only partly in the range
+	uint32_t first = blocks_for(fs, offset);
+	uint32_t last = end / bs;
+	off_t part[2][2] = { { offset, end }, { end, end } };
+	if (first <= last) {
+		part[0][1] = (off_t)first * bs;
+		part[1][0] = (off_t)last * bs;
+	}
+	for (int i = 0; i < 2 && rv == 0; i++) {
+		off_t size = part[i][1] - part[i][0];
+		if (size > 0) {
+			rv = unshare_range(fs, n, part[i][0], size);
+		}
+		if (rv == 0 && size > 0) {
+			file_io(fs, n, IO_ZERO, NULL, size, part[i][0]);
+			mark_dirty(fs, n, part[i][0], size);
+		}
+	}
+
+	// The blocks covered whole, punched in one go so the map is only
+	// rewritten once, and freed once that commits
+	extent* old = NULL;
+	size_t n_old = 0, cap = 0;
+	ext_pos pos = EXT_POS_START;
+	for (uint32_t l = first; l < last && rv == 0;) {
+		extent e = inode_find(fs, n, l, &pos);
+		uint32_t take = pos.base + extent_blocks(fs, e) - l;
+		if (take > last - l) {
+			take = last - l;
+		}
+		if (!ext_hole(e)) {
+			if (n_old == cap) {
+				cap = cap > 0 ? cap * 2 : 16;
+				old = realloc(old, cap * sizeof(extent));
+				assert(old != NULL);
+			}
+			old[n_old++] = ext_compressed(e) ? (extent){ e.start, ext_phys(e) } : (extent){ e.start + (l - pos.base), take };
+		}
+		l += take;
+	}
+	if (rv == 0 && n_old > 0) {
+		rv = inode_punch(fs, n, first, last - first, &pos);
+	}
+	for (size_t i = 0; rv == 0 && i < n_old; i++) {
+		free_run_later(&fs->data, old[i].start, old[i].len);
+	}
+	free(old);
+
+	uint32_t keep = blocks_for(fs, n->data_size);
+	if (rv == 0 && last == n->n_blocks && n->n_blocks > keep) {
+		inode_shrink(fs, n, keep > first ? keep : first);
+	}
+	return rv;
+}
+
+// fallocate: mode 0 maps zeroed blocks for the holes in [offset, offset
+// + len), each hole in one run where the free space has one, and grows
+// the file to cover the range. With FALLOC_FL_KEEP_SIZE the size stays,
+// blocks past the end wait for writes. FALLOC_FL_PUNCH_HOLE, which comes
+// with KEEP_SIZE, makes the range read as zeros and frees its blocks.
+int fs_fallocate_ino(super_blk* fs, int inum, int mode, off_t offset, off_t len) {
+	if (!valid_inum(fs, inum)) {
+		return -ESTALE;
+	}
+	if (offset < 0 || len <= 0) {
+		return -EINVAL;
+	}
+	if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0
+	    || ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))) {
+		return -EOPNOTSUPP;
+	}
+	if (len > max_size(fs) - offset) {
+		return -EFBIG;
+	}
+
+	journal_begin();
+	inode* n = fs_inode(fs, inum);
+	lock_inode(fs, n, true);
+	int rv = 0;
+	if (n->mode == 0) {
+		rv = -ENOENT;
+	} else if (S_ISDIR(n->mode)) {
+		rv = -EISDIR;
+	} else if (!S_ISREG(n->mode)) {
+		rv = -ENODEV;
+	} else if (n->is_snapshot) {
+		rv = -EROFS;
+	} else if (!check_mode(n, 2)) {
+		rv = -EACCES;
+	} else if (mode & FALLOC_FL_PUNCH_HOLE) {
+		rv = punch_range(fs, n, offset, len);
+	} else {
+		rv = prealloc_range(fs, n, offset, offset + len, !(mode & FALLOC_FL_KEEP_SIZE));
+	}
+	if (rv == 0) {
+		time_t t = time(NULL);
+		if (mode != FALLOC_FL_KEEP_SIZE) {
+			n->modified_at = t;
+		}
+		n->changed_at = t;
+		log_inode(n);
+	}
+	unlock_inode(fs, n);
+	journal_end();
+	return rv;
+}
+
+// lseek with SEEK_DATA or SEEK_HOLE: the first offset from offset on
+// that is not in a hole, or that is, where the end of file counts as a
+// hole. -ENXIO at or past the end, and for data when only holes follow.
+off_t fs_lseek_ino(const super_blk* fs, int inum, off_t offset, int whence) {
+	if (!valid_inum(fs, inum)) {
+		return -ESTALE;
+	}
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		return -EINVAL;
+	}
+
+	inode* n = fs_inode(fs, inum);
+	lock_inode(fs, n, false);
+	off_t rv = whence == SEEK_DATA ? offset : n->data_size;
+	if (offset < 0 || offset >= n->data_size) {
+		rv = -ENXIO;
+	} else if (!n->is_inline && n->holes > 0) {
+		size_t bs = fs->data.blk_sz;
+		ext_pos pos = EXT_POS_START;
+		extent e = inode_find(fs, n, offset / bs, &pos);
+		rv = whence == SEEK_DATA ? -ENXIO : n->data_size;
+		for (; pos.k < n->n_ext && (off_t)(pos.base * bs) < n->data_size; e = inode_extent_at(fs, n, pos.k + 1, &pos)) {
+			if (ext_hole(e) == (whence == SEEK_HOLE)) {
+				off_t at = (off_t)pos.base * bs;
+				rv = at > offset ? at : offset;
+				break;
+			}
+		}
+	}
+	unlock_inode(fs, n);
+	return rv;
+}
+
+int fs_getflags_ino(const super_blk* fs, int inum, unsigned* flags) {
+	if (!valid_inum(fs, inum)) {
+		return -ESTALE;
+	}
+
+	inode* n = fs_inode(fs, inum);
+	lock_inode(fs, n, false);
+	*flags = n->is_compressed ? FS_FL_COMPRESS : 0;
+	unlock_inode(fs, n);
 	return 0;
 }
+
+// FS_FL_COMPRESS on a directory is handed down to what is made in it.
+// Taking it off a file expands the clusters already compressed, the
+// flag says whether a file can have any.
+int fs_setflags_ino(super_blk* fs, int inum, unsigned flags) {
+	if (!valid_inum(fs, inum)) {
+		return -ESTALE;
+	}
+	bool on = (flags & FS_FL_COMPRESS) != 0;
+	if ((flags & ~FS_FL_COMPRESS) != 0 || (on && cluster_blks(fs) < 2)) {
+		return -EOPNOTSUPP;
+	}
+
+	// Shared against mknod, which looks at the directory's flag
+	journal_begin();
+	ns_read();
+	inode* n = fs_inode(fs, inum);
+	lock_inode(fs, n, true);
+	int rv = 0;
+	if (n->is_snapshot) {
+		rv = -EROFS;
+	} else if (!S_ISREG(n->mode) && !S_ISDIR(n->mode)) {
+		rv = on ? -EOPNOTSUPP : 0;
+	} else if (on != n->is_compressed) {
+		rv = on ? 0 : expand_range(fs, n, 0, n->data_size);
+		if (rv == 0) {
+			n->is_compressed = on;
+			n->changed_at = time(NULL);
+			log_inode(n);
+		}
+	}
+	unlock_inode(fs, n);
+	ns_unlock();
+	journal_end();
+	return rv;
+}
+
+static int link_locked(super_blk* fs, int idx, int dir, const char* name, fs_entry* e) {
+        inode* original = fs_inode(fs, idx);
+
+        if (original->references == 0) {
+                return -ENOENT;
+        }
+
+        if (is_dir_inode(fs, idx)) {
+                return -EPERM;
+        }
+
+        if (fs_inode(fs, dir)->is_snapshot) {
+                return -EROFS;
+        }
+        if (original->is_snapshot) {
+                return -EXDEV;
+        }
+
+        // Another entry for the same inode, which counts it
+        int rv = put_ent(fs, dir, name, idx);
+        if (rv < 0) {
+                return rv;
+        }
+
+        lock_inode(fs, original, true);
+        original->references += 1;
+        original->changed_at = time(NULL);
+        log_inode(original);
+        unlock_inode(fs, original);
+        inval_entry(dir, name);
+        inval_attrs(idx);
+
+	return e ? make_entry(fs, idx, e) : 0;
+}
+
+int fs_link(super_blk* fs, const char* src, const char* dst) {
+	journal_begin();
+	ns_write();
+	const char* name;
+	int idx = find_inode_idx(fs, src);
+	int dir = idx < 0 ? -ENOENT : tree_lookup_parent(fs, dst, &name);
+	int rv = dir < 0 ? dir : link_locked(fs, idx, dir, name, NULL);
+	ns_unlock();
+	journal_end();
+	return rv;
+}
+
+int fs_link_at(super_blk* fs, int inum, int dir, const char* name, fs_entry* e) {
+	journal_begin();
+	ns_write();
+	int rv = valid_inum(fs, inum) ? check_dir(fs, dir) : -ESTALE;
+	if (rv == 0) {
+		rv = strlen(name) >= DIR_NAME ? -ENAMETOOLONG : link_locked(fs, inum, dir, name, e);
+	}
+	ns_unlock();
+	journal_end();
+	return rv;
+}
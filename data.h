@@ -1,59 +1,243 @@
+#ifndef NUFS_DATA_H
+#define NUFS_DATA_H
+
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <stdint.h>
+
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 6
 
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
+// Metadata regions are aligned to this, block sizes are multiples of it
+#define PAGE_SIZE (4096)
 
-#define NUFS_SIZE (1024 * 1024)
-#define PAGE_COUNT (256)
-#define PAGE_SIZE (NUFS_SIZE / PAGE_COUNT)
+// Extents kept in the inode itself, more spill into indirect blocks
+#define N_DIRECT 6
 
-typedef struct data_blk_info {
-	size_t blk_status_idx;
-	size_t offset;
-} data_blk_info;
+// A regular file this small keeps its bytes in the second half of the
+// inode, where the direct extents would go, and needs no data block
+#define INLINE_MAX 64
 
+// A run of len data blocks starting at block start
+typedef struct extent {
+	uint32_t start;
+	uint32_t len;
+} extent;
+
+// 128 bytes, two cache lines of the table. The first holds everything
+// stat, lookups and allocation read; the second the data map, or the
+// data of an inline file. Names live only in directory entries.
 typedef struct inode {
-	char path[256];
 	int mode;
-        int references;
-        bool is_hlink;
-        int link_idx;
-	data_blk_info db_info;
+	int references;    // directory entries naming it, the link count
+	bool is_inline;    // data in inline_data, no extents or blocks
+	bool is_compressed; // data kept in compressed clusters, new files in a directory too
+	bool is_snapshot;  // part of a snapshot, or the directory holding them, read only
+	uint32_t holes;    // blocks of n_blocks in holes
+	uint32_t generation; // bumped each time the slot is reused
+	uint32_t n_blocks; // blocks of the file the extents map, holes included
+	uint32_t n_ext;    // extents in use, ext[] first then the indirect chain
+	uint32_t indirect; // first indirect extent block, valid once n_ext > N_DIRECT
 	time_t accessed_at;
 	time_t modified_at;
 	time_t changed_at;
-	int data_size;
+	off_t data_size;
+	union {
+		extent ext[N_DIRECT];
+		char inline_data[INLINE_MAX];
+	};
 } inode;
 
+_Static_assert(sizeof(inode) == 128, "the on-disk inode is two cache lines");
+
+#define BITMAP_WORDS(n_blks) (((n_blks) + 63) / 64)
+
 typedef struct data_blks {
 	size_t blk_sz;
 	size_t n_blks;
-	bool blk_status[255]; // false = open, true = used
-	size_t data_offset;
+	size_t n_free;      // blocks not in use, kept up to date by the allocator
+	size_t cursor;      // next-fit position for the next search
+	size_t shared;      // references to blocks past their first owner, the blocks sharing saves
+	size_t data_offset; // data blocks start this far into the image
+	uint64_t bitmap[];  // one bit per block, set = used, BITMAP_WORDS(n_blks) long
 } data_blks;
 
+// Image layout: this header and the block bitmap, sized for max_blks;
+// a reference count per block; the inode bitmap and the inode table,
+// sized for max_inodes; the
+// metadata journal (see journal.c); then the data blocks. The regions reserved for growth
+// are sparse in the backing file.
 typedef struct super_blk {
-	inode inodes[255];
-	data_blks data;
+	uint32_t magic;
+	uint32_t version;
+	uint32_t clean;      // set by a clean close, cleared again at mount
+	uint32_t checksum;   // fs_checksum of this header, kept while clean
+	size_t n_inodes;     // inode slots in use by the table right now
+	size_t max_inodes;   // the inode table region has room for this many
+	size_t free_inodes;  // unused slots among the first n_inodes
+	size_t inode_cursor; // next-fit position for inode allocation
+	size_t max_blks;     // the image may grow to this many data blocks
+	size_t refs_offset;  // one uint32_t per block for max_blks, owners past the first
+	size_t inode_offset; // inode table starts this far into the image
+	size_t inode_bitmap; // offset of one bit per inode slot, set = in use
+	size_t journal_offset; // journal region, everything before it is metadata
+	size_t journal_size;   // 0 for an image without a journal
+	data_blks data;      // stays last, its bitmap runs on past the struct
 } super_blk;
 
+// Geometry picked when an image is made, see mkfs.nufs
+typedef struct fs_geometry {
+	size_t blk_sz;
+	size_t n_blks;
+	size_t max_blks;
+	size_t n_inodes;
+	size_t max_inodes;
+	size_t journal_size;
+	bool compress;       // root directory flagged is_compressed
+} fs_geometry;
+
+// Inode numbers given to the kernel are the slot plus one, FUSE wants
+// the root at 1 and it lives in slot 0
+#define NUFS_INO(inum) ((uint64_t)(inum) + 1)
+#define NUFS_INUM(ino) ((int)((ino) - 1))
+
+// What a lookup or create hands back. Each one counts as an entry the
+// kernel holds until it is dropped again with fs_forget.
+typedef struct fs_entry {
+	int inum;
+	uint32_t generation;
+	struct stat st;
+} fs_entry;
+
+// Called per directory entry, off is where a later listing resumes after
+// it. Returning nonzero stops the listing.
+typedef int (*fs_filler_t)(void* ctx, const char* name, const struct stat* st, off_t off);
+
+// The same for fs_readdirplus_ino, with the entry a lookup would make
+typedef int (*fs_entry_filler_t)(void* ctx, const char* name, const fs_entry* e, off_t off);
+
+// Called when the engine changes what the kernel may have cached for
+// inum without the kernel having asked: its attributes, and its data
+// from off for len bytes (0 for all of it). off < 0 is attributes only.
+// It must not block on the kernel, see nufs.c.
+typedef void (*fs_inval_t)(void* ctx, int inum, off_t off, off_t len);
+
+// The same for the entry name in directory dir, which may now name
+// another inode or none
+typedef void (*fs_inval_entry_t)(void* ctx, int dir, const char* name);
+
+// Fields fs_setattr_ino takes from attr
+#define FS_SET_MODE  (1 << 0)
+#define FS_SET_SIZE  (1 << 1)
+#define FS_SET_ATIME (1 << 2)
+#define FS_SET_MTIME (1 << 3)
+
+// Flags of fs_getflags_ino and fs_setflags_ino
+#define FS_FL_COMPRESS (1 << 0)
+
+static inline inode* fs_inode(const super_blk* fs, size_t inum) {
+	return (inode*)((char*)fs + fs->inode_offset) + inum;
+}
+
+static inline uint64_t* fs_inode_bitmap(const super_blk* fs) {
+	return (uint64_t*)((char*)fs + fs->inode_bitmap);
+}
+
+static inline uint32_t* fs_refs(const super_blk* fs) {
+	return (uint32_t*)((char*)fs + fs->refs_offset);
+}
+
+// The first slot from on that is in use, or n_inodes. Scans skip free
+// runs of the table 64 slots at a time without touching the inodes.
+static inline size_t fs_next_inode(const super_blk* fs, size_t from) {
+	const uint64_t* map = fs_inode_bitmap(fs);
+	while (from < fs->n_inodes) {
+		uint64_t w = map[from / 64] >> (from % 64);
+		if (w != 0) {
+			from += __builtin_ctzll(w);
+			break;
+		}
+		from = (from / 64 + 1) * 64;
+	}
+	return from < fs->n_inodes ? from : fs->n_inodes;
+}
+
+static inline int inode_num(const super_blk* fs, const inode* n) {
+	return n - fs_inode(fs, 0);
+}
+
+char* fs_blkptr(const super_blk* fs, size_t blk_idx);
+
+void default_geometry(fs_geometry* geo);
+int format_fs(const char* path, const fs_geometry* geo);
+uint32_t fs_checksum(const super_blk* fs);
+super_blk* open_fs(const char* path);
+void start_fs(super_blk* fs);
 super_blk* init_fs(const char* path);
 void close_fs(super_blk* fs);
+int fs_grow_blocks(super_blk* fs, size_t want);
+int fs_grow_inodes(super_blk* fs);
+void fs_set_inval(fs_inval_t fn, fs_inval_entry_t entry_fn, void* ctx);
+
+int fs_statfs(const super_blk* fs, struct statvfs* st);
 
+// By path, resolved from the root on every call
 int fs_access(const super_blk* fs, const char* path, int mask);
 int fs_getattr(const super_blk* fs, const char* path, struct stat *st);
-int fs_readdir(const super_blk* fs, const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi);
-int fs_rename(const super_blk* fs, const char* from, const char* to);
-int fs_read(const super_blk* fs, const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
-int fs_write(const super_blk* fs, const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int fs_readdir(const super_blk* fs, const char* path, void* ctx, fs_filler_t filler, off_t offset);
+int fs_rename(super_blk* fs, const char* from, const char* to);
+int fs_read(const super_blk* fs, const char *path, char *buf, size_t size, off_t offset);
+int fs_write(super_blk* fs, const char *path, const char *buf, size_t size, off_t offset);
 int fs_mknod(super_blk* fs, const char* path, mode_t mode, dev_t dev);
 int fs_utimens(super_blk* fs, const char* path, const struct timespec ts[2]);
-int fs_chmod(const super_blk* fs, const char* path, mode_t mode);
+int fs_chmod(super_blk* fs, const char* path, mode_t mode);
+int fs_mkdir(super_blk* fs, const char* path, mode_t mode);
+int fs_rmdir(super_blk* fs, const char* path);
 int fs_unlink(super_blk* fs, const char* path);
 int fs_truncate(super_blk* fs, const char* path, off_t size);
 int fs_link(super_blk* fs, const char* src, const char* dst);
+int fs_fsync(const super_blk* fs, const char* path);
+
+// By inode slot, the way the kernel addresses a mount. Names are a
+// single component inside the directory dir.
+int fs_lookup(const super_blk* fs, int dir, const char* name, fs_entry* e);
+void fs_forget(super_blk* fs, int inum, uint64_t n);
+int fs_access_ino(const super_blk* fs, int inum, int mask);
+int fs_getattr_ino(const super_blk* fs, int inum, struct stat* st);
+int fs_setattr_ino(super_blk* fs, int inum, const struct stat* attr, int to_set, struct stat* st);
+int fs_readdir_ino(const super_blk* fs, int dir, off_t offset, fs_filler_t filler, void* ctx);
+int fs_readdirplus_ino(const super_blk* fs, int dir, off_t offset, fs_entry_filler_t filler, void* ctx);
+int fs_read_ino(const super_blk* fs, int inum, char* buf, size_t size, off_t offset);
+int fs_write_ino(super_blk* fs, int inum, const char* buf, size_t size, off_t offset);
+int fs_fsync_ino(const super_blk* fs, int inum);
+int fs_defrag_next(const super_blk* fs, int inum);
+int fs_defrag_ino(super_blk* fs, int inum, uint32_t* lblk, uint32_t max);
+int fs_getflags_ino(const super_blk* fs, int inum, unsigned* flags);
+int fs_setflags_ino(super_blk* fs, int inum, unsigned flags);
+int fs_compress_ino(super_blk* fs, int inum, const struct iovec* dirty, int n_dirty);
+int fs_dedup_ino(super_blk* fs, int inum, uint32_t* lblk, uint32_t max, time_t since);
+
+// Zero-copy I/O straight on the mapped image. The iovs need room for
+// fs_max_spans(fs, size) entries, the inode stays locked in between.
+int fs_max_spans(const super_blk* fs, size_t size);
+int fs_read_begin(const super_blk* fs, int inum, size_t size, off_t offset, bool cached, struct iovec* iov, int* n_iov);
+void fs_read_end(const super_blk* fs, int inum);
+int fs_write_begin(super_blk* fs, int inum, size_t size, off_t offset, struct iovec* iov, int* n_iov);
+int fs_write_end(super_blk* fs, int inum, off_t offset, size_t done);
+int fs_copy_range(super_blk* fs, int in, off_t off_in, int out, off_t off_out, size_t len);
+int fs_fallocate_ino(super_blk* fs, int inum, int mode, off_t offset, off_t len);
+off_t fs_lseek_ino(const super_blk* fs, int inum, off_t offset, int whence);
+int fs_mknod_at(super_blk* fs, int dir, const char* name, mode_t mode, fs_entry* e);
+int fs_mkdir_at(super_blk* fs, int dir, const char* name, mode_t mode, fs_entry* e);
+int fs_link_at(super_blk* fs, int inum, int dir, const char* name, fs_entry* e);
+int fs_unlink_at(super_blk* fs, int dir, const char* name);
+int fs_rmdir_at(super_blk* fs, int dir, const char* name);
+int fs_rename_at(super_blk* fs, int from_dir, const char* from_name, int to_dir, const char* to_name, unsigned int flags);
+
+#endif
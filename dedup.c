@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "data.h"
+#include "dedup.h"
+
+// Offline block deduplication. The dedup thread walks the inode table
+// every interval_ms and fingerprints the blocks of each regular file
+// changed since its last pass. A block whose fingerprint it has seen
+// before is compared byte for byte with the one it was seen in, and if
+// they match the file is pointed at that block instead of its own.
+// Shared blocks count their extra owners in the image (see alloc.c);
+// writing to one gives the writer its own copy first.
+//
+// Every step is one call into the engine (fs_dedup_ino) that works
+// under the file's write lock and switches its map in one journal
+// transaction, freeing the blocks it stops using once that is committed.
+// The fingerprint index only lives in memory: the first pass after a
+// mount looks at every file again. Files are read at rate bytes per
+// second; compressed and inline files are left alone.
+
+#define DD_DEFAULTS { \
+	.rate = 0, \
+	.chunk = 1 << 20, \
+	.index = 1 << 20, \
+	.interval_ms = 300000, \
+}
+
+static dd_limits limits = DD_DEFAULTS;
+
+static super_blk* fs;
+static bool active;
+static bool stopping;
+static bool kicked;
+static pthread_mutex_t dd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dd_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t dd_done = PTHREAD_COND_INITIALIZER;
+static uint64_t passes;
+static bool in_pass;
+static time_t since; // files not changed since are in the index already
+static pthread_t dd_thread;
+
+// Open addressing on the fingerprint, hash 0 marks an empty slot. A
+// fingerprint maps to the last block seen with it; a stale entry is
+// found out when the block no longer matches, and replaced.
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static dd_entry* table;
+static size_t cap;   // slots, a power of two
+static size_t used;
+static size_t index_max = 1 << 20; // limits.index
+
+uint64_t dedup_hash(const void* data, size_t len) {
+	// Four lanes so the multiplies overlap, len is a multiple of 32
+	const uint64_t* w = data;
+	uint64_t h[4] = { 0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL };
+	for (size_t i = 0; i < len / 8; i += 4) {
+		for (int j = 0; j < 4; j++) {
+			h[j] = (h[j] ^ w[i + j]) * 0xff51afd7ed558ccdULL;
+			h[j] ^= h[j] >> 32;
+		}
+	}
+	uint64_t r = h[0] ^ (h[1] * 3) ^ (h[2] * 5) ^ (h[3] * 7) ^ len;
+	r = (r ^ (r >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+	r ^= r >> 33;
+	return r != 0 ? r : 1;
+}
+
+static dd_entry* slot_for(dd_entry* t, size_t size, uint64_t hash) {
+	size_t i = hash & (size - 1);
+	while (t[i].hash != 0 && t[i].hash != hash) {
+		i = (i + 1) & (size - 1);
+	}
+	return &t[i];
+}
+
+// Doubles the table, false when out of memory
+static bool grow_index(void) {
+	size_t size = cap == 0 ? 4096 : cap * 2;
+	dd_entry* t = calloc(size, sizeof(dd_entry));
+	if (t == NULL) {
+		return false;
+	}
+	for (size_t i = 0; i < cap; i++) {
+		if (table[i].hash != 0) {
+			*slot_for(t, size, table[i].hash) = table[i];
+		}
+	}
+	free(table);
+	table = t;
+	cap = size;
+	return true;
+}
+
+bool dedup_find(uint64_t hash, dd_entry* e) {
+	pthread_mutex_lock(&index_mutex);
+	dd_entry* s = cap > 0 ? slot_for(table, cap, hash) : NULL;
+	bool found = s != NULL && s->hash == hash;
+	if (found) {
+		*e = *s;
+	}
+	pthread_mutex_unlock(&index_mutex);
+	return found;
+}
+
+// Remembers e, in place of whatever had its fingerprint. Once the index
+// is full only those are replaced.
+void dedup_add(const dd_entry* e) {
+	pthread_mutex_lock(&index_mutex);
+	if (cap > 0) {
+		dd_entry* s = slot_for(table, cap, e->hash);
+		if (s->hash == e->hash) {
+			*s = *e;
+			pthread_mutex_unlock(&index_mutex);
+			return;
+		}
+	}
+	if (used >= index_max || ((used + 1) * 4 > cap * 3 && !grow_index())) {
+		pthread_mutex_unlock(&index_mutex);
+		return;
+	}
+	*slot_for(table, cap, e->hash) = *e;
+	used++;
+	pthread_mutex_unlock(&index_mutex);
+}
+
+static void clear_index(void) {
+	pthread_mutex_lock(&index_mutex);
+	free(table);
+	table = NULL;
+	cap = 0;
+	used = 0;
+	pthread_mutex_unlock(&index_mutex);
+}
+
+// Sleeps ms or until stopped, or kicked if kickable, with dd_mutex held
+static void pause_ms(uint64_t ms, bool kickable) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t ns = ts.tv_nsec + ms * 1000000;
+	ts.tv_sec += ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (!stopping && !(kickable && kicked)) {
+		if (pthread_cond_timedwait(&dd_wake, &dd_mutex, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+}
+
+// Looks through one file, returns false once stopped
+static bool dedup_file(int inum) {
+	uint32_t max = limits.chunk / fs->data.blk_sz;
+	if (max < 1) {
+		max = 1;
+	}
+
+	uint32_t lblk = 0;
+	for (;;) {
+		pthread_mutex_unlock(&dd_mutex);
+		int seen = fs_dedup_ino(fs, inum, &lblk, max, since);
+		pthread_mutex_lock(&dd_mutex);
+		if (seen <= 0) {
+			return !stopping;
+		}
+
+		if (stopping || limits.rate == 0) {
+			return false;
+		}
+		pause_ms((uint64_t)seen * fs->data.blk_sz * 1000 / limits.rate, false);
+	}
+}
+
+static void dedup_pass(void) {
+	time_t began = time(NULL);
+	int inum = 0;
+	for (; !stopping && limits.rate > 0; inum++) {
+		pthread_mutex_unlock(&dd_mutex);
+		inum = fs_defrag_next(fs, inum);
+		pthread_mutex_lock(&dd_mutex);
+		if (inum < 0 || !dedup_file(inum)) {
+			break;
+		}
+	}
+	// Only a pass that saw every file lets the next one skip some
+	if (inum < 0) {
+		since = began;
+	}
+}
+
+static void* dedup_main(void* arg) {
+	(void) arg;
+	pthread_mutex_lock(&dd_mutex);
+	while (!stopping) {
+		pause_ms(limits.interval_ms, true);
+		kicked = false;
+		if (!stopping && limits.rate > 0) {
+			in_pass = true;
+			dedup_pass();
+			in_pass = false;
+		}
+		passes++;
+		pthread_cond_broadcast(&dd_done);
+	}
+	pthread_cond_broadcast(&dd_done);
+	pthread_mutex_unlock(&dd_mutex);
+	return NULL;
+}
+
+void dedup_default_limits(dd_limits* l) {
+	*l = (dd_limits) DD_DEFAULTS;
+}
+
+void dedup_set_limits(const dd_limits* l) {
+	assert(l->interval_ms > 0);
+	pthread_mutex_lock(&dd_mutex);
+	limits = *l;
+	pthread_mutex_unlock(&dd_mutex);
+	pthread_mutex_lock(&index_mutex);
+	index_max = l->index;
+	pthread_mutex_unlock(&index_mutex);
+}
+
+// Starts a pass now instead of at the end of the interval and waits
+// for it to finish
+void dedup_now(void) {
+	pthread_mutex_lock(&dd_mutex);
+	// A pass already under way may be past some files
+	uint64_t want = passes + (in_pass ? 2 : 1);
+	kicked = true;
+	pthread_cond_signal(&dd_wake);
+	while (active && !stopping && passes < want) {
+		pthread_cond_wait(&dd_done, &dd_mutex);
+	}
+	pthread_mutex_unlock(&dd_mutex);
+}
+
+void dedup_start(super_blk* image) {
+	fs = image;
+	stopping = false;
+	kicked = false;
+	since = 0;
+	active = true;
+	assert(pthread_create(&dd_thread, NULL, dedup_main, NULL) == 0);
+}
+
+// Stops the thread, a step in progress finishes first. The index goes
+// with it, the next image has other blocks.
+void dedup_stop(void) {
+	if (!active) {
+		return;
+	}
+
+	pthread_mutex_lock(&dd_mutex);
+	stopping = true;
+	pthread_cond_signal(&dd_wake);
+	pthread_mutex_unlock(&dd_mutex);
+	pthread_join(dd_thread, NULL);
+
+	active = false;
+	clear_index();
+}
@@ -0,0 +1,33 @@
+#ifndef NUFS_DEDUP_H
+#define NUFS_DEDUP_H
+
+#include "data.h"
+
+// How hard the background deduplicator works, see dedup.c
+typedef struct dd_limits {
+	size_t rate;          // bytes looked at per second at most, 0 turns it off
+	size_t chunk;         // most bytes looked at under one lock of a file
+	size_t index;         // fingerprints remembered at most
+	unsigned interval_ms; // pause between passes over the image
+} dd_limits;
+
+// Where a block with a given fingerprint was last seen
+typedef struct dd_entry {
+	uint64_t hash;
+	uint32_t blk;
+	uint32_t lblk;       // the logical block of inum that mapped blk
+	int inum;
+	uint32_t generation; // of inum at the time
+} dd_entry;
+
+void dedup_default_limits(dd_limits* l);
+void dedup_set_limits(const dd_limits* l);
+void dedup_start(super_blk* fs);
+void dedup_stop(void);
+void dedup_now(void);
+
+uint64_t dedup_hash(const void* data, size_t len);
+bool dedup_find(uint64_t hash, dd_entry* e);
+void dedup_add(const dd_entry* e);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "data.h"
+#include "defrag.h"
+
+// Online defragmentation. Files written a little at a time next to
+// each other end up in many short extents, which read back slowly. The
+// defrag thread walks the inode table every interval_ms and, file by
+// file, moves each run of short extents (up to chunk bytes together)
+// into one contiguous run, placed right after the extent before it or
+// at the front of the image. Files come together and, with their data
+// moving forward, so does the free space behind them.
+//
+// Every move is one call into the engine (fs_defrag_ino) that copies
+// under the file's write lock, syncs the copy and switches the extent
+// map in one journal transaction. The blocks moved out of stay in use
+// until that transaction is committed (free_run_later), so no crash can
+// leave the file pointing at blocks someone else reused; a crash in
+// between only leaks them. Moves are paced to rate bytes per second.
+
+#define DF_DEFAULTS { \
+	.rate = 16 << 20, \
+	.chunk = 1 << 20, \
+	.interval_ms = 60000, \
+}
+
+static df_limits limits = DF_DEFAULTS;
+
+static super_blk* fs;
+static bool active;
+static bool stopping;
+static bool kicked;
+static pthread_mutex_t df_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t df_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t df_done = PTHREAD_COND_INITIALIZER;
+static uint64_t passes;
+static bool in_pass;
+static pthread_t df_thread;
+
+// Sleeps ms or until stopped, or kicked if kickable, with df_mutex held
+static void pause_ms(uint64_t ms, bool kickable) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t ns = ts.tv_nsec + ms * 1000000;
+	ts.tv_sec += ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (!stopping && !(kickable && kicked)) {
+		if (pthread_cond_timedwait(&df_wake, &df_mutex, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+}
+
+// Moves what it can of one file, returns false once stopped
+static bool defrag_file(int inum) {
+	uint32_t max = limits.chunk / fs->data.blk_sz;
+	if (max < 2) {
+		max = 2;
+	}
+
+	uint32_t lblk = 0;
+	for (;;) {
+		pthread_mutex_unlock(&df_mutex);
+		int moved = fs_defrag_ino(fs, inum, &lblk, max);
+		pthread_mutex_lock(&df_mutex);
+		if (moved == -ENOSPC && max > 8) {
+			// No free run that long, move shorter pieces
+			max /= 2;
+			continue;
+		}
+		if (moved <= 0) {
+			return !stopping;
+		}
+
+		if (stopping || limits.rate == 0) {
+			return false;
+		}
+		pause_ms((uint64_t)moved * fs->data.blk_sz * 1000 / limits.rate, false);
+	}
+}
+
+static void defrag_pass(void) {
+	for (int inum = 0; !stopping && limits.rate > 0; inum++) {
+		pthread_mutex_unlock(&df_mutex);
+		inum = fs_defrag_next(fs, inum);
+		pthread_mutex_lock(&df_mutex);
+		if (inum < 0 || !defrag_file(inum)) {
+			break;
+		}
+	}
+}
+
+static void* defrag_main(void* arg) {
+	(void) arg;
+	pthread_mutex_lock(&df_mutex);
+	while (!stopping) {
+		pause_ms(limits.interval_ms, true);
+		kicked = false;
+		if (!stopping && limits.rate > 0) {
+			in_pass = true;
+			defrag_pass();
+			in_pass = false;
+		}
+		passes++;
+		pthread_cond_broadcast(&df_done);
+	}
+	pthread_cond_broadcast(&df_done);
+	pthread_mutex_unlock(&df_mutex);
+	return NULL;
+}
+
+void defrag_default_limits(df_limits* l) {
+	*l = (df_limits) DF_DEFAULTS;
+}
+
+void defrag_set_limits(const df_limits* l) {
+	assert(l->interval_ms > 0);
+	pthread_mutex_lock(&df_mutex);
+	limits = *l;
+	pthread_mutex_unlock(&df_mutex);
+}
+
+// Starts a pass now instead of at the end of the interval and waits
+// for it to finish
+void defrag_now(void) {
+	pthread_mutex_lock(&df_mutex);
+	// A pass already under way may be past some files
+	uint64_t want = passes + (in_pass ? 2 : 1);
+	kicked = true;
+	pthread_cond_signal(&df_wake);
+	while (active && !stopping && passes < want) {
+		pthread_cond_wait(&df_done, &df_mutex);
+	}
+	pthread_mutex_unlock(&df_mutex);
+}
+
+void defrag_start(super_blk* image) {
+	fs = image;
+	stopping = false;
+	kicked = false;
+	active = true;
+	assert(pthread_create(&df_thread, NULL, defrag_main, NULL) == 0);
+}
+
+// Stops the thread, a move in progress finishes first
+void defrag_stop(void) {
+	if (!active) {
+		return;
+	}
+
+	pthread_mutex_lock(&df_mutex);
+	stopping = true;
+	pthread_cond_signal(&df_wake);
+	pthread_mutex_unlock(&df_mutex);
+	pthread_join(df_thread, NULL);
+
+	active = false;
+}
@@ -0,0 +1,19 @@
+#ifndef NUFS_DEFRAG_H
+#define NUFS_DEFRAG_H
+
+#include "data.h"
+
+// How hard the background defragmenter works, see defrag.c
+typedef struct df_limits {
+	size_t rate;          // bytes moved per second at most, 0 turns it off
+	size_t chunk;         // most bytes moved under one lock of a file
+	unsigned interval_ms; // pause between passes over the image
+} df_limits;
+
+void defrag_default_limits(df_limits* l);
+void defrag_set_limits(const df_limits* l);
+void defrag_start(super_blk* fs);
+void defrag_stop(void);
+void defrag_now(void);
+
+#endif
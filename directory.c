@@ -0,0 +1,380 @@
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+
+#include "data.h"
+#include "directory.h"
+#include "extent.h"
+#include "index.h"
+#include "journal.h"
+
+// (directory inum, name) hash -> dirent position, where a position is
+// physical blk_idx * ents_per_page + slot. Rebuilt from the dirent pages on mount.
+// Nothing here locks, callers hold the namespace lock from data.c.
+// Until the index is ready lookups scan the pages of the directory and
+// changes leave it alone, directory_init picks them up from the pages.
+static hindex dirent_index;
+static bool index_ready;
+
+static size_t ents_per_page(const super_blk* fs) {
+	return fs->data.blk_sz / sizeof(dirent) - 1;
+}
+
+static dir_page* page_at(const super_blk* fs, int blk_idx) {
+	return (dir_page*)fs_blkptr(fs, blk_idx);
+}
+
+// Physical block of the i-th page of dir. A walk through the pages
+// passes pos along, so each page is a step on from the one before.
+static int page_blk(const super_blk* fs, int dir, uint32_t i, ext_pos* pos) {
+	const inode* n = fs_inode(fs, dir);
+	return pos ? inode_map_at(fs, n, i, NULL, pos) : inode_map(fs, n, i, NULL);
+}
+
+static dir_page* first_page(const super_blk* fs, int dir) {
+	return page_at(fs, page_blk(fs, dir, 0, NULL));
+}
+
+static uint64_t ent_hash(int dir, const char* name, size_t len) {
+	return hindex_hash_mix(hindex_hash((const char*)&dir, sizeof(dir)), name, len);
+}
+
+static dirent* ent_at(const super_blk* fs, int pos, dir_page** page) {
+	size_t per = ents_per_page(fs);
+	dir_page* p = page_at(fs, pos / per);
+	if (page) {
+		*page = p;
+	}
+	return &p->ents[pos % per];
+}
+
+static int is_dir(const super_blk* fs, int inum) {
+	const inode* n = fs_inode(fs, inum);
+	return n->references > 0 && S_ISDIR(n->mode);
+}
+
+typedef struct ent_key {
+	const super_blk* fs;
+	int dir;
+	const char* name;
+	size_t len;
+} ent_key;
+
+static int ent_matches(int pos, const void* ctx) {
+	const ent_key* key = ctx;
+	dir_page* page;
+	const dirent* ent = ent_at(key->fs, pos, &page);
+	return page->owner == key->dir && ent->used
+		&& strncmp(ent->name, key->name, key->len) == 0
+		&& ent->name[key->len] == '\0';
+}
+
+static int scan_pos(const super_blk* fs, int dir, const char* name, size_t len) {
+	size_t per = ents_per_page(fs);
+	ext_pos at = EXT_POS_START;
+	for (uint32_t p = 0; p < fs_inode(fs, dir)->n_blocks; p++) {
+		int blk = page_blk(fs, dir, p, &at);
+		const dir_page* page = page_at(fs, blk);
+		int seen = 0;
+		for (size_t s = 0; s < per && seen < page->count; s++) {
+			const dirent* ent = &page->ents[s];
+			if (!ent->used) {
+				continue;
+			}
+			seen++;
+			if (strncmp(ent->name, name, len) == 0 && ent->name[len] == '\0') {
+				return blk * per + s;
+			}
+		}
+	}
+	return -1;
+}
+
+static int find_pos(const super_blk* fs, int dir, const char* name, size_t len) {
+	if (len >= DIR_NAME) {
+		return -1;
+	}
+	if (!__atomic_load_n(&index_ready, __ATOMIC_ACQUIRE)) {
+		return scan_pos(fs, dir, name, len);
+	}
+	ent_key key = { fs, dir, name, len };
+	return hindex_find(&dirent_index, ent_hash(dir, name, len), ent_matches, &key);
+}
+
+// Builds the index from the pages. After a crash (recover) an entry is
+// checked against the inode it names first, which costs a read of the
+// inode table per entry; a cleanly closed image skips that, and needs
+// no more than the namespace lock held shared.
+void directory_init(super_blk* fs, bool recover) {
+	size_t n_inodes = fs->n_inodes;
+	size_t per = ents_per_page(fs);
+
+	hindex_free(&dirent_index);
+	hindex_init(&dirent_index, n_inodes);
+
+	for (size_t i = fs_next_inode(fs, 0); i < n_inodes; i = fs_next_inode(fs, i + 1)) {
+		if (!is_dir(fs, i)) {
+			continue;
+		}
+		ext_pos at = EXT_POS_START;
+		for (uint32_t p = 0; p < fs_inode(fs, i)->n_blocks; p++) {
+			int blk = page_blk(fs, i, p, &at);
+			dir_page* page = page_at(fs, blk);
+			// On a clean image the count can be trusted, the page
+			// holds nothing past its last entry
+			int seen = 0;
+			for (size_t s = 0; s < per && (recover || seen < page->count); s++) {
+				dirent* ent = &page->ents[s];
+				if (!ent->used) {
+					continue;
+				}
+				// A page can reach the disk ahead of the journal commit
+				// that claimed the inode it names, such an entry goes
+				if (recover && (ent->inum < 0 || (size_t)ent->inum >= n_inodes || fs_inode(fs, ent->inum)->mode == 0)) {
+					memset(ent, 0, sizeof(dirent));
+					page->count -= 1;
+					journal_dirty(ent, sizeof(dirent));
+					journal_dirty(page, sizeof(dirent));
+					continue;
+				}
+				hindex_insert(&dirent_index, ent_hash(i, ent->name, strlen(ent->name)), blk * per + s);
+				seen++;
+			}
+		}
+	}
+	__atomic_store_n(&index_ready, true, __ATOMIC_RELEASE);
+}
+
+void directory_free(super_blk* fs) {
+	(void) fs;
+	__atomic_store_n(&index_ready, false, __ATOMIC_RELEASE);
+	hindex_free(&dirent_index);
+}
+
+void directory_init_page(super_blk* fs, int inum, int parent) {
+	dir_page* page = first_page(fs, inum);
+	memset(page, 0, fs->data.blk_sz);
+	page->owner = inum;
+	page->parent = parent;
+	page->count = 0;
+	journal_dirty(page, fs->data.blk_sz);
+}
+
+int directory_lookup_inum(const super_blk* fs, int dir, const char* name) {
+	int pos = find_pos(fs, dir, name, strlen(name));
+	if (pos < 0) {
+		return -ENOENT;
+	}
+	return ent_at(fs, pos, NULL)->inum;
+}
+
+int directory_put_ent(super_blk* fs, int dir, const char* name, int inum) {
+	size_t len = strlen(name);
+	if (len >= DIR_NAME) {
+		return -ENAMETOOLONG;
+	}
+	if (find_pos(fs, dir, name, len) >= 0) {
+		return -EEXIST;
+	}
+
+	size_t per = ents_per_page(fs);
+	inode* n = fs_inode(fs, dir);
+	uint32_t p = 0;
+	ext_pos at = EXT_POS_START;
+	int blk = page_blk(fs, dir, 0, &at);
+	dir_page* page = page_at(fs, blk);
+	while (page->count >= (int)per) {
+		p++;
+		if (p == n->n_blocks) {
+			if (inode_grow(fs, n, p + 1) != 0) {
+				return -ENOSPC;
+			}
+			dir_page* head = first_page(fs, dir);
+			blk = page_blk(fs, dir, p, NULL);
+			page = page_at(fs, blk);
+			memset(page, 0, fs->data.blk_sz);
+			page->owner = dir;
+			page->parent = head->parent;
+			n->data_size += fs->data.blk_sz;
+			journal_dirty(page, fs->data.blk_sz);
+			journal_dirty(n, sizeof(inode));
+			break;
+		}
+		blk = page_blk(fs, dir, p, &at);
+		page = page_at(fs, blk);
+	}
+
+	size_t slot = 0;
+	while (page->ents[slot].used) {
+		slot++;
+	}
+
+	dirent* ent = &page->ents[slot];
+	memset(ent->name, 0, DIR_NAME);
+	memcpy(ent->name, name, len);
+	ent->inum = inum;
+	ent->used = 1;
+	page->count += 1;
+	journal_dirty(ent, sizeof(dirent));
+	journal_dirty(page, sizeof(dirent));
+
+	if (index_ready) {
+		hindex_insert(&dirent_index, ent_hash(dir, name, len), blk * per + slot);
+	}
+	return 0;
+}
+
+int directory_delete(super_blk* fs, int dir, const char* name) {
+	size_t len = strlen(name);
+	int pos = find_pos(fs, dir, name, len);
+	if (pos < 0) {
+		return -ENOENT;
+	}
+
+	if (index_ready) {
+		hindex_remove(&dirent_index, ent_hash(dir, name, len), pos);
+	}
+
+	dir_page* page;
+	dirent* ent = ent_at(fs, pos, &page);
+	memset(ent, 0, sizeof(dirent));
+	page->count -= 1;
+	journal_dirty(ent, sizeof(dirent));
+	journal_dirty(page, sizeof(dirent));
+
+	// Trailing pages that went empty are given back, the first one stays
+	inode* n = fs_inode(fs, dir);
+	while (n->n_blocks > 1 && page_at(fs, page_blk(fs, dir, n->n_blocks - 1, NULL))->count == 0) {
+		inode_shrink(fs, n, n->n_blocks - 1);
+		n->data_size -= fs->data.blk_sz;
+		journal_dirty(n, sizeof(inode));
+	}
+
+	return 0;
+}
+
+// Points the entry name of dir at inum in place, the name and its
+// position stay
+int directory_set_inum(super_blk* fs, int dir, const char* name, int inum) {
+	int pos = find_pos(fs, dir, name, strlen(name));
+	if (pos < 0) {
+		return -ENOENT;
+	}
+
+	dirent* ent = ent_at(fs, pos, NULL);
+	ent->inum = inum;
+	journal_dirty(ent, sizeof(dirent));
+	return 0;
+}
+
+int directory_is_empty(const super_blk* fs, int dir) {
+	ext_pos at = EXT_POS_START;
+	for (uint32_t p = 0; p < fs_inode(fs, dir)->n_blocks; p++) {
+		if (page_at(fs, page_blk(fs, dir, p, &at))->count != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int directory_parent(const super_blk* fs, int dir) {
+	return first_page(fs, dir)->parent;
+}
+
+void directory_set_parent(super_blk* fs, int dir, int parent) {
+	dir_page* page = first_page(fs, dir);
+	page->parent = parent;
+	journal_dirty(page, sizeof(dirent));
+}
+
+// Visits the entries of dir in page order, starting at position from.
+// A position is page index * ents_per_page + slot, so it stays put while
+// other entries come and go and a listing can resume where it left off.
+// The walk stops at the first visit that returns nonzero, a full reply
+// buffer say, and that value is returned; 0 once every entry was seen.
+int directory_list(const super_blk* fs, int dir, size_t from, dir_visit_t visit, void* ctx) {
+	size_t per = ents_per_page(fs);
+	ext_pos at = EXT_POS_START;
+	for (uint32_t p = from / per; p < fs_inode(fs, dir)->n_blocks; p++) {
+		const dir_page* page = page_at(fs, page_blk(fs, dir, p, &at));
+		int seen = 0;
+		size_t s = p == from / per ? from % per : 0;
+		for (size_t i = 0; i < s; i++) {
+			seen += page->ents[i].used;
+		}
+		for (; s < per && seen < page->count; s++) {
+			const dirent* ent = &page->ents[s];
+			if (!ent->used) {
+				continue;
+			}
+			seen++;
+			int rv = visit(ent, (size_t)p * per + s, ctx);
+			if (rv != 0) {
+				return rv;
+			}
+		}
+	}
+	return 0;
+}
+
+// Resolve the first len bytes of an absolute path, one component at a time
+static int tree_walk(const super_blk* fs, const char* path, size_t len) {
+	if (len == 0 || path[0] != '/') {
+		return -ENOENT;
+	}
+
+	int cur = ROOT_INUM;
+	size_t i = 0;
+	while (i < len) {
+		while (i < len && path[i] == '/') {
+			i++;
+		}
+		if (i == len) {
+			break;
+		}
+
+		size_t start = i;
+		while (i < len && path[i] != '/') {
+			i++;
+		}
+
+		if (!is_dir(fs, cur)) {
+			return -ENOTDIR;
+		}
+
+		int pos = find_pos(fs, cur, path + start, i - start);
+		if (pos < 0) {
+			return -ENOENT;
+		}
+		cur = ent_at(fs, pos, NULL)->inum;
+	}
+
+	return cur;
+}
+
+int tree_lookup_inum(const super_blk* fs, const char* path) {
+	return tree_walk(fs, path, strlen(path));
+}
+
+// Resolve the directory holding the last component of path and
+// point name at that component
+int tree_lookup_parent(const super_blk* fs, const char* path, const char** name) {
+	const char* slash = strrchr(path, '/');
+	if (slash == NULL || slash[1] == '\0') {
+		return -EINVAL;
+	}
+
+	*name = slash + 1;
+	if (strlen(*name) >= DIR_NAME) {
+		return -ENAMETOOLONG;
+	}
+
+	int dir = tree_walk(fs, path, slash == path ? 1 : (size_t)(slash - path));
+	if (dir < 0) {
+		return dir;
+	}
+	if (!is_dir(fs, dir)) {
+		return -ENOTDIR;
+	}
+	return dir;
+}
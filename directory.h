@@ -0,0 +1,44 @@
+#ifndef NUFS_DIRECTORY_H
+#define NUFS_DIRECTORY_H
+
+#include "data.h"
+
+#define DIR_NAME 56
+#define ROOT_INUM 0
+
+// One directory entry, 64 bytes on disk
+typedef struct dirent {
+	char name[DIR_NAME];
+	int inum;
+	int used;
+} dirent;
+
+// A directory's data blocks are dirent pages, each page starts with
+// this header in place of its first dirent slot.
+typedef struct dir_page {
+	int owner;  // inum of the directory this page belongs to
+	int parent; // inum of the owner's parent, kept on the first page
+	int count;  // live entries on this page
+	char _pad[sizeof(dirent) - 3 * sizeof(int)];
+	dirent ents[];
+} dir_page;
+
+typedef int (*dir_visit_t)(const dirent* ent, size_t pos, void* ctx);
+
+void directory_init(super_blk* fs, bool recover);
+void directory_free(super_blk* fs);
+void directory_init_page(super_blk* fs, int inum, int parent);
+
+int directory_lookup_inum(const super_blk* fs, int dir, const char* name);
+int directory_put_ent(super_blk* fs, int dir, const char* name, int inum);
+int directory_delete(super_blk* fs, int dir, const char* name);
+int directory_set_inum(super_blk* fs, int dir, const char* name, int inum);
+int directory_is_empty(const super_blk* fs, int dir);
+int directory_parent(const super_blk* fs, int dir);
+void directory_set_parent(super_blk* fs, int dir, int parent);
+int directory_list(const super_blk* fs, int dir, size_t from, dir_visit_t visit, void* ctx);
+
+int tree_lookup_inum(const super_blk* fs, const char* path);
+int tree_lookup_parent(const super_blk* fs, const char* path, const char** name);
+
+#endif
@@ -0,0 +1,617 @@
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "data.h"
+#include "extent.h"
+#include "alloc.h"
+#include "journal.h"
+
+static size_t per_blk(const super_blk* fs) {
+	return (fs->data.blk_sz - sizeof(extent_blk)) / sizeof(extent);
+}
+
+static extent_blk* eblk_at(const super_blk* fs, uint32_t blk) {
+	return (extent_blk*)fs_blkptr(fs, blk);
+}
+
+// The k-th extent of n, walking the indirect chain when needed
+static extent* ext_at(const super_blk* fs, const inode* n, uint32_t k) {
+	if (k < N_DIRECT) {
+		return (extent*)&n->ext[k];
+	}
+
+	size_t per = per_blk(fs);
+	size_t idx = k - N_DIRECT;
+	extent_blk* eb = eblk_at(fs, n->indirect);
+	while (idx >= per) {
+		eb = eblk_at(fs, eb->next);
+		idx -= per;
+	}
+	return &eb->ext[idx];
+}
+
+// The chain of n walked once into a table of its blocks, so every
+// extent after that is one step away however long the map is. Adding
+// and dropping extents through it keeps the table in step.
+typedef struct chain {
+	super_blk* fs;
+	inode* n;
+	size_t per;
+	uint32_t* blk;
+	size_t count, cap;
+} chain;
+
+static void chain_load(chain* c, const super_blk* fs, const inode* n) {
+	c->fs = (super_blk*)fs;
+	c->n = (inode*)n;
+	c->per = per_blk(fs);
+	c->count = n->n_ext > N_DIRECT ? (n->n_ext - N_DIRECT + c->per - 1) / c->per : 0;
+	c->cap = c->count;
+	c->blk = NULL;
+	if (c->count > 0) {
+		c->blk = malloc(c->cap * sizeof(uint32_t));
+		assert(c->blk != NULL);
+		c->blk[0] = n->indirect;
+		for (size_t i = 1; i < c->count; i++) {
+			c->blk[i] = eblk_at(fs, c->blk[i - 1])->next;
+		}
+	}
+}
+
+static void chain_free(chain* c) {
+	free(c->blk);
+	c->blk = NULL;
+}
+
+// Block holding the k-th extent (k >= N_DIRECT)
+static extent_blk* chain_eblk(const chain* c, uint32_t k) {
+	return eblk_at(c->fs, c->blk[(k - N_DIRECT) / c->per]);
+}
+
+static extent* chain_ext(const chain* c, uint32_t k) {
+	if (k < N_DIRECT) {
+		return &c->n->ext[k];
+	}
+	return &chain_eblk(c, k)->ext[(k - N_DIRECT) % c->per];
+}
+
+// Extents kept in the inode are logged along with it, ones out in the
+// chain with the header of their block
+static void chain_log(const chain* c, uint32_t k) {
+	if (k >= N_DIRECT) {
+		journal_dirty(chain_eblk(c, k), sizeof(extent_blk));
+		journal_dirty(chain_ext(c, k), sizeof(extent));
+	}
+}
+
+// The extent pos stands at
+static extent* pos_ext(const super_blk* fs, const inode* n, const ext_pos* pos) {
+	if (pos->k < N_DIRECT) {
+		return (extent*)&n->ext[pos->k];
+	}
+	return &eblk_at(fs, pos->blk)->ext[(pos->k - N_DIRECT) % per_blk(fs)];
+}
+
+// Moves pos on to the next extent, or past the last one
+static void pos_next(const super_blk* fs, const inode* n, ext_pos* pos) {
+	pos->base += extent_blocks(fs, *pos_ext(fs, n, pos));
+	pos->k += 1;
+	if (pos->k >= n->n_ext) {
+		return;
+	}
+	if (pos->k == N_DIRECT) {
+		pos->blk = n->indirect;
+	} else if (pos->k > N_DIRECT && (pos->k - N_DIRECT) % per_blk(fs) == 0) {
+		pos->blk = eblk_at(fs, pos->blk)->next;
+	}
+}
+
+// Blocks in a cluster, compression needs at least two to save one
+uint32_t cluster_blks(const super_blk* fs) {
+	return CLUSTER_SIZE / fs->data.blk_sz;
+}
+
+// Logical blocks of the file the extent covers
+uint32_t extent_blocks(const super_blk* fs, extent e) {
+	return ext_compressed(e) ? cluster_blks(fs) : e.len & ~EXT_HOLE;
+}
+
+// The extent holding logical block lblk, which must be mapped, with
+// pos moved to it. The walk carries on from pos unless lblk comes
+// before it, so going through a file front to back costs one pass over
+// its map however many lookups it takes.
+extent inode_find(const super_blk* fs, const inode* n, uint32_t lblk, ext_pos* pos) {
+	assert(lblk < n->n_blocks);
+	if (lblk < pos->base || pos->k >= n->n_ext) {
+		*pos = EXT_POS_START;
+	}
+
+	// A block of the chain, or the inode, at a time
+	size_t per = per_blk(fs);
+	for (;;) {
+		const extent* e;
+		uint32_t left;
+		if (pos->k < N_DIRECT) {
+			e = &n->ext[pos->k];
+			left = N_DIRECT - pos->k;
+		} else {
+			size_t idx = (pos->k - N_DIRECT) % per;
+			e = &eblk_at(fs, pos->blk)->ext[idx];
+			left = per - idx;
+		}
+		if (left > n->n_ext - pos->k) {
+			left = n->n_ext - pos->k;
+		}
+		for (uint32_t i = 0; i < left; i++) {
+			uint32_t len = extent_blocks(fs, e[i]);
+			if (lblk < pos->base + len) {
+				pos->k += i;
+				return e[i];
+			}
+			pos->base += len;
+		}
+		pos->k += left;
+		assert(pos->k < n->n_ext);
+		pos->blk = pos->k == N_DIRECT ? n->indirect : eblk_at(fs, pos->blk)->next;
+	}
+}
+
+// The k-th extent of n with pos moved to it, walking on from pos unless
+// k comes before it. k may be n_ext, pos then stands past the last
+// extent and the extent is empty.
+extent inode_extent_at(const super_blk* fs, const inode* n, uint32_t k, ext_pos* pos) {
+	assert(k <= n->n_ext);
+	if (k < pos->k) {
+		*pos = EXT_POS_START;
+	}
+	while (pos->k < k) {
+		pos_next(fs, n, pos);
+	}
+	return k < n->n_ext ? *pos_ext(fs, n, pos) : (extent){ 0, 0 };
+}
+
+// A position at the k-th extent of n, which starts at logical block
+// base, for a caller that knows where it is after changing the map
+ext_pos inode_pos(const super_blk* fs, const inode* n, uint32_t k, uint32_t base) {
+	ext_pos pos = { k, base, 0 };
+	if (k >= N_DIRECT && k < n->n_ext) {
+		size_t hops = (k - N_DIRECT) / per_blk(fs);
+		pos.blk = n->indirect;
+		while (hops-- > 0) {
+			pos.blk = eblk_at(fs, pos.blk)->next;
+		}
+	}
+	return pos;
+}
+
+// Physical block of logical block lblk, *run is set to how many blocks
+// from there on are contiguous on disk. Returns -1 past the last block,
+// and in a hole or a compressed cluster, which have no block of their
+// own; *run is then the blocks left in that extent. The lookup goes
+// from pos like inode_find.
+int inode_map_at(const super_blk* fs, const inode* n, uint32_t lblk, uint32_t* run, ext_pos* pos) {
+	if (lblk >= n->n_blocks) {
+		return -1;
+	}
+
+	extent e = inode_find(fs, n, lblk, pos);
+	if (run) {
+		*run = extent_blocks(fs, e) - (lblk - pos->base);
+	}
+	if (ext_compressed(e) || ext_hole(e)) {
+		return -1;
+	}
+	return e.start + (lblk - pos->base);
+}
+
+int inode_map(const super_blk* fs, const inode* n, uint32_t lblk, uint32_t* run) {
+	ext_pos pos = EXT_POS_START;
+	return inode_map_at(fs, n, lblk, run, &pos);
+}
+
+// Adds an extent at the end of the map, and a block to the chain when
+// the last one is full
+static int chain_append(chain* c, uint32_t start, uint32_t len) {
+	super_blk* fs = c->fs;
+	inode* n = c->n;
+	uint32_t k = n->n_ext;
+	if (k >= N_DIRECT) {
+		size_t idx = k - N_DIRECT;
+		if (idx % c->per == 0) {
+			// Current indirect block is full (or there is none yet)
+			fs_grow_blocks(fs, 1);
+			size_t fresh;
+			if (alloc_run(&fs->data, 1, &fresh) != 0) {
+				return -ENOSPC;
+			}
+			extent_blk* eb = eblk_at(fs, fresh);
+			eb->next = 0;
+			eb->count = 0;
+			if (idx == 0) {
+				n->indirect = fresh;
+			} else {
+				extent_blk* prev = eblk_at(fs, c->blk[c->count - 1]);
+				prev->next = fresh;
+				journal_dirty(prev, sizeof(extent_blk));
+			}
+			if (c->count == c->cap) {
+				c->cap = c->cap > 0 ? c->cap * 2 : 4;
+				c->blk = realloc(c->blk, c->cap * sizeof(uint32_t));
+				assert(c->blk != NULL);
+			}
+			c->blk[c->count++] = fresh;
+		}
+		chain_eblk(c, k)->count += 1;
+	}
+
+	n->n_ext += 1;
+	extent* e = chain_ext(c, k);
+	e->start = start;
+	e->len = len;
+	chain_log(c, k);
+	return 0;
+}
+
+static void chain_drop(chain* c) {
+	inode* n = c->n;
+	uint32_t k = n->n_ext - 1;
+	if (k >= N_DIRECT) {
+		extent_blk* eb = chain_eblk(c, k);
+		eb->count -= 1;
+		journal_dirty(eb, sizeof(extent_blk));
+		if (eb->count == 0) {
+			journal_revoke(eb, c->fs->data.blk_sz);
+			free_run_later(&c->fs->data, c->blk[--c->count], 1);
+		}
+	}
+	n->n_ext = k;
+}
+
+// inode_append through a loaded chain
+static int chain_append_run(chain* c, uint32_t start, uint32_t len) {
+	inode* n = c->n;
+	extent* last = n->n_ext > 0 ? chain_ext(c, n->n_ext - 1) : NULL;
+	if (last && !ext_compressed(*last) && !ext_hole(*last) && last->start + last->len == start) {
+		last->len += len;
+		chain_log(c, n->n_ext - 1);
+	} else if (chain_append(c, start, len) != 0) {
+		return -ENOSPC;
+	}
+	n->n_blocks += len;
+	return 0;
+}
+
+// Map more blocks onto the end of n until it has n_blocks. New blocks
+// come from contiguous runs placed right after the last extent when
+// possible, their contents are left as found.
+int inode_grow(super_blk* fs, inode* n, uint32_t n_blocks) {
+	journal_dirty(n, sizeof(inode));
+	chain c;
+	chain_load(&c, fs, n);
+	int rv = 0;
+	while (n->n_blocks < n_blocks) {
+		extent* last = n->n_ext > 0 ? chain_ext(&c, n->n_ext - 1) : NULL;
+		size_t goal = last && !ext_hole(*last) ? last->start + ext_phys(*last) : ALLOC_AT_CURSOR;
+
+		// Grow the image while it is running low, failing that make do
+		// with whatever is left
+		uint32_t need = n_blocks - n->n_blocks;
+		fs_grow_blocks(fs, need);
+
+		size_t got = 0;
+		size_t start = get_free_run(&fs->data, goal, need, &got);
+		if (got == 0) {
+			rv = -ENOSPC;
+			break;
+		}
+
+		if (chain_append_run(&c, start, got) != 0) {
+			free_run(&fs->data, start, got);
+			rv = -ENOSPC;
+			break;
+		}
+	}
+	chain_free(&c);
+	return rv;
+}
+
+// Maps the run of len blocks from start onto the end of n, folded into
+// the last extent when it follows on from it. A new extent may need a
+// block for the chain, -ENOSPC leaves n as it was.
+int inode_append(super_blk* fs, inode* n, uint32_t start, uint32_t len) {
+	journal_dirty(n, sizeof(inode));
+	chain c;
+	chain_load(&c, fs, n);
+	int rv = chain_append_run(&c, start, len);
+	chain_free(&c);
+	return rv;
+}
+
+// Adds a hole of len blocks to the end of n, folded into the last
+// extent when that is one. -ENOSPC leaves n as it was.
+int inode_append_hole(super_blk* fs, inode* n, uint32_t len) {
+	journal_dirty(n, sizeof(inode));
+	assert((uint64_t)n->n_blocks + len < EXT_HOLE);
+	chain c;
+	chain_load(&c, fs, n);
+	int rv = 0;
+	extent* last = n->n_ext > 0 ? chain_ext(&c, n->n_ext - 1) : NULL;
+	if (last && ext_hole(*last)) {
+		last->len += len;
+		chain_log(&c, n->n_ext - 1);
+	} else if (chain_append(&c, 0, EXT_HOLE | len) != 0) {
+		rv = -ENOSPC;
+	}
+	if (rv == 0) {
+		n->n_blocks += len;
+		n->holes += len;
+	}
+	chain_free(&c);
+	return rv;
+}
+
+// Gives the empty inode to the extents of from, one for one, so both
+// map the same blocks. Only the map is copied, the caller counts the
+// new owners. -ENOSPC leaves to empty again.
+int inode_copy_map(super_blk* fs, inode* to, const inode* from) {
+	journal_dirty(to, sizeof(inode));
+	chain c;
+	chain_load(&c, fs, to);
+	ext_pos pos = EXT_POS_START;
+	for (uint32_t k = 0; k < from->n_ext; k++) {
+		extent e = inode_extent_at(fs, from, k, &pos);
+		if (chain_append(&c, e.start, e.len) != 0) {
+			while (to->n_ext > 0) {
+				chain_drop(&c);
+			}
+			to->n_blocks = 0;
+			chain_free(&c);
+			return -ENOSPC;
+		}
+		to->n_blocks += extent_blocks(fs, e);
+	}
+	to->holes = from->holes;
+	chain_free(&c);
+	return 0;
+}
+
+// Give back every block past the first n_blocks, once the operation
+// commits. Those of a directory held dirent pages, the journal must not
+// bring them back. A compressed
+// cluster goes as a whole, the caller expands one it cuts into.
+void inode_shrink(super_blk* fs, inode* n, uint32_t n_blocks) {
+	journal_dirty(n, sizeof(inode));
+	chain c;
+	chain_load(&c, fs, n);
+	while (n->n_blocks > n_blocks) {
+		extent* last = chain_ext(&c, n->n_ext - 1);
+		if (ext_compressed(*last)) {
+			assert(n->n_blocks - n_blocks >= cluster_blks(fs));
+			free_run_later(&fs->data, last->start, ext_phys(*last));
+			n->n_blocks -= cluster_blks(fs);
+			chain_drop(&c);
+			continue;
+		}
+
+		uint32_t drop = n->n_blocks - n_blocks;
+		if (drop > extent_blocks(fs, *last)) {
+			drop = extent_blocks(fs, *last);
+		}
+
+		if (ext_hole(*last)) {
+			n->holes -= drop;
+		} else {
+			uint32_t first = last->start + last->len - drop;
+			if (S_ISDIR(n->mode)) {
+				journal_revoke(fs_blkptr(fs, first), (size_t)drop * fs->data.blk_sz);
+			}
+			free_run_later(&fs->data, first, drop);
+		}
+		last->len -= drop;
+		n->n_blocks -= drop;
+		chain_log(&c, n->n_ext - 1);
+
+		if (extent_blocks(fs, *last) == 0) {
+			chain_drop(&c);
+		}
+	}
+	chain_free(&c);
+}
+
+extent inode_extent(const super_blk* fs, const inode* n, uint32_t k) {
+	return *ext_at(fs, n, k);
+}
+
+// Replaces extents k0 to k1 - 1 of n by the one run at start their
+// blocks were copied to, folded into extent k0 - 1 when it follows on
+// from it. The extents are plain ones. The map only gets shorter, so
+// this needs no blocks and cannot fail. The old blocks stay in use, the
+// caller frees them.
+void inode_remap(super_blk* fs, inode* n, uint32_t k0, uint32_t k1, uint32_t start) {
+	journal_dirty(n, sizeof(inode));
+	chain c;
+	chain_load(&c, fs, n);
+	uint32_t len = 0;
+	for (uint32_t k = k0; k < k1; k++) {
+		len += chain_ext(&c, k)->len;
+	}
+
+	uint32_t to = k0;
+	extent* prev = k0 > 0 ? chain_ext(&c, k0 - 1) : NULL;
+	if (prev && !ext_compressed(*prev) && prev->start + prev->len == start) {
+		prev->len += len;
+		chain_log(&c, k0 - 1);
+	} else {
+		extent* e = chain_ext(&c, to);
+		e->start = start;
+		e->len = len;
+		chain_log(&c, to++);
+	}
+
+	for (uint32_t k = k1; k < n->n_ext; k++, to++) {
+		*chain_ext(&c, to) = *chain_ext(&c, k);
+		chain_log(&c, to);
+	}
+	while (n->n_ext > to) {
+		chain_drop(&c);
+	}
+	chain_free(&c);
+}
+
+// inode_splice through a loaded chain
+static int splice(chain* c, uint32_t k0, uint32_t k1, const extent* list, uint32_t count) {
+	inode* n = c->n;
+	journal_dirty(n, sizeof(inode));
+	uint32_t old_n = n->n_ext;
+	uint32_t new_n = old_n - (k1 - k0) + count;
+	while (n->n_ext < new_n) {
+		if (chain_append(c, 0, 0) != 0) {
+			while (n->n_ext > old_n) {
+				chain_drop(c);
+			}
+			return -ENOSPC;
+		}
+	}
+
+	// Move the extents after the spliced ones into place
+	if (new_n > old_n) {
+		for (uint32_t k = old_n; k-- > k1;) {
+			*chain_ext(c, k + new_n - old_n) = *chain_ext(c, k);
+			chain_log(c, k + new_n - old_n);
+		}
+	} else if (new_n < old_n) {
+		for (uint32_t k = k1; k < old_n; k++) {
+			*chain_ext(c, k - (old_n - new_n)) = *chain_ext(c, k);
+			chain_log(c, k - (old_n - new_n));
+		}
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		*chain_ext(c, k0 + i) = list[i];
+		chain_log(c, k0 + i);
+	}
+	while (n->n_ext > new_n) {
+		chain_drop(c);
+	}
+	return 0;
+}
+
+// Replaces extents k0 to k1 - 1 of n by the count extents in list,
+// which map the same logical blocks. A longer map may need a block for
+// the chain, -ENOSPC leaves n as it was. Blocks no longer mapped stay
+// in use, the caller frees them.
+int inode_splice(super_blk* fs, inode* n, uint32_t k0, uint32_t k1, const extent* list, uint32_t count) {
+	chain c;
+	chain_load(&c, fs, n);
+	int rv = splice(&c, k0, k1, list, count);
+	chain_free(&c);
+	return rv;
+}
+
+// Whether b carries on from a, so the two make one extent: both holes,
+// or plain extents whose blocks follow on from each other
+static bool ext_joins(extent a, extent b) {
+	if (ext_compressed(a) || ext_compressed(b)) {
+		return false;
+	}
+	if (ext_hole(a) || ext_hole(b)) {
+		return ext_hole(a) && ext_hole(b);
+	}
+	return a.start + a.len == b.start;
+}
+
+// len blocks of e from skip on, e a hole or plain
+static extent ext_slice(extent e, uint32_t skip, uint32_t len) {
+	return ext_hole(e) ? (extent){ 0, EXT_HOLE | len } : (extent){ e.start + skip, len };
+}
+
+// Maps logical blocks [lblk, lblk + len) of n, cutting into no
+// compressed cluster, as mid says: a run of blocks or a hole. It is
+// folded into the extents on either side where it joins them. The
+// lookup goes from pos, which is left at the extent now holding lblk.
+static int replace_range(super_blk* fs, inode* n, uint32_t lblk, extent mid, ext_pos* pos) {
+	uint32_t len = extent_blocks(fs, mid);
+	extent first = inode_find(fs, n, lblk, pos);
+	uint32_t k0 = pos->k, base0 = pos->base;
+
+	// On to the last extent in the range, counting its holes for n->holes
+	ext_pos at = *pos;
+	extent last = first;
+	uint32_t was = 0;
+	for (;;) {
+		uint32_t from = at.base > lblk ? at.base : lblk;
+		uint32_t to = at.base + extent_blocks(fs, last);
+		if (ext_hole(last)) {
+			was += (to < lblk + len ? to : lblk + len) - from;
+		}
+		if (to >= lblk + len) {
+			break;
+		}
+		last = inode_extent_at(fs, n, at.k + 1, &at);
+	}
+	uint32_t k1 = at.k + 1, base1 = at.base;
+	assert(!ext_compressed(first) || lblk == base0);
+	assert(!ext_compressed(last) || lblk + len == base1 + extent_blocks(fs, last));
+
+	chain c;
+	chain_load(&c, fs, n);
+	extent list[3];
+	uint32_t count = 0;
+	uint32_t mid_base = lblk;
+	if (lblk > base0) {
+		list[count++] = ext_slice(first, 0, lblk - base0);
+	} else if (k0 > 0) {
+		extent prev = *chain_ext(&c, k0 - 1);
+		if (ext_joins(prev, mid)) {
+			list[count++] = prev;
+			k0 -= 1;
+		}
+	}
+	if (count > 0 && ext_joins(list[count - 1], mid)) {
+		mid_base = lblk - extent_blocks(fs, list[count - 1]);
+		list[count - 1].len += len;
+	} else {
+		list[count++] = mid;
+	}
+	uint32_t mid_at = k0 + count - 1;
+
+	uint32_t tail = lblk + len - base1;
+	uint32_t last_len = extent_blocks(fs, last);
+	if (tail < last_len) {
+		extent rest = ext_slice(last, tail, last_len - tail);
+		if (ext_joins(list[count - 1], rest)) {
+			list[count - 1].len += last_len - tail;
+		} else {
+			list[count++] = rest;
+		}
+	} else if (k1 < n->n_ext) {
+		extent next = *chain_ext(&c, k1);
+		if (ext_joins(mid, next)) {
+			list[count - 1].len += extent_blocks(fs, next);
+			k1 += 1;
+		}
+	}
+
+	int rv = splice(&c, k0, k1, list, count);
+	if (rv == 0) {
+		n->holes += (ext_hole(mid) ? len : 0) - was;
+		*pos = (ext_pos){ mid_at, mid_base, mid_at >= N_DIRECT ? c.blk[(mid_at - N_DIRECT) / c.per] : 0 };
+	}
+	chain_free(&c);
+	return rv;
+}
+
+// Points logical blocks [lblk, lblk + len) of n, cutting into no
+// compressed cluster, at the run of blocks from start. A longer map may
+// need a block for the chain, -ENOSPC leaves n as it was. The blocks no
+// longer mapped stay in use, the caller frees them. pos is where the
+// lookup starts, and is left at the extent holding lblk.
+int inode_replace(super_blk* fs, inode* n, uint32_t lblk, uint32_t len, uint32_t start, ext_pos* pos) {
+	return replace_range(fs, n, lblk, (extent){ start, len }, pos);
+}
+
+// Turns logical blocks [lblk, lblk + len) of n into a hole, like
+// inode_replace
+int inode_punch(super_blk* fs, inode* n, uint32_t lblk, uint32_t len, ext_pos* pos) {
+	return replace_range(fs, n, lblk, (extent){ 0, EXT_HOLE | len }, pos);
+}
@@ -0,0 +1,77 @@
+#ifndef NUFS_EXTENT_H
+#define NUFS_EXTENT_H
+
+#include "data.h"
+
+// Extents past the N_DIRECT kept in the inode live in a chain of
+// blocks laid out like this.
+typedef struct extent_blk {
+	uint32_t next;  // next block of the chain, valid while more extents follow
+	uint32_t count; // extents used in this block
+	extent ext[];
+} extent_blk;
+
+// Files flagged is_compressed keep their data in clusters of this many
+// bytes, each of which is either plain blocks or one compressed extent
+#define CLUSTER_SIZE (64 << 10)
+
+// Set in the len of an extent holding one cluster compressed, the rest
+// of len is the blocks it takes on disk. It stands for a whole cluster.
+#define EXT_COMPRESSED (1u << 31)
+
+// Set in the len of an extent standing for a hole, blocks of the file
+// never written that read as zeros. The rest of len is the blocks of
+// the file it covers, start is 0 and it takes none on disk. Files stay
+// shorter than EXT_HOLE blocks, so one extent holds any hole.
+#define EXT_HOLE (1u << 30)
+
+// First block of a compressed extent, the compressed bytes follow
+typedef struct cluster_hdr {
+	uint32_t bytes;
+	uint32_t pad;
+} cluster_hdr;
+
+static inline bool ext_compressed(extent e) {
+	return (e.len & EXT_COMPRESSED) != 0;
+}
+
+static inline bool ext_hole(extent e) {
+	return (e.len & EXT_HOLE) != 0;
+}
+
+// Blocks the extent takes on disk
+static inline uint32_t ext_phys(extent e) {
+	return ext_hole(e) ? 0 : e.len & ~EXT_COMPRESSED;
+}
+
+// Where a walk through the map of an inode stands: extent k, which
+// starts at logical block base, in chain block blk once k >= N_DIRECT.
+// Lookups given one carry on from there instead of from the inode, it
+// is good until the map changes.
+typedef struct ext_pos {
+	uint32_t k;
+	uint32_t base;
+	uint32_t blk;
+} ext_pos;
+
+#define EXT_POS_START ((ext_pos){ 0, 0, 0 })
+
+uint32_t cluster_blks(const super_blk* fs);
+uint32_t extent_blocks(const super_blk* fs, extent e);
+extent inode_find(const super_blk* fs, const inode* n, uint32_t lblk, ext_pos* pos);
+extent inode_extent_at(const super_blk* fs, const inode* n, uint32_t k, ext_pos* pos);
+ext_pos inode_pos(const super_blk* fs, const inode* n, uint32_t k, uint32_t base);
+int inode_map_at(const super_blk* fs, const inode* n, uint32_t lblk, uint32_t* run, ext_pos* pos);
+int inode_map(const super_blk* fs, const inode* n, uint32_t lblk, uint32_t* run);
+int inode_grow(super_blk* fs, inode* n, uint32_t n_blocks);
+int inode_append(super_blk* fs, inode* n, uint32_t start, uint32_t len);
+int inode_append_hole(super_blk* fs, inode* n, uint32_t len);
+int inode_copy_map(super_blk* fs, inode* to, const inode* from);
+void inode_shrink(super_blk* fs, inode* n, uint32_t n_blocks);
+extent inode_extent(const super_blk* fs, const inode* n, uint32_t k);
+void inode_remap(super_blk* fs, inode* n, uint32_t k0, uint32_t k1, uint32_t start);
+int inode_splice(super_blk* fs, inode* n, uint32_t k0, uint32_t k1, const extent* list, uint32_t count);
+int inode_replace(super_blk* fs, inode* n, uint32_t lblk, uint32_t len, uint32_t start, ext_pos* pos);
+int inode_punch(super_blk* fs, inode* n, uint32_t lblk, uint32_t len, ext_pos* pos);
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "index.h"
+
+// FNV-1a, seeded so a parent id can be folded into a name hash
+uint64_t hindex_hash_mix(uint64_t seed, const char* key, size_t len) {
+	uint64_t h = seed;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+uint64_t hindex_hash(const char* key, size_t len) {
+	return hindex_hash_mix(0xcbf29ce484222325ULL, key, len);
+}
+
+static void alloc_slots(hindex* ix, size_t cap) {
+	ix->slots = malloc(cap * sizeof(hentry));
+	assert(ix->slots != NULL);
+	for (size_t i = 0; i < cap; i++) {
+		ix->slots[i].hash = 0;
+		ix->slots[i].val = HINDEX_EMPTY;
+	}
+	ix->cap = cap;
+	ix->used = 0;
+	ix->tombs = 0;
+}
+
+void hindex_init(hindex* ix, size_t hint) {
+	size_t cap = 16;
+	while (cap < hint * 2) {
+		cap <<= 1;
+	}
+	alloc_slots(ix, cap);
+}
+
+void hindex_free(hindex* ix) {
+	free(ix->slots);
+	ix->slots = NULL;
+	ix->cap = 0;
+	ix->used = 0;
+	ix->tombs = 0;
+}
+
+static void place(hindex* ix, uint64_t hash, int val) {
+	size_t mask = ix->cap - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		if (ix->slots[i].val < 0) {
+			if (ix->slots[i].val == HINDEX_TOMB) {
+				ix->tombs -= 1;
+			}
+			ix->slots[i].hash = hash;
+			ix->slots[i].val = val;
+			ix->used += 1;
+			return;
+		}
+	}
+}
+
+// Rebuild at a size that keeps the load factor under 1/2
+static void rehash(hindex* ix) {
+	hentry* old = ix->slots;
+	size_t old_cap = ix->cap;
+
+	size_t cap = old_cap;
+	while (cap < (ix->used + 1) * 4) {
+		cap <<= 1;
+	}
+	alloc_slots(ix, cap);
+
+	for (size_t i = 0; i < old_cap; i++) {
+		if (old[i].val >= 0) {
+			place(ix, old[i].hash, old[i].val);
+		}
+	}
+	free(old);
+}
+
+void hindex_insert(hindex* ix, uint64_t hash, int val) {
+	assert(val >= 0);
+	if ((ix->used + ix->tombs + 1) * 2 > ix->cap) {
+		rehash(ix);
+	}
+	place(ix, hash, val);
+}
+
+int hindex_remove(hindex* ix, uint64_t hash, int val) {
+	size_t mask = ix->cap - 1;
+	for (size_t i = hash & mask; ix->slots[i].val != HINDEX_EMPTY; i = (i + 1) & mask) {
+		if (ix->slots[i].val == val && ix->slots[i].hash == hash) {
+			ix->slots[i].val = HINDEX_TOMB;
+			ix->used -= 1;
+			ix->tombs += 1;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Returns the first value with this hash that match() accepts, or -1
+int hindex_find(const hindex* ix, uint64_t hash, hindex_match_t match, const void* ctx) {
+	size_t mask = ix->cap - 1;
+	for (size_t i = hash & mask; ix->slots[i].val != HINDEX_EMPTY; i = (i + 1) & mask) {
+		const hentry* e = &ix->slots[i];
+		if (e->val >= 0 && e->hash == hash && match(e->val, ctx)) {
+			return e->val;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,37 @@
+#ifndef NUFS_INDEX_H
+#define NUFS_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// In-memory open addressing hash index, hash -> int.
+// The index only stores hashes, callers confirm a hit
+// against the real key through the match callback.
+
+#define HINDEX_EMPTY (-1)
+#define HINDEX_TOMB  (-2)
+
+typedef struct hentry {
+	uint64_t hash;
+	int val;
+} hentry;
+
+typedef struct hindex {
+	hentry* slots;
+	size_t cap;   // always a power of two
+	size_t used;  // live entries
+	size_t tombs; // removed entries still occupying a slot
+} hindex;
+
+typedef int (*hindex_match_t)(int val, const void* ctx);
+
+uint64_t hindex_hash(const char* key, size_t len);
+uint64_t hindex_hash_mix(uint64_t seed, const char* key, size_t len);
+
+void hindex_init(hindex* ix, size_t hint);
+void hindex_free(hindex* ix);
+void hindex_insert(hindex* ix, uint64_t hash, int val);
+int hindex_remove(hindex* ix, uint64_t hash, int val);
+int hindex_find(const hindex* ix, uint64_t hash, hindex_match_t match, const void* ctx);
+
+#endif
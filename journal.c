@@ -0,0 +1,907 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "data.h"
+#include "journal.h"
+
+// Write-ahead journal for the metadata: the header, block bitmap and
+// inode table at the front of the image, plus the dirent pages and
+// extent blocks out in the data region.
+//
+// Operations are bracketed by journal_begin/journal_end and call
+// journal_dirty on whatever metadata they change. That only marks 64
+// byte lines of the image dirty in the running transaction. Every
+// JOURNAL_COMMIT_MS, or sooner once enough has piled up, the commit
+// thread waits for the operations in flight to end, copies the dirty
+// lines out as they stand, and lets the next transaction start. The
+// copy goes to the journal region with one synchronous write, however
+// many operations it covers, and nobody waits for it except
+// journal_flush.
+//
+// The front of the image is mapped private (see journal_open), so the
+// copy in the file only changes at a checkpoint, which writes back the
+// lines the journal holds and starts the journal over. The data region
+// stays shared, a dirent page may reach the disk ahead of its commit;
+// mount drops entries that point nowhere. After a crash journal_replay
+// writes every complete record back before the image is mapped.
+//
+// Blocks of dirent pages and extent blocks that are freed are revoked,
+// older lines logged for them are not replayed over whatever the
+// block holds next.
+
+#define JOURNAL_MAGIC 0x4c4e524a5346554eULL // "NUFSJRNL"
+#define JREC_MAGIC 0x4345524a               // "JREC"
+
+#define JOURNAL_COMMIT_MS 25
+#define JLINE 64
+
+// First page of the journal region, records follow it
+typedef struct jhdr {
+	uint64_t magic;
+	uint32_t epoch; // bumped each time the journal starts over
+	uint32_t _pad;
+} jhdr;
+
+// One commit: n_revokes jrevoke, then n_lines jline
+typedef struct jrec {
+	uint32_t magic;
+	uint32_t epoch;
+	uint64_t seq; // 1, 2, ... within an epoch
+	uint32_t n_revokes;
+	uint32_t n_lines;
+	uint32_t crc; // crc32c of the record with this field zero
+	uint32_t _pad;
+} jrec;
+
+typedef struct jrevoke {
+	uint64_t off; // byte range of the image
+	uint64_t len;
+} jrevoke;
+
+typedef struct jline {
+	uint64_t off;
+	char data[JLINE];
+} jline;
+
+// Set of line numbers, open addressing. Slots hold the line plus one,
+// 0 is empty and TOMB a removed entry.
+#define TOMB UINT64_MAX
+
+typedef struct line_set {
+	uint64_t* slots;
+	size_t cap;  // power of two
+	size_t used; // live entries and tombstones
+	size_t live;
+} line_set;
+
+static void set_init(line_set* s, size_t cap) {
+	s->slots = calloc(cap, sizeof(uint64_t));
+	assert(s->slots != NULL);
+	s->cap = cap;
+	s->used = 0;
+	s->live = 0;
+}
+
+static void set_free(line_set* s) {
+	free(s->slots);
+	s->slots = NULL;
+	s->cap = 0;
+}
+
+static size_t set_slot(const line_set* s, uint64_t key) {
+	return (key * 0x9e3779b97f4a7c15ULL) >> 17 & (s->cap - 1);
+}
+
+static void set_add(line_set* s, uint64_t line);
+
+static void set_resize(line_set* s, size_t cap) {
+	line_set old = *s;
+	set_init(s, cap);
+	for (size_t i = 0; i < old.cap; i++) {
+		if (old.slots[i] != 0 && old.slots[i] != TOMB) {
+			set_add(s, old.slots[i] - 1);
+		}
+	}
+	set_free(&old);
+}
+
+static void set_add(line_set* s, uint64_t line) {
+	if ((s->used + 1) * 2 > s->cap) {
+		set_resize(s, s->live * 4 > s->cap ? s->cap * 2 : s->cap);
+	}
+
+	uint64_t key = line + 1;
+	size_t i = set_slot(s, key);
+	size_t tomb = SIZE_MAX;
+	while (s->slots[i] != 0) {
+		if (s->slots[i] == key) {
+			return;
+		}
+		if (s->slots[i] == TOMB && tomb == SIZE_MAX) {
+			tomb = i;
+		}
+		i = (i + 1) & (s->cap - 1);
+	}
+	if (tomb != SIZE_MAX) {
+		i = tomb;
+	} else {
+		s->used += 1;
+	}
+	s->slots[i] = key;
+	s->live += 1;
+}
+
+static bool set_has(const line_set* s, uint64_t line) {
+	uint64_t key = line + 1;
+	for (size_t i = set_slot(s, key); s->slots[i] != 0; i = (i + 1) & (s->cap - 1)) {
+		if (s->slots[i] == key) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void set_remove(line_set* s, uint64_t line) {
+	uint64_t key = line + 1;
+	for (size_t i = set_slot(s, key); s->slots[i] != 0; i = (i + 1) & (s->cap - 1)) {
+		if (s->slots[i] == key) {
+			s->slots[i] = TOMB;
+			s->live -= 1;
+			return;
+		}
+	}
+}
+
+// Empties the set, shrinking it again after a burst so clearing and
+// walking it stays in proportion to what it held
+static void set_clear(line_set* s) {
+	size_t cap = s->cap;
+	while (cap > 4096 && s->live * 8 < cap) {
+		cap /= 2;
+	}
+	if (cap != s->cap) {
+		set_free(s);
+		set_init(s, cap);
+		return;
+	}
+	memset(s->slots, 0, s->cap * sizeof(uint64_t));
+	s->used = 0;
+	s->live = 0;
+}
+
+// crc32c, eight bytes a step through eight tables or with the SSE 4.2
+// instruction where there is one
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_update)(uint32_t crc, const unsigned char* p, size_t len);
+
+static uint32_t crc_sw(uint32_t crc, const unsigned char* p, size_t len) {
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		w ^= crc;
+		crc = crc_table[7][w & 0xff] ^ crc_table[6][(w >> 8) & 0xff]
+			^ crc_table[5][(w >> 16) & 0xff] ^ crc_table[4][(w >> 24) & 0xff]
+			^ crc_table[3][(w >> 32) & 0xff] ^ crc_table[2][(w >> 40) & 0xff]
+			^ crc_table[1][(w >> 48) & 0xff] ^ crc_table[0][w >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char* p, size_t len) {
+	uint64_t c = crc;
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		c = __builtin_ia32_crc32di(c, w);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		c = __builtin_ia32_crc32qi(c, *p++);
+	}
+	return c;
+}
+#endif
+
+static void crc_init(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		}
+		crc_table[0][i] = c;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int t = 1; t < 8; t++) {
+			uint32_t c = crc_table[t - 1][i];
+			crc_table[t][i] = crc_table[0][c & 0xff] ^ (c >> 8);
+		}
+	}
+
+	crc_update = crc_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc_update = crc_hw;
+	}
+#endif
+}
+
+// Also checks the superblock of a cleanly closed image, see fs_checksum
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len) {
+	pthread_once(&crc_once, crc_init);
+	return ~crc_update(~crc, buf, len);
+}
+
+static size_t rec_size(const jrec* r) {
+	return sizeof(jrec) + r->n_revokes * sizeof(jrevoke) + (size_t)r->n_lines * sizeof(jline);
+}
+
+// Length of the run of valid records of epoch at the start of buf.
+// Checksums are only checked when verify is set.
+static size_t scan_records(const char* buf, size_t len, uint32_t epoch, bool verify) {
+	size_t at = 0;
+	for (uint64_t seq = 1; len - at >= sizeof(jrec); seq++) {
+		jrec r;
+		memcpy(&r, buf + at, sizeof(jrec));
+		if (r.magic != JREC_MAGIC || r.epoch != epoch || r.seq != seq
+		    || r.n_revokes > len || r.n_lines > len || rec_size(&r) > len - at) {
+			break;
+		}
+
+		if (verify) {
+			uint32_t crc = r.crc;
+			r.crc = 0;
+			uint32_t c = crc32c(0, &r, sizeof(jrec));
+			c = crc32c(c, buf + at + sizeof(jrec), rec_size(&r) - sizeof(jrec));
+			if (c != crc) {
+				break;
+			}
+		}
+		at += rec_size(&r);
+	}
+	return at;
+}
+
+static jline* rec_lines(const char* rec) {
+	const jrec* r = (const jrec*)rec;
+	return (jline*)(rec + sizeof(jrec) + r->n_revokes * sizeof(jrevoke));
+}
+
+// Marks lines of the data region that a later record revoked, walking
+// the records newest first. A revoke does not cover lines logged in its
+// own record, those were dirtied after the block was freed.
+static void drop_revoked(char* buf, size_t len, size_t data_offset) {
+	size_t n = 0;
+	for (size_t at = 0; at < len; at += rec_size((jrec*)(buf + at))) {
+		n++;
+	}
+	char** recs = malloc(n * sizeof(char*));
+	assert(recs != NULL);
+	n = 0;
+	for (size_t at = 0; at < len; at += rec_size((jrec*)(buf + at))) {
+		recs[n++] = buf + at;
+	}
+
+	line_set revoked;
+	set_init(&revoked, 1024);
+	while (n-- > 0) {
+		const jrec* r = (const jrec*)recs[n];
+		jline* lines = rec_lines(recs[n]);
+		for (uint32_t i = 0; i < r->n_lines && revoked.live > 0; i++) {
+			if (lines[i].off >= data_offset && set_has(&revoked, lines[i].off / JLINE)) {
+				lines[i].off = UINT64_MAX;
+			}
+		}
+
+		const jrevoke* rv = (const jrevoke*)(recs[n] + sizeof(jrec));
+		for (uint32_t i = 0; i < r->n_revokes; i++) {
+			for (uint64_t off = rv[i].off; off < rv[i].off + rv[i].len; off += JLINE) {
+				set_add(&revoked, off / JLINE);
+			}
+		}
+	}
+	set_free(&revoked);
+	free(recs);
+}
+
+// Writes the lines of the records in buf to the image, runs of adjacent
+// lines with one call. Only lines before limit are written.
+static int apply_records(int fd, const char* buf, size_t len, size_t limit) {
+	struct iovec iov[IOV_MAX];
+	for (size_t at = 0; at < len; at += rec_size((const jrec*)(buf + at))) {
+		const jrec* r = (const jrec*)(buf + at);
+		const jline* lines = rec_lines(buf + at);
+		for (uint32_t i = 0; i < r->n_lines; ) {
+			uint64_t off = lines[i].off;
+			if (off >= limit) {
+				i++;
+				continue;
+			}
+
+			int n = 0;
+			do {
+				iov[n].iov_base = (void*)lines[i].data;
+				iov[n].iov_len = JLINE;
+				n++;
+				i++;
+			} while (i < r->n_lines && n < IOV_MAX && lines[i].off == off + n * JLINE && lines[i].off < limit);
+
+			if (pwritev(fd, iov, n, off) != n * JLINE) {
+				return -EIO;
+			}
+		}
+	}
+	return 0;
+}
+
+static int write_header(int fd, size_t offset, uint32_t epoch) {
+	jhdr h = { JOURNAL_MAGIC, epoch, 0 };
+	return pwrite(fd, &h, sizeof(h), offset) == sizeof(h) ? 0 : -EIO;
+}
+
+static int read_header(int fd, size_t offset, jhdr* h) {
+	if (pread(fd, h, sizeof(*h), offset) != sizeof(*h) || h->magic != JOURNAL_MAGIC) {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+// Reads the valid records among the first len bytes after the journal
+// header at offset into *buf
+static size_t read_records(int fd, size_t offset, size_t len, uint32_t epoch, bool verify, char** buf) {
+	*buf = malloc(len > 0 ? len : 1);
+	assert(*buf != NULL);
+	ssize_t got = pread(fd, *buf, len, offset + PAGE_SIZE);
+	return got > 0 ? scan_records(*buf, got, epoch, verify) : 0;
+}
+
+// An empty journal for a new image, its blocks allocated up front so
+// commits never wait on the backing filesystem to find room
+int journal_format(int fd, size_t offset, size_t size) {
+	int rv = posix_fallocate(fd, offset, size);
+	if (rv != 0 && rv != EOPNOTSUPP && rv != EINVAL) {
+		return -rv;
+	}
+	return write_header(fd, offset, 1);
+}
+
+// Brings the image up to the last commit that made it to disk. Runs at
+// mount, before anything is mapped.
+int journal_replay(int fd, const super_blk* hdr) {
+	if (hdr->journal_size == 0) {
+		return 0;
+	}
+
+	jhdr h;
+	if (read_header(fd, hdr->journal_offset, &h) != 0) {
+		return -EINVAL;
+	}
+
+	char* buf;
+	size_t len = read_records(fd, hdr->journal_offset, hdr->journal_size - PAGE_SIZE, h.epoch, true, &buf);
+	int rv = 0;
+	if (len > 0) {
+		drop_revoked(buf, len, hdr->data.data_offset);
+		rv = apply_records(fd, buf, len, UINT64_MAX);
+		if (rv == 0 && fdatasync(fd) != 0) {
+			rv = -errno;
+		}
+		if (rv == 0) {
+			rv = write_header(fd, hdr->journal_offset, h.epoch + 1);
+		}
+		if (rv == 0 && fdatasync(fd) != 0) {
+			rv = -errno;
+		}
+	}
+	free(buf);
+	return rv;
+}
+
+// The mounted image
+static char* base;
+static size_t map_len;
+static size_t head_len;    // [0, head_len) is mapped private
+static size_t j_offset;    // the journal region
+static size_t j_size;
+static int image_fd = -1;  // for checkpoints
+static int log_fd = -1;    // same file, O_DSYNC, for commits
+static bool active;
+
+// Only the commit thread touches these once started
+static uint32_t epoch;
+static uint64_t seq;
+static size_t tail;        // where the next record goes, from j_offset
+static size_t rec_max;     // largest record, half the space for them
+static bool failed;
+
+// The running transaction, under j_mutex
+static pthread_mutex_t j_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t open_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static line_set dirty;
+static jrevoke* revokes;
+static size_t n_revokes, cap_revokes;
+static extent* frees;       // blocks the running transaction let go of
+static size_t n_frees, cap_frees;
+static extent* released;    // and those of committed ones
+static size_t n_released, cap_released;
+static atomic_size_t n_ready;
+static size_t wake_lines;   // commit early past this many dirty lines
+static uint64_t running;    // id of the running transaction
+static uint64_t committed;  // last one on disk
+static bool flush_wanted;
+static bool stopping;
+static bool threaded;       // commit_thread runs, see journal_run
+static pthread_t commit_thread;
+
+// Operations between journal_begin and journal_end, and whether the
+// commit thread is waiting for them to finish
+static atomic_long handles;
+static atomic_bool closing;
+static __thread int depth;
+
+// Lines an operation dirtied, handed to the running transaction in one
+// go when it ends (or fills up) so the mutex is taken once per operation
+#define LOCAL_LINES 64
+static __thread uint64_t local[LOCAL_LINES];
+static __thread int n_local;
+
+// Called with j_mutex held
+static void push_local(void) {
+	for (int i = 0; i < n_local; i++) {
+		set_add(&dirty, local[i]);
+	}
+	n_local = 0;
+}
+
+static void push_local_wake(void) {
+	pthread_mutex_lock(&j_mutex);
+	push_local();
+	bool wake = dirty.live >= wake_lines;
+	pthread_mutex_unlock(&j_mutex);
+
+	if (wake) {
+		pthread_cond_signal(&wake_cond);
+	}
+}
+
+void journal_begin(void) {
+	if (!active || depth++ > 0) {
+		return;
+	}
+
+	for (;;) {
+		atomic_fetch_add(&handles, 1);
+		if (!atomic_load(&closing)) {
+			return;
+		}
+
+		// A commit is copying the last transaction out, wait for it
+		pthread_mutex_lock(&j_mutex);
+		if (atomic_fetch_sub(&handles, 1) == 1) {
+			pthread_cond_signal(&drained_cond);
+		}
+		while (atomic_load(&closing)) {
+			pthread_cond_wait(&open_cond, &j_mutex);
+		}
+		pthread_mutex_unlock(&j_mutex);
+	}
+}
+
+void journal_end(void) {
+	if (!active || --depth > 0) {
+		return;
+	}
+
+	if (n_local > 0) {
+		push_local_wake();
+	}
+	if (atomic_fetch_sub(&handles, 1) == 1 && atomic_load(&closing)) {
+		pthread_mutex_lock(&j_mutex);
+		pthread_cond_signal(&drained_cond);
+		pthread_mutex_unlock(&j_mutex);
+	}
+}
+
+// Adds [ptr, ptr + len) to the running transaction. Anything outside the
+// mapped image is ignored.
+void journal_dirty(const void* ptr, size_t len) {
+	const char* p = ptr;
+	if (!active || p < base || p >= base + map_len || len == 0) {
+		return;
+	}
+	assert(depth > 0);
+
+	uint64_t first = (p - base) / JLINE;
+	uint64_t last = (p - base + len - 1) / JLINE;
+	for (uint64_t line = first; line <= last; line++) {
+		// An operation logs the same inode a few times over
+		bool seen = false;
+		for (int i = n_local - 1; i >= 0 && !seen; i--) {
+			seen = local[i] == line;
+		}
+		if (seen) {
+			continue;
+		}
+		if (n_local == LOCAL_LINES) {
+			push_local_wake();
+		}
+		local[n_local++] = line;
+	}
+}
+
+// [ptr, ptr + len) of the data region no longer holds metadata
+void journal_revoke(const void* ptr, size_t len) {
+	const char* p = ptr;
+	if (!active || p < base || p >= base + map_len || len == 0) {
+		return;
+	}
+	assert(depth > 0);
+
+	uint64_t first = (p - base) / JLINE;
+	uint64_t end = (p - base + len) / JLINE;
+	int kept = 0;
+	for (int i = 0; i < n_local; i++) {
+		if (local[i] < first || local[i] >= end) {
+			local[kept++] = local[i];
+		}
+	}
+	n_local = kept;
+
+	pthread_mutex_lock(&j_mutex);
+	for (uint64_t line = first; line < end; line++) {
+		set_remove(&dirty, line);
+	}
+	if (n_revokes == cap_revokes) {
+		cap_revokes = cap_revokes ? cap_revokes * 2 : 64;
+		revokes = realloc(revokes, cap_revokes * sizeof(jrevoke));
+		assert(revokes != NULL);
+	}
+	revokes[n_revokes].off = p - base;
+	revokes[n_revokes].len = len;
+	n_revokes++;
+	pthread_mutex_unlock(&j_mutex);
+}
+
+static void push_extent(extent** list, size_t* n, size_t* cap, size_t start, size_t len) {
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		*list = realloc(*list, *cap * sizeof(extent));
+		assert(*list != NULL);
+	}
+	(*list)[*n].start = start;
+	(*list)[*n].len = len;
+	*n += 1;
+}
+
+// Blocks [start, start + len) are unused once the running transaction
+// commits, but until then the image on disk may still point at them.
+// They are handed to journal_take_released after that commit.
+void journal_free_later(size_t start, size_t len) {
+	pthread_mutex_lock(&j_mutex);
+	if (active) {
+		assert(depth > 0);
+		push_extent(&frees, &n_frees, &cap_frees, start, len);
+	} else {
+		push_extent(&released, &n_released, &cap_released, start, len);
+		atomic_store(&n_ready, n_released);
+	}
+	pthread_mutex_unlock(&j_mutex);
+}
+
+// Takes the blocks whose frees are on disk, returns how many runs are
+// in *out (the caller frees the array)
+size_t journal_take_released(extent** out) {
+	if (atomic_load(&n_ready) == 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&j_mutex);
+	size_t n = n_released;
+	*out = released;
+	released = NULL;
+	n_released = cap_released = 0;
+	atomic_store(&n_ready, 0);
+	pthread_mutex_unlock(&j_mutex);
+	return n;
+}
+
+// Writes the head lines the journal holds to the file and starts the
+// journal over. Lines out in the data region are in the shared mapping
+// already, the fdatasync takes them along.
+static void checkpoint(void) {
+	// Written by this mount, no need to check them again
+	char* buf;
+	size_t len = read_records(log_fd, j_offset, tail - PAGE_SIZE, epoch, false, &buf);
+	int rv = apply_records(image_fd, buf, len, head_len);
+	free(buf);
+
+	if (rv == 0 && fdatasync(image_fd) != 0) {
+		rv = -errno;
+	}
+	if (rv == 0) {
+		rv = write_header(log_fd, j_offset, epoch + 1);
+	}
+	if (rv != 0) {
+		if (!failed) {
+			fprintf(stderr, "nufs: journal checkpoint failed, metadata is no longer safe on disk\n");
+		}
+		failed = true;
+		return;
+	}
+
+	epoch += 1;
+	seq = 0;
+	tail = PAGE_SIZE;
+}
+
+static int cmp_line(const void* a, const void* b) {
+	uint64_t x = ((const jline*)a)->off;
+	uint64_t y = ((const jline*)b)->off;
+	return x < y ? -1 : x > y;
+}
+
+// Writes a transaction as one record, or as several when it is too
+// large for one (it is then no longer all or nothing)
+static void write_transaction(jline* lines, size_t n_lines, const jrevoke* rv, size_t n_rv) {
+	qsort(lines, n_lines, sizeof(jline), cmp_line);
+
+	size_t l = 0, r = 0;
+	do {
+		jrec h = { JREC_MAGIC, 0, 0, 0, 0, 0, 0 };
+		size_t room = rec_max - sizeof(jrec);
+		h.n_revokes = n_rv - r < room / sizeof(jrevoke) ? n_rv - r : room / sizeof(jrevoke);
+		room -= h.n_revokes * sizeof(jrevoke);
+		h.n_lines = n_lines - l < room / sizeof(jline) ? n_lines - l : room / sizeof(jline);
+
+		if (tail + rec_size(&h) > j_size) {
+			checkpoint();
+		}
+		h.epoch = epoch;
+		h.seq = ++seq;
+
+		struct iovec iov[3] = {
+			{ &h, sizeof(jrec) },
+			{ (void*)(rv + r), h.n_revokes * sizeof(jrevoke) },
+			{ lines + l, h.n_lines * sizeof(jline) },
+		};
+		uint32_t c = crc32c(0, &h, sizeof(jrec));
+		c = crc32c(c, iov[1].iov_base, iov[1].iov_len);
+		h.crc = crc32c(c, iov[2].iov_base, iov[2].iov_len);
+
+		if (pwritev(log_fd, iov, 3, j_offset + tail) != (ssize_t)rec_size(&h)) {
+			if (!failed) {
+				fprintf(stderr, "nufs: journal write failed, metadata is no longer safe on disk\n");
+			}
+			failed = true;
+		}
+		tail += rec_size(&h);
+		r += h.n_revokes;
+		l += h.n_lines;
+	} while (r < n_rv || l < n_lines);
+
+	if (tail - PAGE_SIZE > (j_size - PAGE_SIZE) / 2) {
+		checkpoint();
+	}
+}
+
+// Copies 8 bytes at a time, a reader may be storing an atime meanwhile
+static void copy_line(jline* out, uint64_t line) {
+	const uint64_t* src = (const uint64_t*)(base + line * JLINE);
+	uint64_t* dst = (uint64_t*)out->data;
+	for (int i = 0; i < JLINE / 8; i++) {
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	}
+	out->off = line * JLINE;
+}
+
+// Closes the running transaction and writes it out. Called with j_mutex
+// held, drops it around the write.
+static void commit_locked(void) {
+	uint64_t id = running++;
+	if (dirty.live == 0 && n_revokes == 0 && n_frees == 0) {
+		committed = id;
+		pthread_cond_broadcast(&done_cond);
+		return;
+	}
+
+	atomic_store(&closing, true);
+	while (atomic_load(&handles) > 0) {
+		pthread_cond_wait(&drained_cond, &j_mutex);
+	}
+
+	// Nothing is changing the image now, take the lines as they are
+	size_t n_lines = dirty.live;
+	jline* lines = malloc(n_lines * sizeof(jline));
+	assert(lines != NULL);
+	size_t k = 0;
+	for (size_t i = 0; i < dirty.cap; i++) {
+		if (dirty.slots[i] != 0 && dirty.slots[i] != TOMB) {
+			copy_line(&lines[k++], dirty.slots[i] - 1);
+		}
+	}
+	set_clear(&dirty);
+	jrevoke* rv = revokes;
+	size_t n_rv = n_revokes;
+	revokes = NULL;
+	n_revokes = cap_revokes = 0;
+	extent* fr = frees;
+	size_t n_fr = n_frees;
+	frees = NULL;
+	n_frees = cap_frees = 0;
+
+	atomic_store(&closing, false);
+	pthread_cond_broadcast(&open_cond);
+	pthread_mutex_unlock(&j_mutex);
+
+	write_transaction(lines, n_lines, rv, n_rv);
+	free(lines);
+	free(rv);
+
+	pthread_mutex_lock(&j_mutex);
+	// Kept in use for good if the commit did not make it to disk
+	for (size_t i = 0; i < n_fr && !failed; i++) {
+		push_extent(&released, &n_released, &cap_released, fr[i].start, fr[i].len);
+	}
+	atomic_store(&n_ready, n_released);
+	free(fr);
+	committed = id;
+	pthread_cond_broadcast(&done_cond);
+}
+
+static void* commit_main(void* arg) {
+	(void) arg;
+	pthread_mutex_lock(&j_mutex);
+	while (!stopping) {
+		if (!flush_wanted && dirty.live < wake_lines) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec += 1;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&wake_cond, &j_mutex, &ts);
+		}
+		flush_wanted = false;
+		commit_locked();
+	}
+	commit_locked();
+	pthread_mutex_unlock(&j_mutex);
+	return NULL;
+}
+
+// Waits until every operation that ended before the call is on disk
+int journal_flush(void) {
+	if (!active) {
+		return 0;
+	}
+	assert(depth == 0);
+
+	pthread_mutex_lock(&j_mutex);
+	uint64_t want = running;
+	if (!threaded) {
+		commit_locked();
+	}
+	flush_wanted = true;
+	pthread_cond_signal(&wake_cond);
+	while (committed < want) {
+		pthread_cond_wait(&done_cond, &j_mutex);
+	}
+	pthread_mutex_unlock(&j_mutex);
+	return failed ? -EIO : 0;
+}
+
+// Sets up journaling of the image mapped at fs. The front of the image,
+// up to the journal, is remapped private so changes to it stay in memory
+// until a checkpoint has their commit to write back. Nothing commits on
+// its own until journal_run starts the commit thread.
+int journal_open(super_blk* fs, const char* path, int fd) {
+	if (fs->journal_size == 0) {
+		return 0;
+	}
+
+	jhdr h;
+	if (read_header(fd, fs->journal_offset, &h) != 0) {
+		return -EINVAL;
+	}
+
+	log_fd = open(path, O_RDWR | O_DSYNC);
+	if (log_fd == -1) {
+		return -errno;
+	}
+
+	base = (char*)fs;
+	head_len = fs->journal_offset;
+	map_len = fs->data.data_offset + fs->max_blks * fs->data.blk_sz;
+	if (mmap(base, head_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		int rv = -errno;
+		close(log_fd);
+		log_fd = -1;
+		return rv;
+	}
+
+	j_offset = fs->journal_offset;
+	j_size = fs->journal_size;
+	image_fd = fd;
+	epoch = h.epoch;
+	seq = 0;
+	tail = PAGE_SIZE;
+	rec_max = (j_size - PAGE_SIZE) / 2;
+	failed = false;
+
+	set_init(&dirty, 4096);
+	wake_lines = rec_max / sizeof(jline) / 2;
+	running = 1;
+	committed = 0;
+	flush_wanted = false;
+	stopping = false;
+	active = true;
+	return 0;
+}
+
+// Starts the commit thread, in the process that is going to keep it
+void journal_run(void) {
+	if (!active || threaded) {
+		return;
+	}
+	threaded = true;
+	assert(pthread_create(&commit_thread, NULL, commit_main, NULL) == 0);
+}
+
+// Commits what is left and checkpoints, the image on disk is then
+// complete without the journal. Fails if some checkpoint did.
+int journal_stop(void) {
+	if (!active) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&j_mutex);
+	stopping = true;
+	pthread_cond_signal(&wake_cond);
+	if (!threaded) {
+		commit_locked();
+	}
+	pthread_mutex_unlock(&j_mutex);
+	if (threaded) {
+		pthread_join(commit_thread, NULL);
+		threaded = false;
+	}
+
+	checkpoint();
+	active = false;
+	set_free(&dirty);
+	free(revokes);
+	revokes = NULL;
+	n_revokes = cap_revokes = 0;
+	// close_fs took the released blocks before stopping
+	free(released);
+	released = NULL;
+	n_released = cap_released = 0;
+	atomic_store(&n_ready, 0);
+	close(log_fd);
+	log_fd = -1;
+	image_fd = -1;
+	return failed ? -EIO : 0;
+}
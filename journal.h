@@ -0,0 +1,28 @@
+#ifndef NUFS_JOURNAL_H
+#define NUFS_JOURNAL_H
+
+#include "data.h"
+
+// Default size of the journal region, mkfs.nufs -j to pick another
+#define JOURNAL_DEFAULT_SIZE (8 << 20)
+
+// Smallest journal worth having, 0 makes an image without one
+#define JOURNAL_MIN_SIZE (64 << 10)
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+int journal_format(int fd, size_t offset, size_t size);
+int journal_replay(int fd, const super_blk* hdr);
+int journal_open(super_blk* fs, const char* path, int image_fd);
+void journal_run(void);
+int journal_stop(void);
+
+void journal_begin(void);
+void journal_end(void);
+void journal_dirty(const void* ptr, size_t len);
+void journal_revoke(const void* ptr, size_t len);
+void journal_free_later(size_t start, size_t len);
+size_t journal_take_released(extent** out);
+int journal_flush(void);
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+// Copies in 16 byte steps and may write up to 15 bytes past dst + n
+static void wild_copy(uint8_t* dst, const uint8_t* src, size_t n) {
+	uint8_t* end = dst + n;
+	do {
+		memcpy(dst, src, 16);
+		dst += 16;
+		src += 16;
+	} while (dst < end);
+}
+
+// The LZ4 block format: a run of sequences, each a token byte (literal
+// count in the high nibble, match length - 4 in the low one), more
+// length bytes when a nibble is 15, the literals, then a two byte
+// little endian offset back to the match and more match length bytes.
+// The last sequence is literals only. Matches are found greedily with
+// one hash table slot per 4 byte prefix; the search steps faster the
+// longer it goes without a match, so data that does not compress is
+// given up on quickly.
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+#define MF_LIMIT 12    // no match starts this close to the end
+#define LAST_LITERALS 5 // and none runs into the last this many bytes
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t read64(const uint8_t* p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+	return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static uint8_t* put_len(uint8_t* op, size_t n) {
+	while (n >= 255) {
+		*op++ = 255;
+		n -= 255;
+	}
+	*op++ = n;
+	return op;
+}
+
+// Appends a sequence, returns NULL if it does not fit before oend
+static uint8_t* put_seq(uint8_t* op, uint8_t* oend, const uint8_t* lit, size_t n_lit, size_t offset, size_t mlen) {
+	size_t worst = 1 + n_lit / 255 + 1 + n_lit + (offset ? 2 + mlen / 255 + 1 : 0);
+	if (worst > (size_t)(oend - op)) {
+		return NULL;
+	}
+
+	uint8_t* token = op++;
+	*token = (n_lit < 15 ? n_lit : 15) << 4;
+	if (n_lit >= 15) {
+		op = put_len(op, n_lit - 15);
+	}
+	memcpy(op, lit, n_lit);
+	op += n_lit;
+
+	if (offset) {
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		mlen -= MIN_MATCH;
+		*token |= mlen < 15 ? mlen : 15;
+		if (mlen >= 15) {
+			op = put_len(op, mlen - 15);
+		}
+	}
+	return op;
+}
+
+int lz_compress(const void* src_, int len, void* dst_, int cap) {
+	const uint8_t* src = src_;
+	const uint8_t* iend = src + len;
+	const uint8_t* anchor = src;
+	uint8_t* dst = dst_;
+	uint8_t* op = dst;
+	uint8_t* oend = dst + cap;
+
+	if (len > MF_LIMIT) {
+		uint32_t table[1 << HASH_LOG];
+		memset(table, 0, sizeof(table));
+		const uint8_t* mf_limit = iend - MF_LIMIT;
+		const uint8_t* match_limit = iend - LAST_LITERALS;
+
+		const uint8_t* ip = src + 1;
+		while (ip < mf_limit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = hash4(seq);
+			const uint8_t* ref = src + table[h];
+			table[h] = ip - src;
+			if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			// Eight bytes at a time, the first that differs ends it
+			const uint8_t* end = ip + MIN_MATCH;
+			const uint8_t* r = ref + MIN_MATCH;
+			while (end + 8 <= match_limit) {
+				uint64_t diff = read64(end) ^ read64(r);
+				if (diff) {
+					end += __builtin_ctzll(diff) / 8;
+					goto matched;
+				}
+				end += 8;
+				r += 8;
+			}
+			while (end < match_limit && *end == *r) {
+				end++;
+				r++;
+			}
+matched:
+
+			op = put_seq(op, oend, anchor, ip - anchor, ip - ref, end - ip);
+			if (op == NULL) {
+				return 0;
+			}
+			anchor = ip = end;
+			if (ip - 2 > src) {
+				table[hash4(read32(ip - 2))] = ip - 2 - src;
+			}
+		}
+	}
+
+	op = put_seq(op, oend, anchor, iend - anchor, 0, 0);
+	return op ? op - dst : 0;
+}
+
+static int get_len(const uint8_t** ip, const uint8_t* iend, size_t* n) {
+	uint8_t b;
+	do {
+		if (*ip >= iend) {
+			return -1;
+		}
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+	return 0;
+}
+
+int lz_decompress(const void* src_, int len, void* dst_, int cap) {
+	const uint8_t* ip = src_;
+	const uint8_t* iend = ip + len;
+	uint8_t* dst = dst_;
+	uint8_t* op = dst;
+	uint8_t* oend = dst + cap;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t n_lit = token >> 4;
+		if (n_lit == 15 && get_len(&ip, iend, &n_lit) != 0) {
+			return -1;
+		}
+		if (n_lit > (size_t)(iend - ip) || n_lit > (size_t)(oend - op)) {
+			return -1;
+		}
+		if (n_lit + 16 <= (size_t)(iend - ip) && n_lit + 16 <= (size_t)(oend - op)) {
+			wild_copy(op, ip, n_lit);
+		} else {
+			memcpy(op, ip, n_lit);
+		}
+		op += n_lit;
+		ip += n_lit;
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+		size_t offset = ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		size_t mlen = token & 15;
+		if (mlen == 15 && get_len(&ip, iend, &mlen) != 0) {
+			return -1;
+		}
+		mlen += MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(op - dst) || mlen > (size_t)(oend - op)) {
+			return -1;
+		}
+
+		const uint8_t* m = op - offset;
+		if (offset >= 16 && mlen + 16 <= (size_t)(oend - op)) {
+			wild_copy(op, m, mlen);
+		} else if (offset >= mlen) {
+			memcpy(op, m, mlen);
+		} else {
+			// Overlapping, the match repeats the last offset bytes
+			for (size_t i = 0; i < mlen; i++) {
+				op[i] = m[i];
+			}
+		}
+		op += mlen;
+	}
+	return op - dst;
+}
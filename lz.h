@@ -0,0 +1,14 @@
+#ifndef NUFS_LZ_H
+#define NUFS_LZ_H
+
+// Byte-oriented LZ77 in the LZ4 block format, see lz.c
+
+// Compresses len bytes of src into dst. Returns the compressed size, or
+// 0 when it would not fit in cap bytes.
+int lz_compress(const void* src, int len, void* dst, int cap);
+
+// Expands len compressed bytes of src into dst. Returns the size, or -1
+// for input that is corrupt or would not fit in cap bytes.
+int lz_decompress(const void* src, int len, void* dst, int cap);
+
+#endif
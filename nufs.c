@@ -1,174 +1,836 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
-#include <dirent.h>
-#include <bsd/string.h>
+#include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <linux/fs.h>
 
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
+#define FUSE_USE_VERSION 34
+#include <fuse_lowlevel.h>
 
 #include "data.h"
+#include "trace.h"
+#include "writeback.h"
+#include "defrag.h"
+#include "dedup.h"
 
 static super_blk* fs;
+static struct fuse_session* session;
+
+// How long the kernel may keep names and attributes without asking
+// again. Every change goes through this daemon, which answers from the
+// same table, so a second is about reuse and not about correctness.
+// In cache mode (NUFS_CACHE=1) the kernel keeps them, and file pages
+// across opens, until the engine invalidates them; it also buffers
+// writes itself.
+#define ENTRY_TIMEOUT 1.0
+#define ATTR_TIMEOUT 1.0
+#define CACHE_TIMEOUT 86400.0
+
+static bool cache_mode;
+static double entry_timeout = ENTRY_TIMEOUT;
+static double attr_timeout = ATTR_TIMEOUT;
+
+// Largest write the kernel may send in one request
+#define MAX_WRITE (1 << 20)
+
+// The low-level API addresses everything by inode number. Slot n of
+// the inode table is inode n + 1, so the kernel's root (1) is slot 0.
+
+static void fill_entry(struct fuse_entry_param* ep, const fs_entry* e) {
+	memset(ep, 0, sizeof(struct fuse_entry_param));
+	ep->ino = NUFS_INO(e->inum);
+	ep->generation = e->generation;
+	ep->attr = e->st;
+	ep->attr_timeout = attr_timeout;
+	ep->entry_timeout = entry_timeout;
+}
+
+// Every entry handed out was counted as a lookup, one the kernel never
+// got (the request was interrupted) has to be dropped again
+static void reply_entry(fuse_req_t req, int rv, const fs_entry* e) {
+	if (rv < 0) {
+		fuse_reply_err(req, -rv);
+		return;
+	}
+
+	struct fuse_entry_param ep;
+	fill_entry(&ep, e);
+	if (fuse_reply_entry(req, &ep) != 0) {
+		fs_forget(fs, e->inum, 1);
+	}
+}
+
+// Resolves one name inside a directory, the kernel caches the result
+// and does the walk from the root itself
+void
+nufs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	TRACE_BEGIN();
+	fs_entry e;
+	int rv = fs_lookup(fs, NUFS_INUM(parent), name, &e);
+	TRACE_END(TRACE_OPS, EV_LOOKUP, rv, parent, name, NULL, 0, 0);
+	reply_entry(req, rv, &e);
+}
+
+// The kernel dropped nlookup of the entries it got for ino
+void
+nufs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	TRACE_BEGIN();
+	fs_forget(fs, NUFS_INUM(ino), nlookup);
+	TRACE_END(TRACE_OPS, EV_FORGET, 0, ino, NULL, NULL, nlookup, 0);
+	fuse_reply_none(req);
+}
+
+void
+nufs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets)
+{
+	for (size_t i = 0; i < count; i++) {
+		TRACE_BEGIN();
+		fs_forget(fs, NUFS_INUM(forgets[i].ino), forgets[i].nlookup);
+		TRACE_END(TRACE_OPS, EV_FORGET, 0, forgets[i].ino, NULL, NULL, forgets[i].nlookup, 0);
+	}
+	fuse_reply_none(req);
+}
 
 // implementation for: man 2 access
 // Checks if a file exists.
-int
-nufs_access(const char *path, int mask)
+void
+nufs_access(fuse_req_t req, fuse_ino_t ino, int mask)
 {
-	printf("access(%s, %04o)\n", path, mask);
-	return fs_access(fs, path, mask);
+	TRACE_BEGIN();
+	int rv = fs_access_ino(fs, NUFS_INUM(ino), mask);
+	TRACE_END(TRACE_OPS, EV_ACCESS, rv, ino, NULL, NULL, mask, 0);
+	fuse_reply_err(req, -rv);
 }
 
 // implementation for: man 2 stat
 // gets an object's attributes (type, permissions, size, etc)
-int
-nufs_getattr(const char *path, struct stat *st)
+void
+nufs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+        TRACE_BEGIN();
+        struct stat st;
+        int rv = fs_getattr_ino(fs, NUFS_INUM(ino), &st);
+        TRACE_END(TRACE_OPS, EV_GETATTR, rv, ino, NULL, NULL, 0, 0);
+        if (rv < 0) {
+                fuse_reply_err(req, -rv);
+        } else {
+                fuse_reply_attr(req, &st, attr_timeout);
+        }
+}
+
+// chmod, truncate and utimens all arrive here
+void
+nufs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi)
 {
-        printf("getattr(%s)\n", path);
-        return fs_getattr(fs, path, st);
+        TRACE_BEGIN();
+        // Owners are not stored, everything belongs to whoever mounted it
+        int rv = (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) ? -ENOSYS : 0;
+
+        int set = 0;
+        set |= (to_set & FUSE_SET_ATTR_MODE) ? FS_SET_MODE : 0;
+        set |= (to_set & FUSE_SET_ATTR_SIZE) ? FS_SET_SIZE : 0;
+        set |= (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_ATIME_NOW)) ? FS_SET_ATIME : 0;
+        set |= (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)) ? FS_SET_MTIME : 0;
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+                clock_gettime(CLOCK_REALTIME, &attr->st_atim);
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+                clock_gettime(CLOCK_REALTIME, &attr->st_mtim);
+        }
+
+        struct stat st;
+        if (rv == 0) {
+                rv = fs_setattr_ino(fs, NUFS_INUM(ino), attr, set, &st);
+        }
+        TRACE_END(TRACE_OPS, EV_SETATTR, rv, ino, NULL, NULL, to_set, attr->st_size);
+        if (rv < 0) {
+                fuse_reply_err(req, -rv);
+        } else {
+                fuse_reply_attr(req, &st, attr_timeout);
+        }
+}
+
+typedef struct dir_buf {
+        fuse_req_t req;
+        char* buf;
+        size_t size;
+        size_t used;
+        int* listed; // readdirplus: entries counted as lookups
+        size_t n_listed;
+} dir_buf;
+
+static int add_dirent(void* ctx, const char* name, const struct stat* st, off_t off)
+{
+        dir_buf* db = ctx;
+        size_t len = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used, name, st, off);
+        if (len > db->size - db->used) {
+                return 1;
+        }
+        db->used += len;
+        return 0;
 }
 
 // implementation for: man 2 readdir
-// lists the contents of a directory
-int
-nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-             off_t offset, struct fuse_file_info *fi)
+// lists the contents of a directory, as much as fits in size bytes
+// starting after entry off
+void
+nufs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi)
+{
+        TRACE_BEGIN();
+        dir_buf db = { req, malloc(size), size, 0, NULL, 0 };
+        int rv = db.buf ? fs_readdir_ino(fs, NUFS_INUM(ino), off, add_dirent, &db) : -ENOMEM;
+        TRACE_END(TRACE_OPS, EV_READDIR, rv, ino, NULL, NULL, off, 0);
+        if (rv < 0) {
+                fuse_reply_err(req, -rv);
+        } else {
+                fuse_reply_buf(req, db.buf, db.used);
+        }
+        free(db.buf);
+}
+
+static int add_direntry_plus(void* ctx, const char* name, const fs_entry* e, off_t off)
+{
+        dir_buf* db = ctx;
+        struct fuse_entry_param ep;
+        fill_entry(&ep, e);
+        size_t len = fuse_add_direntry_plus(db->req, db->buf + db->used, db->size - db->used, name, &ep, off);
+        if (len > db->size - db->used) {
+                return 1;
+        }
+        db->used += len;
+        if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+                db->listed[db->n_listed++] = e->inum;
+        }
+        return 0;
+}
+
+// readdir with the attributes of every entry, so ls -l costs one round
+// trip per page instead of a lookup and a getattr per name. Each entry
+// sent counts as a lookup the kernel will forget.
+void
+nufs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi)
 {
-        printf("readdir(%s)\n", path);
-        return fs_readdir(fs, path, buf, filler, offset, fi);
+        TRACE_BEGIN();
+        // An entry takes more than 128 bytes of the reply
+        dir_buf db = { req, malloc(size), size, 0, malloc((size / 128 + 1) * sizeof(int)), 0 };
+        int rv = db.buf && db.listed ? fs_readdirplus_ino(fs, NUFS_INUM(ino), off, add_direntry_plus, &db) : -ENOMEM;
+        TRACE_END(TRACE_OPS, EV_READDIRPLUS, rv, ino, NULL, NULL, off, 0);
+        if (rv < 0) {
+                fuse_reply_err(req, -rv);
+        } else if (fuse_reply_buf(req, db.buf, db.used) != 0) {
+                // The kernel never got them, as with reply_entry
+                for (size_t i = 0; i < db.n_listed; i++) {
+                        fs_forget(fs, db.listed[i], 1);
+                }
+        }
+        free(db.listed);
+        free(db.buf);
 }
 
 // mknod makes a filesystem object like a file or directory
 // called for: man 2 open, man 2 link
-int
-nufs_mknod(const char *path, mode_t mode, dev_t rdev)
+void
+nufs_mknod(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, dev_t rdev)
 {
-        printf("mknod(%s, %04o)\n", path, mode);
-        return fs_mknod(fs, path, mode, rdev);
+        TRACE_BEGIN();
+        fs_entry e;
+        int rv = fs_mknod_at(fs, NUFS_INUM(parent), name, mode, &e);
+        TRACE_END(TRACE_OPS, EV_MKNOD, rv, parent, name, NULL, mode, 0);
+        reply_entry(req, rv, &e);
 }
 
 // most of the following callbacks implement
 // another system call; see section 2 of the manual
-int
-nufs_mkdir(const char *path, mode_t mode)
+void
+nufs_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
 {
-        printf("mkdir(%s)\n", path);
-        return -1;
+        TRACE_BEGIN();
+        fs_entry e;
+        int rv = fs_mkdir_at(fs, NUFS_INUM(parent), name, mode, &e);
+        TRACE_END(TRACE_OPS, EV_MKDIR, rv, parent, name, NULL, mode, 0);
+        reply_entry(req, rv, &e);
 }
 
-int
-nufs_unlink(const char *path)
+// open(O_CREAT) in one round trip instead of mknod, lookup and open
+void
+nufs_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, struct fuse_file_info* fi)
 {
-        printf("unlink(%s)\n", path);
-        return fs_unlink(fs, path);
+        TRACE_BEGIN();
+        fs_entry e;
+        int rv = fs_mknod_at(fs, NUFS_INUM(parent), name, mode, &e);
+        TRACE_END(TRACE_OPS, EV_CREATE, rv, parent, name, NULL, mode, 0);
+        if (rv < 0) {
+                fuse_reply_err(req, -rv);
+                return;
+        }
+
+        struct fuse_entry_param ep;
+        fill_entry(&ep, &e);
+        fi->keep_cache = cache_mode;
+        if (fuse_reply_create(req, &ep, fi) != 0) {
+                fs_forget(fs, e.inum, 1);
+        }
 }
 
-int
-nufs_rmdir(const char *path)
+void
+nufs_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
 {
-        printf("rmdir(%s)\n", path);
-        return -1;
+        TRACE_BEGIN();
+        int rv = fs_unlink_at(fs, NUFS_INUM(parent), name);
+        TRACE_END(TRACE_OPS, EV_UNLINK, rv, parent, name, NULL, 0, 0);
+        fuse_reply_err(req, -rv);
+}
+
+void
+nufs_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+        TRACE_BEGIN();
+        int rv = fs_rmdir_at(fs, NUFS_INUM(parent), name);
+        TRACE_END(TRACE_OPS, EV_RMDIR, rv, parent, name, NULL, 0, 0);
+        fuse_reply_err(req, -rv);
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
-int
-nufs_rename(const char *from, const char *to)
+void
+nufs_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+            fuse_ino_t newparent, const char* newname, unsigned int flags)
 {
-        printf("rename(%s => %s)\n", from, to);
-        return fs_rename(fs, from, to);
+        TRACE_BEGIN();
+        int rv = fs_rename_at(fs, NUFS_INUM(parent), name, NUFS_INUM(newparent), newname, flags);
+        TRACE_END(TRACE_OPS, EV_RENAME, rv, parent, name, newname, newparent, flags);
+        fuse_reply_err(req, -rv);
 }
 
-int
-nufs_chmod(const char *path, mode_t mode)
+void
+nufs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname)
 {
-        printf("chmod(%s, %04o)\n", path, mode);
-        return fs_chmod(fs, path, mode);
+	TRACE_BEGIN();
+	fs_entry e;
+	int rv = fs_link_at(fs, NUFS_INUM(ino), NUFS_INUM(newparent), newname, &e);
+	TRACE_END(TRACE_OPS, EV_LINK, rv, newparent, newname, NULL, ino, 0);
+	reply_entry(req, rv, &e);
 }
 
-int
-nufs_truncate(const char *path, off_t size)
+// this is called on open, but doesn't need to do much
+// since the kernel's lookup already keeps the inode alive
+// for as long as the file is open. In cache mode the pages the
+// kernel has stay valid, the engine invalidates them on a change.
+// Reads then come from the kernel filling those pages, for writes
+// too, so whether the file may be read is settled here.
+void
+nufs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
-        printf("truncate(%s, %ld bytes)\n", path, size);
-        return fs_truncate(fs, path, size);
+        TRACE_BEGIN();
+        int rv = 0;
+        if (cache_mode && (fi->flags & O_ACCMODE) != O_WRONLY) {
+                rv = fs_access_ino(fs, NUFS_INUM(ino), R_OK);
+        }
+        TRACE_END(TRACE_OPS, EV_OPEN, rv, ino, NULL, NULL, fi->flags, 0);
+        if (rv < 0) {
+                fuse_reply_err(req, -rv);
+                return;
+        }
+        fi->keep_cache = cache_mode;
+        fuse_reply_open(req, fi);
 }
 
-// this is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-int
-nufs_open(const char *path, struct fuse_file_info *fi)
+// Actually read data, straight from the mapped image into the reply.
+// The spans go out with one writev on /dev/fuse, so the kernel's copy
+// into the reader's pages is the only one.
+void
+nufs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
 {
-        printf("open(%s)\n", path);
-        return 0;
+        TRACE_BEGIN();
+        int n_iov = fs_max_spans(fs, size);
+        struct iovec* iov = malloc(n_iov * sizeof(struct iovec));
+        int rv = iov ? fs_read_begin(fs, NUFS_INUM(ino), size, offset, cache_mode, iov, &n_iov) : -ENOMEM;
+        TRACE_END(TRACE_IO, EV_READ, rv, ino, NULL, NULL, size, offset);
+        if (rv < 0) {
+                fuse_reply_err(req, -rv);
+        } else {
+                fuse_reply_iov(req, iov, n_iov);
+                fs_read_end(fs, NUFS_INUM(ino));
+        }
+        free(iov);
 }
 
-// Actually read data
-int
-nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Actually write data. With splice the request body is still sitting in
+// a pipe here and is read from it right into the file's blocks.
+void
+nufs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* bufv, off_t offset, struct fuse_file_info* fi)
 {
-        printf("read(%s, %ld bytes, @%ld)\n", path, size, offset);
-        return fs_read(fs, path, buf, size, offset, fi);
+        TRACE_BEGIN();
+        size_t size = fuse_buf_size(bufv);
+        int n_iov = fs_max_spans(fs, size);
+        struct iovec* iov = malloc(n_iov * sizeof(struct iovec));
+        struct fuse_bufvec* dst = malloc(sizeof(struct fuse_bufvec) + n_iov * sizeof(struct fuse_buf));
+        int rv = iov && dst ? fs_write_begin(fs, NUFS_INUM(ino), size, offset, iov, &n_iov) : -ENOMEM;
+        if (rv >= 0) {
+                memset(dst, 0, sizeof(struct fuse_bufvec));
+                dst->count = n_iov;
+                for (int i = 0; i < n_iov; i++) {
+                        dst->buf[i] = (struct fuse_buf) { .size = iov[i].iov_len, .mem = iov[i].iov_base, .fd = -1 };
+                }
+
+                ssize_t got = fuse_buf_copy(dst, bufv, 0);
+                fs_write_end(fs, NUFS_INUM(ino), offset, got < 0 ? 0 : got);
+                rv = got;
+        }
+        TRACE_END(TRACE_IO, EV_WRITE, rv, ino, NULL, NULL, size, offset);
+        if (rv < 0) {
+                fuse_reply_err(req, -rv);
+        } else {
+                fuse_reply_write(req, rv);
+        }
+        free(dst);
+        free(iov);
 }
 
-// Actually write data
-int
-nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// A copy inside the image: whole blocks are shared with the source
+// rather than copied, so cp of a large file costs its extent map. The
+// clone ioctls (FICLONE, cp --reflink=always) never get here, the
+// kernel only offers them to filesystems of its own; cp falls back to
+// copy_file_range by itself.
+void
+nufs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info* fi_in,
+                     fuse_ino_t ino_out, off_t off_out, struct fuse_file_info* fi_out, size_t len, int flags)
 {
-        printf("write(%s, %ld bytes, @%ld)\n", path, size, offset);
-        return fs_write(fs, path, buf, size, offset, fi);
+        TRACE_BEGIN();
+        int rv = flags != 0 ? -EINVAL : fs_copy_range(fs, NUFS_INUM(ino_in), off_in, NUFS_INUM(ino_out), off_out, len);
+        TRACE_END(TRACE_IO, EV_COPY, rv, ino_in, NULL, NULL, len, ino_out);
+        if (rv < 0) {
+                fuse_reply_err(req, -rv);
+        } else {
+                fuse_reply_write(req, rv);
+        }
 }
 
-// Update the timestamps on a file or directory.
-int
-nufs_utimens(const char* path, const struct timespec ts[2])
+// Preallocation and hole punching, see fs_fallocate_ino
+void
+nufs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info* fi)
 {
-	int rv = fs_utimens(fs, path, ts);
-	printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n",
-	       path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
-	return rv;
+        TRACE_BEGIN();
+        int rv = fs_fallocate_ino(fs, NUFS_INUM(ino), mode, offset, length);
+        TRACE_END(TRACE_IO, EV_FALLOCATE, rv, ino, NULL, NULL, mode, length);
+        fuse_reply_err(req, -rv);
 }
 
-int
-nufs_link(const char* src, const char* dst) {
-	printf("link(%s, %s)\n", src, dst);
-	return fs_link(fs, src, dst);
-}
-
-void
-nufs_init_ops(struct fuse_operations* ops)
-{
-        memset(ops, 0, sizeof(struct fuse_operations));
-        ops->access   = nufs_access;
-        ops->getattr  = nufs_getattr;
-        ops->readdir  = nufs_readdir;
-        ops->mknod    = nufs_mknod;
-        ops->mkdir    = nufs_mkdir;
-        ops->unlink   = nufs_unlink;
-        ops->rmdir    = nufs_rmdir;
-        ops->rename   = nufs_rename;
-        ops->chmod    = nufs_chmod;
-        ops->truncate = nufs_truncate;
-        ops->open	  = nufs_open;
-        ops->read     = nufs_read;
-        ops->write    = nufs_write;
-        ops->utimens  = nufs_utimens;
-        ops->link     = nufs_link;
+// SEEK_DATA and SEEK_HOLE, so cp and tar skip the holes of a sparse file
+void
+nufs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info* fi)
+{
+        TRACE_BEGIN();
+        off_t rv = fs_lseek_ino(fs, NUFS_INUM(ino), off, whence);
+        TRACE_END(TRACE_IO, EV_LSEEK, rv < 0 ? (int)rv : 0, ino, NULL, NULL, whence, off);
+        if (rv < 0) {
+                fuse_reply_err(req, (int)-rv);
+        } else {
+                fuse_reply_lseek(req, rv);
+        }
+}
+
+// Writes back the pages this file dirtied, not the whole image, then
+// waits for the journal to commit the metadata
+void
+nufs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi)
+{
+        TRACE_BEGIN();
+        int rv = fs_fsync_ino(fs, NUFS_INUM(ino));
+        TRACE_END(TRACE_OPS, EV_FSYNC, rv, ino, NULL, NULL, datasync, 0);
+        fuse_reply_err(req, -rv);
+}
+
+// A directory is all metadata, this only waits for the journal
+void
+nufs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi)
+{
+        TRACE_BEGIN();
+        int rv = fs_fsync_ino(fs, NUFS_INUM(ino));
+        TRACE_END(TRACE_OPS, EV_FSYNCDIR, rv, ino, NULL, NULL, datasync, 0);
+        fuse_reply_err(req, -rv);
+}
+
+// Nothing is buffered per open file, writes are in the image by the
+// time they are answered. Closing does not write anything back, that is
+// what fsync is for.
+void
+nufs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+        TRACE_BEGIN();
+        TRACE_END(TRACE_OPS, EV_FLUSH, 0, ino, NULL, NULL, 0, 0);
+        fuse_reply_err(req, 0);
+}
+
+void
+nufs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+        TRACE_BEGIN();
+        TRACE_END(TRACE_OPS, EV_RELEASE, 0, ino, NULL, NULL, 0, 0);
+        fuse_reply_err(req, 0);
+}
+
+void
+nufs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+        TRACE_BEGIN();
+        struct statvfs st;
+        int rv = fs_statfs(fs, &st);
+        TRACE_END(TRACE_OPS, EV_STATFS, rv, ino, NULL, NULL, 0, 0);
+        if (rv < 0) {
+                fuse_reply_err(req, -rv);
+        } else {
+                fuse_reply_statfs(req, &st);
+        }
+}
+
+// lsattr and chattr. Compression (FS_COMPR_FL, chattr +c) is the only
+// attribute nufs keeps, the others are dropped.
+void
+nufs_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void* arg, struct fuse_file_info* fi,
+           unsigned flags, const void* in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+        TRACE_BEGIN();
+        unsigned fl = 0;
+        uint32_t attr = 0;
+        int rv;
+        switch ((unsigned int)cmd) {
+        case FS_IOC_GETFLAGS:
+                rv = fs_getflags_ino(fs, NUFS_INUM(ino), &fl);
+                attr = fl & FS_FL_COMPRESS ? FS_COMPR_FL : 0;
+                break;
+        case FS_IOC_SETFLAGS:
+                if (in_bufsz < sizeof(attr)) {
+                        rv = -EINVAL;
+                        break;
+                }
+                memcpy(&attr, in_buf, sizeof(attr));
+                rv = fs_setflags_ino(fs, NUFS_INUM(ino), attr & FS_COMPR_FL ? FS_FL_COMPRESS : 0);
+                break;
+        default:
+                rv = -ENOTTY;
+        }
+        TRACE_END(TRACE_OPS, EV_IOCTL, rv, ino, NULL, NULL, (unsigned int)cmd, attr);
+
+        // The flags are an int whatever size the command number says
+        if (rv < 0) {
+                fuse_reply_err(req, -rv);
+        } else if ((unsigned int)cmd == FS_IOC_GETFLAGS) {
+                fuse_reply_ioctl(req, 0, &attr, sizeof(attr));
+        } else {
+                fuse_reply_ioctl(req, 0, NULL, 0);
+        }
+}
+
+// Invalidations the engine asks for go out from a thread of their own.
+// Sending one from a request handler can deadlock: the kernel may hold
+// the very inode or page locks it needs to wait for that request.
+// An entry invalidation carries the name, an inode one none.
+typedef struct inval {
+        int inum;
+        off_t off;
+        off_t len;
+        char* name;
+} inval;
+
+static pthread_mutex_t inval_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static inval* inval_queue;
+static size_t n_inval, cap_inval;
+static bool inval_stopping;
+static pthread_t inval_thread;
+
+static void push_inval(inval iv)
+{
+        pthread_mutex_lock(&inval_mutex);
+        if (n_inval == cap_inval) {
+                cap_inval = cap_inval ? cap_inval * 2 : 64;
+                inval_queue = realloc(inval_queue, cap_inval * sizeof(inval));
+                assert(inval_queue != NULL);
+        }
+        inval_queue[n_inval++] = iv;
+        pthread_cond_signal(&inval_cond);
+        pthread_mutex_unlock(&inval_mutex);
+}
+
+static void queue_inval(void* ctx, int inum, off_t off, off_t len)
+{
+        push_inval((inval) { inum, off, len, NULL });
+}
+
+static void queue_inval_entry(void* ctx, int dir, const char* name)
+{
+        char* copy = strdup(name);
+        assert(copy != NULL);
+        push_inval((inval) { dir, 0, 0, copy });
+}
+
+static void* inval_main(void* arg)
+{
+        pthread_mutex_lock(&inval_mutex);
+        while (!inval_stopping) {
+                if (n_inval == 0) {
+                        pthread_cond_wait(&inval_cond, &inval_mutex);
+                        continue;
+                }
+
+                inval* batch = inval_queue;
+                size_t n = n_inval;
+                inval_queue = NULL;
+                n_inval = cap_inval = 0;
+                pthread_mutex_unlock(&inval_mutex);
+
+                // -ENOENT only means the kernel has nothing cached for it
+                for (size_t i = 0; i < n; i++) {
+                        inval* iv = &batch[i];
+                        if (iv->name) {
+                                fuse_lowlevel_notify_inval_entry(session, NUFS_INO(iv->inum), iv->name, strlen(iv->name));
+                                free(iv->name);
+                        } else {
+                                fuse_lowlevel_notify_inval_inode(session, NUFS_INO(iv->inum), iv->off, iv->len);
+                        }
+                }
+                free(batch);
+                pthread_mutex_lock(&inval_mutex);
+        }
+        pthread_mutex_unlock(&inval_mutex);
+        return NULL;
+}
+
+// Runs in the process that serves requests, after any daemonizing
+void
+nufs_init(void* userdata, struct fuse_conn_info* conn)
+{
+        // Let write data stay in a pipe until write_buf reads it into place
+        if (conn->capable & FUSE_CAP_SPLICE_READ) {
+                conn->want |= FUSE_CAP_SPLICE_READ;
+        }
+        // Big writes in one request, reads may overlap
+        conn->max_write = MAX_WRITE;
+        if (conn->capable & FUSE_CAP_ASYNC_READ) {
+                conn->want |= FUSE_CAP_ASYNC_READ;
+        }
+        // The kernel buffers writes and keeps pages, and drops them only
+        // when told to
+        if (cache_mode && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+                conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+        }
+        if (cache_mode && (conn->capable & FUSE_CAP_EXPLICIT_INVAL_DATA)) {
+                conn->want |= FUSE_CAP_EXPLICIT_INVAL_DATA;
+                conn->want &= ~FUSE_CAP_AUTO_INVAL_DATA;
+        }
+        // Attributes come with every listing, not only when the kernel
+        // guesses they will be wanted
+        if (conn->capable & FUSE_CAP_READDIRPLUS) {
+                conn->want |= FUSE_CAP_READDIRPLUS;
+                conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+        }
+
+        start_fs(fs);
+        inval_stopping = false;
+        assert(pthread_create(&inval_thread, NULL, inval_main, NULL) == 0);
+        fs_set_inval(queue_inval, queue_inval_entry, NULL);
+        trace_start();
+}
+
+void
+nufs_destroy(void* userdata)
+{
+        fs_set_inval(NULL, NULL, NULL);
+        pthread_mutex_lock(&inval_mutex);
+        inval_stopping = true;
+        pthread_cond_signal(&inval_cond);
+        pthread_mutex_unlock(&inval_mutex);
+        pthread_join(inval_thread, NULL);
+        for (size_t i = 0; i < n_inval; i++) {
+                free(inval_queue[i].name);
+        }
+        free(inval_queue);
+        inval_queue = NULL;
+        n_inval = cap_inval = 0;
+        trace_stop();
+}
+
+void
+nufs_init_ops(struct fuse_lowlevel_ops* ops)
+{
+        memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+        ops->lookup       = nufs_lookup;
+        ops->forget       = nufs_forget;
+        ops->forget_multi = nufs_forget_multi;
+        ops->access       = nufs_access;
+        ops->getattr      = nufs_getattr;
+        ops->setattr      = nufs_setattr;
+        ops->readdir      = nufs_readdir;
+        ops->readdirplus  = nufs_readdirplus;
+        ops->mknod        = nufs_mknod;
+        ops->mkdir        = nufs_mkdir;
+        ops->create       = nufs_create;
+        ops->unlink       = nufs_unlink;
+        ops->rmdir        = nufs_rmdir;
+        ops->rename       = nufs_rename;
+        ops->link         = nufs_link;
+        ops->open         = nufs_open;
+        ops->read         = nufs_read;
+        ops->write_buf    = nufs_write_buf;
+        ops->copy_file_range = nufs_copy_file_range;
+        ops->fallocate    = nufs_fallocate;
+        ops->lseek        = nufs_lseek;
+        ops->fsync        = nufs_fsync;
+        ops->fsyncdir     = nufs_fsyncdir;
+        ops->flush        = nufs_flush;
+        ops->release      = nufs_release;
+        ops->statfs       = nufs_statfs;
+        ops->ioctl        = nufs_ioctl;
+        ops->init         = nufs_init;
+        ops->destroy      = nufs_destroy;
 };
 
-struct fuse_operations nufs_ops;
+struct fuse_lowlevel_ops nufs_ops;
+
+// A byte count with an optional K, M or G suffix from the environment
+static size_t env_size(const char* name, size_t dflt) {
+        const char* text = getenv(name);
+        if (text == NULL || *text == '\0') {
+                return dflt;
+        }
+        char* end;
+        size_t n = strtoull(text, &end, 10);
+        switch (*end) {
+        case 'G': case 'g': n <<= 10; // fall through
+        case 'M': case 'm': n <<= 10; // fall through
+        case 'K': case 'k': n <<= 10;
+        }
+        return n;
+}
+
+// NUFS_DIRTY_BACKGROUND and NUFS_DIRTY_LIMIT (bytes), NUFS_DIRTY_EXPIRE_MS
+// and NUFS_WRITEBACK_MS override the writeback defaults
+static void writeback_env(void) {
+        wb_limits l;
+        writeback_default_limits(&l);
+        l.background = env_size("NUFS_DIRTY_BACKGROUND", l.background);
+        l.limit = env_size("NUFS_DIRTY_LIMIT", l.limit);
+        l.expire_ms = env_size("NUFS_DIRTY_EXPIRE_MS", l.expire_ms);
+        l.interval_ms = env_size("NUFS_WRITEBACK_MS", l.interval_ms);
+        if (l.limit < l.background) {
+                l.limit = l.background;
+        }
+        if (l.interval_ms == 0) {
+                l.interval_ms = 1;
+        }
+        writeback_set_limits(&l);
+}
+
+// NUFS_DEFRAG_RATE (bytes per second, 0 for none) and NUFS_DEFRAG_MS
+// override the defragmenter defaults
+static void defrag_env(void) {
+        df_limits l;
+        defrag_default_limits(&l);
+        l.rate = env_size("NUFS_DEFRAG_RATE", l.rate);
+        l.interval_ms = env_size("NUFS_DEFRAG_MS", l.interval_ms);
+        if (l.interval_ms == 0) {
+                l.interval_ms = 1;
+        }
+        defrag_set_limits(&l);
+}
+
+// NUFS_DEDUP_RATE (bytes per second, 0 for none) and NUFS_DEDUP_MS
+// turn on the deduplicator and set how often it runs
+static void dedup_env(void) {
+        dd_limits l;
+        dedup_default_limits(&l);
+        l.rate = env_size("NUFS_DEDUP_RATE", l.rate);
+        l.interval_ms = env_size("NUFS_DEDUP_MS", l.interval_ms);
+        if (l.interval_ms == 0) {
+                l.interval_ms = 1;
+        }
+        dedup_set_limits(&l);
+}
 
 int
 main(int argc, char *argv[])
 {
-        assert(argc > 2 && argc < 6);
-        fs = init_fs(argv[--argc]);
+        // The image comes last, everything before it is for FUSE
+        const char* image = NULL;
+        if (argc > 2 && argv[argc - 1][0] != '-') {
+                image = argv[--argc];
+        }
+        struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+        struct fuse_cmdline_opts opts;
+        if (fuse_parse_cmdline(&args, &opts) != 0) {
+                fuse_opt_free_args(&args);
+                return 1;
+        }
+        if (opts.show_help || opts.mountpoint == NULL || image == NULL) {
+                printf("usage: %s [options] <mountpoint> <image>\n", argv[0]);
+                if (opts.show_help) {
+                        fuse_cmdline_help();
+                        fuse_lowlevel_help();
+                }
+                free(opts.mountpoint);
+                fuse_opt_free_args(&args);
+                return opts.show_help ? 0 : 1;
+        }
+
+        writeback_env();
+        defrag_env();
+        dedup_env();
+        cache_mode = getenv("NUFS_CACHE") && atoi(getenv("NUFS_CACHE")) != 0;
+        if (cache_mode) {
+                entry_timeout = CACHE_TIMEOUT;
+                attr_timeout = CACHE_TIMEOUT;
+        }
+        // The engine's threads start in nufs_init, a fork would lose them
+        int rv = 1;
+        fs = open_fs(image);
+        if (fs == NULL) {
+                goto out_args;
+        }
+
+        trace_init(getenv("NUFS_TRACE_FILE") ? getenv("NUFS_TRACE_FILE") : "nufs.trace");
         nufs_init_ops(&nufs_ops);
-        return fuse_main(argc, argv, &nufs_ops, NULL);
-}
 
+        struct fuse_session* se = fuse_session_new(&args, &nufs_ops, sizeof(nufs_ops), NULL);
+        if (se == NULL) {
+                goto out;
+        }
+        session = se;
+        if (fuse_set_signal_handlers(se) != 0) {
+                goto out_session;
+        }
+        if (fuse_session_mount(se, opts.mountpoint) != 0) {
+                goto out_signals;
+        }
+
+        fuse_daemonize(opts.foreground);
+        if (opts.singlethread) {
+                rv = fuse_session_loop(se);
+        } else {
+                struct fuse_loop_config config = { 0 };
+                config.clone_fd = opts.clone_fd;
+                config.max_idle_threads = opts.max_idle_threads;
+                rv = fuse_session_loop_mt(se, &config);
+        }
+
+        fuse_session_unmount(se);
+out_signals:
+        fuse_remove_signal_handlers(se);
+out_session:
+        fuse_session_destroy(se);
+out:
+        close_fs(fs);
+out_args:
+        free(opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return rv ? 1 : 0;
+}
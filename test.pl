@@ -2,7 +2,7 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 28;
+use Test::Simple tests => 31;
 use IO::Handle;
 
 sub mount {
@@ -131,6 +131,16 @@ my $msg7 = read_text("foo/abc.txt");
 say "# '$msg2' eq '$msg7'?";
 ok($msg2 eq $msg7, "Read back data from copy in subdir.");
 
+system("mkdir -p mnt/foo/bar/baz");
+ok(-d "mnt/foo/bar/baz", "Made nested directories");
+
+system("rmdir mnt/foo/bar/baz");
+ok(!-e "mnt/foo/bar/baz", "Removed a directory");
+
+system("mv mnt/foo/abc.txt mnt/foo/bar/abc.txt");
+$files = `ls mnt/foo/bar`;
+ok($files =~ /abc\.txt/, "moved a file between directories");
+
 my $huge0 = "=This string is fourty characters long.=" x 1000;
 write_text("40k.txt", $huge0);
 my $huge1 = read_text("40k.txt");
@@ -0,0 +1,572 @@
+// Behaviour tests of the engine, run by make test ahead of test.pl.
+// No mount needed: each section drives data.c directly on an image of
+// its own and checks what a user of the mount would see, then the
+// image is closed and fsck.nufs has to find it clean. Crashes are a
+// forked child that exits without closing. Output is TAP, like test.pl.
+//
+//   tests/engine [fsck]   (fsck.nufs, ./fsck.nufs by default)
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "data.h"
+#include "journal.h"
+
+#define IMAGE "test-engine.nufs"
+#define MB (1 << 20)
+
+static const char* fsck_prog = "./fsck.nufs";
+static super_blk* fs;
+static int n_tests, n_failed;
+static char a[4 * MB], b[4 * MB], got[4 * MB + 1];
+
+static void ok(bool pass, const char* what) {
+	n_tests++;
+	if (!pass) {
+		n_failed++;
+	}
+	printf("%sok %d - %s\n", pass ? "" : "not ", n_tests, what);
+	fflush(stdout);
+}
+
+static void section(const char* name) {
+	printf("#           == %s ==\n", name);
+}
+
+// A fresh image of n_blks blocks, mounted
+static void fresh(size_t n_blks, bool compress) {
+	fs_geometry geo;
+	default_geometry(&geo);
+	geo.n_blks = n_blks;
+	geo.compress = compress;
+	unlink(IMAGE);
+	if (format_fs(IMAGE, &geo) != 0 || (fs = init_fs(IMAGE)) == NULL) {
+		printf("Bail out! cannot make " IMAGE "\n");
+		exit(1);
+	}
+}
+
+static void remount(void) {
+	close_fs(fs);
+	fs = init_fs(IMAGE);
+	if (fs == NULL) {
+		printf("Bail out! cannot mount " IMAGE " again\n");
+		exit(1);
+	}
+}
+
+// Runs fsck.nufs on the image, which must not be mounted, and returns
+// its exit status
+static int fsck(const char* opts) {
+	char cmd[256];
+	snprintf(cmd, sizeof(cmd), "%s %s " IMAGE " > /dev/null 2>&1", fsck_prog, opts);
+	int rv = system(cmd);
+	return WIFEXITED(rv) ? WEXITSTATUS(rv) : -1;
+}
+
+static void done(const char* what) {
+	close_fs(fs);
+	fs = NULL;
+	char msg[128];
+	snprintf(msg, sizeof(msg), "fsck finds nothing wrong after %s", what);
+	ok(fsck("") == 0, msg);
+}
+
+static int inum(const char* path) {
+	struct stat st;
+	return fs_getattr(fs, path, &st) == 0 ? NUFS_INUM(st.st_ino) : -1;
+}
+
+static struct stat stat_of(const char* path) {
+	struct stat st = { 0 };
+	fs_getattr(fs, path, &st);
+	return st;
+}
+
+static bool make(const char* path, const char* data, size_t len) {
+	return fs_mknod(fs, path, 0100644, 0) == 0
+	    && fs_write(fs, path, data, len, 0) == (int)len;
+}
+
+// The file holds exactly want[0..len)
+static bool holds(const char* path, const char* want, size_t len) {
+	memset(got, 0x55, len + 1);
+	return stat_of(path).st_size == (off_t)len
+	    && fs_read(fs, path, got, len + 1, 0) == (int)len
+	    && memcmp(got, want, len) == 0;
+}
+
+// Mounts the image in a child that runs work and dies without
+// closing it, the way a crash would leave it
+static void crash(void (*work)(void)) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		fs = init_fs(IMAGE);
+		if (fs) {
+			work();
+		}
+		_exit(fs == NULL);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("Bail out! the crashing child could not mount\n");
+		exit(1);
+	}
+}
+
+// Free data blocks. Those given up are only free once their commit is
+// checkpointed, which a remount is sure to have done.
+static size_t free_blocks(void) {
+	struct statvfs v;
+	fs_statfs(fs, &v);
+	return v.f_bfree;
+}
+
+static super_blk header(void) {
+	super_blk h = { 0 };
+	int fd = open(IMAGE, O_RDONLY);
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h)) {
+		h.magic = 0;
+	}
+	close(fd);
+	return h;
+}
+
+static void journal_work(void) {
+	fs_mknod(fs, "/new", 0100644, 0);
+	fs_write(fs, "/new", a, 3 * MB, 0);
+	fs_mkdir(fs, "/dir", 0755);
+	fs_rename(fs, "/kept", "/dir/kept");
+	journal_flush();
+}
+
+static void unlink_work(void) {
+	fs_unlink(fs, "/new");
+	journal_flush();
+}
+
+// The truncated file's blocks are only free once its commit is on disk,
+// fsync of any file forces that commit
+static void reuse_work(void) {
+	fs_truncate(fs, "/old", 0);
+	make("/reuse", a + 2 * MB, 2 * MB);
+	fs_fsync(fs, "/dir/kept");
+}
+
+static void test_journal(void) {
+	section("Journal");
+	fresh(1024, false);
+	ok(make("/kept", "before", 6), "made a file");
+	close_fs(fs);
+
+	// The child commits some changes and dies. The front of the image
+	// is mapped private, so what it committed is only in the journal
+	// until the replay at the next mount.
+	crash(journal_work);
+	ok(header().clean == 0, "image left unclean by the crash");
+
+	fs = init_fs(IMAGE);
+	ok(fs != NULL, "mounts after the crash");
+	ok(holds("/new", a, 3 * MB), "file created before the commit survives the crash");
+	ok(holds("/dir/kept", "before", 6), "rename before the commit survives the crash");
+	ok(inum("/kept") < 0, "old name is gone");
+	done("a crash");
+
+	// fsck replays a crashed image the same way
+	crash(unlink_work);
+	ok(fsck("") == 0, "fsck replays the journal of a crashed image");
+	fs = init_fs(IMAGE);
+	ok(inum("/new") < 0, "unlink before the commit is replayed by fsck");
+	ok(holds("/dir/kept", "before", 6), "the rest is kept");
+	done("fsck replayed it");
+
+	fs = init_fs(IMAGE);
+	ok(make("/old", a, 2 * MB), "made a file to truncate");
+	close_fs(fs);
+	crash(reuse_work);
+	fs = init_fs(IMAGE);
+	ok(holds("/old", a, 0), "truncate before the fsync survives the crash");
+	ok(holds("/reuse", a + 2 * MB, 2 * MB), "so does the file written after it");
+	done("a crash after blocks were freed");
+}
+
+static void test_clean(void) {
+	section("Clean flag and fsck.nufs");
+	fresh(1024, false);
+	ok(header().clean == 0, "clean flag cleared while mounted");
+	ok(fsck("") == 8, "fsck leaves a mounted image alone");
+	fs_mkdir(fs, "/d", 0755);
+	make("/d/f", "abc", 3);
+	fs_link(fs, "/d/f", "/g");
+	int f = inum("/d/f");
+	close_fs(fs);
+	super_blk h = header();
+	ok(h.clean == 1 && h.checksum == fs_checksum(&h), "clean close sets the flag and checksum");
+	ok(fsck("") == 0, "fsck passes a clean image");
+
+	// A header that does not match its checksum is not trusted
+	int fd = open(IMAGE, O_RDWR);
+	size_t n_free = h.data.n_free + 7;
+	pwrite(fd, &n_free, sizeof(n_free), offsetof(super_blk, data.n_free));
+	close(fd);
+	ok(init_fs(IMAGE) == NULL, "mount refuses a damaged header");
+	ok(fsck("") == 4, "fsck reports a damaged header");
+	ok(fsck("-r") == 1, "fsck -r repairs it");
+	ok(fsck("") == 0, "image is fine after the repair");
+
+	// A wrong link count
+	fd = open(IMAGE, O_RDWR);
+	h = header();
+	inode n;
+	off_t at = h.inode_offset + f * sizeof(inode);
+	pread(fd, &n, sizeof(n), at);
+	n.references = 5;
+	pwrite(fd, &n, sizeof(n), at);
+	h.checksum = fs_checksum(&h);
+	pwrite(fd, &h, sizeof(h), 0);
+	close(fd);
+	ok(fsck("") == 4, "fsck finds a wrong link count");
+	ok(fsck("-r") == 1, "fsck -r sets it right");
+	fs = init_fs(IMAGE);
+	ok(stat_of("/g").st_nlink == 2, "link count is the number of names again");
+	ok(holds("/g", "abc", 3), "data kept through the repair");
+	done("repairs");
+}
+
+static void fsync_work(void) {
+	fs_write(fs, "/f", a + MB, MB, MB / 2);
+	fs_truncate(fs, "/f", 2 * MB);
+	fs_fsync(fs, "/f");
+}
+
+static void test_fsync(void) {
+	section("fsync");
+	fresh(1024, false);
+	make("/f", a, MB);
+	close_fs(fs);
+
+	// Overwritten in place, synced, then a crash
+	crash(fsync_work);
+	fs = init_fs(IMAGE);
+	memcpy(b, a, MB / 2);
+	memcpy(b + MB / 2, a + MB, MB);
+	memset(b + 3 * MB / 2, 0, MB / 2);
+	ok(holds("/f", b, 2 * MB), "data and size synced by fsync survive a crash");
+	ok(fs_fsync_ino(fs, inum("/f")) == 0, "fsync by inode");
+	ok(fs_fsync(fs, "/none") == -ENOENT, "fsync of a missing file");
+	done("fsync");
+}
+
+static void test_inline(void) {
+	section("Inline files");
+	fresh(1024, false);
+	size_t free0 = free_blocks();
+	ok(make("/small", "tiny", 4), "made a small file");
+	ok(free_blocks() == free0, "a small file takes no data block");
+	ok(stat_of("/small").st_blocks == 0, "and reports none");
+	ok(fs_write(fs, "/small", "!", 1, INLINE_MAX - 1) == 1, "write up to the inline limit");
+	memset(b, 0, INLINE_MAX);
+	memcpy(b, "tiny", 4);
+	b[INLINE_MAX - 1] = '!';
+	ok(holds("/small", b, INLINE_MAX) && stat_of("/small").st_blocks == 0, "still inline, gap reads as zeros");
+	ok(fs_write(fs, "/small", "+", 1, INLINE_MAX) == 1, "write past the inline limit");
+	b[INLINE_MAX] = '+';
+	ok(holds("/small", b, INLINE_MAX + 1) && stat_of("/small").st_blocks > 0, "moved to a block, data kept");
+	ok(fs_truncate(fs, "/small", 0) == 0 && fs_write(fs, "/small", "again", 5, 0) == 5, "truncated and rewritten");
+	ok(stat_of("/small").st_blocks == 0, "inline again");
+	fs_link(fs, "/small", "/other");
+	remount();
+	ok(holds("/other", "again", 5), "inline data kept through a remount");
+	done("inline files");
+}
+
+static void test_compression(void) {
+	section("Compression");
+	fresh(4096, false);
+	for (size_t i = 0; i < 2 * MB; i++) {
+		b[i] = "compressible "[i % 13];
+	}
+	fs_mkdir(fs, "/z", 0755);
+	unsigned flags = 0;
+	ok(fs_setflags_ino(fs, inum("/z"), FS_FL_COMPRESS) == 0, "flag a directory for compression");
+	size_t free0 = free_blocks();
+	ok(make("/z/f", b, 2 * MB), "made a file in it");
+	ok(fs_getflags_ino(fs, inum("/z/f"), &flags) == 0 && (flags & FS_FL_COMPRESS), "the file inherits the flag");
+	// Compressed as it is written back, which a close finishes
+	remount();
+	ok(free0 - free_blocks() < 2 * MB / 4096 / 4, "compressed on writeback, far fewer blocks used");
+	ok(holds("/z/f", b, 2 * MB), "reads back the same");
+	ok(fs_write(fs, "/z/f", "patch", 5, MB + 3) == 5, "write into a compressed cluster");
+	memcpy(b + MB + 3, "patch", 5);
+	ok(holds("/z/f", b, 2 * MB), "reads back with the write");
+	remount();
+	ok(holds("/z/f", b, 2 * MB), "compressed data kept through a remount");
+	ok(free0 - free_blocks() < 2 * MB / 4096 / 4, "and stays compressed");
+	ok(fs_setflags_ino(fs, inum("/z/f"), 0) == 0 && make("/z/g", b, 4096), "flag cleared on the file");
+	ok(fs_getflags_ino(fs, inum("/z/g"), &flags) == 0 && (flags & FS_FL_COMPRESS), "the directory keeps its flag");
+	done("compression");
+
+	fresh(1024, true);
+	make("/f", b, 4096);
+	ok(fs_getflags_ino(fs, inum("/f"), &flags) == 0 && (flags & FS_FL_COMPRESS), "files of a compressed image are flagged");
+	done("a compressed image");
+}
+
+static void dedup(const char* path) {
+	uint32_t lblk = 0;
+	while (fs_dedup_ino(fs, inum(path), &lblk, 64, 0) > 0) {
+	}
+}
+
+static void test_dedup(void) {
+	section("Dedup");
+	fresh(4096, false);
+	make("/a", a, MB);
+	make("/b", a, MB);
+	remount();
+	size_t free0 = free_blocks();
+	dedup("/a");
+	dedup("/b");
+	remount();
+	ok(free_blocks() >= free0 + MB / 4096, "equal blocks stored once");
+	ok(holds("/a", a, MB) && holds("/b", a, MB), "both read back");
+	ok(fs_write(fs, "/b", "x", 1, 4096) == 1, "write into a shared block");
+	memcpy(b, a, MB);
+	b[4096] = 'x';
+	ok(holds("/b", b, MB) && holds("/a", a, MB), "only the written file changes");
+	fs_unlink(fs, "/a");
+	ok(holds("/b", b, MB), "the other keeps its blocks after an unlink");
+	done("dedup");
+}
+
+static void test_clone(void) {
+	section("copy_file_range and clones");
+	fresh(4096, false);
+	make("/src", a, 2 * MB);
+	fs_mknod(fs, "/dst", 0100644, 0);
+	fs_fsync(fs, "/src");
+	size_t free0 = free_blocks();
+	ok(fs_copy_range(fs, inum("/src"), 0, inum("/dst"), 0, 2 * MB) == 2 * MB, "block aligned copy");
+	fs_fsync(fs, "/dst");
+	ok(holds("/dst", a, 2 * MB), "copy reads back");
+	ok(free_blocks() + 16 > free0, "the copy shares the blocks");
+	ok(fs_write(fs, "/dst", "y", 1, 100) == 1, "write into the clone");
+	memcpy(b, a, 2 * MB);
+	b[100] = 'y';
+	ok(holds("/dst", b, 2 * MB) && holds("/src", a, 2 * MB), "the source is untouched");
+	fs_mknod(fs, "/odd", 0100644, 0);
+	ok(fs_copy_range(fs, inum("/src"), 7, inum("/odd"), 3, 100000) == 100000, "unaligned copy");
+	memset(b, 0, 3);
+	memcpy(b + 3, a + 7, 100000);
+	ok(holds("/odd", b, 100003), "unaligned copy reads back");
+	ok(fs_copy_range(fs, inum("/src"), 0, inum("/src"), MB, MB) == MB, "copy within a file");
+	memcpy(b, a, MB);
+	memcpy(b + MB, a, MB);
+	ok(holds("/src", b, 2 * MB), "reads back");
+	ok(fs_copy_range(fs, inum("/src"), 4 * MB, inum("/dst"), 0, 10) == 0, "copy from past the end is empty");
+	done("clones");
+}
+
+static void test_snapshots(void) {
+	section("Snapshots");
+	fresh(1024, false);
+	fs_mkdir(fs, "/d", 0755);
+	make("/d/f", "original", 8);
+	ok(fs_mkdir(fs, "/.snapshots/s", 0755) == 0, "took a snapshot");
+	ok(holds("/.snapshots/s/d/f", "original", 8), "it holds the file");
+	ok(fs_write(fs, "/d/f", "changed!", 8, 0) == 8, "changed the file");
+	ok(holds("/.snapshots/s/d/f", "original", 8), "snapshot keeps the old data");
+	ok(fs_write(fs, "/.snapshots/s/d/f", "x", 1, 0) == -EROFS, "no writes");
+	ok(fs_truncate(fs, "/.snapshots/s/d/f", 0) == -EROFS, "no truncate");
+	ok(fs_mknod(fs, "/.snapshots/s/d/g", 0100644, 0) == -EROFS, "no new files");
+	ok(fs_unlink(fs, "/.snapshots/s/d/f") == -EROFS, "no unlink");
+	ok(fs_rename(fs, "/.snapshots/s/d/f", "/.snapshots/s/g") == -EROFS, "no rename inside");
+	ok(fs_rename(fs, "/d/f", "/.snapshots/s/f") == -EROFS, "no rename into");
+	ok(fs_link(fs, "/d/f", "/.snapshots/s/l") == -EROFS, "no links into");
+	ok(fs_chmod(fs, "/.snapshots/s/d/f", 0600) == -EROFS, "no chmod");
+	ok(fs_fallocate_ino(fs, inum("/.snapshots/s/d/f"), 0, 0, 4096) == -EROFS, "no fallocate");
+	ok(fs_setflags_ino(fs, inum("/.snapshots/s/d/f"), FS_FL_COMPRESS) == -EROFS, "no flags");
+	ok(fs_rmdir(fs, "/.snapshots/s/d") == -EROFS, "no rmdir inside");
+	ok(fs_mknod(fs, "/.snapshots/x", 0100644, 0) == -EROFS, "only directories in /.snapshots");
+	remount();
+	ok(holds("/.snapshots/s/d/f", "original", 8), "snapshot kept through a remount");
+	ok(fs_rmdir(fs, "/.snapshots/s") == 0, "dropped the snapshot");
+	ok(holds("/d/f", "changed!", 8), "the live file stays");
+	done("snapshots");
+}
+
+static void test_holes(void) {
+	section("fallocate, punch and seek");
+	fresh(4096, false);
+	make("/f", a, 4 * MB);
+	int f = inum("/f");
+	ok(fs_fallocate_ino(fs, f, FALLOC_FL_PUNCH_HOLE, 0, 4096) == -EOPNOTSUPP, "punch needs KEEP_SIZE");
+	ok(fs_fallocate_ino(fs, f, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, MB, MB) == 0, "punched a hole");
+	memcpy(b, a, 4 * MB);
+	memset(b + MB, 0, MB);
+	ok(holds("/f", b, 4 * MB), "hole reads as zeros, size kept");
+	ok(stat_of("/f").st_blocks == (3 * MB) / 512, "its blocks are freed");
+	ok(fs_fallocate_ino(fs, f, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 10, 20) == 0, "punched inside a block");
+	memset(b + 10, 0, 20);
+	ok(holds("/f", b, 4 * MB), "zeroed in place");
+	ok(fs_lseek_ino(fs, f, 0, SEEK_HOLE) == MB, "SEEK_HOLE finds the hole");
+	ok(fs_lseek_ino(fs, f, 0, SEEK_DATA) == 0, "SEEK_DATA at data stays");
+	ok(fs_lseek_ino(fs, f, MB + 5, SEEK_DATA) == 2 * MB, "SEEK_DATA skips the hole");
+	ok(fs_lseek_ino(fs, f, 2 * MB, SEEK_HOLE) == 4 * MB, "the end is a hole");
+	ok(fs_lseek_ino(fs, f, 4 * MB, SEEK_DATA) == -ENXIO, "no data past the end");
+	ok(fs_lseek_ino(fs, f, 4 * MB, SEEK_HOLE) == -ENXIO, "nor holes");
+
+	fs_mknod(fs, "/pre", 0100644, 0);
+	int pre = inum("/pre");
+	ok(fs_fallocate_ino(fs, pre, 0, 0, 2 * MB) == 0, "fallocate");
+	ok(stat_of("/pre").st_size == 2 * MB && stat_of("/pre").st_blocks == (2 * MB) / 512, "size and blocks set");
+	memset(b, 0, 2 * MB);
+	ok(holds("/pre", b, 2 * MB), "reads as zeros");
+	ok(fs_fallocate_ino(fs, pre, FALLOC_FL_KEEP_SIZE, 2 * MB, MB) == 0, "fallocate past the end, KEEP_SIZE");
+	ok(stat_of("/pre").st_size == 2 * MB && stat_of("/pre").st_blocks == (3 * MB) / 512, "size kept, blocks taken");
+	ok(fs_fallocate_ino(fs, pre, 0, 0, 0) == -EINVAL, "empty range refused");
+	ok(fs_fallocate_ino(fs, inum("/"), 0, 0, 1) == -EISDIR, "not on a directory");
+
+	ok(fs_truncate(fs, "/pre", 0) == 0 && fs_write(fs, "/pre", "x", 1, 3 * MB) == 1, "write far past the end");
+	ok(stat_of("/pre").st_blocks == 4096 / 512, "only the written block is kept");
+	ok(fs_lseek_ino(fs, pre, 0, SEEK_DATA) == 3 * MB, "SEEK_DATA past the gap");
+	remount();
+	memcpy(b, a, 4 * MB);
+	memset(b + 10, 0, 20);
+	memset(b + MB, 0, MB);
+	ok(holds("/f", b, 4 * MB) && fs_lseek_ino(fs, inum("/f"), 0, SEEK_HOLE) == MB, "holes kept through a remount");
+	done("holes");
+}
+
+static void test_links(void) {
+	section("Link counts");
+	fresh(1024, false);
+	make("/f", "data", 4);
+	ok(stat_of("/f").st_nlink == 1, "a new file has one name");
+	ok(fs_link(fs, "/f", "/g") == 0, "linked");
+	fs_mkdir(fs, "/d", 0755);
+	ok(fs_link(fs, "/f", "/d/h") == 0, "linked in another directory");
+	ok(stat_of("/f").st_nlink == 3 && stat_of("/d/h").st_nlink == 3, "three names");
+	ok(stat_of("/f").st_ino == stat_of("/d/h").st_ino, "one inode");
+	ok(fs_link(fs, "/f", "/g") == -EEXIST, "the name is taken");
+	ok(fs_link(fs, "/d", "/e") == -EPERM, "no links to directories");
+	ok(fs_unlink(fs, "/f") == 0 && stat_of("/g").st_nlink == 2, "unlink drops the count");
+	ok(fs_rename(fs, "/g", "/d/h") == 0 && stat_of("/d/h").st_nlink == 2, "rename onto another name of it");
+	remount();
+	ok(stat_of("/d/h").st_nlink == 2 && holds("/d/h", "data", 4), "counts kept through a remount");
+	ok(fs_unlink(fs, "/d/h") == 0 && fs_unlink(fs, "/g") == 0, "unlinked both");
+	ok(inum("/g") < 0, "the file is gone");
+	done("links");
+}
+
+static int rename_at(const char* from, const char* to, unsigned flags) {
+	return fs_rename_at(fs, 0, from + 1, 0, to + 1, flags);
+}
+
+static void test_rename(void) {
+	section("Rename flags");
+	fresh(1024, false);
+	make("/a", "aaa", 3);
+	make("/b", "bbb", 3);
+	ok(rename_at("/a", "/b", RENAME_NOREPLACE) == -EEXIST, "NOREPLACE refuses a taken name");
+	ok(holds("/a", "aaa", 3) && holds("/b", "bbb", 3), "nothing changed");
+	ok(rename_at("/a", "/c", RENAME_NOREPLACE) == 0, "NOREPLACE to a free name");
+	ok(holds("/c", "aaa", 3) && inum("/a") < 0, "moved");
+	ok(rename_at("/c", "/b", RENAME_EXCHANGE) == 0, "EXCHANGE");
+	ok(holds("/c", "bbb", 3) && holds("/b", "aaa", 3), "swapped");
+	ok(rename_at("/c", "/none", RENAME_EXCHANGE) == -ENOENT, "EXCHANGE needs both names");
+	ok(rename_at("/c", "/b", RENAME_EXCHANGE | RENAME_NOREPLACE) == -EINVAL, "not both flags");
+	fs_mkdir(fs, "/d", 0755);
+	make("/d/in", "in", 2);
+	ok(rename_at("/d", "/b", RENAME_EXCHANGE) == 0, "EXCHANGE a directory and a file");
+	ok(holds("/b/in", "in", 2) && holds("/d", "aaa", 3), "swapped");
+	ok(fs_rename_at(fs, inum("/b"), "in", 0, "d", RENAME_EXCHANGE) == 0, "EXCHANGE across directories");
+	ok(holds("/d", "in", 2) && holds("/b/in", "aaa", 3), "swapped");
+	ok(rename_at("/b", "/c", 0) == -ENOTDIR, "a directory does not replace a file");
+	ok(rename_at("/c", "/b", 0) == -EISDIR, "nor a file a directory");
+	remount();
+	ok(holds("/d", "in", 2) && holds("/b/in", "aaa", 3) && holds("/c", "bbb", 3), "kept through a remount");
+	done("renames");
+}
+
+// What the engine asked to invalidate, "e<dir>/<name> " for an entry
+// and "a<inum> " for attributes
+static char inval_log[4096];
+
+static void log_inval(void* ctx, int inum, off_t off, off_t len) {
+	(void) ctx;
+	(void) len;
+	size_t at = strlen(inval_log);
+	snprintf(inval_log + at, sizeof(inval_log) - at, "%c%d ", off < 0 ? 'a' : 'd', inum);
+}
+
+static void log_inval_entry(void* ctx, int dir, const char* name) {
+	(void) ctx;
+	size_t at = strlen(inval_log);
+	snprintf(inval_log + at, sizeof(inval_log) - at, "e%d/%s ", dir, name);
+}
+
+static bool logged(const char* fmt, int n) {
+	char want[64];
+	snprintf(want, sizeof(want), fmt, n);
+	return strstr(inval_log, want) != NULL;
+}
+
+static void test_inval(void) {
+	section("Cache invalidation");
+	fresh(1024, false);
+	fs_set_inval(log_inval, log_inval_entry, NULL);
+	make("/f", "data", 4);
+	int f = inum("/f");
+	inval_log[0] = '\0';
+	ok(fs_link(fs, "/f", "/g") == 0 && logged("e%d/g ", 0) && logged("a%d ", f), "link");
+	inval_log[0] = '\0';
+	ok(fs_rename(fs, "/g", "/h") == 0 && logged("e%d/g ", 0) && logged("e%d/h ", 0) && logged("a%d ", f), "rename");
+	inval_log[0] = '\0';
+	ok(fs_unlink(fs, "/h") == 0 && logged("e%d/h ", 0) && logged("a%d ", f), "unlink");
+	inval_log[0] = '\0';
+	ok(fs_mkdir(fs, "/.snapshots/s", 0755) == 0 && logged("e%d/s ", inum("/.snapshots")), "snapshot taken");
+	int s = inum("/.snapshots/s");
+	inval_log[0] = '\0';
+	ok(fs_rmdir(fs, "/.snapshots/s") == 0 && logged("e%d/f ", s), "names in a dropped snapshot");
+	fs_set_inval(NULL, NULL, NULL);
+	done("invalidations");
+}
+
+int main(int argc, char* argv[]) {
+	if (argc > 1) {
+		fsck_prog = argv[1];
+	}
+	srand(1);
+	for (size_t i = 0; i < sizeof(a); i++) {
+		a[i] = rand();
+	}
+
+	test_journal();
+	test_clean();
+	test_fsync();
+	test_inline();
+	test_compression();
+	test_dedup();
+	test_clone();
+	test_snapshots();
+	test_holes();
+	test_links();
+	test_rename();
+	test_inval();
+
+	unlink(IMAGE);
+	printf("1..%d\n", n_tests);
+	if (n_failed) {
+		printf("# failed %d of %d\n", n_failed, n_tests);
+	}
+	return n_failed != 0;
+}
@@ -0,0 +1,467 @@
+// convert.nufs: copy a version 2, 3, 4 or 5 image into a new image in
+// the current format.
+//
+//   convert.nufs old.nufs new.nufs
+//
+// Version 2 kept 112 byte inodes with the data map in the middle and
+// found free slots by scanning the table. Version 3 had no reference
+// counts for shared blocks. All three made each hard link a slot of its
+// own pointing at the file; now it is one more entry naming the file.
+// Version 5 only lacked the clean flag in the header. The new image has
+// the same geometry, so block numbers, extents and directory pages are
+// copied as they are; the inode table is rewritten (and for version 2
+// the inode bitmap built from it), entries naming a link are pointed at
+// its file and the link slots freed. A version 5 table is copied as it
+// is. Blocks are shared only if a version 4 or 5 image shared them. The
+// old image's journal is replayed into it first.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "data.h"
+#include "directory.h"
+#include "extent.h"
+#include "journal.h"
+
+#define V2_INLINE_MAX (N_DIRECT * 8)
+
+typedef struct inode_v2 {
+	int mode;
+	int references;
+	bool is_hlink;
+	bool is_inline;
+	int link_idx;
+	union {
+		extent ext[N_DIRECT];
+		char inline_data[V2_INLINE_MAX];
+	};
+	uint32_t n_ext;
+	uint32_t indirect;
+	uint32_t n_blocks;
+	uint32_t generation;
+	time_t accessed_at;
+	time_t modified_at;
+	time_t changed_at;
+	off_t data_size;
+} inode_v2;
+
+// The inode of versions 3 and 4
+typedef struct inode_v4 {
+	int mode;
+	int references;
+	bool is_hlink;
+	bool is_inline;
+	bool is_compressed;
+	bool is_snapshot;
+	union {
+		int link_idx;    // the slot a hard link points at
+		uint32_t holes;
+	};
+	uint32_t generation;
+	uint32_t n_blocks;
+	uint32_t n_ext;
+	uint32_t indirect;
+	time_t accessed_at;
+	time_t modified_at;
+	time_t changed_at;
+	off_t data_size;
+	union {
+		extent ext[N_DIRECT];
+		char inline_data[INLINE_MAX];
+	};
+} inode_v4;
+
+_Static_assert(sizeof(inode_v4) == sizeof(inode), "both fill a slot of the table");
+
+// The allocator header of both
+typedef struct data_blks_v3 {
+	size_t blk_sz;
+	size_t n_blks;
+	size_t n_free;
+	size_t cursor;
+	size_t data_offset;
+	uint64_t bitmap[];
+} data_blks_v3;
+
+typedef struct super_blk_v2 {
+	uint32_t magic;
+	uint32_t version;
+	size_t n_inodes;
+	size_t max_inodes;
+	size_t free_inodes;
+	size_t inode_cursor;
+	size_t max_blks;
+	size_t inode_offset;
+	size_t journal_offset;
+	size_t journal_size;
+	data_blks_v3 data;
+} super_blk_v2;
+
+typedef struct super_blk_v3 {
+	uint32_t magic;
+	uint32_t version;
+	size_t n_inodes;
+	size_t max_inodes;
+	size_t free_inodes;
+	size_t inode_cursor;
+	size_t max_blks;
+	size_t inode_offset;
+	size_t inode_bitmap;
+	size_t journal_offset;
+	size_t journal_size;
+	data_blks_v3 data;
+} super_blk_v3;
+
+// The header of versions 4 and 5
+typedef struct super_blk_v4 {
+	uint32_t magic;
+	uint32_t version;
+	size_t n_inodes;
+	size_t max_inodes;
+	size_t free_inodes;
+	size_t inode_cursor;
+	size_t max_blks;
+	size_t refs_offset;
+	size_t inode_offset;
+	size_t inode_bitmap;
+	size_t journal_offset;
+	size_t journal_size;
+	data_blks data;
+} super_blk_v4;
+
+// What any of the headers says, with its allocator header in the mapping
+typedef struct old_image {
+	uint32_t version;
+	size_t n_inodes;
+	size_t inode_cursor;
+	size_t max_blks;
+	size_t max_inodes;
+	size_t inode_offset;
+	size_t inode_bitmap; // version 3 on
+	size_t refs_offset;  // version 4 on
+	size_t shared;
+	size_t journal_offset;
+	size_t journal_size;
+	data_blks_v3 data;
+} old_image;
+
+static const char* prog;
+
+static void die(const char* path, const char* what) {
+	fprintf(stderr, "%s: %s: %s\n", prog, path, what);
+	exit(1);
+}
+
+static void* map_image(int fd, size_t len, int prot) {
+	void* p = mmap(0, len, prot, MAP_SHARED, fd, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static void convert_v2(inode_v4* n, const inode_v2* o) {
+	memset(n, 0, sizeof(inode_v4));
+	n->mode = o->mode;
+	n->references = o->references;
+	n->is_hlink = o->is_hlink;
+	n->is_inline = o->is_inline;
+	if (o->is_hlink) {
+		// Shares its room with the hole count, files had no holes yet
+		n->link_idx = o->link_idx;
+	}
+	n->generation = o->generation;
+	n->n_blocks = o->n_blocks;
+	n->n_ext = o->n_ext;
+	n->indirect = o->indirect;
+	n->accessed_at = o->accessed_at;
+	n->modified_at = o->modified_at;
+	n->changed_at = o->changed_at;
+	n->data_size = o->data_size;
+	// The extents and the inline bytes share the same 48 bytes in both
+	memcpy(n->inline_data, o->inline_data, V2_INLINE_MAX);
+}
+
+// A link slot comes out free, only its generation carries over
+static void convert_v4(inode* n, const inode_v4* o) {
+	memset(n, 0, sizeof(inode));
+	n->generation = o->generation;
+	if (o->is_hlink) {
+		return;
+	}
+	n->mode = o->mode;
+	n->references = o->references;
+	n->is_inline = o->is_inline;
+	n->is_compressed = o->is_compressed;
+	n->is_snapshot = o->is_snapshot;
+	n->holes = o->holes;
+	n->n_blocks = o->n_blocks;
+	n->n_ext = o->n_ext;
+	n->indirect = o->indirect;
+	n->accessed_at = o->accessed_at;
+	n->modified_at = o->modified_at;
+	n->changed_at = o->changed_at;
+	n->data_size = o->data_size;
+	memcpy(n->inline_data, o->inline_data, INLINE_MAX);
+}
+
+// Reads the header of a version 2 to 5 image into o, false if it is
+// not one
+static bool read_header(int fd, old_image* o) {
+	super_blk_v3 h;
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != NUFS_MAGIC) {
+		return false;
+	}
+	o->version = h.version;
+	o->refs_offset = 0;
+	o->shared = 0;
+	if (h.version == 2) {
+		super_blk_v2 h2;
+		memcpy(&h2, &h, sizeof(h2));
+		o->n_inodes = h2.n_inodes;
+		o->inode_cursor = h2.inode_cursor;
+		o->max_blks = h2.max_blks;
+		o->max_inodes = h2.max_inodes;
+		o->inode_offset = h2.inode_offset;
+		o->inode_bitmap = 0;
+		o->journal_offset = h2.journal_offset;
+		o->journal_size = h2.journal_size;
+		o->data = h2.data;
+		return true;
+	}
+	if (h.version == 3) {
+		o->n_inodes = h.n_inodes;
+		o->inode_cursor = h.inode_cursor;
+		o->max_blks = h.max_blks;
+		o->max_inodes = h.max_inodes;
+		o->inode_offset = h.inode_offset;
+		o->inode_bitmap = h.inode_bitmap;
+		o->journal_offset = h.journal_offset;
+		o->journal_size = h.journal_size;
+		o->data = h.data;
+		return true;
+	}
+	if (h.version == 4 || h.version == 5) {
+		super_blk_v4 h4;
+		if (pread(fd, &h4, sizeof(h4), 0) != sizeof(h4)) {
+			return false;
+		}
+		o->n_inodes = h4.n_inodes;
+		o->inode_cursor = h4.inode_cursor;
+		o->max_blks = h4.max_blks;
+		o->max_inodes = h4.max_inodes;
+		o->inode_offset = h4.inode_offset;
+		o->inode_bitmap = h4.inode_bitmap;
+		o->refs_offset = h4.refs_offset;
+		o->shared = h4.data.shared;
+		o->journal_offset = h4.journal_offset;
+		o->journal_size = h4.journal_size;
+		o->data.blk_sz = h4.data.blk_sz;
+		o->data.n_blks = h4.data.n_blks;
+		o->data.n_free = h4.data.n_free;
+		o->data.cursor = h4.data.cursor;
+		o->data.data_offset = h4.data.data_offset;
+		return true;
+	}
+	return false;
+}
+
+// Fills the inode table of fs from the old one, returns the slots in use
+static size_t copy_inodes(super_blk* fs, const char* src, const old_image* old, const inode_v4* table) {
+	uint64_t* map = fs_inode_bitmap(fs);
+	const uint64_t* omap = old->version > 2 ? (const uint64_t*)(src + old->inode_bitmap) : NULL;
+	size_t used = 0;
+	for (size_t i = 0; i < old->n_inodes; i++) {
+		const inode_v4* o = &table[i];
+		convert_v4(fs_inode(fs, i), o);
+		// Orphans still hold their slot, the next mount frees them
+		bool in_use = omap ? (omap[i / 64] & (1ULL << (i % 64))) != 0
+		                   : o->mode != 0 || o->references > 0;
+		if (in_use && !o->is_hlink) {
+			map[i / 64] |= 1ULL << (i % 64);
+			used++;
+		}
+	}
+	return used;
+}
+
+// Version 5 has the current inodes and bitmap, returns the slots in use
+static size_t copy_table(super_blk* fs, const char* src, const old_image* old) {
+	size_t words = BITMAP_WORDS(old->n_inodes);
+	const uint64_t* omap = (const uint64_t*)(src + old->inode_bitmap);
+	memcpy(fs_inode_bitmap(fs), omap, words * sizeof(uint64_t));
+	memcpy(fs_inode(fs, 0), src + old->inode_offset, old->n_inodes * sizeof(inode));
+	size_t used = 0;
+	for (size_t w = 0; w < words; w++) {
+		used += __builtin_popcountll(omap[w]);
+	}
+	return used;
+}
+
+// Points every entry naming a link slot at the file behind it, and
+// counts a file's entries as its links. Returns the entries moved.
+static size_t fold_links(const char* path, super_blk* fs, const inode_v4* table, size_t n_inodes) {
+	int* names = calloc(n_inodes, sizeof(int));
+	if (names == NULL) {
+		die(path, strerror(errno));
+	}
+
+	size_t per = fs->data.blk_sz / sizeof(dirent) - 1;
+	size_t moved = 0;
+	for (size_t i = fs_next_inode(fs, 0); i < n_inodes; i = fs_next_inode(fs, i + 1)) {
+		const inode* d = fs_inode(fs, i);
+		if (d->references < 1 || !S_ISDIR(d->mode)) {
+			continue;
+		}
+		for (uint32_t p = 0; p < d->n_blocks; p++) {
+			dir_page* page = (dir_page*)fs_blkptr(fs, inode_map(fs, d, p, NULL));
+			for (size_t k = 0; k < per; k++) {
+				dirent* ent = &page->ents[k];
+				if (!ent->used || ent->inum < 0 || (size_t)ent->inum >= n_inodes) {
+					continue;
+				}
+				// A link to a link goes to the end of the chain
+				int t = ent->inum;
+				for (size_t hops = 0; table[t].is_hlink && hops < n_inodes; hops++) {
+					t = table[t].link_idx;
+				}
+				if (t != ent->inum) {
+					ent->inum = t;
+					moved++;
+				}
+				names[t]++;
+			}
+		}
+	}
+
+	for (size_t i = fs_next_inode(fs, 0); i < n_inodes; i = fs_next_inode(fs, i + 1)) {
+		inode* n = fs_inode(fs, i);
+		if (!S_ISDIR(n->mode)) {
+			n->references = names[i];
+		}
+	}
+	free(names);
+	return moved;
+}
+
+int main(int argc, char* argv[]) {
+	prog = argv[0];
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s old.nufs new.nufs\n", prog);
+		return 2;
+	}
+	const char* from = argv[1];
+	const char* to = argv[2];
+
+	int ofd = open(from, O_RDWR);
+	if (ofd == -1) {
+		die(from, strerror(errno));
+	}
+	old_image old;
+	if (!read_header(ofd, &old)) {
+		die(from, "not a version 2 to 5 nufs image");
+	}
+
+	// journal_replay only looks at where the journal and the data are
+	super_blk jh;
+	memset(&jh, 0, sizeof(jh));
+	jh.journal_offset = old.journal_offset;
+	jh.journal_size = old.journal_size;
+	jh.data.data_offset = old.data.data_offset;
+	if (journal_replay(ofd, &jh) != 0 || !read_header(ofd, &old)) {
+		die(from, "cannot replay the journal");
+	}
+
+	fs_geometry geo = {
+		.blk_sz = old.data.blk_sz,
+		.n_blks = old.data.n_blks,
+		.max_blks = old.max_blks,
+		.n_inodes = old.n_inodes,
+		.max_inodes = old.max_inodes,
+		.journal_size = old.journal_size,
+	};
+	int rv = format_fs(to, &geo);
+	if (rv < 0) {
+		die(to, strerror(-rv));
+	}
+	int nfd = open(to, O_RDWR);
+	if (nfd == -1) {
+		die(to, strerror(errno));
+	}
+
+	size_t old_len = old.data.data_offset + old.data.n_blks * old.data.blk_sz;
+	const char* src = map_image(ofd, old_len, PROT_READ);
+	if (src == NULL) {
+		die(from, strerror(errno));
+	}
+	const uint64_t* obitmap = old.version == 2 ? ((const super_blk_v2*)src)->data.bitmap
+	                        : old.version == 3 ? ((const super_blk_v3*)src)->data.bitmap
+	                                           : ((const super_blk_v4*)src)->data.bitmap;
+
+	super_blk hdr;
+	if (pread(nfd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		die(to, strerror(errno));
+	}
+	size_t new_len = hdr.data.data_offset + hdr.data.n_blks * hdr.data.blk_sz;
+	super_blk* fs = map_image(nfd, new_len, PROT_READ | PROT_WRITE);
+	if (fs == NULL) {
+		die(to, strerror(errno));
+	}
+
+	// Same block numbers, so the allocator state and the used blocks
+	// carry over; free blocks stay holes in the new file
+	size_t words = BITMAP_WORDS(old.data.n_blks);
+	memcpy(fs->data.bitmap, obitmap, words * sizeof(uint64_t));
+	fs->data.n_free = old.data.n_free;
+	fs->data.cursor = old.data.cursor;
+	for (size_t b = 0; b < old.data.n_blks; b++) {
+		if (obitmap[b / 64] & (1ULL << (b % 64))) {
+			memcpy(fs_blkptr(fs, b), src + old.data.data_offset + b * old.data.blk_sz, old.data.blk_sz);
+		}
+	}
+
+	if (old.version >= 4) {
+		memcpy(fs_refs(fs), src + old.refs_offset, old.data.n_blks * sizeof(uint32_t));
+		fs->data.shared = old.shared;
+	}
+
+	size_t used, moved = 0;
+	if (old.version == 5) {
+		used = copy_table(fs, src, &old);
+	} else {
+		inode_v4* v2 = NULL;
+		const inode_v4* table = (const inode_v4*)(src + old.inode_offset);
+		if (old.version == 2) {
+			v2 = calloc(old.n_inodes, sizeof(inode_v4));
+			if (v2 == NULL) {
+				die(from, strerror(errno));
+			}
+			for (size_t i = 0; i < old.n_inodes; i++) {
+				convert_v2(&v2[i], &((const inode_v2*)(src + old.inode_offset))[i]);
+			}
+			table = v2;
+		}
+		used = copy_inodes(fs, src, &old, table);
+		moved = fold_links(to, fs, table, old.n_inodes);
+		free(v2);
+	}
+	fs->free_inodes = old.n_inodes - used;
+	fs->inode_cursor = old.inode_cursor;
+
+	// Not clean, so its first mount frees the orphans copied over
+	fs->clean = 0;
+	if (msync(fs, new_len, MS_SYNC) != 0 || fsync(nfd) != 0) {
+		die(to, strerror(errno));
+	}
+	munmap(fs, new_len);
+	munmap((void*)src, old_len);
+	close(nfd);
+	close(ofd);
+
+	printf("%s: version %u, %zu of %zu inodes and %zu blocks in use, %zu hard links folded, written to %s\n",
+	       from, old.version, used, old.n_inodes, old.data.n_blks - old.data.n_free, moved, to);
+	return 0;
+}
@@ -0,0 +1,757 @@
+// fsck.nufs: check an image that is not mounted, and repair it with -r.
+//
+//   fsck.nufs [-r] [-j threads] image.nufs
+//
+// The journal is replayed first, as a mount would; without -r that is
+// the only write. Then, each pass spread over the threads (one per CPU
+// unless -j says otherwise):
+//  1. every inode in use on its own: size, extents inside the image,
+//     the indirect chain, block and hole counts
+//  2. every directory page: owner, live count, each entry a proper name
+//     naming an inode in use, no name twice; counts each inode's names
+//  3. link counts against those names, and every directory named once
+//     and reachable from the root with its parent recorded
+//  4. the owners of each block against the block bitmap, the reference
+//     counts and the free counts in the header
+// With -r what is found is fixed in place: a broken inode is cleared, an
+// entry naming nothing dropped, an inode no entry names (an orphan, or
+// a directory cut off from the root with all below it) freed, the counts
+// set to what was found. The image is marked clean after.
+//
+// Exits 0 if the image is fine, 1 if problems were repaired, 4 if some
+// are left, 8 if it could not be checked.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "data.h"
+#include "directory.h"
+#include "extent.h"
+#include "journal.h"
+
+// Problems printed, past that they are only counted
+#define SHOW_MAX 100
+
+// Inodes or blocks a thread takes at a time, a multiple of 64 so each
+// word of a bitmap is only ever touched by one thread
+#define CHUNK 4096
+
+enum { I_FREE, I_OK, I_DROP };
+
+static const char* prog;
+static const char* path;
+static super_blk* fs;
+static bool repair;
+static bool clean_image; // flagged clean, with a good checksum
+static int n_threads;
+static size_t n_problems;
+static size_t n_orphans;
+
+static uint8_t* state;     // I_* per inode slot
+static uint32_t* names;    // entries naming each inode
+static int* named_by;      // for a directory, one directory naming it
+static uint8_t* kept;      // a directory's entry in named_by was kept
+static uint32_t* owners;   // inodes mapping each block
+static bool drop_needed;
+
+static void die(const char* what) {
+	fprintf(stderr, "%s: %s: %s\n", prog, path, what);
+	exit(8);
+}
+
+static void problem(const char* fmt, ...) {
+	size_t n = __atomic_add_fetch(&n_problems, 1, __ATOMIC_RELAXED);
+	if (n > SHOW_MAX) {
+		return;
+	}
+	char line[256];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	printf("%s%s\n", line, repair ? ", fixed" : "");
+	if (n == SHOW_MAX) {
+		printf("more problems are only counted\n");
+	}
+}
+
+static bool test_bit(const uint64_t* map, size_t i) {
+	return (map[i / 64] >> (i % 64)) & 1;
+}
+
+static void set_bit(uint64_t* map, size_t i, bool on) {
+	if (on) {
+		map[i / 64] |= 1ULL << (i % 64);
+	} else {
+		map[i / 64] &= ~(1ULL << (i % 64));
+	}
+}
+
+static void* alloc_table(size_t n, size_t size) {
+	void* p = calloc(n, size);
+	if (p == NULL) {
+		die(strerror(errno));
+	}
+	return p;
+}
+
+// Runs fn over [0, n) in chunks, on all the threads
+typedef void (*chunk_fn)(size_t from, size_t to);
+
+static size_t next_chunk, chunk_end;
+static chunk_fn chunk_work;
+
+static void* worker(void* arg) {
+	(void) arg;
+	for (;;) {
+		size_t from = __atomic_fetch_add(&next_chunk, CHUNK, __ATOMIC_RELAXED);
+		if (from >= chunk_end) {
+			return NULL;
+		}
+		chunk_work(from, from + CHUNK < chunk_end ? from + CHUNK : chunk_end);
+	}
+}
+
+static void run_pass(chunk_fn fn, size_t n) {
+	next_chunk = 0;
+	chunk_end = n;
+	chunk_work = fn;
+	pthread_t t[n_threads];
+	for (int i = 0; i < n_threads; i++) {
+		if (pthread_create(&t[i], NULL, worker, NULL) != 0) {
+			die("cannot start threads");
+		}
+	}
+	for (int i = 0; i < n_threads; i++) {
+		pthread_join(t[i], NULL);
+	}
+}
+
+// Empties slot i, its generation carries on
+static void clear_inode(size_t i) {
+	inode* n = fs_inode(fs, i);
+	uint32_t gen = n->generation;
+	memset(n, 0, sizeof(inode));
+	n->generation = gen;
+	set_bit(fs_inode_bitmap(fs), i, false);
+}
+
+static size_t per_eblk(void) {
+	return (fs->data.blk_sz - sizeof(extent_blk)) / sizeof(extent);
+}
+
+// Calls fn on each extent of n and each block of its indirect chain (as
+// a one block extent with chain set), walking the chain only as far as
+// it checks out. Returns why it is broken, or NULL.
+typedef void (*extent_fn)(extent e, bool chain, void* ctx);
+
+static const char* walk_extents(const inode* n, extent_fn fn, void* ctx) {
+	size_t per = per_eblk();
+	const extent_blk* eb = NULL;
+	for (uint32_t k = 0; k < n->n_ext; k++) {
+		if (k < N_DIRECT) {
+			fn(n->ext[k], false, ctx);
+			continue;
+		}
+		size_t idx = (k - N_DIRECT) % per;
+		if (idx == 0) {
+			uint32_t b = k == N_DIRECT ? n->indirect : eb->next;
+			if (b >= fs->data.n_blks) {
+				return "indirect block out of range";
+			}
+			eb = (const extent_blk*)fs_blkptr(fs, b);
+			size_t left = n->n_ext - k;
+			if (eb->count != (left < per ? left : per)) {
+				return "indirect block holds the wrong count";
+			}
+			fn((extent){ b, 1 }, true, ctx);
+		}
+		fn(eb->ext[idx], false, ctx);
+	}
+	return NULL;
+}
+
+typedef struct map_sum {
+	uint64_t blocks;
+	uint64_t holes;
+	const char* bad;
+	bool dir;
+} map_sum;
+
+static void sum_extent(extent e, bool chain, void* ctx) {
+	map_sum* m = ctx;
+	if (chain || m->bad) {
+		return;
+	}
+	if (ext_hole(e)) {
+		if (ext_compressed(e) || e.start != 0 || (e.len & ~EXT_HOLE) == 0) {
+			m->bad = "malformed hole";
+		} else if (m->dir) {
+			m->bad = "hole in a directory";
+		}
+		m->holes += e.len & ~EXT_HOLE;
+		m->blocks += e.len & ~EXT_HOLE;
+		return;
+	}
+	uint32_t phys = ext_phys(e);
+	if (phys == 0) {
+		m->bad = "empty extent";
+	} else if (ext_compressed(e) && (phys >= cluster_blks(fs) || m->dir)) {
+		m->bad = "malformed compressed cluster";
+	} else if ((size_t)e.start + phys > fs->data.n_blks) {
+		m->bad = "extent out of range";
+	}
+	m->blocks += extent_blocks(fs, e);
+}
+
+// Why the inode in use at n cannot be kept, or NULL
+static const char* check_inode(inode* n) {
+	if (n->mode == 0) {
+		return "in use but empty";
+	}
+	if (n->references < 0) {
+		return "negative link count";
+	}
+	size_t blk_sz = fs->data.blk_sz;
+	bool dir = S_ISDIR(n->mode);
+	if (n->is_inline) {
+		if (dir) {
+			return "inline directory";
+		}
+		if (n->data_size < 0 || n->data_size > INLINE_MAX) {
+			return "inline data past the inode";
+		}
+		return NULL;
+	}
+
+	map_sum m = { 0, 0, NULL, dir };
+	const char* why = walk_extents(n, sum_extent, &m);
+	if (why || m.bad) {
+		return why ? why : m.bad;
+	}
+	if (m.blocks != n->n_blocks) {
+		return "extents do not add up to its blocks";
+	}
+	if (n->data_size < 0 || ((uint64_t)n->data_size + blk_sz - 1) / blk_sz > n->n_blocks) {
+		return "size past its blocks";
+	}
+	if (dir && (n->n_blocks < 1 || (uint64_t)n->data_size != (uint64_t)n->n_blocks * blk_sz)) {
+		return "directory pages do not match its size";
+	}
+	if (m.holes != n->holes) {
+		problem("inode %zu: %u blocks in holes, counted %lu", (size_t)inode_num(fs, n), n->holes, (unsigned long)m.holes);
+		if (repair) {
+			n->holes = m.holes;
+		}
+	}
+	return NULL;
+}
+
+static void pass_inodes(size_t from, size_t to) {
+	const uint64_t* map = fs_inode_bitmap(fs);
+	for (size_t i = from; i < to; i++) {
+		inode* n = fs_inode(fs, i);
+		if (!test_bit(map, i)) {
+			if (n->mode != 0 || n->references != 0) {
+				problem("inode %zu: free slot holds an inode", i);
+				if (repair) {
+					clear_inode(i);
+				}
+			}
+			continue;
+		}
+		const char* why = check_inode(n);
+		if (why) {
+			problem("inode %zu: %s", i, why);
+			if (repair) {
+				clear_inode(i);
+			}
+			continue;
+		}
+		state[i] = I_OK;
+	}
+}
+
+static size_t ents_per_page(void) {
+	return fs->data.blk_sz / sizeof(dirent) - 1;
+}
+
+static dir_page* page_of(const inode* d, uint32_t p) {
+	return (dir_page*)fs_blkptr(fs, inode_map(fs, d, p, NULL));
+}
+
+static void drop_entry(dir_page* page, dirent* ent) {
+	memset(ent, 0, sizeof(dirent));
+	page->count -= 1;
+}
+
+// Why the entry cannot stay, or NULL
+static const char* check_entry(const dirent* ent) {
+	size_t len = strnlen(ent->name, DIR_NAME);
+	if (len == 0 || len == DIR_NAME || memchr(ent->name, '/', len) != NULL
+	    || strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0) {
+		return "is not a proper name";
+	}
+	if (ent->inum <= ROOT_INUM || (size_t)ent->inum >= fs->n_inodes) {
+		return "names no inode";
+	}
+	if (state[ent->inum] != I_OK) {
+		return "names a free inode";
+	}
+	return NULL;
+}
+
+typedef struct named {
+	dir_page* page;
+	dirent* ent;
+} named;
+
+static int cmp_named(const void* a, const void* b) {
+	return strncmp(((const named*)a)->ent->name, ((const named*)b)->ent->name, DIR_NAME);
+}
+
+static void check_dir(size_t i) {
+	const inode* d = fs_inode(fs, i);
+	size_t per = ents_per_page();
+	named* ents = NULL;
+	size_t n = 0, cap = 0;
+
+	for (uint32_t p = 0; p < d->n_blocks; p++) {
+		dir_page* page = page_of(d, p);
+		if (page->owner != (int)i) {
+			problem("directory %zu: page %u owned by %d", i, p, page->owner);
+			if (repair) {
+				page->owner = i;
+			}
+		}
+		int held = 0, live = 0;
+		for (size_t s = 0; s < per; s++) {
+			dirent* ent = &page->ents[s];
+			if (!ent->used) {
+				continue;
+			}
+			held++;
+			const char* why = check_entry(ent);
+			if (why) {
+				problem("directory %zu: entry \"%.*s\" %s", i, DIR_NAME, ent->name, why);
+				if (repair) {
+					memset(ent, 0, sizeof(dirent));
+				}
+				continue;
+			}
+			live++;
+			if (n == cap) {
+				cap = cap ? cap * 2 : 64;
+				if ((ents = realloc(ents, cap * sizeof(named))) == NULL) {
+					die(strerror(errno));
+				}
+			}
+			ents[n++] = (named){ page, ent };
+		}
+		if (page->count != held) {
+			problem("directory %zu: page %u counts %d entries, holds %d", i, p, page->count, held);
+		}
+		if (repair) {
+			page->count = live;
+		}
+	}
+
+	if (n > 1) {
+		qsort(ents, n, sizeof(named), cmp_named);
+	}
+	for (size_t k = 0; k < n; k++) {
+		dirent* ent = ents[k].ent;
+		if (k > 0 && cmp_named(&ents[k - 1], &ents[k]) == 0) {
+			problem("directory %zu: \"%.*s\" twice", i, DIR_NAME, ent->name);
+			if (repair) {
+				drop_entry(ents[k].page, ent);
+				// the kept one still compares equal to those after
+				ents[k] = ents[k - 1];
+			}
+			continue;
+		}
+		__atomic_add_fetch(&names[ent->inum], 1, __ATOMIC_RELAXED);
+		if (S_ISDIR(fs_inode(fs, ent->inum)->mode)) {
+			__atomic_store_n(&named_by[ent->inum], (int)i, __ATOMIC_RELAXED);
+		}
+	}
+	free(ents);
+}
+
+static void pass_dirs(size_t from, size_t to) {
+	for (size_t i = from; i < to; i++) {
+		if (state[i] == I_OK && S_ISDIR(fs_inode(fs, i)->mode)) {
+			check_dir(i);
+		}
+	}
+}
+
+// Whether the directory d is reachable from the root through named_by.
+// reach is 0 for not known yet, 1 for reachable, 2 for not, 3 for on
+// the path being walked.
+static bool reachable(uint8_t* reach, size_t d) {
+	size_t cur = d;
+	while (reach[cur] == 0) {
+		reach[cur] = 3;
+		if (names[cur] == 0) {
+			reach[cur] = 2;
+			break;
+		}
+		cur = named_by[cur];
+	}
+	// Whatever was on the path shares the answer, a loop back onto it
+	// never reaches the root
+	uint8_t r = reach[cur] == 3 ? 2 : reach[cur];
+	for (cur = d; reach[cur] == 3; cur = named_by[cur]) {
+		reach[cur] = r;
+	}
+	return r == 1;
+}
+
+// Directories must each have one name and reach the root, the parent on
+// their first page being the one naming them
+static void check_tree(void) {
+	size_t n_inodes = fs->n_inodes;
+	uint8_t* reach = alloc_table(n_inodes, 1);
+	reach[ROOT_INUM] = state[ROOT_INUM] == I_OK ? 1 : 2;
+
+	for (size_t i = ROOT_INUM + 1; i < n_inodes; i++) {
+		if (state[i] != I_OK || !S_ISDIR(fs_inode(fs, i)->mode)) {
+			continue;
+		}
+		if (names[i] > 1) {
+			problem("directory %zu: %u names", i, names[i]);
+			drop_needed = true;
+		}
+	}
+	for (size_t i = ROOT_INUM + 1; i < n_inodes; i++) {
+		if (state[i] != I_OK || !S_ISDIR(fs_inode(fs, i)->mode)) {
+			continue;
+		}
+		if (!reachable(reach, i)) {
+			problem("directory %zu: not reachable from the root", i);
+			if (repair) {
+				state[i] = I_DROP;
+				drop_needed = true;
+			}
+			continue;
+		}
+		dir_page* first = page_of(fs_inode(fs, i), 0);
+		if (first->parent != named_by[i]) {
+			problem("directory %zu: parent %d, named in %d", i, first->parent, named_by[i]);
+			if (repair) {
+				first->parent = named_by[i];
+			}
+		}
+	}
+	dir_page* root = state[ROOT_INUM] == I_OK ? page_of(fs_inode(fs, ROOT_INUM), 0) : NULL;
+	if (root && root->parent != ROOT_INUM) {
+		problem("root directory: parent %d", root->parent);
+		if (repair) {
+			root->parent = ROOT_INUM;
+		}
+	}
+	free(reach);
+}
+
+// Drops the entries of directories being freed, and those naming a
+// directory from anywhere but the one kept
+static void pass_drop(size_t from, size_t to) {
+	size_t per = ents_per_page();
+	for (size_t i = from; i < to; i++) {
+		if (state[i] == I_FREE || !S_ISDIR(fs_inode(fs, i)->mode)) {
+			continue;
+		}
+		const inode* d = fs_inode(fs, i);
+		for (uint32_t p = 0; p < d->n_blocks; p++) {
+			dir_page* page = page_of(d, p);
+			for (size_t s = 0; s < per; s++) {
+				dirent* ent = &page->ents[s];
+				if (!ent->used) {
+					continue;
+				}
+				int t = ent->inum;
+				if (state[i] == I_OK && (!S_ISDIR(fs_inode(fs, t)->mode) || names[t] <= 1)) {
+					continue;
+				}
+				if (state[i] == I_OK && named_by[t] == (int)i
+				    && !__atomic_exchange_n(&kept[t], 1, __ATOMIC_RELAXED)) {
+					continue;
+				}
+				drop_entry(page, ent);
+				__atomic_sub_fetch(&names[t], 1, __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+// Link counts against the names found. What no entry names is freed, as
+// a mount would free it; it is only a problem on an image closed clean.
+static void pass_links(size_t from, size_t to) {
+	for (size_t i = from; i < to; i++) {
+		if (state[i] == I_DROP) {
+			if (repair) {
+				clear_inode(i);
+			}
+			state[i] = I_FREE;
+			continue;
+		}
+		if (state[i] != I_OK) {
+			continue;
+		}
+		inode* n = fs_inode(fs, i);
+		bool dir = S_ISDIR(n->mode);
+		uint32_t want = dir ? 1 : names[i];
+		if (i != ROOT_INUM && names[i] == 0) {
+			// check_tree told of a directory already
+			if (dir && !repair) {
+				continue;
+			}
+			if (n->references == 0 && !dir) {
+				__atomic_add_fetch(&n_orphans, 1, __ATOMIC_RELAXED);
+				if (clean_image) {
+					problem("inode %zu: orphan on a clean image", i);
+				}
+			} else {
+				problem("inode %zu: no entry names it", i);
+			}
+			if (repair) {
+				clear_inode(i);
+				state[i] = I_FREE;
+			}
+			continue;
+		}
+		if ((uint32_t)n->references != want) {
+			problem("inode %zu: link count %d, %u names", i, n->references, want);
+			if (repair) {
+				n->references = want;
+			}
+		}
+	}
+}
+
+static void own_extent(extent e, bool chain, void* ctx) {
+	(void) chain;
+	(void) ctx;
+	for (uint32_t b = 0; b < ext_phys(e); b++) {
+		__atomic_add_fetch(&owners[e.start + b], 1, __ATOMIC_RELAXED);
+	}
+}
+
+static size_t inodes_used;
+
+static void pass_owners(size_t from, size_t to) {
+	size_t used = 0;
+	for (size_t i = from; i < to; i++) {
+		if (state[i] != I_OK) {
+			continue;
+		}
+		used++;
+		const inode* n = fs_inode(fs, i);
+		if (!n->is_inline) {
+			walk_extents(n, own_extent, NULL);
+		}
+	}
+	__atomic_add_fetch(&inodes_used, used, __ATOMIC_RELAXED);
+}
+
+static size_t blocks_free, blocks_shared;
+
+// A block with k owners is used and has a reference count of k - 1
+static void pass_blocks(size_t from, size_t to) {
+	uint64_t* map = fs->data.bitmap;
+	uint32_t* refs = fs_refs(fs);
+	size_t n_free = 0, shared = 0;
+	for (size_t b = from; b < to; b++) {
+		uint32_t o = owners[b];
+		bool used = test_bit(map, b);
+		if (o == 0 && used) {
+			problem("block %zu: in use but no inode maps it", b);
+		} else if (o > 0 && !used) {
+			problem("block %zu: mapped by %u inodes but free", b, o);
+		}
+		if (o > 0 ? refs[b] != o - 1 : refs[b] != 0) {
+			problem("block %zu: %u owners past the first, counted %u", b, o > 0 ? o - 1 : 0, refs[b]);
+		}
+		if (repair) {
+			set_bit(map, b, o > 0);
+			refs[b] = o > 0 ? o - 1 : 0;
+			used = o > 0;
+		}
+		n_free += !used;
+		shared += refs[b];
+	}
+	__atomic_add_fetch(&blocks_free, n_free, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&blocks_shared, shared, __ATOMIC_RELAXED);
+}
+
+// Why the header cannot describe an image of size bytes, or NULL
+static const char* check_header(const super_blk* h, size_t size) {
+	size_t bs = h->data.blk_sz;
+	if (bs < PAGE_SIZE || bs > (1 << 20) || (bs & (bs - 1)) != 0) {
+		return "bad block size";
+	}
+	if (h->data.n_blks < 1 || h->data.n_blks > h->max_blks || h->max_blks > UINT32_MAX) {
+		return "bad block count";
+	}
+	if (h->n_inodes < 1 || h->n_inodes > h->max_inodes || h->max_inodes > INT32_MAX) {
+		return "bad inode count";
+	}
+	if (h->refs_offset < sizeof(super_blk) + BITMAP_WORDS(h->max_blks) * sizeof(uint64_t)
+	    || h->inode_bitmap < h->refs_offset + h->max_blks * sizeof(uint32_t)
+	    || h->inode_offset < h->inode_bitmap + BITMAP_WORDS(h->max_inodes) * sizeof(uint64_t)
+	    || h->journal_offset < h->inode_offset + h->max_inodes * sizeof(inode)
+	    || h->data.data_offset < h->journal_offset + h->journal_size) {
+		return "regions overlap";
+	}
+	if (size < h->data.data_offset + h->data.n_blks * bs) {
+		return "image shorter than its blocks";
+	}
+	return NULL;
+}
+
+int main(int argc, char* argv[]) {
+	prog = argv[0];
+	n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt(argc, argv, "rj:")) != -1) {
+		switch (opt) {
+		case 'r':
+			repair = true;
+			break;
+		case 'j':
+			n_threads = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || n_threads < 1) {
+usage:
+		fprintf(stderr, "usage: %s [-r] [-j threads] image.nufs\n", prog);
+		return 8;
+	}
+	path = argv[optind];
+
+	int fd = open(path, O_RDWR);
+	if (fd == -1) {
+		die(strerror(errno));
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		die("in use by a mount");
+	}
+
+	super_blk hdr;
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != NUFS_MAGIC) {
+		die("not a nufs image");
+	}
+	if (hdr.version != NUFS_VERSION) {
+		die("made by another version, see convert.nufs");
+	}
+	clean_image = hdr.clean != 0;
+	if (clean_image && fs_checksum(&hdr) != hdr.checksum) {
+		problem("superblock checksum does not match");
+		clean_image = false;
+	}
+	if (!clean_image && (journal_replay(fd, &hdr) != 0 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))) {
+		die("cannot replay the journal");
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		die(strerror(errno));
+	}
+	const char* why = check_header(&hdr, st.st_size);
+	if (why) {
+		die(why);
+	}
+	size_t len = hdr.data.data_offset + hdr.data.n_blks * hdr.data.blk_sz;
+	fs = mmap(0, len, repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (fs == MAP_FAILED) {
+		die(strerror(errno));
+	}
+
+	size_t n_inodes = fs->n_inodes;
+	size_t n_blks = fs->data.n_blks;
+	state = alloc_table(n_inodes, 1);
+	names = alloc_table(n_inodes, sizeof(uint32_t));
+	named_by = alloc_table(n_inodes, sizeof(int));
+	kept = alloc_table(n_inodes, 1);
+	owners = alloc_table(n_blks, sizeof(uint32_t));
+
+	run_pass(pass_inodes, n_inodes);
+	if (state[ROOT_INUM] != I_OK || !S_ISDIR(fs_inode(fs, ROOT_INUM)->mode)) {
+		// The next mount makes a new one, all else is cut off from it
+		problem("root directory is missing");
+		state[ROOT_INUM] = I_FREE;
+		if (repair) {
+			clear_inode(ROOT_INUM);
+		}
+	}
+	run_pass(pass_dirs, n_inodes);
+	check_tree();
+	if (repair && drop_needed) {
+		run_pass(pass_drop, n_inodes);
+	}
+	run_pass(pass_links, n_inodes);
+	run_pass(pass_owners, n_inodes);
+	run_pass(pass_blocks, n_blks);
+
+	// Bits past the last block stay set so no search returns them
+	uint64_t* map = fs->data.bitmap;
+	uint64_t tail = n_blks % 64 ? ~0ULL << (n_blks % 64) : 0;
+	if (tail != 0 && (map[n_blks / 64] & tail) != tail) {
+		problem("block bitmap: bits past the last block are clear");
+		if (repair) {
+			map[n_blks / 64] |= tail;
+		}
+	}
+
+	if (fs->data.n_free != blocks_free) {
+		problem("header: %zu free blocks, counted %zu", fs->data.n_free, blocks_free);
+		if (repair) {
+			fs->data.n_free = blocks_free;
+		}
+	}
+	if (fs->data.shared != blocks_shared) {
+		problem("header: %zu shared references, counted %zu", fs->data.shared, blocks_shared);
+		if (repair) {
+			fs->data.shared = blocks_shared;
+		}
+	}
+	if (fs->free_inodes != n_inodes - inodes_used) {
+		problem("header: %zu free inodes, counted %zu", fs->free_inodes, n_inodes - inodes_used);
+		if (repair) {
+			fs->free_inodes = n_inodes - inodes_used;
+		}
+	}
+	if (repair) {
+		if (fs->data.cursor >= n_blks) {
+			fs->data.cursor = 0;
+		}
+		if (fs->inode_cursor >= n_inodes) {
+			fs->inode_cursor = 0;
+		}
+		fs->clean = 1;
+		fs->checksum = fs_checksum(fs);
+		if (msync(fs, len, MS_SYNC) != 0 || fsync(fd) != 0) {
+			die(strerror(errno));
+		}
+	}
+
+	printf("%s: %zu of %zu inodes and %zu of %zu blocks in use, %zu shared references, %zu orphans, %zu problems%s\n",
+	       path, inodes_used, n_inodes, n_blks - blocks_free, n_blks, blocks_shared, n_orphans,
+	       n_problems, n_problems && repair ? " fixed" : "");
+	munmap(fs, len);
+	close(fd);
+	return n_problems == 0 ? 0 : repair ? 1 : 4;
+}
@@ -0,0 +1,77 @@
+// mkfs.nufs: make an empty nufs image with a chosen geometry.
+//
+//   mkfs.nufs [-c] [-b block size] [-s size] [-S max size] [-i inodes] [-I max inodes] [-j journal] image
+//
+// Sizes take a K, M or G suffix. The image starts at size and the
+// mounted filesystem grows it on demand up to max size; the inode
+// table grows the same way up to max inodes. -j 0 leaves the metadata
+// journal out. -c compresses every file made in the image (chattr +c
+// does it per file or directory).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "data.h"
+
+static size_t parse_size(const char* text) {
+	char* end;
+	size_t n = strtoull(text, &end, 10);
+	switch (*end) {
+	case 'G': case 'g': n <<= 10; // fall through
+	case 'M': case 'm': n <<= 10; // fall through
+	case 'K': case 'k': n <<= 10;
+	}
+	return n;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-c] [-b block size] [-s size] [-S max size] [-i inodes] [-I max inodes] [-j journal] image\n", prog);
+	exit(2);
+}
+
+int main(int argc, char* argv[]) {
+	fs_geometry geo;
+	default_geometry(&geo);
+
+	size_t size = geo.n_blks * geo.blk_sz;
+	size_t max_size = geo.max_blks * geo.blk_sz;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "cb:s:S:i:I:j:")) != -1) {
+		switch (opt) {
+		case 'c': geo.compress = true; break;
+		case 'b': geo.blk_sz = parse_size(optarg); break;
+		case 's': size = parse_size(optarg); break;
+		case 'S': max_size = parse_size(optarg); break;
+		case 'i': geo.n_inodes = parse_size(optarg); break;
+		case 'I': geo.max_inodes = parse_size(optarg); break;
+		case 'j': geo.journal_size = parse_size(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+	}
+
+	geo.n_blks = size / geo.blk_sz;
+	geo.max_blks = max_size / geo.blk_sz;
+	if (geo.max_blks < geo.n_blks) {
+		geo.max_blks = geo.n_blks;
+	}
+	if (geo.max_inodes < geo.n_inodes) {
+		geo.max_inodes = geo.n_inodes;
+	}
+
+	int rv = format_fs(argv[optind], &geo);
+	if (rv < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(-rv));
+		return 1;
+	}
+
+	printf("%s: %zu byte blocks, %zu of %zu blocks, %zu of %zu inodes, %zu byte journal%s\n",
+	       argv[optind], geo.blk_sz, geo.n_blks, geo.max_blks, geo.n_inodes, geo.max_inodes,
+	       geo.journal_size, geo.compress ? ", compressed" : "");
+	return 0;
+}
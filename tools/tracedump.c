@@ -0,0 +1,159 @@
+// tracedump: print a nufs trace file as text, oldest event first.
+//
+//   tracedump [-e event] [-s] nufs.trace
+//
+// -e keeps only one kind of event, -s prints a per-event summary
+// (count, errors, mean and worst latency) instead of the events.
+//
+// Each line is: seconds since the first event, thread, call, inode,
+// name(s), arguments, result and how long the call took.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_INFO(id, name, fmt, paths) { name, fmt, paths },
+static const struct {
+	const char* name;
+	const char* fmt;
+	int paths;
+} events[] = { TRACE_EVENTS(TRACE_INFO) };
+#undef TRACE_INFO
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-e event] [-s] trace\n", prog);
+	exit(2);
+}
+
+static int by_time(const void* a, const void* b) {
+	const trace_rec* x = a;
+	const trace_rec* y = b;
+	return x->ts_ns < y->ts_ns ? -1 : x->ts_ns > y->ts_ns;
+}
+
+static int find_event(const char* name) {
+	for (int e = 0; e < N_TRACE_EVENTS; e++) {
+		if (strcmp(events[e].name, name) == 0) {
+			return e;
+		}
+	}
+	return -1;
+}
+
+static void print_rec(const trace_rec* r, uint64_t t0) {
+	double t = (r->ts_ns - t0) / 1e9;
+	if (r->event >= N_TRACE_EVENTS) {
+		printf("%12.6f t%-3u [%ld events lost, ring full]\n", t, r->thread, (long)r->arg0);
+		return;
+	}
+
+	char path[TRACE_PATH + 8] = "";
+	if (events[r->event].paths == 2) {
+		snprintf(path, sizeof(path), " %.*s => %.*s",
+		         TRACE_PATH / 2, r->path, TRACE_PATH / 2, r->path + TRACE_PATH / 2);
+	} else if (events[r->event].paths == 1) {
+		snprintf(path, sizeof(path), " %.*s", TRACE_PATH, r->path);
+	}
+
+	char args[96] = "";
+	snprintf(args, sizeof(args), events[r->event].fmt, r->arg0, r->arg1);
+
+	printf("%12.6f t%-3u %-8s ino %lu%s%s%s = %d (%u us)\n", t, r->thread, events[r->event].name,
+	       (unsigned long)r->ino, path, args[0] ? " " : "", args, r->rv, r->dur_ns / 1000);
+}
+
+int main(int argc, char* argv[]) {
+	int only = -1;
+	int summary = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "e:s")) != -1) {
+		switch (opt) {
+		case 'e':
+			if ((only = find_event(optarg)) < 0) {
+				fprintf(stderr, "unknown event %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 's': summary = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+	}
+
+	FILE* in = fopen(argv[optind], "rb");
+	if (in == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	char magic[8];
+	uint32_t hdr[2];
+	if (fread(magic, 1, 8, in) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0
+	    || fread(hdr, sizeof(hdr), 1, in) != 1 || hdr[0] != sizeof(trace_rec)) {
+		fprintf(stderr, "%s: not a nufs trace, or from another version\n", argv[optind]);
+		return 1;
+	}
+
+	size_t n = 0, cap = 4096;
+	trace_rec* recs = malloc(cap * sizeof(trace_rec));
+	while (recs && fread(&recs[n], sizeof(trace_rec), 1, in) == 1) {
+		if (++n == cap) {
+			cap *= 2;
+			recs = realloc(recs, cap * sizeof(trace_rec));
+		}
+	}
+	fclose(in);
+	if (recs == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	// Rings are drained one after another, so the file is only ordered per thread
+	qsort(recs, n, sizeof(trace_rec), by_time);
+	uint64_t t0 = n ? recs[0].ts_ns : 0;
+
+	if (!summary) {
+		for (size_t i = 0; i < n; i++) {
+			if (only < 0 || recs[i].event == only) {
+				print_rec(&recs[i], t0);
+			}
+		}
+		free(recs);
+		return 0;
+	}
+
+	struct { size_t count, errors; uint64_t total_ns, max_ns; } st[N_TRACE_EVENTS + 1] = { 0 };
+	for (size_t i = 0; i < n; i++) {
+		const trace_rec* r = &recs[i];
+		int e = r->event < N_TRACE_EVENTS ? r->event : N_TRACE_EVENTS;
+		if (e == N_TRACE_EVENTS) {
+			st[e].count += r->arg0;
+			continue;
+		}
+		st[e].count += 1;
+		st[e].errors += r->rv < 0;
+		st[e].total_ns += r->dur_ns;
+		if (r->dur_ns > st[e].max_ns) {
+			st[e].max_ns = r->dur_ns;
+		}
+	}
+
+	printf("%-10s %10s %8s %10s %10s\n", "event", "count", "errors", "mean us", "max us");
+	for (int e = 0; e < N_TRACE_EVENTS; e++) {
+		if (st[e].count == 0 || (only >= 0 && e != only)) {
+			continue;
+		}
+		printf("%-10s %10zu %8zu %10.1f %10.1f\n", events[e].name, st[e].count, st[e].errors,
+		       st[e].total_ns / 1e3 / st[e].count, st[e].max_ns / 1e3);
+	}
+	if (st[N_TRACE_EVENTS].count) {
+		printf("%-10s %10zu\n", "lost", st[N_TRACE_EVENTS].count);
+	}
+	free(recs);
+	return 0;
+}
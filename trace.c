@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "trace.h"
+
+// Records per ring, a power of two. A full ring drops new events and
+// counts them rather than making the caller wait for the drain thread.
+#define RING_RECS 4096
+#define DRAIN_MS 50
+
+// Single producer (the owning thread), single consumer (the drain thread).
+// A ring outlives its thread and is handed to the next thread that starts.
+typedef struct trace_ring {
+	struct trace_ring* next;
+	int in_use;
+	uint16_t id;
+	_Alignas(64) uint64_t head;    // next slot the owner writes
+	uint64_t dropped;
+	_Alignas(64) uint64_t tail;    // next slot the drain thread reads
+	uint64_t dropped_seen;
+	_Alignas(64) trace_rec recs[RING_RECS];
+} trace_ring;
+
+int trace_level = TRACE_OFF;
+
+static trace_ring* rings;
+static uint16_t n_rings;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread trace_ring* my_ring;
+
+static char out_path[PATH_MAX];
+static FILE* out;
+static pthread_t drainer;
+static int running;
+static int stopping;
+
+uint64_t trace_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	return ns ? ns : 1;
+}
+
+static void release_ring(void* ring) {
+	__atomic_store_n(&((trace_ring*)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// Takes over an idle ring or makes a new one, only on a thread's first event
+static trace_ring* claim_ring(void) {
+	pthread_mutex_lock(&ring_mutex);
+	trace_ring* r = rings;
+	while (r && __atomic_load_n(&r->in_use, __ATOMIC_ACQUIRE)) {
+		r = r->next;
+	}
+	if (r == NULL && n_rings < UINT16_MAX && (r = aligned_alloc(64, sizeof(trace_ring))) != NULL) {
+		memset(r, 0, sizeof(trace_ring));
+		r->id = n_rings++;
+		r->next = rings;
+		__atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+	}
+	if (r) {
+		r->in_use = 1;
+		pthread_setspecific(ring_key, r);
+	}
+	pthread_mutex_unlock(&ring_mutex);
+	return r;
+}
+
+// Keeps the last cap - 1 bytes of src, the end of a path says the most
+static void copy_tail(char* dst, size_t cap, const char* src) {
+	size_t len = strlen(src);
+	if (len >= cap) {
+		src += len - (cap - 1);
+		len = cap - 1;
+	}
+	memcpy(dst, src, len);
+	memset(dst + len, 0, cap - len);
+}
+
+void trace_emit(int level, int event, uint64_t t0, int rv, uint64_t ino, const char* path, const char* path2, int64_t arg0, int64_t arg1) {
+	int cur = __atomic_load_n(&trace_level, __ATOMIC_RELAXED);
+	if (cur < level && !(rv < 0 && cur >= TRACE_ERR)) {
+		return;
+	}
+
+	trace_ring* r = my_ring;
+	if (r == NULL && (r = my_ring = claim_ring()) == NULL) {
+		return;
+	}
+
+	uint64_t head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RING_RECS) {
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	trace_rec* rec = &r->recs[head % RING_RECS];
+	uint64_t t1 = trace_now();
+	rec->ts_ns = t0;
+	rec->dur_ns = t1 - t0 > UINT32_MAX ? UINT32_MAX : t1 - t0;
+	rec->event = event;
+	rec->thread = r->id;
+	rec->rv = rv;
+	rec->_pad = 0;
+	rec->arg0 = arg0;
+	rec->arg1 = arg1;
+	rec->ino = ino;
+	if (path2) {
+		copy_tail(rec->path, TRACE_PATH / 2, path);
+		copy_tail(rec->path + TRACE_PATH / 2, TRACE_PATH / 2, path2);
+	} else {
+		copy_tail(rec->path, TRACE_PATH, path ? path : "");
+	}
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int open_out(void) {
+	if (out) {
+		return 0;
+	}
+	if ((out = fopen(out_path, "wb")) == NULL) {
+		perror(out_path);
+		return -1;
+	}
+	uint32_t hdr[2] = { sizeof(trace_rec), 0 };
+	fwrite(TRACE_MAGIC, 1, 8, out);
+	fwrite(hdr, sizeof(hdr), 1, out);
+	return 0;
+}
+
+// Lost events show up in the dump as one record per ring and drain
+static void drain_ring(trace_ring* r) {
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = r->tail;
+	uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	if (head == tail && dropped == r->dropped_seen) {
+		return;
+	}
+	if (open_out() != 0) {
+		__atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+		return;
+	}
+
+	while (tail < head) {
+		size_t at = tail % RING_RECS;
+		size_t n = head - tail < RING_RECS - at ? head - tail : RING_RECS - at;
+		fwrite(&r->recs[at], sizeof(trace_rec), n, out);
+		tail += n;
+	}
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+	if (dropped != r->dropped_seen) {
+		trace_rec lost = { .ts_ns = trace_now(), .event = N_TRACE_EVENTS, .thread = r->id,
+		                   .arg0 = dropped - r->dropped_seen };
+		fwrite(&lost, sizeof(lost), 1, out);
+		r->dropped_seen = dropped;
+	}
+}
+
+static void drain_all(void) {
+	for (trace_ring* r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		drain_ring(r);
+	}
+	if (out) {
+		fflush(out);
+	}
+}
+
+static void* drain_main(void* arg) {
+	(void) arg;
+	struct timespec nap = { 0, DRAIN_MS * 1000000L };
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		drain_all();
+		nanosleep(&nap, NULL);
+	}
+	drain_all();
+	return NULL;
+}
+
+static void on_usr1(int sig) {
+	(void) sig;
+	int cur = __atomic_load_n(&trace_level, __ATOMIC_RELAXED);
+	__atomic_store_n(&trace_level, cur < TRACE_IO ? cur + 1 : TRACE_IO, __ATOMIC_RELAXED);
+}
+
+static void on_usr2(int sig) {
+	(void) sig;
+	__atomic_store_n(&trace_level, TRACE_OFF, __ATOMIC_RELAXED);
+}
+
+static int parse_level(const char* text) {
+	if (text == NULL || *text == '\0') {
+		return TRACE_OFF;
+	}
+	if (strcmp(text, "err") == 0) {
+		return TRACE_ERR;
+	}
+	if (strcmp(text, "ops") == 0) {
+		return TRACE_OPS;
+	}
+	if (strcmp(text, "io") == 0) {
+		return TRACE_IO;
+	}
+	int n = atoi(text);
+	return n < TRACE_OFF ? TRACE_OFF : n > TRACE_IO ? TRACE_IO : n;
+}
+
+// Picks the level from NUFS_TRACE and the dump file, relative to the
+// current directory which a daemonized mount no longer has later on.
+// The file is only created once the first event arrives.
+void trace_init(const char* file) {
+	if (file[0] == '/' || getcwd(out_path, sizeof(out_path)) == NULL) {
+		out_path[0] = '\0';
+	} else {
+		strncat(out_path, "/", sizeof(out_path) - strlen(out_path) - 1);
+	}
+	strncat(out_path, file, sizeof(out_path) - strlen(out_path) - 1);
+
+	pthread_key_create(&ring_key, release_ring);
+	__atomic_store_n(&trace_level, parse_level(getenv("NUFS_TRACE")), __ATOMIC_RELAXED);
+	signal(SIGUSR1, on_usr1);
+	signal(SIGUSR2, on_usr2);
+}
+
+// Starts the drain thread, from the process that will serve requests
+int trace_start(void) {
+	if (running) {
+		return 0;
+	}
+	stopping = 0;
+	if (pthread_create(&drainer, NULL, drain_main, NULL) != 0) {
+		return -1;
+	}
+	running = 1;
+	return 0;
+}
+
+// Turns tracing off and writes out whatever the rings still hold
+void trace_stop(void) {
+	if (!running) {
+		return;
+	}
+	__atomic_store_n(&trace_level, TRACE_OFF, __ATOMIC_RELAXED);
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(drainer, NULL);
+	running = 0;
+	if (out) {
+		fclose(out);
+		out = NULL;
+	}
+}
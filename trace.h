@@ -0,0 +1,98 @@
+#ifndef NUFS_TRACE_H
+#define NUFS_TRACE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Binary event tracing for the FUSE callbacks.
+//
+// Each thread appends fixed size records to a ring of its own, a
+// background thread drains the rings into a file that tools/tracedump.c
+// turns back into text. The level can change while mounted: it starts
+// from NUFS_TRACE, SIGUSR1 steps it up and SIGUSR2 turns tracing off.
+// While off a callback pays one relaxed load and a branch.
+
+enum trace_level {
+	TRACE_OFF = 0,
+	TRACE_ERR = 1, // failed calls only
+	TRACE_OPS = 2, // every call except data I/O
+	TRACE_IO  = 3, // everything
+};
+
+// name, format of the two numeric arguments, number of names. The inode
+// is the one the call is about, or the directory for calls by name.
+#define TRACE_EVENTS(X) \
+	X(LOOKUP,   "lookup",   "",                  1) \
+	X(FORGET,   "forget",   "nlookup %ld",       0) \
+	X(ACCESS,   "access",   "mask %04lo",        0) \
+	X(GETATTR,  "getattr",  "",                  0) \
+	X(SETATTR,  "setattr",  "valid %lx size %ld", 0) \
+	X(READDIR,  "readdir",  "@%ld",              0) \
+	X(MKNOD,    "mknod",    "mode %06lo",        1) \
+	X(MKDIR,    "mkdir",    "mode %06lo",        1) \
+	X(CREATE,   "create",   "mode %06lo",        1) \
+	X(UNLINK,   "unlink",   "",                  1) \
+	X(RMDIR,    "rmdir",    "",                  1) \
+	X(RENAME,   "rename",   "into %ld flags %lx", 2) \
+	X(OPEN,     "open",     "flags %lo",         0) \
+	X(READ,     "read",     "%lu bytes @%ld",    0) \
+	X(WRITE,    "write",    "%lu bytes @%ld",    0) \
+	X(STATFS,   "statfs",   "",                  0) \
+	X(LINK,     "link",     "from %ld",          1) \
+	X(FSYNC,    "fsync",    "datasync %ld",      0) \
+	X(FSYNCDIR, "fsyncdir", "datasync %ld",      0) \
+	X(FLUSH,    "flush",    "",                  0) \
+	X(RELEASE,  "release",  "",                  0) \
+	X(READDIRPLUS, "readdirplus", "@%ld",        0) \
+	X(IOCTL,    "ioctl",    "cmd %lx flags %lx", 0) \
+	X(COPY,     "copy_file_range", "%lu bytes into %ld", 0) \
+	X(FALLOCATE, "fallocate", "mode %lx %ld bytes", 0) \
+	X(LSEEK,    "lseek",    "whence %ld @%ld",   0)
+
+#define TRACE_ENUM(id, name, fmt, paths) EV_##id,
+enum trace_event { TRACE_EVENTS(TRACE_ENUM) N_TRACE_EVENTS };
+#undef TRACE_ENUM
+
+#define TRACE_PATH 48
+
+// One event, 96 bytes in the ring and in the dump file. A two name
+// event keeps the tail of each in one half of path.
+typedef struct trace_rec {
+	uint64_t ts_ns;  // CLOCK_MONOTONIC at the start of the call
+	uint32_t dur_ns;
+	uint16_t event;
+	uint16_t thread; // ring number, stable for the life of a thread
+	int32_t rv;
+	uint32_t _pad;
+	int64_t arg0;
+	int64_t arg1;
+	uint64_t ino;
+	char path[TRACE_PATH];
+} trace_rec;
+
+#define TRACE_MAGIC "NUFSTRC2"
+
+extern int trace_level;
+
+static inline int trace_enabled(void) {
+	return __builtin_expect(__atomic_load_n(&trace_level, __ATOMIC_RELAXED) != TRACE_OFF, 0);
+}
+
+uint64_t trace_now(void);
+void trace_emit(int level, int event, uint64_t t0, int rv, uint64_t ino, const char* path, const char* path2, int64_t arg0, int64_t arg1);
+
+void trace_init(const char* file);
+int trace_start(void);
+void trace_stop(void);
+
+// Bracket a call: TRACE_BEGIN() before it, TRACE_END(...) after with its
+// result. Nothing but the level check runs unless tracing is on.
+#define TRACE_BEGIN() uint64_t trace_t0 = trace_enabled() ? trace_now() : 0
+
+#define TRACE_END(level, event, rv, ino, path, path2, arg0, arg1) do { \
+		if (__builtin_expect(trace_t0 != 0, 0)) { \
+			trace_emit(level, event, trace_t0, rv, ino, path, path2, arg0, arg1); \
+		} \
+	} while (0)
+
+#endif
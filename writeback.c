@@ -0,0 +1,488 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "data.h"
+#include "writeback.h"
+
+// Writeback of file data. Writes land in the shared mapping of the
+// image and the kernel flushes those pages whenever it likes, fsync
+// needs to know which of them belong to the file. Every write reports
+// the pages of the image it touched under the file's inode number;
+// writeback_sync msyncs just those.
+//
+// A file keeps up to WB_RANGES page ranges, a write next to or over
+// one grows it and one too many merges the two closest. Dirty files
+// sit on a list oldest first. The writeback thread wakes every
+// interval_ms and writes back files dirty longer than expire_ms, and
+// oldest first while more than background bytes are dirty. Past limit
+// a writer also writes back its own file before returning.
+//
+// Ranges are taken off a file before its msync and put back if it
+// fails, a write racing the msync adds its pages again. The error is
+// kept for the next writeback_sync of the file.
+//
+// The thread hands files flagged for compression to fs_compress_ino
+// first, which compresses the clusters the ranges touch and drops their
+// plain pages. fsync and writers over the limit write them plain.
+
+#define WB_RANGES 8
+
+typedef struct wb_range {
+	size_t start, end; // pages of the image
+} wb_range;
+
+typedef struct wb_inode {
+	int inum;
+	int n;          // ranges in use, sorted and apart
+	wb_range r[WB_RANGES];
+	size_t pages;   // covered by r
+	uint64_t since; // ms when the file went from clean to dirty
+	int flushing;   // writebacks of ranges taken off it in progress
+	int waiting;    // syncs waiting for those
+	int error;      // from a failed writeback, for the next sync
+	bool compress;  // data goes through fs_compress_ino
+	struct wb_inode* hnext;
+	struct wb_inode* prev; // dirty list
+	struct wb_inode* next;
+} wb_inode;
+
+static char* base;
+static size_t map_len;
+static bool active;
+
+#define WB_DEFAULTS { \
+	.background = 64 << 20, \
+	.limit = 256 << 20, \
+	.expire_ms = 30000, \
+	.interval_ms = 5000, \
+}
+
+static wb_limits limits = WB_DEFAULTS;
+
+static pthread_mutex_t wb_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wb_done = PTHREAD_COND_INITIALIZER;
+static wb_inode** buckets;
+static size_t n_buckets, n_files;
+static wb_inode* oldest;
+static wb_inode* newest;
+static size_t dirty_pages;
+static bool kicked;
+static bool stopping;
+static bool threaded; // wb_thread runs, see writeback_run
+static pthread_t wb_thread;
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static size_t bg_pages(void) {
+	return limits.background / PAGE_SIZE;
+}
+
+static wb_inode** bucket(int inum) {
+	return &buckets[(size_t)inum * 0x9e3779b97f4a7c15ULL % n_buckets];
+}
+
+static void rehash(void) {
+	size_t old_n = n_buckets;
+	wb_inode** old = buckets;
+	n_buckets *= 2;
+	buckets = calloc(n_buckets, sizeof(wb_inode*));
+	assert(buckets != NULL);
+	for (size_t i = 0; i < old_n; i++) {
+		wb_inode* w = old[i];
+		while (w) {
+			wb_inode* next = w->hnext;
+			wb_inode** b = bucket(w->inum);
+			w->hnext = *b;
+			*b = w;
+			w = next;
+		}
+	}
+	free(old);
+}
+
+static wb_inode* find(int inum, bool create) {
+	for (wb_inode* w = *bucket(inum); w; w = w->hnext) {
+		if (w->inum == inum) {
+			return w;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	if (n_files >= n_buckets * 2) {
+		rehash();
+	}
+	wb_inode* w = calloc(1, sizeof(wb_inode));
+	assert(w != NULL);
+	w->inum = inum;
+	wb_inode** b = bucket(inum);
+	w->hnext = *b;
+	*b = w;
+	n_files++;
+	return w;
+}
+
+// Frees w once nothing refers to it any more
+static void put(wb_inode* w) {
+	if (w->n > 0 || w->flushing > 0 || w->waiting > 0 || w->error != 0) {
+		return;
+	}
+	wb_inode** b = bucket(w->inum);
+	while (*b != w) {
+		b = &(*b)->hnext;
+	}
+	*b = w->hnext;
+	n_files--;
+	free(w);
+}
+
+static void list_remove(wb_inode* w) {
+	if (w->prev) {
+		w->prev->next = w->next;
+	} else {
+		oldest = w->next;
+	}
+	if (w->next) {
+		w->next->prev = w->prev;
+	} else {
+		newest = w->prev;
+	}
+	w->prev = w->next = NULL;
+}
+
+static void list_append(wb_inode* w) {
+	w->prev = newest;
+	w->next = NULL;
+	if (newest) {
+		newest->next = w;
+	} else {
+		oldest = w;
+	}
+	newest = w;
+}
+
+static void count(wb_inode* w) {
+	size_t pages = 0;
+	for (int i = 0; i < w->n; i++) {
+		pages += w->r[i].end - w->r[i].start;
+	}
+	dirty_pages += pages - w->pages;
+	w->pages = pages;
+}
+
+static void add_range(wb_inode* w, size_t start, size_t end) {
+	if (w->n == 0) {
+		w->since = now_ms();
+		list_append(w);
+	}
+
+	// Find where it goes, swallowing any ranges it touches
+	int i = 0;
+	while (i < w->n && w->r[i].end < start) {
+		i++;
+	}
+	int j = i;
+	while (j < w->n && w->r[j].start <= end) {
+		if (w->r[j].start < start) {
+			start = w->r[j].start;
+		}
+		if (w->r[j].end > end) {
+			end = w->r[j].end;
+		}
+		j++;
+	}
+	if (j == i + 1 && w->r[i].start == start && w->r[i].end == end) {
+		return;
+	}
+	memmove(&w->r[i + 1], &w->r[j], (w->n - j) * sizeof(wb_range));
+	w->r[i] = (wb_range) { start, end };
+	w->n += 1 - (j - i);
+
+	if (w->n > WB_RANGES - 1) {
+		// Out of room for the next one, merge the closest pair
+		int best = 0;
+		for (int k = 1; k < w->n - 1; k++) {
+			if (w->r[k + 1].start - w->r[k].end < w->r[best + 1].start - w->r[best].end) {
+				best = k;
+			}
+		}
+		w->r[best].end = w->r[best + 1].end;
+		memmove(&w->r[best + 1], &w->r[best + 2], (w->n - best - 2) * sizeof(wb_range));
+		w->n--;
+	}
+	count(w);
+}
+
+// Takes the ranges off w into out for a writeback, the count of them
+static int take(wb_inode* w, wb_range* out) {
+	int n = w->n;
+	memcpy(out, w->r, n * sizeof(wb_range));
+	if (n > 0) {
+		w->n = 0;
+		count(w);
+		list_remove(w);
+	}
+	w->flushing++;
+	return n;
+}
+
+// Called without wb_mutex
+static int write_ranges(const wb_range* r, int n) {
+	int rv = 0;
+	for (int i = 0; i < n; i++) {
+		if (msync(base + r[i].start * PAGE_SIZE, (r[i].end - r[i].start) * PAGE_SIZE, MS_SYNC) != 0) {
+			rv = -errno;
+		}
+	}
+	return rv;
+}
+
+// Hands back ranges a writeback took, after it wrote them with result rv
+static void done(wb_inode* w, const wb_range* r, int n, int rv) {
+	if (rv < 0) {
+		for (int i = 0; i < n; i++) {
+			add_range(w, r[i].start, r[i].end);
+		}
+		w->error = rv;
+	}
+	w->flushing--;
+	pthread_cond_broadcast(&wb_done);
+}
+
+// Writes back w under wb_mutex, dropped for the msync. With compress,
+// a file flagged for it is compressed first.
+static int flush_locked(wb_inode* w, bool compress) {
+	wb_range r[WB_RANGES];
+	compress = compress && w->compress;
+	int n = take(w, r);
+	pthread_mutex_unlock(&wb_mutex);
+	if (compress && n > 0) {
+		struct iovec spans[WB_RANGES];
+		for (int i = 0; i < n; i++) {
+			spans[i].iov_base = base + r[i].start * PAGE_SIZE;
+			spans[i].iov_len = (r[i].end - r[i].start) * PAGE_SIZE;
+		}
+		fs_compress_ino((super_blk*)base, w->inum, spans, n);
+	}
+	int rv = write_ranges(r, n);
+	pthread_mutex_lock(&wb_mutex);
+	done(w, r, n, rv);
+	return rv;
+}
+
+// Marks [ptr, ptr + len) of the image as data of inode inum not yet on
+// disk, compress if the file keeps its data compressed
+void writeback_dirty(int inum, const void* ptr, size_t len, bool compress) {
+	const char* p = ptr;
+	if (!active || len == 0) {
+		return;
+	}
+	assert(p >= base && p + len <= base + map_len);
+
+	size_t start = (p - base) / PAGE_SIZE;
+	size_t end = (p - base + len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	pthread_mutex_lock(&wb_mutex);
+	wb_inode* w = find(inum, true);
+	w->compress = compress;
+	add_range(w, start, end);
+	bool wake = !kicked && dirty_pages >= bg_pages();
+	if (wake) {
+		kicked = true;
+	}
+	pthread_mutex_unlock(&wb_mutex);
+
+	if (wake) {
+		pthread_cond_signal(&wb_wake);
+	}
+}
+
+// Past the dirty limit a writer writes its own file back, not waiting
+// on the thread to catch up with everyone
+void writeback_balance(int inum) {
+	if (!active) {
+		return;
+	}
+
+	pthread_mutex_lock(&wb_mutex);
+	if (dirty_pages >= limits.limit / PAGE_SIZE) {
+		wb_inode* w = find(inum, false);
+		if (w && w->n > 0) {
+			flush_locked(w, false);
+			put(w);
+		}
+	}
+	pthread_mutex_unlock(&wb_mutex);
+}
+
+// Writes back everything of inode inum written so far, including what
+// a writeback already under way took, and reports any error since the
+// last sync
+int writeback_sync(int inum) {
+	if (!active) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&wb_mutex);
+	wb_inode* w = find(inum, false);
+	if (w == NULL) {
+		pthread_mutex_unlock(&wb_mutex);
+		return 0;
+	}
+
+	// The writeback that finishes last would free w under us otherwise
+	int rv = w->n > 0 ? flush_locked(w, false) : 0;
+	w->waiting++;
+	while (w->flushing > 0) {
+		pthread_cond_wait(&wb_done, &wb_mutex);
+	}
+	w->waiting--;
+	if (rv == 0) {
+		rv = w->error;
+	}
+	w->error = 0;
+	put(w);
+	pthread_mutex_unlock(&wb_mutex);
+	return rv;
+}
+
+// The file is gone, its pages need not be written
+void writeback_forget(int inum) {
+	if (!active) {
+		return;
+	}
+
+	pthread_mutex_lock(&wb_mutex);
+	wb_inode* w = find(inum, false);
+	if (w) {
+		if (w->n > 0) {
+			w->n = 0;
+			count(w);
+			list_remove(w);
+		}
+		w->error = 0;
+		put(w);
+	}
+	pthread_mutex_unlock(&wb_mutex);
+}
+
+// Writes back the files that are due, or all of them. A file put back
+// by a failed writeback is not tried again in the same pass.
+static void flush_due(bool all) {
+	uint64_t now = now_ms();
+	size_t left = n_files;
+	wb_inode* w;
+	while (left-- > 0 && (w = oldest) != NULL
+	       && (all || dirty_pages >= bg_pages() || now - w->since >= limits.expire_ms)) {
+		bool failing = w->error != 0;
+		int rv = flush_locked(w, true);
+		if (rv < 0 && !failing) {
+			fprintf(stderr, "nufs: writeback of inode %d failed: %s\n", w->inum, strerror(-rv));
+		}
+		put(w);
+	}
+	kicked = false;
+}
+
+static void* writeback_main(void* arg) {
+	(void) arg;
+	pthread_mutex_lock(&wb_mutex);
+	while (!stopping) {
+		if (!kicked) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			uint64_t ns = ts.tv_nsec + (uint64_t)limits.interval_ms * 1000000;
+			ts.tv_sec += ns / 1000000000;
+			ts.tv_nsec = ns % 1000000000;
+			pthread_cond_timedwait(&wb_wake, &wb_mutex, &ts);
+		}
+		flush_due(false);
+	}
+	flush_due(true);
+	pthread_mutex_unlock(&wb_mutex);
+	return NULL;
+}
+
+void writeback_default_limits(wb_limits* l) {
+	*l = (wb_limits) WB_DEFAULTS;
+}
+
+// Takes effect on the next pass of the thread, or right away if the new
+// background threshold is already passed
+void writeback_set_limits(const wb_limits* l) {
+	assert(l->interval_ms > 0 && l->background <= l->limit);
+	pthread_mutex_lock(&wb_mutex);
+	limits = *l;
+	kicked = true;
+	pthread_cond_signal(&wb_wake);
+	pthread_mutex_unlock(&wb_mutex);
+}
+
+// Starts tracking writes to the first map_len bytes mapped at fs, the
+// thread that writes them back waits for writeback_run
+void writeback_open(super_blk* fs, size_t len) {
+	base = (char*)fs;
+	map_len = len;
+	n_buckets = 1024;
+	buckets = calloc(n_buckets, sizeof(wb_inode*));
+	assert(buckets != NULL);
+	n_files = 0;
+	oldest = newest = NULL;
+	dirty_pages = 0;
+	kicked = false;
+	stopping = false;
+	active = true;
+}
+
+void writeback_run(void) {
+	if (!active || threaded) {
+		return;
+	}
+	threaded = true;
+	assert(pthread_create(&wb_thread, NULL, writeback_main, NULL) == 0);
+}
+
+// Writes back everything still dirty and stops the thread
+void writeback_stop(void) {
+	if (!active) {
+		return;
+	}
+
+	pthread_mutex_lock(&wb_mutex);
+	stopping = true;
+	pthread_cond_signal(&wb_wake);
+	if (!threaded) {
+		flush_due(true);
+	}
+	pthread_mutex_unlock(&wb_mutex);
+	if (threaded) {
+		pthread_join(wb_thread, NULL);
+		threaded = false;
+	}
+
+	active = false;
+	for (size_t i = 0; i < n_buckets; i++) {
+		wb_inode* w = buckets[i];
+		while (w) {
+			wb_inode* next = w->hnext;
+			free(w);
+			w = next;
+		}
+	}
+	free(buckets);
+	buckets = NULL;
+	n_buckets = n_files = 0;
+}
@@ -0,0 +1,25 @@
+#ifndef NUFS_WRITEBACK_H
+#define NUFS_WRITEBACK_H
+
+#include "data.h"
+
+// When dirty file data in the mapped image goes to disk, see writeback.c
+typedef struct wb_limits {
+	size_t background;    // dirty bytes before the writeback thread starts early
+	size_t limit;         // dirty bytes before writers write back their own file
+	unsigned expire_ms;   // data dirty this long is written back regardless
+	unsigned interval_ms; // how often the writeback thread looks
+} wb_limits;
+
+void writeback_default_limits(wb_limits* l);
+void writeback_set_limits(const wb_limits* l);
+void writeback_open(super_blk* fs, size_t map_len);
+void writeback_run(void);
+void writeback_stop(void);
+
+void writeback_dirty(int inum, const void* ptr, size_t len, bool compress);
+void writeback_balance(int inum);
+int writeback_sync(int inum);
+void writeback_forget(int inum);
+
+#endif